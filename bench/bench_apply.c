@@ -0,0 +1,242 @@
+/*
+ * bench_apply.c: Time to new settings, one command against three.
+ *
+ * The station is started, then switched back and forth between two sets of
+ * frequency and modulation. Each switch is made the old way, with setmod,
+ * setfreq and reload each waiting for its reply, then with the three sent
+ * at once, and last with a single apply. Latency runs from the first byte
+ * sent to the last reply. Given the HTTP port of a station started with
+ * --metrics, child spawns and restarts per switch are reported too. One
+ * JSON line per way.
+ */
+
+#include "common.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+enum mode {
+	MODE_SEQUENCE,
+	MODE_PIPELINED,
+	MODE_APPLY,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+	[MODE_SEQUENCE]  = "sequence",
+	[MODE_PIPELINED] = "pipelined",
+	[MODE_APPLY]     = "apply",
+};
+
+static const char *mods[2] = {"fm", "am"};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Send 'len' bytes of 'cmd' and wait for 'n' reply lines, events skipped */
+static int command(int fd, struct line_buffer *lb, const char *cmd,
+	size_t len, unsigned n, char **reply)
+{
+	ssize_t nbr;
+
+	if (write(fd, cmd, len) != (ssize_t)len)
+		return -1;
+
+	while (n > 0) {
+		while (n > 0 && line_buffer_next(lb, reply) >= 0)
+			n -= (**reply != '!');
+		if (n == 0)
+			break;
+		nbr = line_buffer_fill(lb, fd);
+		if (nbr <= 0 && !(nbr < 0 && errno == EINTR))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Value of a counter in the /metrics page, 0 when unavailable */
+static uint64_t scrape(const char *host, int port, const char *name)
+{
+	static char page[1 << 16];
+	const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+	size_t len = 0, nlen = strlen(name);
+	uint64_t val = 0;
+	ssize_t nbr;
+	char *p;
+	int fd;
+
+	if (port <= 0 || (fd = tcp_client_socket(host, port)) < 0)
+		return 0;
+	if (write(fd, req, strlen(req)) == (ssize_t)strlen(req)) {
+		while (len < sizeof page - 1 &&
+		       (nbr = read(fd, page + len, sizeof page - 1 - len)) > 0)
+			len += nbr;
+	}
+	close(fd);
+	page[len] = '\0';
+
+	for (p = page; (p = strstr(p, name)); p += nlen) {
+		if (p[nlen] == ' ' && (p == page || p[-1] == '\n')) {
+			val = strtoull(p + nlen + 1, NULL, 10);
+			break;
+		}
+	}
+
+	return val;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static int run(int fd, struct line_buffer *lb, enum mode mode, unsigned n,
+	uint32_t freq, const char *host, int hport)
+{
+	uint64_t *lat, t0, total, spawns, restarts;
+	unsigned k, failed = 0;
+	char cmd[256], *reply;
+	const char *mod;
+	size_t len;
+	uint32_t f;
+
+	lat = malloc(n * sizeof *lat);
+	if (!lat)
+		return -1;
+	spawns = scrape(host, hport, "sdrrc_child_spawns_total");
+	restarts = scrape(host, hport, "sdrrc_child_restarts_total");
+
+	t0 = now_ns();
+	for (k = 0; k < n; k++) {
+		/* Every switch changes both, from the set the last one left */
+		f = freq + ((k & 1) ? 0 : 100000);
+		mod = mods[!(k & 1)];
+
+		lat[k] = now_ns();
+		switch (mode) {
+		case MODE_SEQUENCE:
+			len = snprintf(cmd, sizeof cmd, "setmod %s\n", mod);
+			if (command(fd, lb, cmd, len, 1, &reply) < 0)
+				goto _err;
+			failed += (strstr(reply, "Error") != NULL);
+			len = snprintf(cmd, sizeof cmd, "setfreq %u\n", f);
+			if (command(fd, lb, cmd, len, 1, &reply) < 0)
+				goto _err;
+			failed += (strstr(reply, "Error") != NULL);
+			if (command(fd, lb, "reload\n", 7, 1, &reply) < 0)
+				goto _err;
+			break;
+		case MODE_PIPELINED:
+			len = snprintf(cmd, sizeof cmd, "setmod %s\nsetfreq %u\nreload\n",
+				mod, f);
+			if (command(fd, lb, cmd, len, 3, &reply) < 0)
+				goto _err;
+			break;
+		default:
+			len = snprintf(cmd, sizeof cmd, "apply freq=%u mod=%s\n", f, mod);
+			if (command(fd, lb, cmd, len, 1, &reply) < 0)
+				goto _err;
+			break;
+		}
+		lat[k] = now_ns() - lat[k];
+		failed += (strstr(reply, "Error") != NULL);
+	}
+	total = now_ns() - t0;
+
+	/* Let the last children come up before counting them */
+	usleep(200000);
+	spawns = scrape(host, hport, "sdrrc_child_spawns_total") - spawns;
+	restarts = scrape(host, hport, "sdrrc_child_restarts_total") - restarts;
+
+	qsort(lat, n, sizeof *lat, &cmp_u64);
+	printf("{\"bench\":\"apply\",\"mode\":\"%s\",\"switches\":%u"
+		",\"failed\":%u,\"switches_per_s\":%.1f"
+		",\"switch_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+		mode_names[mode], n, failed, n * 1e9 / total, lat[n / 2] / 1e6,
+		lat[(uint64_t)n * 99 / 100] / 1e6, lat[n - 1] / 1e6);
+	if (hport > 0)
+		printf(",\"spawns_per_switch\":%.2f,\"restarts_per_switch\":%.2f",
+			(double)spawns / n, (double)restarts / n);
+	printf("}\n");
+	fflush(stdout);
+
+	free(lat);
+	return 0;
+
+_err:
+	free(lat);
+	return -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host       station host (127.0.0.1)\n"
+		"  -p port       control port (17920)\n"
+		"  -H port       HTTP port, for the spawn counts (none)\n"
+		"  -n switches   settings switches per way (1000)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	struct line_buffer lb;
+	int port = 17920, hport = 0, opt, fd;
+	unsigned n = 1000, m;
+	uint32_t freq = 0;
+	char *reply, *p;
+
+	while ((opt = getopt(argc, argv, "h:p:H:n:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'H': hport = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (n == 0)
+		usage(argv[0]);
+
+	fd = tcp_client_socket(host, port);
+	if (fd < 0) {
+		print_error("cannot connect to %s:%d\n", host, port);
+		return 2;
+	}
+	line_buffer_init(&lb);
+
+	/* Switches go between where the station is and 100 kHz above */
+	if (command(fd, &lb, "status\n", 7, 1, &reply) < 0 ||
+	    !(p = strstr(reply, "Freq: ")) ||
+	    (freq = strtoul(p + 6, NULL, 10)) == 0 ||
+	    command(fd, &lb, "start\n", 6, 1, &reply) < 0 ||
+	    strstr(reply, "Error")) {
+		print_error("cannot start the station\n");
+		return 2;
+	}
+
+	for (m = 0; m < MODE_COUNT; m++) {
+		if (run(fd, &lb, m, n, freq, host, hport) < 0) {
+			print_error("station went away\n");
+			return 2;
+		}
+	}
+
+	command(fd, &lb, "stop\n", 5, 1, &reply);
+	close(fd);
+	return 0;
+}
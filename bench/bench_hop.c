@@ -0,0 +1,433 @@
+/*
+ * bench_hop.c: Frequency hopping driven by a client against the station's
+ * own scan list.
+ *
+ * The station is started and made to hop through a dozen frequencies around
+ * the one it is on, in its modulation and with the same dwell time, twice:
+ * first by this program sleeping to a fixed schedule and sending setfreq for
+ * every hop, then with a single hop command and the station's timers doing
+ * the rest. Each hop is timed when its reply or "!<Hop:" event comes in, and
+ * the jitter is how far the time between two hops is from the dwell. Given
+ * the HTTP port, the station's own account of how late its timers fired is
+ * added. One JSON line per way. The station needs an IQ source, without one
+ * it refuses dwell times this short.
+ *
+ * A recorded IQ file cannot be retuned, so given a port this program also
+ * plays the tuner, like bench_retune: it serves rtl_tcp noise to the station
+ * and counts the frequencies it is sent, which shows every hop reached it:
+ *   sdrrc -p 17920 -M -i rtltcp:127.0.0.1:1234 -r 1032000
+ *   bench_hop -p 17920 -P 1234
+ */
+
+#include "common.h"
+#include "iq_source.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define HOPS            12
+#define HOP_STEP        50000
+#define WARMUP_NS       200000000
+#define CHUNK_HZ        500             /* Chunks of IQ sent per second */
+
+enum mode {
+	MODE_EXTERNAL,
+	MODE_SCHEDULER,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+	[MODE_EXTERNAL]  = "external",
+	[MODE_SCHEDULER] = "scheduler",
+};
+
+/* The tuner side, run on a thread of its own */
+struct standin {
+	pthread_t        tid;
+	int              lfd;
+	_Atomic uint32_t freq;
+	_Atomic uint64_t tunes;         /* Changes of 'freq' */
+	atomic_bool      streaming;
+	atomic_bool      stop;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * Act on whole commands in 'cmd', keeping a partial one for later. Once
+ * streaming, 'rate' is NULL: the noise was made for the first one.
+ */
+static void standin_commands(struct standin *s, uint8_t *cmd, size_t *len,
+	uint32_t *rate)
+{
+	uint32_t param;
+	size_t k;
+
+	for (k = 0; k + 5 <= *len; k += 5) {
+		param = (uint32_t)cmd[k + 1] << 24 | cmd[k + 2] << 16 |
+			cmd[k + 3] << 8 | cmd[k + 4];
+		if (cmd[k] == RTLTCP_SET_FREQ) {
+			if (atomic_exchange(&s->freq, param) != param)
+				atomic_fetch_add(&s->tunes, 1);
+		} else if (cmd[k] == RTLTCP_SET_SAMPLE_RATE && rate) {
+			*rate = param;
+		}
+	}
+	memmove(cmd, cmd + k, *len - k);
+	*len -= k;
+}
+
+/*
+ * Serve one station: the header, its first commands, then one second of
+ * noise over and over in chunks at the sample rate, reading the commands
+ * that come in between chunks.
+ */
+static void *standin(void *arg)
+{
+	struct standin *s = arg;
+	uint8_t hdr[12] = {'R', 'T', 'L', '0', 0, 0, 0, 5, 0, 0, 0, 0};
+	uint8_t cmd[64], *noise = NULL;
+	uint32_t rate = 0, k;
+	size_t len = 0, got = 0, chunk, pos = 0;
+	uint64_t due;
+	ssize_t nbr;
+	int fd;
+
+	fd = accept(s->lfd, NULL, NULL);
+	if (fd < 0 || send(fd, hdr, sizeof hdr, MSG_NOSIGNAL) != sizeof hdr)
+		goto _out;
+
+	/* Rate, gain mode and frequency come right after the header */
+	while (got < 15 && (nbr = recv(fd, cmd + len, sizeof cmd - len, 0)) > 0) {
+		len += nbr;
+		got += nbr;
+		standin_commands(s, cmd, &len, &rate);
+	}
+	if (rate < CHUNK_HZ || !(noise = malloc(2 * (size_t)rate)))
+		goto _out;
+	srand(330);
+	for (k = 0; k < 2 * rate; k++)
+		noise[k] = 124 + rand() % 8;
+
+	chunk = rate / CHUNK_HZ;
+	atomic_store(&s->streaming, true);
+	for (due = now_ns(); !atomic_load(&s->stop); ) {
+		while ((nbr = recv(fd, cmd + len, sizeof cmd - len, MSG_DONTWAIT)) > 0) {
+			len += nbr;
+			standin_commands(s, cmd, &len, NULL);
+		}
+		if (nbr == 0)
+			break;
+
+		if (send(fd, noise + 2 * pos, 2 * chunk, MSG_NOSIGNAL) != (ssize_t)(2 * chunk))
+			break;
+		pos = (pos + chunk) % (rate - rate % chunk);
+
+		/* Far behind, the schedule starts over instead of bursting */
+		due += UINT64_C(1000000000) / CHUNK_HZ;
+		if (due + UINT64_C(100000000) < now_ns())
+			due = now_ns();
+		sleep_until(due);
+	}
+
+_out:
+	atomic_store(&s->streaming, false);
+	if (fd >= 0)
+		close(fd);
+	free(noise);
+	return NULL;
+}
+
+/* Send 'cmd' and wait for its reply, events skipped */
+static int command(int fd, struct line_buffer *lb, const char *cmd,
+	char **reply)
+{
+	size_t len = strlen(cmd);
+	ssize_t nbr;
+
+	if (write(fd, cmd, len) != (ssize_t)len)
+		return -1;
+
+	for (;;) {
+		while (line_buffer_next(lb, reply) >= 0) {
+			if (**reply != '!')
+				return 0;
+		}
+		nbr = line_buffer_fill(lb, fd);
+		if (nbr <= 0 && !(nbr < 0 && errno == EINTR))
+			return -1;
+	}
+}
+
+/* Value of a sample in the /metrics page, 0 when unavailable */
+static double scrape(const char *host, int port, const char *name)
+{
+	static char page[1 << 16];
+	const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+	size_t len = 0, nlen = strlen(name);
+	double val = 0;
+	ssize_t nbr;
+	char *p;
+	int fd;
+
+	if (port <= 0 || (fd = tcp_client_socket(host, port)) < 0)
+		return 0;
+	if (write(fd, req, strlen(req)) == (ssize_t)strlen(req)) {
+		while (len < sizeof page - 1 &&
+		       (nbr = read(fd, page + len, sizeof page - 1 - len)) > 0)
+			len += nbr;
+	}
+	close(fd);
+	page[len] = '\0';
+
+	for (p = page; (p = strstr(p, name)); p += nlen) {
+		if (p[nlen] == ' ' && (p == page || p[-1] == '\n')) {
+			val = strtod(p + nlen + 1, NULL);
+			break;
+		}
+	}
+
+	return val;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* Hops 'dwell' ms apart by setfreq, each timed when its reply is in */
+static unsigned hop_external(int fd, struct line_buffer *lb, uint32_t freq,
+	unsigned dwell, uint64_t end, uint64_t *at, unsigned max)
+{
+	uint64_t due = now_ns();
+	char cmd[64], *reply;
+	unsigned n;
+
+	for (n = 0; n < max && due < end; n++) {
+		sleep_until(due);
+		snprintf(cmd, sizeof cmd, "setfreq %u\n",
+			freq - 6 * HOP_STEP + (n % HOPS) * HOP_STEP);
+		if (command(fd, lb, cmd, &reply) < 0 || strstr(reply, "Error"))
+			break;
+		at[n] = now_ns();
+
+		/* Like the station, start over rather than catch up */
+		due += (uint64_t)dwell * 1000000;
+		if (due < at[n])
+			due = at[n];
+	}
+
+	return n;
+}
+
+/*
+ * One hop command, then every "!<Hop:" event timed as it comes in. The
+ * reply to it waits for the client's delayed ACK of the first event, and
+ * the events right behind come all at once, so the first ones are left out.
+ */
+static unsigned hop_scheduler(int fd, struct line_buffer *lb, uint32_t freq,
+	const char *mod, unsigned dwell, uint64_t end, uint64_t *at, unsigned max)
+{
+	char cmd[HOPS * 32 + 8], *line, *reply;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	uint64_t now, from = now_ns() + WARMUP_NS;
+	unsigned n = 0, k;
+	size_t len;
+	ssize_t nbr;
+
+	len = snprintf(cmd, sizeof cmd, "hop ");
+	for (k = 0; k < HOPS; k++)
+		len += snprintf(cmd + len, sizeof cmd - len, "%s%u:%s:%u",
+			k ? "," : "", freq - 6 * HOP_STEP + k * HOP_STEP, mod, dwell);
+	snprintf(cmd + len, sizeof cmd - len, "\n");
+	if (command(fd, lb, cmd, &reply) < 0 || strstr(reply, "Error"))
+		return 0;
+
+	while (n < max && (now = now_ns()) < end) {
+		if (poll(&pfd, 1, (end - now) / 1000000 + 1) <= 0)
+			continue;
+		nbr = line_buffer_fill(lb, fd);
+		if (nbr <= 0 && !(nbr < 0 && errno == EINTR))
+			break;
+		now = now_ns();
+		while (n < max && line_buffer_next(lb, &line) >= 0) {
+			if (!strncmp(line, "!<Hop:", 6) && now >= from)
+				at[n++] = now;
+		}
+	}
+
+	command(fd, lb, "hop off\n", &reply);
+	return n;
+}
+
+static int run(int fd, struct line_buffer *lb, enum mode mode, uint32_t freq,
+	const char *mod, unsigned dwell, unsigned secs, const char *host, int hport,
+	struct standin *s)
+{
+	unsigned max = secs * 1000 / dwell + HOPS, n, k;
+	uint64_t *at, *jit, end, d, tunes;
+	double hops, late;
+
+	at = malloc(max * sizeof *at);
+	jit = malloc(max * sizeof *jit);
+	if (!at || !jit) {
+		free(at);
+		free(jit);
+		return -1;
+	}
+	hops = scrape(host, hport, "sdrrc_hops_total");
+	late = scrape(host, hport, "sdrrc_hop_late_seconds_total");
+	tunes = s ? atomic_load(&s->tunes) : 0;
+
+	end = now_ns() + secs * UINT64_C(1000000000);
+	if (mode == MODE_EXTERNAL)
+		n = hop_external(fd, lb, freq, dwell, end, at, max);
+	else
+		n = hop_scheduler(fd, lb, freq, mod, dwell, end, at, max);
+	if (n < 2) {
+		free(at);
+		free(jit);
+		return -1;
+	}
+
+	for (k = 1; k < n; k++) {
+		d = at[k] - at[k - 1];
+		jit[k - 1] = (d > dwell * UINT64_C(1000000)) ?
+			d - dwell * UINT64_C(1000000) : dwell * UINT64_C(1000000) - d;
+	}
+	qsort(jit, n - 1, sizeof *jit, &cmp_u64);
+
+	printf("{\"bench\":\"hop\",\"mode\":\"%s\",\"dwell_ms\":%u,\"hops\":%u"
+		",\"hops_per_s\":%.1f,\"jitter_ms\":{\"p50\":%.3f,\"p99\":%.3f"
+		",\"max\":%.3f}", mode_names[mode], dwell, n,
+		(n - 1) * 1e9 / (at[n - 1] - at[0]), jit[(n - 1) / 2] / 1e6,
+		jit[(uint64_t)(n - 1) * 99 / 100] / 1e6, jit[n - 2] / 1e6);
+	if (s)
+		printf(",\"tuned\":%" PRIu64, atomic_load(&s->tunes) - tunes);
+	if (hport > 0 && mode == MODE_SCHEDULER) {
+		hops = scrape(host, hport, "sdrrc_hops_total") - hops;
+		late = scrape(host, hport, "sdrrc_hop_late_seconds_total") - late;
+		printf(",\"timer_late_ms\":{\"mean\":%.3f,\"max\":%.3f}",
+			hops > 0 ? late * 1e3 / hops : 0.0,
+			scrape(host, hport, "sdrrc_hop_late_max_seconds") * 1e3);
+	}
+	printf("}\n");
+	fflush(stdout);
+
+	free(at);
+	free(jit);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host       station host (127.0.0.1)\n"
+		"  -p port       control port (17920)\n"
+		"  -H port       HTTP port, for the station's timer lateness (none)\n"
+		"  -P port       serve rtl_tcp noise to the station on this port (none)\n"
+		"  -D msecs      dwell time, at least 10 (20)\n"
+		"  -d seconds    duration of each way (5)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct standin s;
+	const char *host = "127.0.0.1";
+	struct line_buffer lb;
+	int port = 17920, hport = 0, tport = 0, opt, fd;
+	unsigned dwell = 20, secs = 5, m, k;
+	uint32_t freq = 0;
+	char *reply, *p, mod[8] = "";
+
+	while ((opt = getopt(argc, argv, "h:p:H:P:D:d:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'H': hport = atoi(optarg); break;
+		case 'P': tport = atoi(optarg); break;
+		case 'D': dwell = atoi(optarg); break;
+		case 'd': secs = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (dwell < 10 || secs == 0 || tport < 0 || tport > 65535)
+		usage(argv[0]);
+
+	if (tport > 0) {
+		s.lfd = tcp_server_socket(tport, 1);
+		if (s.lfd < 0 || pthread_create(&s.tid, NULL, &standin, &s) != 0) {
+			print_error("cannot listen on port %d\n", tport);
+			return 2;
+		}
+	}
+
+	fd = tcp_client_socket(host, port);
+	if (fd < 0) {
+		print_error("cannot connect to %s:%d\n", host, port);
+		return 2;
+	}
+	line_buffer_init(&lb);
+
+	/* Hops go from 300 kHz below where the station is to 250 kHz above */
+	if (command(fd, &lb, "status\n", &reply) < 0 ||
+	    !(p = strstr(reply, "Freq: ")) ||
+	    (freq = strtoul(p + 6, NULL, 10)) <= 6 * HOP_STEP ||
+	    !(p = strstr(reply, "Mod: ")) || sscanf(p + 5, "%7[a-z]", mod) != 1 ||
+	    command(fd, &lb, "start\n", &reply) < 0 ||
+	    strstr(reply, "Error")) {
+		print_error("cannot start the station\n");
+		return 2;
+	}
+	for (k = 0; tport > 0 && k < 50 && !atomic_load(&s.streaming); k++)
+		usleep(100000);
+	if (tport > 0 && !atomic_load(&s.streaming)) {
+		print_error("the station did not connect to the stand-in\n");
+		return 2;
+	}
+
+	for (m = 0; m < MODE_COUNT; m++) {
+		if (run(fd, &lb, m, freq, mod, dwell, secs, host, hport,
+			tport > 0 ? &s : NULL) < 0) {
+			print_error("station went away\n");
+			return 2;
+		}
+	}
+
+	command(fd, &lb, "stop\n", &reply);
+	close(fd);
+	if (tport > 0) {
+		atomic_store(&s.stop, true);
+		pthread_join(s.tid, NULL);
+		close(s.lfd);
+	}
+	return 0;
+}
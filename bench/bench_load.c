@@ -0,0 +1,776 @@
+/*
+ * bench_load.c: Load generator for the station control plane.
+ *
+ * Opens 'conns' connections that keep 'depth' commands in flight each, drawn
+ * from a weighted mix, plus 'idle' connections that only sit there. Latency
+ * is taken from the write of a command to its reply and kept in a log-linear
+ * histogram. The result is a single JSON object on stdout.
+ *
+ * With -l, it opens HTTP listeners on a stream instead and reports how much
+ * audio each one got and how many were dropped, the time to the first byte
+ * and between reads that brought Ogg pages. Given the station process, its
+ * CPU time over the run is added, in all and per listener.
+ */
+
+#include "common.h"
+#include "event_loop.h"
+#include "net_utils.h"
+#include "proto.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+/* Histogram: 16 linear sub-buckets per power of two, in nanoseconds */
+#define HIST_SUB        16
+#define HIST_BUCKETS    (64 * HIST_SUB)
+
+/* Seconds to wait for in-flight replies once the run is over */
+#define DRAIN_TIMEOUT   5
+
+#define MIX_MAX         8
+
+enum {
+	C_CONNECTING,
+	C_HANDSHAKE,        /* Waiting for "<Protocol: binary>" */
+	C_RUNNING,
+	C_IDLE,
+	C_DONE,
+};
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t max;
+};
+
+struct mix_entry {
+	const char *cmd;
+	uint8_t     op;
+	unsigned    weight;
+};
+
+struct conn {
+	struct ev_handler   h;
+	struct bench       *b;
+	int                 state;
+	bool                want_write;
+	uint64_t            connect_ns;
+	bool                replied;
+	struct line_buffer  rx;
+
+	char               *tx;
+	size_t              tx_head;
+	size_t              tx_len;
+
+	/* Send times of the commands in flight, oldest first */
+	uint64_t           *sent;
+	unsigned            sent_head;
+	unsigned            inflight;
+
+	/* Listener mode */
+	uint64_t            bytes;
+	bool                ok;
+	uint32_t            magic;      /* Last four bytes, for "OggS" */
+	uint64_t            page_ns;    /* Last read with a page in it */
+};
+
+struct bench {
+	const char *host;
+	uint16_t    port;
+	uint16_t    http_port;
+	const char *path;
+	unsigned    nconns;
+	unsigned    nidle;
+	unsigned    depth;
+	unsigned    seconds;
+	bool        binary;
+	unsigned    listeners;
+	pid_t       pid;
+	char       *mix_str;
+
+	struct mix_entry mix[MIX_MAX];
+	unsigned    nmix;
+	unsigned    mix_total;
+
+	struct ev_loop    loop;
+	struct ev_handler timer_h;
+	struct conn      *conns;
+	unsigned          total;
+	bool              stopping;
+	bool              draining;
+	uint64_t          start_ns;
+	uint64_t          stop_ns;
+	uint64_t          inflight;
+	uint32_t          rand;
+	uint32_t          seq;
+
+	uint64_t    commands;
+	uint64_t    errors;
+	uint64_t    disconnects;
+	struct hist lat;
+	struct hist first;      /* Reply, or byte for listeners */
+	struct hist gap;        /* Between pages, listeners only */
+	uint64_t    cpu_ns;     /* Of the station, listeners only */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* xorshift32, good enough to pick commands */
+static uint32_t bench_rand(struct bench *b)
+{
+	b->rand ^= b->rand << 13;
+	b->rand ^= b->rand >> 17;
+	b->rand ^= b->rand << 5;
+	return b->rand;
+}
+
+static unsigned hist_bucket(uint64_t v)
+{
+	unsigned e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_lower(unsigned idx)
+{
+	unsigned e = idx / HIST_SUB + 3;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (e - 4);
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_bucket(v)]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Upper bound of the bucket holding the 'q' quantile, in microseconds */
+static double hist_quantile(const struct hist *h, double q)
+{
+	uint64_t rank = q * h->n, seen = 0;
+	unsigned k;
+
+	if (h->n == 0)
+		return 0.0;
+
+	for (k = 0; k < HIST_BUCKETS; k++) {
+		seen += h->count[k];
+		if (seen > rank)
+			break;
+	}
+	if (k >= HIST_BUCKETS - 1)
+		return h->max / 1e3;
+
+	return (hist_lower(k + 1) < h->max ? hist_lower(k + 1) : h->max) / 1e3;
+}
+
+/* "status:8,setfreq:1" */
+static int parse_mix(struct bench *b)
+{
+	static const struct {
+		const char *cmd;
+		uint8_t op;
+	} known[] = {
+		{"status",   PROTO_OP_STATUS},
+		{"setfreq",  PROTO_OP_SETFREQ},
+		{"setmod",   PROTO_OP_SETMOD},
+		{"listchan", PROTO_OP_LISTCHAN},
+	};
+	char *str = strdup(b->mix_str), *tok, *save, *colon;
+	unsigned k;
+
+	for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		unsigned weight = 1;
+
+		if ((colon = strchr(tok, ':'))) {
+			*colon = '\0';
+			weight = strtoul(colon + 1, NULL, 10);
+		}
+
+		for (k = 0; k < sizeof known / sizeof *known; k++)
+			if (strcmp(tok, known[k].cmd) == 0)
+				break;
+		if (k == sizeof known / sizeof *known || b->nmix == MIX_MAX ||
+		    weight == 0) {
+			print_error("Bad mix entry: %s\n", tok);
+			free(str);
+			return -1;
+		}
+
+		b->mix[b->nmix++] = (struct mix_entry) {known[k].cmd, known[k].op, weight};
+		b->mix_total += weight;
+	}
+
+	free(str);
+	return b->nmix ? 0 : -1;
+}
+
+static const struct mix_entry *pick_command(struct bench *b)
+{
+	unsigned r = bench_rand(b) % b->mix_total, k;
+
+	for (k = 0; r >= b->mix[k].weight; k++)
+		r -= b->mix[k].weight;
+
+	return &b->mix[k];
+}
+
+static void conn_want_write(struct conn *c, bool on)
+{
+	if (c->want_write == on)
+		return;
+
+	c->want_write = on;
+	ev_mod(&c->b->loop, &c->h, EPOLLIN | (on ? EPOLLOUT : 0));
+}
+
+static void conn_close(struct conn *c, bool failed)
+{
+	struct bench *b = c->b;
+
+	if (c->state == C_DONE)
+		return;
+
+	if (failed)
+		b->disconnects++;
+	b->inflight -= c->inflight;
+	c->inflight = 0;
+	c->state = C_DONE;
+	ev_del(&b->loop, &c->h);
+	close(c->h.fd);
+	c->h.fd = -1;
+}
+
+static void conn_flush(struct conn *c)
+{
+	ssize_t nbw;
+
+	while (c->tx_head < c->tx_len) {
+		nbw = send(c->h.fd, c->tx + c->tx_head, c->tx_len - c->tx_head,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (nbw < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn_want_write(c, true);
+				return;
+			}
+			conn_close(c, true);
+			return;
+		}
+		c->tx_head += nbw;
+	}
+
+	c->tx_head = c->tx_len = 0;
+	conn_want_write(c, false);
+}
+
+static void conn_push(struct conn *c, const void *data, size_t len)
+{
+	memcpy(c->tx + c->tx_len, data, len);
+	c->tx_len += len;
+}
+
+/* Top the pipeline up to 'depth' commands, in a single write */
+static void conn_refill(struct conn *c)
+{
+	struct bench *b = c->b;
+	const struct mix_entry *m;
+	struct proto_request req;
+	uint32_t frame_len, *len_field = NULL;
+	uint64_t now;
+	char line[64];
+	int n;
+
+	if (c->state != C_RUNNING || b->stopping || c->want_write ||
+	    c->inflight == b->depth)
+		return;
+
+	if (b->binary) {
+		frame_len = 0;
+		len_field = (uint32_t *)(c->tx + c->tx_len);
+		conn_push(c, &frame_len, sizeof frame_len);
+	}
+
+	now = now_ns();
+	while (c->inflight < b->depth) {
+		m = pick_command(b);
+
+		if (b->binary) {
+			memset(&req, 0, sizeof req);
+			req.id = htole32(++b->seq);
+			req.op = m->op;
+			req.modulation = (bench_rand(b) & 1) ? MOD_WBFM : MOD_FM;
+			req.freq = htole32(88000000 + (bench_rand(b) % 200) * 100000);
+			conn_push(c, &req, sizeof req);
+		} else {
+			if (m->op == PROTO_OP_SETFREQ)
+				n = snprintf(line, sizeof line, "setfreq %u\n",
+					88000000 + (bench_rand(b) % 200) * 100000);
+			else if (m->op == PROTO_OP_SETMOD)
+				n = snprintf(line, sizeof line, "setmod %s\n",
+					(bench_rand(b) & 1) ? "wbfm" : "fm");
+			else
+				n = snprintf(line, sizeof line, "%s\n", m->cmd);
+			conn_push(c, line, n);
+		}
+
+		c->sent[(c->sent_head + c->inflight) % b->depth] = now;
+		c->inflight++;
+		b->inflight++;
+	}
+
+	if (len_field) {
+		frame_len = (char *)(c->tx + c->tx_len) - (char *)(len_field + 1);
+		frame_len = htole32(frame_len);
+		memcpy(len_field, &frame_len, sizeof frame_len);
+	}
+
+	if (!c->want_write)
+		conn_flush(c);
+}
+
+static void conn_reply(struct conn *c, bool error)
+{
+	struct bench *b = c->b;
+	uint64_t now = now_ns();
+
+	if (c->inflight == 0) {
+		b->errors++;
+		return;
+	}
+
+	if (!c->replied) {
+		c->replied = true;
+		hist_add(&b->first, now - c->connect_ns);
+	}
+
+	hist_add(&b->lat, now - c->sent[c->sent_head]);
+	c->sent_head = (c->sent_head + 1) % b->depth;
+	c->inflight--;
+	b->inflight--;
+	b->commands++;
+	if (error)
+		b->errors++;
+}
+
+static void conn_read(struct conn *c)
+{
+	struct bench *b = c->b;
+	struct proto_reply rep;
+	ssize_t nbr, len, off;
+	void *frame;
+	char *line;
+
+	for (;;) {
+		nbr = line_buffer_fill(&c->rx, c->h.fd);
+
+		while (c->state == C_HANDSHAKE || (c->state == C_RUNNING && !b->binary)) {
+			len = line_buffer_next(&c->rx, &line);
+			if (len == LB_AGAIN)
+				break;
+			if (len < 0 || line[0] == '!')
+				continue;
+			if (c->state == C_HANDSHAKE) {
+				if (strcmp(line, "<Protocol: binary>") != 0) {
+					print_error("Station does not speak binary\n");
+					conn_close(c, true);
+					return;
+				}
+				c->state = C_RUNNING;
+				conn_refill(c);
+				continue;
+			}
+			conn_reply(c, strncmp(line, "<Error", 6) == 0);
+		}
+
+		while (c->state == C_RUNNING && b->binary &&
+		       (len = line_buffer_frame(&c->rx, &frame)) >= 0) {
+			for (off = 0; off + (ssize_t)sizeof rep <= len; off += sizeof rep) {
+				memcpy(&rep, (char *)frame + off, sizeof rep);
+				if (!(rep.flags & PROTO_F_MORE))
+					conn_reply(c, rep.status != PROTO_OK);
+			}
+		}
+
+		if (nbr == 0 || (nbr < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			conn_close(c, true);
+			return;
+		}
+		if (nbr < 0)
+			break;
+	}
+
+	conn_refill(c);
+}
+
+static void conn_cb(struct ev_loop *loop, struct ev_handler *h, uint32_t events)
+{
+	struct conn *c = h->context;
+	socklen_t len = sizeof(int);
+	int err;
+
+	if (c->state == C_DONE)
+		return;
+
+	if (c->state == C_CONNECTING) {
+		if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			conn_close(c, true);
+			return;
+		}
+		conn_want_write(c, false);
+
+		/* Idle connections come after the active ones */
+		if (c - c->b->conns >= (long)c->b->nconns) {
+			c->state = C_IDLE;
+			return;
+		}
+		if (c->b->binary) {
+			c->state = C_HANDSHAKE;
+			conn_push(c, "binary\n", 7);
+			conn_flush(c);
+		} else {
+			c->state = C_RUNNING;
+			conn_refill(c);
+		}
+		return;
+	}
+
+	if (events & EPOLLOUT)
+		conn_flush(c);
+	if (c->state != C_DONE && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		conn_read(c);
+}
+
+/*
+ * Listener mode
+ */
+
+/* User and system time of a process so far, 0 when it cannot be read */
+static uint64_t proc_cpu_ns(pid_t pid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	ssize_t nbr;
+	int fd;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	nbr = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (nbr <= 0)
+		return 0;
+	buf[nbr] = '\0';
+
+	/* Fields 14 and 15, counted from the one after the command name */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+			" %lu %lu", &utime, &stime) != 2)
+		return 0;
+
+	return (utime + stime) * (UINT64_C(1000000000) / sysconf(_SC_CLK_TCK));
+}
+
+/* Time the first byte, and the gaps between reads that bring pages */
+static void listener_data(struct conn *c, const char *buf, size_t len)
+{
+	struct bench *b = c->b;
+	uint64_t now = now_ns();
+	bool page = false;
+	size_t k;
+
+	if (c->bytes == 0) {
+		c->ok = (len >= 12 && memcmp(buf + 9, "200", 3) == 0);
+		hist_add(&b->first, now - c->connect_ns);
+	}
+	c->bytes += len;
+
+	for (k = 0; k < len; k++) {
+		c->magic = c->magic << 8 | (uint8_t)buf[k];
+		page |= (c->magic == 0x4f676753);       /* "OggS" */
+	}
+	if (!page)
+		return;
+	if (c->page_ns)
+		hist_add(&b->gap, now - c->page_ns);
+	c->page_ns = now;
+}
+
+static void listener_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	static char buf[65536];
+	struct conn *c = h->context;
+	socklen_t len = sizeof(int);
+	ssize_t nbr;
+	int err;
+
+	if (c->state == C_DONE)
+		return;
+
+	if (c->state == C_CONNECTING) {
+		if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			conn_close(c, true);
+			return;
+		}
+		c->state = C_RUNNING;
+		conn_flush(c);
+		return;
+	}
+
+	if (events & EPOLLOUT)
+		conn_flush(c);
+
+	while ((nbr = read(h->fd, buf, sizeof buf)) > 0)
+		listener_data(c, buf, nbr);
+
+	/* The station closes listeners that fall too far behind */
+	if (nbr == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		conn_close(c, !c->b->stopping);
+}
+
+/* The run is over: stop issuing, then give in-flight replies some time */
+static void timer_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct bench *b = h->context;
+	struct itimerspec its = {.it_value = {.tv_sec = DRAIN_TIMEOUT}};
+	uint64_t count;
+
+	if (read(h->fd, &count, sizeof count) < 0)
+		return;
+
+	if (b->stopping || b->listeners) {
+		b->stopping = true;
+		ev_stop(loop);
+		return;
+	}
+
+	b->stopping = true;
+	b->stop_ns = now_ns();
+	timerfd_settime(h->fd, 0, &its, NULL);
+	if (b->inflight == 0)
+		ev_stop(loop);
+}
+
+static void batch_done(struct ev_loop *loop, void *context)
+{
+	struct bench *b = context;
+
+	if (b->stopping && b->inflight == 0)
+		ev_stop(loop);
+}
+
+static void print_hist(const char *name, const struct hist *h)
+{
+	printf(",\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f"
+		",\"max\":%.1f}", name, hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+		hist_quantile(h, 0.99), hist_quantile(h, 0.999), h->max / 1e3);
+}
+
+static void report_load(struct bench *b)
+{
+	double secs = (b->stop_ns - b->start_ns) / 1e9;
+	unsigned k;
+	bool first = true;
+
+	printf("{\"bench\":\"load\",\"proto\":\"%s\",\"conns\":%u,\"idle\":%u"
+		",\"depth\":%u,\"mix\":\"%s\",\"seconds\":%.3f,\"commands\":%" PRIu64
+		",\"errors\":%" PRIu64 ",\"disconnects\":%" PRIu64
+		",\"cmd_per_s\":%.0f", b->binary ? "binary" : "text", b->nconns,
+		b->nidle, b->depth, b->mix_str, secs, b->commands, b->errors,
+		b->disconnects, secs > 0 ? b->commands / secs : 0.0);
+	print_hist("latency_us", &b->lat);
+	print_hist("first_reply_us", &b->first);
+
+	printf(",\"hist_us\":[");
+	for (k = 0; k < HIST_BUCKETS; k++) {
+		if (!b->lat.count[k])
+			continue;
+		printf("%s[%.3f,%" PRIu64 "]", first ? "" : ",", hist_lower(k) / 1e3,
+			b->lat.count[k]);
+		first = false;
+	}
+	printf("]}\n");
+}
+
+static void report_listeners(struct bench *b)
+{
+	double secs = (b->stop_ns - b->start_ns) / 1e9, kbps;
+	double kmin = 0.0, kmax = 0.0, ksum = 0.0;
+	unsigned k, ok = 0;
+
+	for (k = 0; k < b->total; k++) {
+		kbps = b->conns[k].bytes * 8 / 1e3 / secs;
+		if (k == 0 || kbps < kmin)
+			kmin = kbps;
+		if (kbps > kmax)
+			kmax = kbps;
+		ksum += kbps;
+		ok += b->conns[k].ok;
+	}
+
+	printf("{\"bench\":\"listeners\",\"listeners\":%u,\"seconds\":%.3f"
+		",\"ok\":%u,\"dropped\":%" PRIu64 ",\"kbps_min\":%.1f"
+		",\"kbps_avg\":%.1f,\"kbps_max\":%.1f", b->total, secs, ok,
+		b->disconnects, kmin, b->total ? ksum / b->total : 0.0, kmax);
+	if (b->pid > 0)
+		printf(",\"station_cpu_pct\":%.1f,\"cpu_us_per_listener_s\":%.2f",
+			b->cpu_ns / secs / 1e7,
+			b->total ? b->cpu_ns / 1e3 / secs / b->total : 0.0);
+	print_hist("first_byte_us", &b->first);
+	print_hist("page_gap_us", &b->gap);
+	printf("}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host       station host (127.0.0.1)\n"
+		"  -p port       control port (17920)\n"
+		"  -c conns      active connections (1)\n"
+		"  -i idle       idle connections (0)\n"
+		"  -P depth      commands in flight per connection (1)\n"
+		"  -m mix        weighted commands, e.g. status:8,setfreq:1 (status)\n"
+		"  -b            binary protocol\n"
+		"  -d seconds    run time (5)\n"
+		"  -l listeners  HTTP listeners instead of commands\n"
+		"  -H port       HTTP port (8000)\n"
+		"  -u path       stream path (/stream.ogg)\n"
+		"  -s pid        station process, for its CPU time with -l\n"
+		"Only the first connection controls the station, control commands\n"
+		"from the others are answered with errors.\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct bench b = {
+		.host = "127.0.0.1", .port = 17920, .http_port = 8000,
+		.path = "/stream.ogg", .nconns = 1, .depth = 1, .seconds = 5,
+		.mix_str = "status", .rand = 2463534242u,
+	};
+	struct itimerspec its = {.it_value = {.tv_sec = 0}};
+	struct rlimit rl;
+	struct conn *c;
+	char req[512];
+	unsigned k;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:c:i:P:m:bd:l:H:u:s:")) != -1) {
+		switch (opt) {
+		case 'h': b.host = optarg; break;
+		case 'p': b.port = atoi(optarg); break;
+		case 'c': b.nconns = atoi(optarg); break;
+		case 'i': b.nidle = atoi(optarg); break;
+		case 'P': b.depth = atoi(optarg); break;
+		case 'm': b.mix_str = optarg; break;
+		case 'b': b.binary = true; break;
+		case 'd': b.seconds = atoi(optarg); break;
+		case 'l': b.listeners = atoi(optarg); break;
+		case 'H': b.http_port = atoi(optarg); break;
+		case 'u': b.path = optarg; break;
+		case 's': b.pid = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (b.depth < 1 || (b.binary && b.depth > PROTO_MAX_RECORDS) ||
+	    b.seconds < 1 || parse_mix(&b) < 0)
+		usage(argv[0]);
+
+	b.total = b.listeners ? b.listeners : b.nconns + b.nidle;
+	b.conns = calloc(b.total, sizeof *b.conns);
+	if (!b.conns || ev_loop_init(&b.loop) < 0)
+		return 2;
+	b.loop.batch_done = &batch_done;
+	b.loop.batch_context = &b;
+
+	/* Every connection is a file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < b.total + 64) {
+		rl.rlim_cur = (rl.rlim_max < b.total + 64) ? rl.rlim_max : b.total + 64;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	b.timer_h.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	b.timer_h.func = &timer_cb;
+	b.timer_h.context = &b;
+	if (b.timer_h.fd < 0 || ev_add(&b.loop, &b.timer_h, EPOLLIN) < 0)
+		return 2;
+
+	snprintf(req, sizeof req, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", b.path,
+		b.host);
+
+	b.start_ns = now_ns();
+	if (b.listeners && b.pid > 0)
+		b.cpu_ns = proc_cpu_ns(b.pid);
+	for (k = 0; k < b.total; k++) {
+		c = &b.conns[k];
+		c->b = &b;
+		c->h.context = c;
+		c->h.func = b.listeners ? &listener_cb : &conn_cb;
+		c->sent = malloc(b.depth * sizeof *c->sent);
+		c->tx = malloc(b.depth * 64 + sizeof req);
+		if (!c->sent || !c->tx)
+			return 2;
+		line_buffer_init(&c->rx);
+
+		c->connect_ns = now_ns();
+		c->h.fd = tcp_client_connect(b.host, b.listeners ? b.http_port : b.port);
+		if (c->h.fd < 0 || ev_add(&b.loop, &c->h, EPOLLIN | EPOLLOUT) < 0) {
+			print_error("cannot connect (%u connections open)\n", k);
+			return 2;
+		}
+		c->want_write = true;
+		if (b.listeners)
+			conn_push(c, req, strlen(req));
+	}
+
+	its.it_value.tv_sec = b.seconds;
+	timerfd_settime(b.timer_h.fd, 0, &its, NULL);
+	ev_run(&b.loop);
+	if (!b.stop_ns)
+		b.stop_ns = now_ns();
+	if (b.listeners && b.pid > 0)
+		b.cpu_ns = proc_cpu_ns(b.pid) - b.cpu_ns;
+
+	if (b.listeners)
+		report_listeners(&b);
+	else
+		report_load(&b);
+
+	for (k = 0; k < b.total; k++) {
+		conn_close(&b.conns[k], false);
+		free(b.conns[k].sent);
+		free(b.conns[k].tx);
+	}
+	free(b.conns);
+	close(b.timer_h.fd);
+	ev_loop_close(&b.loop);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * bench_log.c: Cost of a log call on the thread that makes it.
+ *
+ * Several threads log the same message as fast as they can, first with
+ * the fprintf() the print_* macros used to expand to, then through log.c
+ * written in line, then queued for its writer thread, and last below the
+ * runtime level. Messages go to a sink, /dev/null unless told otherwise,
+ * line buffered as on a terminal unless -f is given; the results, one JSON
+ * line each, to the original stdout.
+ */
+
+#include "common.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS     64
+
+/* What print_info() was before log.c */
+#define old_print_info(fmt, ...) \
+	do { fprintf(stdout, COLOR_OFF "INFO: " fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
+
+enum mode {
+	MODE_STDIO,
+	MODE_SYNC,
+	MODE_ASYNC,
+	MODE_FILTERED,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+	[MODE_STDIO]    = "stdio",
+	[MODE_SYNC]     = "sync",
+	[MODE_ASYNC]    = "async",
+	[MODE_FILTERED] = "filtered",
+};
+
+struct worker {
+	pthread_t tid;
+	enum mode mode;
+	unsigned  calls;
+	unsigned  id;
+	uint64_t  ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Time is CPU time of the calling thread, whatever the writer takes */
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t t0 = cpu_ns();
+	unsigned k;
+
+	for (k = 0; k < w->calls; k++) {
+		switch (w->mode) {
+		case MODE_STDIO:
+			old_print_info("worker %u sent command %u to %s\n", w->id, k,
+				"station");
+			break;
+		case MODE_FILTERED:
+			debug_info("worker %u sent command %u to %s\n", w->id, k,
+				"station");
+			/* Same check against the runtime level, for a debug build */
+			log_print(LOG_S_INFO + (LOG_LEVEL_MAX == LOG_DEBUG),
+				"worker %u sent command %u to %s\n", w->id, k, "station");
+			break;
+		default:
+			print_info("worker %u sent command %u to %s\n", w->id, k,
+				"station");
+			break;
+		}
+	}
+
+	w->ns = cpu_ns() - t0;
+	return NULL;
+}
+
+static void run(FILE *out, enum mode mode, unsigned nthreads, unsigned calls)
+{
+	static struct worker workers[MAX_THREADS];
+	uint64_t ns = 0, drops = log_dropped(), t0, wall;
+	unsigned k, n;
+
+	if (mode == MODE_ASYNC && log_start() < 0) {
+		fprintf(out, "{\"bench\":\"log\",\"mode\":\"async\","
+			"\"skipped\":\"cannot start the writer\"}\n");
+		return;
+	}
+	log_set_level(mode == MODE_FILTERED ? LOG_WARN : LOG_INFO);
+
+	t0 = now_ns();
+	for (n = 0; n < nthreads; n++) {
+		workers[n] = (struct worker){.mode = mode, .calls = calls, .id = n};
+		if (pthread_create(&workers[n].tid, NULL, &worker, &workers[n]) != 0)
+			break;
+	}
+	for (k = 0; k < n; k++) {
+		pthread_join(workers[k].tid, NULL);
+		ns += workers[k].ns;
+	}
+	wall = now_ns() - t0;
+
+	/* Queued messages still count, until they are out */
+	if (mode == MODE_ASYNC)
+		log_stop();
+	fflush(stdout);
+
+	fprintf(out, "{\"bench\":\"log\",\"mode\":\"%s\",\"threads\":%u"
+		",\"calls\":%u,\"ns_per_call\":%.1f,\"calls_per_s\":%.0f"
+		",\"dropped\":%" PRIu64 "}\n", mode_names[mode], n, calls,
+		n ? (double)ns / ((uint64_t)n * calls) : 0.0,
+		(double)n * calls * 1e9 / wall, log_dropped() - drops);
+	fflush(out);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n calls      log calls per thread (200000)\n"
+		"  -t threads    logging threads, up to %d (1 and 4)\n"
+		"  -o path       where the messages go (/dev/null)\n"
+		"  -f            fully buffered sink, as when redirected\n", name,
+		MAX_THREADS);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned calls = 200000, threads = 0, k, m;
+	const char *sink = "/dev/null";
+	bool full = false;
+	FILE *out;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "n:t:o:f")) != -1) {
+		switch (opt) {
+		case 'n': calls = strtoul(optarg, NULL, 10); break;
+		case 't': threads = strtoul(optarg, NULL, 10); break;
+		case 'o': sink = optarg; break;
+		case 'f': full = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (calls == 0 || threads > MAX_THREADS)
+		usage(argv[0]);
+
+	/* Keep the real stdout for the results, messages go to the sink */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	fd = open(sink, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (!out || fd < 0) {
+		print_error("cannot open %s\n", sink);
+		return 1;
+	}
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+	setvbuf(stdout, NULL, full ? _IOFBF : _IOLBF, 0);
+	setvbuf(stderr, NULL, full ? _IOFBF : _IOLBF, 0);
+
+	for (k = 0; k < 2; k++) {
+		if (threads && k > 0)
+			break;
+		for (m = 0; m < MODE_COUNT; m++)
+			run(out, m, threads ? threads : (k ? 4 : 1), calls);
+	}
+
+	fclose(out);
+	return 0;
+}
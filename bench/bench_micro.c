@@ -0,0 +1,446 @@
+/*
+ * bench_micro.c: Microbenchmarks of the station hot paths.
+ *
+ * Every result is one JSON object per line on stdout, so runs can be kept
+ * and compared by scripts. Usage: bench_micro [-t msecs] [name...]
+ */
+
+#include "common.h"
+#include "demod.h"
+#include "dsp.h"
+#include "net_utils.h"
+#include "sdrrc.h"
+#include "station.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* Station logs would go to stdout along with the results */
+static FILE *out;
+
+/* Minimum wall time of every benchmark */
+static uint64_t min_ns = 200000000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Line framing: the old byte-at-a-time read_line() against the buffered
+ * line_buffer, over the same stream of manager commands.
+ */
+#define LINES_PER_PASS  4096
+
+static int make_command_file(size_t *len)
+{
+	static const char *lines[] = {
+		"status\n", "setfreq 94500000\n", "setmod wbfm\n", "listchan\n",
+	};
+	FILE *fp = tmpfile();
+	int fd = fp ? dup(fileno(fp)) : -1;
+	unsigned k;
+
+	if (fp)
+		fclose(fp);
+
+	*len = 0;
+	for (k = 0; k < LINES_PER_PASS; k++) {
+		const char *l = lines[k % 4];
+
+		if (write(fd, l, strlen(l)) < 0)
+			return -1;
+		*len += strlen(l);
+	}
+
+	return fd;
+}
+
+static void bench_read_line(void)
+{
+	char line[LINE_BUFSZ];
+	uint64_t t0, t, nlines = 0, nreads = 0;
+	size_t len;
+	ssize_t n;
+	int fd = make_command_file(&len);
+
+	t0 = now_ns();
+	do {
+		lseek(fd, 0, SEEK_SET);
+		while ((n = read_line(fd, line, sizeof line)) > 0) {
+			nlines++;
+			nreads += n;    /* One read() per byte */
+		}
+		nreads++;           /* EOF */
+		t = now_ns() - t0;
+	} while (t < min_ns);
+	close(fd);
+
+	fprintf(out, "{\"bench\":\"read_line\",\"lines\":%" PRIu64
+		",\"ns_per_line\":%.1f,\"reads_per_line\":%.2f}\n",
+		nlines, (double)t / nlines, (double)nreads / nlines);
+}
+
+static void bench_line_buffer(void)
+{
+	struct line_buffer lb;
+	uint64_t t0, t, nlines = 0, nreads = 0;
+	size_t len;
+	ssize_t n;
+	char *line;
+	int fd = make_command_file(&len);
+
+	t0 = now_ns();
+	do {
+		lseek(fd, 0, SEEK_SET);
+		line_buffer_init(&lb);
+		do {
+			n = line_buffer_fill(&lb, fd);
+			nreads++;
+			while (line_buffer_next(&lb, &line) >= 0)
+				nlines++;
+		} while (n > 0);
+		t = now_ns() - t0;
+	} while (t < min_ns);
+	close(fd);
+
+	fprintf(out, "{\"bench\":\"line_buffer\",\"lines\":%" PRIu64
+		",\"ns_per_line\":%.1f,\"reads_per_line\":%.4f}\n",
+		nlines, (double)t / nlines, (double)nreads / nlines);
+}
+
+/* Command lookup alone, every command plus a few unknown words */
+static void bench_cmd_lookup(void)
+{
+	static const char *words[] = {
+		"status", "start", "stop", "reload", "setmod", "setfreq", "control",
+		"addchan", "delchan", "listchan", "binary", "logout", "getfreq", "x",
+	};
+	size_t lens[sizeof words / sizeof *words];
+	uint64_t t0, t, n = 0, hits = 0;
+	unsigned k;
+
+	for (k = 0; k < sizeof words / sizeof *words; k++)
+		lens[k] = strlen(words[k]);
+
+	t0 = now_ns();
+	do {
+		for (k = 0; k < sizeof words / sizeof *words; k++)
+			hits += (cmd_lookup(words[k], lens[k]) != NULL);
+		n += k;
+		t = now_ns() - t0;
+	} while (t < min_ns);
+
+	fprintf(out, "{\"bench\":\"cmd_lookup\",\"lookups\":%" PRIu64
+		",\"ns_per_lookup\":%.2f,\"hit_ratio\":%.3f}\n",
+		n, (double)t / n, (double)hits / n);
+}
+
+/*
+ * Whole dispatch of a command line, down to the send() of its reply: split,
+ * lookup, permission check, callback and sta_reply() into a socketpair.
+ */
+static void bench_dispatch(void)
+{
+	static const char *lines[] = {
+		"status", "setfreq 94500000", "setmod fm", "status",
+	};
+	static struct sta_context ctx;
+	struct sta_client client;
+	char line[64], sink[65536];
+	uint64_t t0, t, n = 0;
+	int sv[2], size = 1 << 20;
+	unsigned k;
+
+	ctx.cfg = cfg_alloc_init();
+	if (!ctx.cfg || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	memset(&client, 0, sizeof client);
+	client.h.fd = sv[0];
+	client.ctx = &ctx;
+	client.cfg = ctx.cfg;
+	ctx.controller = &client;
+
+	t0 = now_ns();
+	do {
+		for (k = 0; k < 64; k++) {
+			const char *l = lines[k % 4];
+			size_t len = strlen(l);
+
+			memcpy(line, l, len + 1);
+			sta_exec_line(&client, line, len);
+		}
+		n += k;
+		while (read(sv[1], sink, sizeof sink) > 0)
+			;
+		t = now_ns() - t0;
+	} while (t < min_ns && !client.closing);
+
+	fprintf(out, "{\"bench\":\"dispatch\",\"commands\":%" PRIu64
+		",\"ns_per_command\":%.1f}\n", n, (double)t / n);
+
+	close(sv[0]);
+	close(sv[1]);
+	cfg_free(ctx.cfg);
+}
+
+static void bench_mcode(void)
+{
+	static const char *names[] = {"fm", "wbfm", "raw", "am", "usb", "lsb", "xx"};
+	uint64_t t0, t, n = 0, sum = 0;
+	unsigned k;
+
+	t0 = now_ns();
+	do {
+		for (k = 0; k < 7; k++)
+			sum += string_to_mcode(names[k]);
+		n += k;
+		t = now_ns() - t0;
+	} while (t < min_ns);
+
+	fprintf(out, "{\"bench\":\"string_to_mcode\",\"calls\":%" PRIu64
+		",\"ns_per_call\":%.2f,\"check\":%" PRIu64 "}\n", n, (double)t / n, sum);
+
+	n = sum = 0;
+	t0 = now_ns();
+	do {
+		for (k = 0; k < 7; k++)
+			sum += (uintptr_t)mcode_to_string(k);
+		n += k;
+		t = now_ns() - t0;
+	} while (t < min_ns);
+
+	fprintf(out, "{\"bench\":\"mcode_to_string\",\"calls\":%" PRIu64
+		",\"ns_per_call\":%.2f}\n", n, (double)t / n);
+}
+
+/* One FM carrier at 'offset' Hz, modulated by a 1 kHz tone */
+static uint8_t *make_iq(uint32_t rate, double offset, size_t n)
+{
+	uint8_t *iq = malloc(2 * n);
+	double ph = 0.0;
+	size_t k;
+
+	if (!iq)
+		return NULL;
+
+	for (k = 0; k < n; k++) {
+		double f = offset + DSP_FM_DEV * sin(2.0 * M_PI * 1000.0 * k / rate);
+
+		ph += 2.0 * M_PI * f / rate;
+		iq[2 * k] = 127.5 + 100.0 * cos(ph);
+		iq[2 * k + 1] = 127.5 + 100.0 * sin(ph);
+	}
+
+	return iq;
+}
+
+/* Single channel chain, in capture samples per second on one core */
+static void bench_dsp_chain(uint8_t modulation)
+{
+	uint32_t rate = dsp_capture_rate(DSP_DEMOD_RATE);
+	struct dsp_chain ch;
+	int16_t *pcm = malloc(DSP_BLOCK * sizeof *pcm);
+	uint8_t *iq = make_iq(rate, 0.0, DSP_BLOCK);
+	uint64_t t0, t, n = 0;
+
+	if (!pcm || !iq || dsp_chain_init(&ch, modulation, rate, DSP_OUT_RATE) < 0)
+		goto _free;
+
+	t0 = now_ns();
+	do {
+		dsp_chain_process(&ch, iq, DSP_BLOCK, pcm);
+		n += DSP_BLOCK;
+		t = now_ns() - t0;
+	} while (t < min_ns);
+	dsp_chain_free(&ch);
+
+	fprintf(out, "{\"bench\":\"dsp_chain\",\"kernels\":\"%s\",\"mod\":\"%s\""
+		",\"in_rate\":%u,\"msps\":%.2f,\"realtime_x\":%.1f}\n", dsp_k.name,
+		mcode_to_string(modulation), rate, n * 1e3 / t,
+		(n * 1e9 / t) / rate);
+
+_free:
+	free(pcm);
+	free(iq);
+}
+
+/*
+ * Blocks through a demodulation engine with 'nchans' channels and 'nworkers'
+ * workers besides the calling thread, which stands in for the engine's own.
+ * The main frequency is demodulated as well, as in the station.
+ */
+static void bench_channelizer(unsigned nchans, unsigned nworkers)
+{
+	uint32_t rate = 1032000;
+	struct sdr_settings sdr = {.frequency = 94500000, .modulation = MOD_FM};
+	struct demod_engine *eng;
+	uint8_t *iq = make_iq(rate, 200000.0, DSP_BLOCK);
+	uint64_t t0, t, n = 0;
+	unsigned k;
+
+	eng = iq ? demod_create(rate, &sdr, NULL, nworkers) : NULL;
+	if (!eng) {
+		free(iq);
+		return;
+	}
+
+	for (k = 0; k < nchans; k++)
+		demod_add_channel(eng, k + 1, 94500000 + (k % 5) * 100000,
+			MOD_FM, NULL);
+
+	t0 = now_ns();
+	do {
+		demod_process(eng, iq, DSP_BLOCK);
+		n += DSP_BLOCK;
+		t = now_ns() - t0;
+	} while (t < min_ns);
+
+	fprintf(out, "{\"bench\":\"channelizer\",\"kernels\":\"%s\",\"channels\":%u"
+		",\"workers\":%u,\"in_rate\":%u,\"msps\":%.2f,\"realtime_x\":%.1f}\n",
+		dsp_k.name, nchans, eng->nworkers, rate, n * 1e3 / t,
+		(n * 1e9 / t) / rate);
+
+	demod_destroy(eng);
+	free(iq);
+}
+
+static void bench_dsp(void)
+{
+	long ncpu;
+	unsigned n;
+
+	/* Kernels start out scalar, then the best ones for this CPU */
+	bench_dsp_chain(MOD_FM);
+	dsp_kernels_init();
+	if (strcmp(dsp_k.name, "scalar") != 0)
+		bench_dsp_chain(MOD_FM);
+	bench_dsp_chain(MOD_WBFM);
+
+	for (n = 1; n <= STA_MAX_CHANNELS; n *= 2)
+		bench_channelizer(n, 0);
+
+	/* Every channel again, with up to the pool the station would start */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (n = 1; n == 1 || (n < (unsigned)ncpu && n <= DEMOD_MAX_WORKERS); n++)
+		bench_channelizer(STA_MAX_CHANNELS, n);
+}
+
+/*
+ * rtl_fm on the dongle, with the arguments the station gives it, for the
+ * same figure as bench_dsp_chain(): capture samples per second of its CPU
+ * time. It reads the device itself and cannot be fed a file, so this is
+ * skipped without rtl_fm or a dongle. Its start is counted as if samples
+ * were already flowing, which only flatters it.
+ */
+#define RTL_FM_SECS     5
+
+static void bench_rtl_fm(void)
+{
+	uint32_t rate = dsp_capture_rate(DSP_DEMOD_RATE);
+	char demod_str[16], rate_str[16];
+	char *argv[] = {
+		"rtl_fm", "-M", "fm", "-f", "94500000", "-s", demod_str,
+		"-r", rate_str, "-A", "lut", "-E", "dc", "-", NULL
+	};
+	struct timespec ts = {.tv_sec = RTL_FM_SECS};
+	struct rusage ru;
+	uint64_t t0, t, cpu;
+	int status, fd;
+	pid_t pid;
+
+	snprintf(demod_str, sizeof demod_str, "%u", DSP_DEMOD_RATE);
+	snprintf(rate_str, sizeof rate_str, "%u", DSP_OUT_RATE);
+
+	t0 = now_ns();
+	pid = fork();
+	if (pid < 0)
+		return;
+	if (pid == 0) {
+		fd = open("/dev/null", O_RDWR);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	/* Gone before its time: no rtl_fm, or no dongle for it */
+	nanosleep(&ts, NULL);
+	if (waitpid(pid, &status, WNOHANG) == pid) {
+		fprintf(out, "{\"bench\":\"rtl_fm\",\"skipped\":\"needs rtl_fm"
+			" and a dongle\"}\n");
+		return;
+	}
+	kill(pid, SIGTERM);
+	t = now_ns() - t0;
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return;
+
+	cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * UINT64_C(1000000000) +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * UINT64_C(1000);
+	fprintf(out, "{\"bench\":\"rtl_fm\",\"mod\":\"fm\",\"in_rate\":%u"
+		",\"seconds\":%.1f,\"cpu_pct\":%.1f,\"msps\":%.2f}\n", rate,
+		t * 1e-9, 100.0 * cpu / t, cpu ? rate * (t * 1e-9) / (cpu * 1e-3) : 0.0);
+}
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} benches[] = {
+	{"read_line",   &bench_read_line},
+	{"line_buffer", &bench_line_buffer},
+	{"cmd_lookup",  &bench_cmd_lookup},
+	{"dispatch",    &bench_dispatch},
+	{"mcode",       &bench_mcode},
+	{"dsp",         &bench_dsp},
+	{"rtl_fm",      &bench_rtl_fm},
+};
+
+int main(int argc, char **argv)
+{
+	unsigned k;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			min_ns = strtoull(optarg, NULL, 10) * 1000000;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t msecs] [name...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout))
+		return 1;
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	for (k = 0; k < sizeof benches / sizeof *benches; k++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (strcmp(argv[i], benches[k].name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		benches[k].func();
+	}
+
+	return 0;
+}
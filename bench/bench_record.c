@@ -0,0 +1,201 @@
+/*
+ * bench_record.c: Sustained write rate of the recorder with many streams.
+ *
+ * Every stream gets Ogg-like pages as fast as the calling thread can hand
+ * them out, round robin, the way the station does with one page per
+ * encoder read. That is more than any disk takes, so the recorder drops
+ * pages and what gets written is the sustained rate, timed up to the point
+ * where every segment is on disk. A seek on each recording then checks the
+ * index against the files.
+ */
+
+#include "common.h"
+#include "recorder.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_STREAMS     256
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Page number 'seq' of stream 'k', tagged so a seek can be checked */
+static void make_page(uint8_t *page, size_t len, unsigned k, uint64_t seq)
+{
+	memcpy(page, "OggS", 4);
+	memcpy(page + 4, &k, sizeof k);
+	memcpy(page + 8, &seq, sizeof seq);
+}
+
+/* The page recorded at the middle of the run must be a page boundary */
+static bool check_seek(struct recorder *rec, uint64_t ts_ms)
+{
+	char path[512], magic[4];
+	uint64_t offset, page_ms;
+	bool ok;
+	int fd;
+
+	if (recorder_seek(rec, ts_ms, path, sizeof path, &offset, &page_ms) < 0)
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ok = pread(fd, magic, sizeof magic, offset) == sizeof magic &&
+		memcmp(magic, "OggS", 4) == 0 && page_ms <= ts_ms;
+	close(fd);
+	return ok;
+}
+
+static void remove_dir(const char *dir)
+{
+	char path[1024];
+	struct dirent *de;
+	DIR *d = opendir(dir);
+
+	while (d && (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+		unlink(path);
+	}
+	if (d)
+		closedir(d);
+	rmdir(dir);
+}
+
+static int run(const char *base, unsigned nstreams, unsigned secs,
+	size_t page_len)
+{
+	struct recorder *recs[MAX_STREAMS];
+	struct rec_writer w;
+	char dir[512], name[16];
+	uint8_t *page = calloc(1, page_len);
+	uint8_t hdr[64] = "OggS";
+	uint64_t t0, t_end, t_fed, t_done, seq = 0, mid_ms, dropped = 0;
+	uint64_t offered;
+	unsigned k, nsegs = 0, seek_ok = 0;
+
+	snprintf(dir, sizeof dir, "%s/bench_record.XXXXXX", base);
+	if (!page || !mkdtemp(dir)) {
+		free(page);
+		return -1;
+	}
+
+	if (rec_writer_init(&w) < 0) {
+		free(page);
+		rmdir(dir);
+		return -1;
+	}
+	for (k = 0; k < nstreams; k++) {
+		snprintf(name, sizeof name, "s%u", k);
+		recs[k] = recorder_create(&w, dir, name);
+		if (!recs[k]) {
+			print_error("cannot create the recorders\n");
+			exit(2);
+		}
+	}
+
+	t0 = now_ns();
+	t_end = t0 + secs * UINT64_C(1000000000);
+	mid_ms = get_timestamp_ms() + secs * 500;
+	do {
+		/* Check the clock every so often only */
+		for (k = 0; k < 64 * nstreams; k++, seq++) {
+			make_page(page, page_len, k % nstreams, seq);
+			recorder_page(recs[k % nstreams], hdr, sizeof hdr, page,
+				page_len);
+		}
+		t_fed = now_ns();
+	} while (t_fed < t_end);
+
+	offered = seq * page_len;
+
+	for (k = 0; k < nstreams; k++)
+		recorder_stop(recs[k]);
+	for (k = 0; k < nstreams; k++)
+		recorder_sync(recs[k]);
+	t_done = now_ns();
+
+	for (k = 0; k < nstreams; k++) {
+		dropped += recs[k]->dropped;
+		nsegs += recs[k]->nsegs;
+		seek_ok += check_seek(recs[k], mid_ms);
+		recorder_free(recs[k]);
+	}
+
+	printf("{\"bench\":\"record\",\"backend\":\"%s\",\"streams\":%u"
+		",\"page_bytes\":%zu,\"seconds\":%.2f,\"offered_mb_per_s\":%.1f"
+		",\"written_mb_per_s\":%.1f,\"writes\":%" PRIu64
+		",\"writes_per_call\":%.1f,\"segments\":%u,\"dropped_share\":%.3f"
+		",\"seek_ok\":%u}\n",
+		rec_writer_backend(&w), nstreams, page_len, (t_done - t0) / 1e9,
+		offered / 1e6 / ((t_fed - t0) / 1e9),
+		atomic_load(&w.bytes) / 1e6 / ((t_done - t0) / 1e9),
+		atomic_load(&w.writes),
+		(double)atomic_load(&w.writes) /
+			(atomic_load(&w.submits) ? atomic_load(&w.submits) : 1),
+		nsegs, (double)dropped / offered, seek_ok);
+
+	rec_writer_close(&w);
+	remove_dir(dir);
+	free(page);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d dir        where to write ($TMPDIR or /tmp)\n"
+		"  -t seconds    feeding time per run (3)\n"
+		"  -n list       stream counts, comma separated (1,8,64)\n"
+		"  -p bytes      page size (4096)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *base = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char defaults[] = "1,8,64", *list = defaults, *tok, *save;
+	unsigned secs = 3, n;
+	size_t page_len = 4096;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:n:p:")) != -1) {
+		switch (opt) {
+		case 'd': base = optarg; break;
+		case 't': secs = strtoul(optarg, NULL, 10); break;
+		case 'n': list = optarg; break;
+		case 'p': page_len = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (secs == 0 || page_len < 16 || page_len > 65536)
+		usage(argv[0]);
+
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		n = strtoul(tok, NULL, 10);
+		if (n < 1 || n > MAX_STREAMS)
+			usage(argv[0]);
+		if (run(base, n, secs, page_len) < 0) {
+			print_error("cannot record into %s: %s\n", base,
+				strerror(errno));
+			return 2;
+		}
+	}
+
+	return 0;
+}
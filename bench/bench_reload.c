@@ -0,0 +1,192 @@
+/*
+ * bench_reload.c: Pipeline start and reload latency of a station.
+ *
+ * Sends 'reload' commands one at a time, each one waiting for its reply, and
+ * reports the latency percentiles. The station process is inspected through
+ * /proc before and after the run: open file descriptors and child processes
+ * (zombies included) must stay flat however many reloads it went through.
+ * The result is a single JSON object on stdout.
+ */
+
+#include "common.h"
+#include "net_utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Time given to the station to reap the last children before counting */
+#define SETTLE_US       500000
+
+struct proc_count {
+	unsigned fds;
+	unsigned children;
+	unsigned zombies;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static unsigned count_dir(const char *path)
+{
+	struct dirent *de;
+	unsigned n = 0;
+	DIR *dir = opendir(path);
+
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)))
+		n += (de->d_name[0] != '.');
+	closedir(dir);
+	return n;
+}
+
+/* Open descriptors and children of 'pid', from /proc */
+static void proc_count(pid_t pid, struct proc_count *pc)
+{
+	char path[300], buf[512], state, *p;
+	struct dirent *de;
+	DIR *dir;
+	FILE *fp;
+	int ppid;
+
+	snprintf(path, sizeof path, "/proc/%d/fd", (int)pid);
+	pc->fds = count_dir(path);
+	pc->children = pc->zombies = 0;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof path, "/proc/%s/stat", de->d_name);
+		if (!(fp = fopen(path, "r")))
+			continue;
+		if (fgets(buf, sizeof buf, fp) && (p = strrchr(buf, ')')) &&
+		    sscanf(p + 1, " %c %d", &state, &ppid) == 2 && ppid == pid) {
+			pc->children++;
+			pc->zombies += (state == 'Z');
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+}
+
+/* Send 'cmd' and wait for its reply line, events are skipped */
+static int command(int fd, struct line_buffer *lb, const char *cmd,
+	char **reply)
+{
+	size_t len = strlen(cmd);
+	ssize_t n;
+
+	if (write(fd, cmd, len) != (ssize_t)len)
+		return -1;
+
+	for (;;) {
+		while (line_buffer_next(lb, reply) >= 0)
+			if (**reply != '!')
+				return 0;
+		n = line_buffer_fill(lb, fd);
+		if (n <= 0 && !(n < 0 && errno == EINTR))
+			return -1;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s -s pid [options]\n"
+		"  -s pid        station process, for the fd and child counts\n"
+		"  -h host       station host (127.0.0.1)\n"
+		"  -p port       control port (17920)\n"
+		"  -n reloads    number of reloads (10000)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	struct proc_count before, after;
+	struct line_buffer lb;
+	uint64_t *lat, t0, start_ns, total_ns;
+	unsigned n = 10000, k, failed = 0;
+	int port = 17920, opt, fd;
+	pid_t pid = 0;
+	char *reply;
+
+	while ((opt = getopt(argc, argv, "s:h:p:n:")) != -1) {
+		switch (opt) {
+		case 's': pid = atoi(optarg); break;
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (pid <= 0 || n == 0)
+		usage(argv[0]);
+
+	lat = malloc(n * sizeof *lat);
+	fd = tcp_client_socket(host, port);
+	if (!lat || fd < 0) {
+		print_error("cannot connect to %s:%d\n", host, port);
+		return 2;
+	}
+	line_buffer_init(&lb);
+
+	/* First start, and a settled pipeline to compare against */
+	t0 = now_ns();
+	if (command(fd, &lb, "start\n", &reply) < 0 || strstr(reply, "Error")) {
+		print_error("cannot start the station: %s\n", reply);
+		return 2;
+	}
+	start_ns = now_ns() - t0;
+	usleep(SETTLE_US);
+	proc_count(pid, &before);
+
+	t0 = now_ns();
+	for (k = 0; k < n; k++) {
+		lat[k] = now_ns();
+		if (command(fd, &lb, "reload\n", &reply) < 0)
+			return 2;
+		lat[k] = now_ns() - lat[k];
+		failed += (strstr(reply, "Error") != NULL);
+	}
+	total_ns = now_ns() - t0;
+
+	usleep(SETTLE_US);
+	proc_count(pid, &after);
+	command(fd, &lb, "stop\n", &reply);
+	close(fd);
+
+	qsort(lat, n, sizeof *lat, &cmp_u64);
+	printf("{\"bench\":\"reload\",\"reloads\":%u,\"failed\":%u"
+		",\"reloads_per_s\":%.1f,\"start_ms\":%.3f"
+		",\"reload_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}"
+		",\"fds\":{\"before\":%u,\"after\":%u}"
+		",\"children\":{\"before\":%u,\"after\":%u}"
+		",\"zombies\":{\"before\":%u,\"after\":%u}}\n",
+		n, failed, n * 1e9 / total_ns, start_ns / 1e6,
+		lat[n / 2] / 1e6, lat[(uint64_t)n * 99 / 100] / 1e6,
+		lat[n - 1] / 1e6, before.fds, after.fds, before.children,
+		after.children, before.zombies, after.zombies);
+
+	free(lat);
+	return (after.fds > before.fds || after.children > before.children);
+}
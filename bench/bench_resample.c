@@ -0,0 +1,278 @@
+/*
+ * bench_resample.c: Accuracy and throughput of the PCM resampler.
+ *
+ * Every output rate is checked against pure tones at the demodulator rate:
+ * signal to noise ratio of a 1 kHz tone, gain across the passband, and how
+ * much of a tone past the lower Nyquist rate leaks into the output as an
+ * alias (down) or an image (up). Feeding odd sized chunks must give the
+ * very same samples as one call. Then the throughput, on the calling
+ * thread. The exit status is 1 when a check fails.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "resample.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define TEST_SECONDS    2
+#define TEST_AMPLITUDE  16384.0
+
+/* Pass marks */
+#define MIN_SNR_DB      60.0
+#define MAX_RIPPLE_DB   0.1
+#define MAX_LEAK_DB     -60.0
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int16_t *make_tone(uint32_t rate, double freq, size_t n)
+{
+	int16_t *x = malloc(n * sizeof *x);
+	size_t k;
+
+	for (k = 0; x && k < n; k++)
+		x[k] = lrint(TEST_AMPLITUDE * sin(2.0 * M_PI * freq * k / rate));
+	return x;
+}
+
+/*
+ * Least squares fit of a sinusoid at 'freq' over 'y', skipping the filter
+ * transients at both ends. Returns its amplitude, and the power of what is
+ * left in 'resid' when asked.
+ */
+static double fit_tone(const int16_t *y, size_t n, size_t skip, uint32_t rate,
+	double freq, double *resid)
+{
+	double scc = 0, sss = 0, scs = 0, syc = 0, sys = 0, a, b, det, e = 0;
+	size_t k;
+
+	for (k = skip; k + skip < n; k++) {
+		double c = cos(2.0 * M_PI * freq * k / rate);
+		double s = sin(2.0 * M_PI * freq * k / rate);
+
+		scc += c * c;
+		sss += s * s;
+		scs += c * s;
+		syc += y[k] * c;
+		sys += y[k] * s;
+	}
+
+	det = scc * sss - scs * scs;
+	a = (syc * sss - sys * scs) / det;
+	b = (sys * scc - syc * scs) / det;
+
+	if (resid) {
+		for (k = skip; k + skip < n; k++) {
+			double d = y[k] - a * cos(2.0 * M_PI * freq * k / rate) -
+				b * sin(2.0 * M_PI * freq * k / rate);
+
+			e += d * d;
+		}
+		*resid = e / (n - 2 * skip);
+	}
+
+	return sqrt(a * a + b * b);
+}
+
+/* Resample a whole tone in one call */
+static int16_t *run_tone(uint32_t in_rate, uint32_t out_rate, double freq,
+	size_t *nout)
+{
+	size_t n = (size_t)in_rate * TEST_SECONDS;
+	struct resampler rs;
+	int16_t *x = make_tone(in_rate, freq, n), *y = NULL;
+
+	if (x && resampler_init(&rs, in_rate, out_rate) == 0) {
+		y = malloc(resampler_max_out(&rs, n) * sizeof *y);
+		if (y)
+			*nout = resampler_process(&rs, x, n, y);
+		resampler_free(&rs);
+	}
+
+	free(x);
+	return y;
+}
+
+/* Gain at 'freq' in dB, 0 being a perfect passband */
+static double gain_db(uint32_t in_rate, uint32_t out_rate, double freq,
+	size_t skip)
+{
+	size_t nout;
+	int16_t *y = run_tone(in_rate, out_rate, freq, &nout);
+	double amp;
+
+	if (!y)
+		return NAN;
+	amp = fit_tone(y, nout, skip, out_rate, freq, NULL);
+	free(y);
+	return 20.0 * log10(amp / TEST_AMPLITUDE);
+}
+
+/* Same output whether the input comes in one call or in odd chunks */
+static bool check_chunks(uint32_t in_rate, uint32_t out_rate)
+{
+	size_t n = (size_t)in_rate * TEST_SECONDS, pos, len, nout = 0, nref;
+	struct resampler rs;
+	int16_t *x = make_tone(in_rate, 1234.5, n), *y = NULL, *ref;
+	bool ok = false;
+
+	ref = run_tone(in_rate, out_rate, 1234.5, &nref);
+	if (x && ref && resampler_init(&rs, in_rate, out_rate) == 0) {
+		y = malloc(resampler_max_out(&rs, n) * sizeof *y);
+		srand(330);
+		for (pos = 0; y && pos < n; pos += len) {
+			len = 1 + rand() % (2 * RS_BLOCK);
+			if (len > n - pos)
+				len = n - pos;
+			nout += resampler_process(&rs, x + pos, len, y + nout);
+		}
+		ok = y && nout == nref && memcmp(y, ref, nout * sizeof *y) == 0;
+		resampler_free(&rs);
+	}
+
+	free(x);
+	free(y);
+	free(ref);
+	return ok;
+}
+
+/* Input samples per second of CPU, over at least 'secs' */
+static double throughput(uint32_t in_rate, uint32_t out_rate, double secs)
+{
+	size_t n = (size_t)in_rate * TEST_SECONDS, done = 0;
+	struct resampler rs;
+	int16_t *x = make_tone(in_rate, 1000.0, n), *y = NULL;
+	uint64_t t0, dt = 0;
+
+	if (x && resampler_init(&rs, in_rate, out_rate) == 0) {
+		y = malloc(resampler_max_out(&rs, n) * sizeof *y);
+		t0 = cpu_ns();
+		while (y && dt < secs * 1e9) {
+			resampler_process(&rs, x, n, y);
+			done += n;
+			dt = cpu_ns() - t0;
+		}
+		resampler_free(&rs);
+	}
+
+	free(x);
+	free(y);
+	return dt ? done / (dt / 1e9) : 0.0;
+}
+
+static bool run(uint32_t in_rate, uint32_t out_rate, double secs)
+{
+	double low_nyq, snr, ripple = 0, g, leak, f, leak_f, amp, resid, sps;
+	struct resampler rs;
+	size_t nout, skip;
+	int16_t *y;
+	bool chunks_ok, ok;
+	int k;
+
+	if (resampler_init(&rs, in_rate, out_rate) < 0) {
+		print_error("cannot resample %u to %u Hz: %s\n", in_rate, out_rate,
+			strerror(errno));
+		return false;
+	}
+	low_nyq = ((in_rate < out_rate) ? in_rate : out_rate) / 2.0;
+	skip = 2 * (size_t)rs.ntaps * out_rate / in_rate + 2 * rs.ntaps;
+
+	/* Distortion and noise of a tone well inside the passband */
+	y = run_tone(in_rate, out_rate, 1000.0, &nout);
+	if (!y)
+		return false;
+	amp = fit_tone(y, nout, skip, out_rate, 1000.0, &resid);
+	snr = 10.0 * log10(amp * amp / 2.0 / resid);
+	free(y);
+
+	/* Flatness up to 70% of the lower Nyquist rate */
+	for (k = 1; k <= 7; k++) {
+		g = gain_db(in_rate, out_rate, low_nyq * k / 10.0, skip);
+		if (fabs(g) > fabs(ripple))
+			ripple = g;
+	}
+
+	/* A tone 15% past the output band aliases, one 20% past the input images */
+	if (out_rate < in_rate) {
+		f = out_rate / 2.0 * 1.15;
+		leak_f = out_rate - f;
+	} else {
+		f = in_rate / 2.0 * 0.8;
+		leak_f = in_rate - f;
+	}
+	y = run_tone(in_rate, out_rate, f, &nout);
+	if (!y)
+		return false;
+	leak = 20.0 * log10(fit_tone(y, nout, skip, out_rate, leak_f, NULL) /
+		TEST_AMPLITUDE + 1e-12);
+	free(y);
+
+	chunks_ok = check_chunks(in_rate, out_rate);
+	sps = throughput(in_rate, out_rate, secs);
+
+	ok = snr >= MIN_SNR_DB && fabs(ripple) <= MAX_RIPPLE_DB &&
+		leak <= MAX_LEAK_DB && chunks_ok;
+
+	printf("{\"bench\":\"resample\",\"kernels\":\"%s\",\"in_rate\":%u"
+		",\"out_rate\":%u,\"up\":%u,\"down\":%u,\"taps\":%u"
+		",\"snr_db\":%.1f,\"ripple_db\":%.3f,\"leak_db\":%.1f"
+		",\"chunks_ok\":%s,\"msps\":%.2f,\"realtime_x\":%.0f,\"ok\":%s}\n",
+		dsp_k.name, in_rate, out_rate, rs.up, rs.down, rs.ntaps, snr, ripple,
+		leak, chunks_ok ? "true" : "false", sps / 1e6, sps / in_rate,
+		ok ? "true" : "false");
+
+	resampler_free(&rs);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -i rate       input rate (%u)\n"
+		"  -o list       output rates, comma separated (8000,16000,44100,48000)\n"
+		"  -t seconds    CPU time of each throughput run (1)\n", name,
+		DSP_OUT_RATE);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char defaults[] = "8000,16000,44100,48000", *list = defaults, *tok, *save;
+	uint32_t in_rate = DSP_OUT_RATE, out_rate;
+	double secs = 1.0;
+	bool ok = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:o:t:")) != -1) {
+		switch (opt) {
+		case 'i': in_rate = strtoul(optarg, NULL, 10); break;
+		case 'o': list = optarg; break;
+		case 't': secs = strtod(optarg, NULL); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (in_rate < RS_MIN_RATE || in_rate > RS_MAX_RATE || secs <= 0)
+		usage(argv[0]);
+
+	dsp_kernels_init();
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		out_rate = strtoul(tok, NULL, 10);
+		if (out_rate < RS_MIN_RATE || out_rate > RS_MAX_RATE)
+			usage(argv[0]);
+		ok &= run(in_rate, out_rate, secs);
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,397 @@
+/*
+ * bench_retune.c: Retune-to-audio latency against a local rtl_tcp stand-in.
+ *
+ * This program plays the tuner: it listens for the station's rtl_tcp
+ * connection and streams u8 IQ at the sample rate it is asked for, noise
+ * everywhere but on one frequency, where an FM carrier with a 1 kHz tone
+ * is on the air. The station is given a squelch, then retuned back and
+ * forth between that frequency and where it was, with setfreq. For every
+ * retune onto the carrier, three times are taken from the moment setfreq
+ * is sent: the tuner seeing the new frequency, the reply, and the squelch
+ * opening, which is the first block of the new audio going to the encoder.
+ * Given the HTTP port, child spawns per retune show that the pipeline was
+ * not restarted. One JSON line.
+ *
+ * The station must use the stand-in as its source, for instance:
+ *   sdrrc -p 17920 -i rtltcp:127.0.0.1:1234 -r 1032000
+ *   bench_retune -p 17920 -P 1234
+ */
+
+#include "common.h"
+#include "iq_source.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TARGET_OFFSET   200000          /* Carrier, above the station */
+#define CHUNK_HZ        500             /* Chunks of IQ sent per second */
+#define EVENT_TIMEOUT   5000            /* ms */
+#define REPLY_LEN       256
+
+/* The tuner side, run on a thread of its own */
+struct standin {
+	pthread_t        tid;
+	int              lfd;
+	uint32_t         target;
+	_Atomic uint32_t freq;
+	_Atomic uint64_t tuned_ns;      /* When 'freq' last changed */
+	atomic_bool      streaming;
+	atomic_bool      stop;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* One second of noise, with the carrier on it when 'carrier' is set */
+static uint8_t *make_iq(uint32_t rate, bool carrier)
+{
+	uint8_t *iq = malloc(2 * (size_t)rate);
+	double ph = 0.0, i, q;
+	uint32_t k;
+
+	if (!iq)
+		return NULL;
+
+	srand(330);
+	for (k = 0; k < rate; k++) {
+		i = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		q = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		if (carrier) {
+			ph += 2.0 * M_PI * 5000.0 *
+				sin(2.0 * M_PI * 1000.0 * k / rate) / rate;
+			i += 60.0 * cos(ph);
+			q += 60.0 * sin(ph);
+		}
+		iq[2 * k] = i;
+		iq[2 * k + 1] = q;
+	}
+
+	return iq;
+}
+
+/* Act on whole commands in 'cmd', keeping a partial one for later */
+static void standin_commands(struct standin *s, uint8_t *cmd, size_t *len,
+	uint32_t *rate)
+{
+	uint32_t param;
+	size_t k;
+
+	for (k = 0; k + 5 <= *len; k += 5) {
+		param = (uint32_t)cmd[k + 1] << 24 | cmd[k + 2] << 16 |
+			cmd[k + 3] << 8 | cmd[k + 4];
+		if (cmd[k] == RTLTCP_SET_FREQ) {
+			atomic_store(&s->freq, param);
+			atomic_store(&s->tuned_ns, now_ns());
+		} else if (cmd[k] == RTLTCP_SET_SAMPLE_RATE) {
+			*rate = param;
+		}
+	}
+	memmove(cmd, cmd + k, *len - k);
+	*len -= k;
+}
+
+/*
+ * Serve one station: the header, its first commands, then IQ in chunks at
+ * the sample rate, reading the commands that come in between chunks.
+ */
+static void *standin(void *arg)
+{
+	struct standin *s = arg;
+	uint8_t hdr[12] = {'R', 'T', 'L', '0', 0, 0, 0, 5, 0, 0, 0, 0};
+	uint8_t cmd[64], *noise = NULL, *carrier = NULL, *src;
+	uint32_t rate = 0;
+	size_t len = 0, got = 0, chunk, pos = 0;
+	uint64_t due;
+	ssize_t nbr;
+	int fd;
+
+	fd = accept(s->lfd, NULL, NULL);
+	if (fd < 0 || send(fd, hdr, sizeof hdr, MSG_NOSIGNAL) != sizeof hdr)
+		goto _out;
+
+	/* Rate, gain mode and frequency come right after the header */
+	while (got < 15 && (nbr = recv(fd, cmd + len, sizeof cmd - len, 0)) > 0) {
+		len += nbr;
+		got += nbr;
+		standin_commands(s, cmd, &len, &rate);
+	}
+	if (rate < CHUNK_HZ)
+		goto _out;
+	noise = make_iq(rate, false);
+	carrier = make_iq(rate, true);
+	if (!noise || !carrier)
+		goto _out;
+
+	chunk = rate / CHUNK_HZ;
+	atomic_store(&s->streaming, true);
+	for (due = now_ns(); !atomic_load(&s->stop); ) {
+		while ((nbr = recv(fd, cmd + len, sizeof cmd - len, MSG_DONTWAIT)) > 0) {
+			len += nbr;
+			standin_commands(s, cmd, &len, &rate);
+		}
+		if (nbr == 0)
+			break;
+
+		src = (atomic_load(&s->freq) == s->target) ? carrier : noise;
+		if (send(fd, src + 2 * pos, 2 * chunk, MSG_NOSIGNAL) != (ssize_t)(2 * chunk))
+			break;
+		pos = (pos + chunk) % (rate - rate % chunk);
+
+		/* Far behind, the schedule starts over instead of bursting */
+		due += UINT64_C(1000000000) / CHUNK_HZ;
+		if (due + UINT64_C(100000000) < now_ns())
+			due = now_ns();
+		sleep_until(due);
+	}
+
+_out:
+	atomic_store(&s->streaming, false);
+	if (fd >= 0)
+		close(fd);
+	free(noise);
+	free(carrier);
+	return NULL;
+}
+
+/* Value of a counter in the /metrics page, 0 when unavailable */
+static uint64_t scrape(const char *host, int port, const char *name)
+{
+	static char page[1 << 16];
+	const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+	size_t len = 0, nlen = strlen(name);
+	uint64_t val = 0;
+	ssize_t nbr;
+	char *p;
+	int fd;
+
+	if (port <= 0 || (fd = tcp_client_socket(host, port)) < 0)
+		return 0;
+	if (write(fd, req, strlen(req)) == (ssize_t)strlen(req)) {
+		while (len < sizeof page - 1 &&
+		       (nbr = read(fd, page + len, sizeof page - 1 - len)) > 0)
+			len += nbr;
+	}
+	close(fd);
+	page[len] = '\0';
+
+	for (p = page; (p = strstr(p, name)); p += nlen) {
+		if (p[nlen] == ' ' && (p == page || p[-1] == '\n')) {
+			val = strtoull(p + nlen + 1, NULL, 10);
+			break;
+		}
+	}
+
+	return val;
+}
+
+/*
+ * Send 'cmd', then read until its reply, copied into 'reply', and with
+ * 'state' set, a squelch event of the main stream going to that state. The
+ * times they came in are stored into 'reply_ns' and 'event_ns'. Returns -1
+ * on a timeout.
+ */
+static int command(int fd, struct line_buffer *lb, const char *cmd,
+	const char *state, uint64_t *reply_ns, uint64_t *event_ns,
+	char reply[REPLY_LEN])
+{
+	const char *ev = "!<Squelch: /stream.ogg ";
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	uint64_t end = now_ns() + EVENT_TIMEOUT * UINT64_C(1000000);
+	bool replied = false, evented = (state == NULL);
+	size_t len = strlen(cmd);
+	char *line;
+	ssize_t nbr;
+
+	if (write(fd, cmd, len) != (ssize_t)len)
+		return -1;
+
+	while (!replied || !evented) {
+		while (line_buffer_next(lb, &line) >= 0) {
+			if (*line != '!') {
+				*reply_ns = now_ns();
+				snprintf(reply, REPLY_LEN, "%s", line);
+				replied = true;
+			} else if (state && !strncmp(line, ev, strlen(ev)) &&
+				   !strncmp(line + strlen(ev), state, strlen(state))) {
+				*event_ns = now_ns();
+				evented = true;
+			}
+		}
+		if (replied && evented)
+			break;
+		if (now_ns() >= end ||
+		    poll(&pfd, 1, (end - now_ns()) / 1000000 + 1) <= 0)
+			return -1;
+		nbr = line_buffer_fill(lb, fd);
+		if (nbr <= 0 && !(nbr < 0 && errno == EINTR))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host       station host (127.0.0.1)\n"
+		"  -p port       control port (17920)\n"
+		"  -H port       HTTP port, for the spawn counts (none)\n"
+		"  -P port       port of the rtl_tcp stand-in (1234)\n"
+		"  -n retunes    retunes onto the carrier (20)\n"
+		"  -S dBFS       squelch level given to the station (-20)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct standin s;
+	const char *host = "127.0.0.1", *sql = "-20";
+	uint64_t *tuner, *reply, *audio, t0, t1, t2, spawns;
+	int port = 17920, hport = 0, tport = 1234, opt, fd;
+	unsigned n = 20, k, m = 0, failed = 0;
+	struct line_buffer lb;
+	uint32_t freq;
+	char cmd[64], line[REPLY_LEN], *p;
+
+	while ((opt = getopt(argc, argv, "h:p:H:P:n:S:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'H': hport = atoi(optarg); break;
+		case 'P': tport = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		case 'S': sql = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (n == 0 || tport <= 0 || tport > 65535)
+		usage(argv[0]);
+
+	tuner = malloc(n * sizeof *tuner);
+	reply = malloc(n * sizeof *reply);
+	audio = malloc(n * sizeof *audio);
+	if (!tuner || !reply || !audio)
+		return 2;
+
+	s.lfd = tcp_server_socket(tport, 1);
+	if (s.lfd < 0 || pthread_create(&s.tid, NULL, &standin, &s) != 0) {
+		print_error("cannot listen on port %d\n", tport);
+		return 2;
+	}
+
+	fd = tcp_client_socket(host, port);
+	if (fd < 0) {
+		print_error("cannot connect to %s:%d\n", host, port);
+		return 2;
+	}
+	line_buffer_init(&lb);
+
+	/* The carrier is 200 kHz above where the station is */
+	snprintf(cmd, sizeof cmd, "squelch %s\n", sql);
+	if (command(fd, &lb, "status\n", NULL, &t1, &t2, line) < 0 ||
+	    !(p = strstr(line, "Freq: ")) ||
+	    (freq = strtoul(p + 6, NULL, 10)) == 0 ||
+	    command(fd, &lb, cmd, NULL, &t1, &t2, line) < 0 ||
+	    strstr(line, "Error") ||
+	    command(fd, &lb, "start\n", NULL, &t1, &t2, line) < 0 ||
+	    strstr(line, "Error")) {
+		print_error("cannot start the station\n");
+		return 2;
+	}
+	s.target = freq + TARGET_OFFSET;
+	for (k = 0; k < 50 && !atomic_load(&s.streaming); k++)
+		usleep(100000);
+	if (!atomic_load(&s.streaming)) {
+		print_error("the station did not connect to the stand-in\n");
+		return 2;
+	}
+
+	/* Noise only, the squelch settles closed */
+	sleep(1);
+	spawns = scrape(host, hport, "sdrrc_child_spawns_total");
+
+	for (k = 0; k < n; k++) {
+		snprintf(cmd, sizeof cmd, "setfreq %u\n", s.target);
+		t0 = now_ns();
+		if (command(fd, &lb, cmd, "open", &t1, &t2, line) < 0 ||
+		    strstr(line, "Error")) {
+			failed++;
+		} else {
+			tuner[m] = atomic_load(&s.tuned_ns) - t0;
+			reply[m] = t1 - t0;
+			audio[m] = t2 - t0;
+			m++;
+		}
+
+		/* Back off the carrier, until the squelch has closed again */
+		snprintf(cmd, sizeof cmd, "setfreq %u\n", freq);
+		if (command(fd, &lb, cmd, "closed", &t1, &t2, line) < 0)
+			failed++;
+	}
+	spawns = scrape(host, hport, "sdrrc_child_spawns_total") - spawns;
+
+	command(fd, &lb, "stop\n", NULL, &t1, &t2, line);
+	close(fd);
+	atomic_store(&s.stop, true);
+	pthread_join(s.tid, NULL);
+	close(s.lfd);
+
+	if (m == 0) {
+		print_error("the squelch never opened on the carrier\n");
+		return 2;
+	}
+	qsort(tuner, m, sizeof *tuner, &cmp_u64);
+	qsort(reply, m, sizeof *reply, &cmp_u64);
+	qsort(audio, m, sizeof *audio, &cmp_u64);
+
+	printf("{\"bench\":\"retune\",\"retunes\":%u,\"failed\":%u", m, failed);
+	printf(",\"tuner_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+		tuner[m / 2] / 1e6, tuner[(uint64_t)m * 99 / 100] / 1e6,
+		tuner[m - 1] / 1e6);
+	printf(",\"reply_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+		reply[m / 2] / 1e6, reply[(uint64_t)m * 99 / 100] / 1e6,
+		reply[m - 1] / 1e6);
+	printf(",\"audio_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+		audio[m / 2] / 1e6, audio[(uint64_t)m * 99 / 100] / 1e6,
+		audio[m - 1] / 1e6);
+	if (hport > 0)
+		printf(",\"spawns_per_retune\":%.2f", (double)spawns / (2 * n));
+	printf("}\n");
+
+	free(tuner);
+	free(reply);
+	free(audio);
+	return failed ? 1 : 0;
+}
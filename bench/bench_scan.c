@@ -0,0 +1,169 @@
+/*
+ * bench_scan.c: Spectrum sweep time on a recorded capture.
+ *
+ * Sweeps an IQ file with scan_sweep() and reports the time per MHz along
+ * with the peaks found. Without a capture, one is synthesized with a few
+ * carriers at known offsets in noise, and every one of them must be found.
+ * The result is a single JSON object on stdout.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SYNTH_SAMPLES   (1 << 18)
+
+/* Offsets from the center and amplitudes of the synthesized carriers */
+static const struct {
+	int32_t offset;
+	double  amp;
+} carriers[] = {
+	{-300000, 40.0},
+	{ 100000, 20.0},
+	{ 250000, 10.0},
+};
+
+#define NCARRIERS   (sizeof carriers / sizeof carriers[0])
+
+/* u8 IQ capture of the carriers in white noise, written to a temp file */
+static int make_capture(char *path, uint32_t rate)
+{
+	double ph[NCARRIERS] = {0}, i, q;
+	uint8_t *iq;
+	unsigned c;
+	size_t k;
+	int fd;
+
+	fd = mkstemp(path);
+	iq = malloc(2 * SYNTH_SAMPLES);
+	if (fd < 0 || !iq) {
+		free(iq);
+		return -1;
+	}
+
+	srand(330);
+	for (k = 0; k < SYNTH_SAMPLES; k++) {
+		i = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		q = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		for (c = 0; c < NCARRIERS; c++) {
+			ph[c] += 2.0 * M_PI * carriers[c].offset / rate;
+			i += carriers[c].amp * cos(ph[c]);
+			q += carriers[c].amp * sin(ph[c]);
+		}
+		iq[2 * k] = (i < 0) ? 0 : (i > 255) ? 255 : i;
+		iq[2 * k + 1] = (q < 0) ? 0 : (q > 255) ? 255 : q;
+	}
+
+	if (write(fd, iq, 2 * SYNTH_SAMPLES) != 2 * SYNTH_SAMPLES) {
+		free(iq);
+		close(fd);
+		return -1;
+	}
+
+	free(iq);
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -i spec       IQ capture, file:<path> (synthesized)\n"
+		"  -r rate       its sample rate (1032000)\n"
+		"  -c freq       frequency it was tuned to (100000000)\n"
+		"  -s freq       start of the sweep (center - 500 kHz)\n"
+		"  -e freq       end of the sweep (center + 500 kHz)\n"
+		"  -S step       step in Hz (10000)\n"
+		"  -n sweeps     sweeps to average the time over (20)\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/bench_scan.XXXXXX", spec[64];
+	const char *src = NULL;
+	uint32_t rate = 1032000, center = 100000000, start = 0, stop = 0;
+	uint32_t step = 10000;
+	struct scan_result res;
+	uint64_t total_ns = 0;
+	unsigned n = 20, k, c, found = 0;
+	double mhz;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:r:c:s:e:S:n:")) != -1) {
+		switch (opt) {
+		case 'i': src = optarg; break;
+		case 'r': rate = strtoul(optarg, NULL, 10); break;
+		case 'c': center = strtoul(optarg, NULL, 10); break;
+		case 's': start = strtoul(optarg, NULL, 10); break;
+		case 'e': stop = strtoul(optarg, NULL, 10); break;
+		case 'S': step = strtoul(optarg, NULL, 10); break;
+		case 'n': n = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (rate == 0 || step == 0 || n == 0)
+		usage(argv[0]);
+	if (start == 0)
+		start = center - 500000;
+	if (stop == 0)
+		stop = center + 500000;
+
+	dsp_kernels_init();
+	if (!src) {
+		if (make_capture(path, rate) < 0) {
+			print_error("cannot write a capture in /tmp\n");
+			return 2;
+		}
+		snprintf(spec, sizeof spec, "file:%s", path);
+		src = spec;
+	}
+
+	for (k = 0; k < n; k++) {
+		if (scan_sweep(src, rate, center, start, stop, step, NULL, &res) < 0) {
+			print_error("scan of %s has failed: %s\n", src, strerror(errno));
+			if (src == spec)
+				unlink(path);
+			return 2;
+		}
+		total_ns += res.elapsed_ns;
+	}
+	if (src == spec)
+		unlink(path);
+
+	/* Synthesized carriers must show up within a step */
+	if (src == spec) {
+		for (c = 0; c < NCARRIERS; c++) {
+			for (k = 0; k < res.npeaks; k++)
+				if (labs((long)res.peaks[k].freq -
+				    (long)(center + carriers[c].offset)) <= (long)step)
+					break;
+			found += (k < res.npeaks);
+		}
+	}
+
+	mhz = (res.hi - res.lo + step) / 1e6;
+	printf("{\"bench\":\"scan\",\"source\":\"%s\",\"sweeps\":%u"
+		",\"lo\":%u,\"hi\":%u,\"step\":%u,\"hops\":%u,\"kernels\":\"%s\""
+		",\"sweep_ms\":%.3f,\"ms_per_mhz\":%.3f,\"floor_db\":%.1f,\"peaks\":[",
+		(src == spec) ? "synthetic" : src, n, res.lo, res.hi, step, res.hops,
+		dsp_k.name, total_ns / 1e6 / n, total_ns / 1e6 / n / mhz,
+		res.floor_db);
+	for (k = 0; k < res.npeaks; k++)
+		printf("%s{\"freq\":%u,\"snr_db\":%.1f}", k ? "," : "",
+			res.peaks[k].freq, res.peaks[k].snr_db);
+	printf("]");
+	if (src == spec)
+		printf(",\"found\":%u,\"expected\":%zu", found, NCARRIERS);
+	printf("}\n");
+
+	return (src == spec && found < NCARRIERS);
+}
@@ -0,0 +1,185 @@
+/*
+ * bench_squelch.c: CPU saved by the squelch on a mostly idle capture.
+ *
+ * The same capture goes through the demodulation chain twice, without and
+ * with the squelch, on the calling thread. Reported are the CPU time of
+ * both runs and how much PCM would reach the encoder, which is what ffmpeg
+ * and the listeners fan-out cost scale with. Without -i, the capture is
+ * noise with an FM carrier keyed up one second out of ten.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "squelch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SYNTH_SECONDS   10
+#define SYNTH_ACTIVE    1
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Noise, plus an FM carrier with a 1 kHz tone during the first second */
+static uint8_t *make_capture(uint32_t rate, size_t *len)
+{
+	size_t n = (size_t)rate * SYNTH_SECONDS, k;
+	uint8_t *iq = malloc(2 * n);
+	double ph = 0.0, i, q;
+
+	if (!iq)
+		return NULL;
+
+	srand(330);
+	for (k = 0; k < n; k++) {
+		i = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		q = 127.5 + 8.0 * (rand() / (double)RAND_MAX - 0.5);
+		if (k < (size_t)rate * SYNTH_ACTIVE) {
+			ph += 2.0 * M_PI * DSP_FM_DEV *
+				sin(2.0 * M_PI * 1000.0 * k / rate) / rate;
+			i += 60.0 * cos(ph);
+			q += 60.0 * sin(ph);
+		}
+		iq[2 * k] = i;
+		iq[2 * k + 1] = q;
+	}
+
+	*len = 2 * n;
+	return iq;
+}
+
+static uint8_t *load_capture(const char *path, size_t *len)
+{
+	struct stat st;
+	uint8_t *iq;
+	size_t got = 0;
+	ssize_t nbr;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 2) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	iq = malloc(st.st_size);
+	while (iq && got < (size_t)st.st_size) {
+		nbr = read(fd, iq + got, st.st_size - got);
+		if (nbr <= 0) {
+			free(iq);
+			iq = NULL;
+			break;
+		}
+		got += nbr;
+	}
+	close(fd);
+
+	*len = got & ~(size_t)1;
+	return iq;
+}
+
+/* Whole capture through the chain, returns the CPU time */
+static uint64_t run_chain(const uint8_t *iq, size_t len, uint32_t rate,
+	struct squelch *sq, uint64_t *pcm_bytes)
+{
+	struct dsp_chain ch;
+	int16_t *pcm = malloc(DSP_BLOCK * sizeof *pcm);
+	uint64_t t0;
+	size_t off, n;
+
+	*pcm_bytes = 0;
+	if (!pcm || dsp_chain_init(&ch, MOD_FM, rate, DSP_OUT_RATE) < 0) {
+		free(pcm);
+		return 0;
+	}
+	ch.sq = sq;
+
+	t0 = cpu_ns();
+	for (off = 0; off + 2 <= len; off += 2 * n) {
+		n = (len - off) / 2;
+		if (n > DSP_BLOCK)
+			n = DSP_BLOCK;
+		*pcm_bytes += dsp_chain_process(&ch, iq + off, n, pcm) * sizeof *pcm;
+	}
+	t0 = cpu_ns() - t0;
+
+	dsp_chain_free(&ch);
+	free(pcm);
+	return t0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -i path       u8 IQ capture (synthesized)\n"
+		"  -r rate       its sample rate (%u)\n"
+		"  -l level      squelch level in dBFS (-25)\n", name,
+		dsp_capture_rate(DSP_DEMOD_RATE));
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	uint32_t rate = dsp_capture_rate(DSP_DEMOD_RATE);
+	float level = -25.0f;
+	struct squelch sq;
+	uint64_t cpu_off, cpu_on, pcm_off, pcm_on;
+	size_t len;
+	uint8_t *iq;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:r:l:")) != -1) {
+		switch (opt) {
+		case 'i': path = optarg; break;
+		case 'r': rate = strtoul(optarg, NULL, 10); break;
+		case 'l': level = strtof(optarg, NULL); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (rate < DSP_DEMOD_RATE)
+		usage(argv[0]);
+
+	dsp_kernels_init();
+	iq = path ? load_capture(path, &len) : make_capture(rate, &len);
+	if (!iq) {
+		print_error("cannot load the capture: %s\n", strerror(errno));
+		return 2;
+	}
+
+	cpu_off = run_chain(iq, len, rate, NULL, &pcm_off);
+	squelch_init(&sq, level, -1);
+	cpu_on = run_chain(iq, len, rate, &sq, &pcm_on);
+	free(iq);
+
+	if (cpu_off == 0 || pcm_off == 0) {
+		print_error("cannot run the demodulation chain\n");
+		return 2;
+	}
+
+	printf("{\"bench\":\"squelch\",\"source\":\"%s\",\"kernels\":\"%s\""
+		",\"seconds\":%.1f,\"level_db\":%.1f,\"changes\":%u"
+		",\"open_share\":%.3f,\"chain_cpu_ms\":{\"off\":%.1f,\"on\":%.1f}"
+		",\"chain_saved_pct\":%.1f,\"pcm_bytes\":{\"off\":%" PRIu64
+		",\"on\":%" PRIu64 "},\"encoder_saved_pct\":%.1f}\n",
+		path ? path : "synthetic", dsp_k.name, len / 2.0 / rate, level,
+		atomic_load(&sq.seq), (double)pcm_on / pcm_off, cpu_off / 1e6,
+		cpu_on / 1e6, 100.0 * (1.0 - (double)cpu_on / cpu_off), pcm_off,
+		pcm_on, 100.0 * (1.0 - (double)pcm_on / pcm_off));
+
+	return 0;
+}
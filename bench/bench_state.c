@@ -0,0 +1,194 @@
+/*
+ * bench_state.c: Readers and writers hammering the station state.
+ *
+ * Writers keep publishing settings whose fields are all derived from the
+ * same counter, and readers check every copy they get is one of them, never
+ * half of one and half of another. The same run is then repeated with the
+ * state behind a plain mutex, for comparison. One JSON line each; the exit
+ * status is 1 when a reader saw a torn value.
+ *
+ * Built with -fsanitize=thread, it should run without a single report:
+ *   gcc -std=gnu11 -fsanitize=thread -g -Isrc bench/bench_state.c \
+ *       src/state.c src/log.c src/thread_slot.c \
+ *       -o bench_state_tsan -lpthread
+ */
+
+#include "common.h"
+#include "state.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define MAX_THREADS     256
+
+struct bench {
+	bool              locked;       /* Mutex baseline instead of the seqlock */
+	struct state_pub *pub;
+	pthread_mutex_t   lock;
+	struct sta_state  plain;
+	atomic_bool       stop;
+	atomic_uint       seed;
+};
+
+struct worker {
+	pthread_t     tid;
+	struct bench *b;
+	uint64_t      ops;
+	uint64_t      torn;
+};
+
+/* Every field follows from 'n', so a mix of two writes shows */
+static void make_state(struct sta_state *st, uint32_t n)
+{
+	st->sdr.frequency = FREQ_MIN + n % (FREQ_MAX - FREQ_MIN);
+	st->sdr.modulation = n % 6;
+	st->status = n % 4;
+	st->running = n & 1;
+}
+
+static bool check_state(const struct sta_state *st)
+{
+	uint32_t n = st->sdr.frequency - FREQ_MIN;
+
+	return st->sdr.modulation == n % 6 && st->status == n % 4 &&
+		st->running == (n & 1);
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	struct bench *b = w->b;
+	struct sta_state st;
+
+	while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+		if (b->locked) {
+			pthread_mutex_lock(&b->lock);
+			st = b->plain;
+			pthread_mutex_unlock(&b->lock);
+		} else {
+			state_read(b->pub, &st);
+		}
+		if (!check_state(&st))
+			w->torn++;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	struct bench *b = w->b;
+	struct sta_state st;
+	uint32_t n;
+
+	while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+		n = atomic_fetch_add_explicit(&b->seed, 1, memory_order_relaxed);
+		if (b->locked) {
+			pthread_mutex_lock(&b->lock);
+			make_state(&b->plain, n);
+			pthread_mutex_unlock(&b->lock);
+		} else {
+			state_begin(b->pub, &st);
+			make_state(&st, n);
+			state_commit(b->pub, &st);
+		}
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static bool run(bool locked, unsigned nreaders, unsigned nwriters,
+	unsigned msecs)
+{
+	static struct worker workers[MAX_THREADS];
+	struct timespec ts = {msecs / 1000, (msecs % 1000) * 1000000L};
+	struct sta_state init = {{0}};
+	struct bench b = {.locked = locked};
+	uint64_t reads = 0, writes = 0, torn = 0;
+	unsigned k, n = nreaders + nwriters;
+
+	make_state(&init, 0);
+	b.pub = state_create(&init);
+	if (!b.pub) {
+		print_error("cannot allocate the state\n");
+		return false;
+	}
+	b.plain = init;
+	pthread_mutex_init(&b.lock, NULL);
+	atomic_init(&b.stop, false);
+	atomic_init(&b.seed, 1);
+
+	for (k = 0; k < n; k++) {
+		workers[k] = (struct worker){.b = &b};
+		if (pthread_create(&workers[k].tid, NULL,
+				(k < nreaders) ? &reader : &writer, &workers[k]) != 0) {
+			print_error("cannot start thread %u\n", k);
+			atomic_store(&b.stop, true);
+			n = k;
+			break;
+		}
+	}
+
+	nanosleep(&ts, NULL);
+	atomic_store(&b.stop, true);
+
+	for (k = 0; k < n; k++) {
+		pthread_join(workers[k].tid, NULL);
+		if (k < nreaders)
+			reads += workers[k].ops;
+		else
+			writes += workers[k].ops;
+		torn += workers[k].torn;
+	}
+
+	printf("{\"bench\":\"state\",\"lock\":\"%s\",\"readers\":%u"
+		",\"writers\":%u,\"reads_per_s\":%.0f,\"writes_per_s\":%.0f"
+		",\"torn\":%" PRIu64 ",\"ok\":%s}\n",
+		locked ? "mutex" : "seqlock", nreaders, nwriters,
+		reads * 1000.0 / msecs, writes * 1000.0 / msecs, torn,
+		torn ? "false" : "true");
+
+	pthread_mutex_destroy(&b.lock);
+	state_free(b.pub);
+	return torn == 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -r readers    reader threads (8)\n"
+		"  -w writers    writer threads (2)\n"
+		"  -d msecs      duration of each run (1000)\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned nreaders = 8, nwriters = 2, msecs = 1000;
+	bool ok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:w:d:")) != -1) {
+		switch (opt) {
+		case 'r': nreaders = strtoul(optarg, NULL, 10); break;
+		case 'w': nwriters = strtoul(optarg, NULL, 10); break;
+		case 'd': msecs = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nreaders + nwriters == 0 || nreaders + nwriters > MAX_THREADS ||
+	    msecs == 0)
+		usage(argv[0]);
+
+	ok = run(false, nreaders, nwriters, msecs);
+	ok &= run(true, nreaders, nwriters, msecs);
+
+	return ok ? 0 : 1;
+}
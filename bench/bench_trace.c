@@ -0,0 +1,201 @@
+/*
+ * bench_trace.c: Cost of a span, and dumps taken while spans are recorded.
+ *
+ * Several threads wrap an empty span around nothing, first with tracing
+ * off, then on. A last run records made-up spans whose times follow from
+ * their argument while another thread keeps dumping the rings; every span
+ * in those dumps is checked to be whole, not a mix of two. Each run clears
+ * what the one before left in the rings. One JSON line each; the exit
+ * status is 1 when a dump held a torn span.
+ *
+ * Built with -fsanitize=thread, it should run without a single report:
+ *   gcc -std=gnu11 -fsanitize=thread -g -Isrc bench/bench_trace.c \
+ *       src/trace.c src/log.c src/thread_slot.c \
+ *       -o bench_trace_tsan -lpthread
+ */
+
+#include "common.h"
+#include "trace.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS     64
+
+enum mode {
+	MODE_OFF,
+	MODE_ON,
+	MODE_DUMP,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+	[MODE_OFF]  = "off",
+	[MODE_ON]   = "on",
+	[MODE_DUMP] = "dump",
+};
+
+struct worker {
+	pthread_t tid;
+	enum mode mode;
+	unsigned  spans;
+	uint64_t  ns;
+};
+
+/* Dump run spans start after this, in whole microseconds */
+static uint64_t base_us;
+
+struct dumper {
+	pthread_t   tid;
+	atomic_bool stop;
+	unsigned    dumps;
+	uint64_t    checked;
+	uint64_t    torn;
+};
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Span 'k' of the dump run starts k us after the base and lasts k % 97 us */
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t t0 = cpu_ns(), ts;
+	unsigned k;
+
+	for (k = 0; k < w->spans; k++) {
+		if (w->mode == MODE_DUMP) {
+			trace_record("bench", "bench", (base_us + k) * 1000,
+				(base_us + k + k % 97) * 1000, k);
+			continue;
+		}
+		ts = trace_begin();
+		__asm__ __volatile__("" ::: "memory");
+		trace_end("bench", "bench", ts, k);
+	}
+
+	w->ns = cpu_ns() - t0;
+	return NULL;
+}
+
+/*
+ * Dump into memory and check every span against its argument, until the
+ * workers are done and once more with the rings full.
+ */
+static void *dumper(void *arg)
+{
+	struct dumper *d = arg;
+	uint64_t ts, dur, k;
+	char *body, *p;
+	size_t len;
+	FILE *fp;
+	bool last;
+
+	do {
+		last = atomic_load_explicit(&d->stop, memory_order_relaxed);
+		body = NULL;
+		fp = open_memstream(&body, &len);
+		if (!fp)
+			break;
+		trace_write_json(fp);
+		fclose(fp);
+
+		for (p = strstr(body, "\"ts\":"); p; p = strstr(p + 1, "\"ts\":")) {
+			if (sscanf(p, "\"ts\":%" SCNu64 ".000,\"dur\":%" SCNu64
+					".000,\"pid\":%*d,\"tid\":%*d,\"args\":{\"arg\":%"
+					SCNu64 "}", &ts, &dur, &k) != 3 ||
+			    ts != base_us + k || dur != k % 97)
+				d->torn++;
+			d->checked++;
+		}
+		free(body);
+		d->dumps++;
+	} while (!last);
+
+	return NULL;
+}
+
+static bool run(enum mode mode, unsigned nthreads, unsigned spans)
+{
+	static struct worker workers[MAX_THREADS];
+	struct dumper d = {.dumps = 0};
+	uint64_t ns = 0;
+	unsigned k, n;
+
+	trace_clear();
+	base_us = trace_now() / 1000 + 1;
+	trace_set_enabled(mode != MODE_OFF);
+	atomic_init(&d.stop, false);
+	if (mode == MODE_DUMP &&
+	    pthread_create(&d.tid, NULL, &dumper, &d) != 0) {
+		print_error("cannot start the dumper\n");
+		return false;
+	}
+
+	for (n = 0; n < nthreads; n++) {
+		workers[n] = (struct worker){.mode = mode, .spans = spans};
+		if (pthread_create(&workers[n].tid, NULL, &worker, &workers[n]) != 0)
+			break;
+	}
+	for (k = 0; k < n; k++) {
+		pthread_join(workers[k].tid, NULL);
+		ns += workers[k].ns;
+	}
+
+	if (mode == MODE_DUMP) {
+		atomic_store(&d.stop, true);
+		pthread_join(d.tid, NULL);
+	}
+
+	printf("{\"bench\":\"trace\",\"mode\":\"%s\",\"threads\":%u"
+		",\"spans\":%u,\"ns_per_span\":%.1f", mode_names[mode], n, spans,
+		n ? (double)ns / ((uint64_t)n * spans) : 0.0);
+	if (mode == MODE_DUMP)
+		printf(",\"dumps\":%u,\"checked\":%" PRIu64 ",\"torn\":%" PRIu64
+			",\"ok\":%s", d.dumps, d.checked, d.torn,
+			d.torn ? "false" : "true");
+	printf("}\n");
+	fflush(stdout);
+
+	return d.torn == 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n spans      spans per thread (1000000)\n"
+		"  -t threads    recording threads, up to %d (4)\n", name,
+		MAX_THREADS);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned spans = 1000000, threads = 4, m;
+	bool ok = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n': spans = strtoul(optarg, NULL, 10); break;
+		case 't': threads = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (spans == 0 || threads == 0 || threads > MAX_THREADS)
+		usage(argv[0]);
+
+	for (m = 0; m < MODE_COUNT; m++)
+		ok &= run(m, threads, spans);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+#!/bin/bash
+#
+# run.sh: Run the benchmark suite against local stations and print one JSON
+# object per line, so runs can be stored and compared. Build first with
+# 'make && make bench'.
+#
+#   bench/run.sh [seconds]
+#
+# Environment:
+#   STATIONS    stations driven by the manager run (200)
+#   LISTENERS   HTTP listeners, needs ffmpeg and an IQ capture (1000)
+#   RELOADS     pipeline reloads, needs ffmpeg and rtl_fm or IQ (10000)
+#   IQ          IQ source for the listener run, e.g. file:capture.iq
+#   IQ_RATE     sample rate of that capture
+#   IDLE_IQ     mostly idle u8 IQ file for the squelch run, a plain path
+#   IDLE_IQ_RATE  its sample rate
+#   BASE_PORT   first TCP port used by the local stations (27000)
+#   BASELINE    another sdrrc build, e.g. from before the epoll loop, whose
+#               idle CPU is measured next to this one
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+SECS=${1:-5}
+STATIONS=${STATIONS:-200}
+LISTENERS=${LISTENERS:-1000}
+RELOADS=${RELOADS:-10000}
+BASE=${BASE_PORT:-27000}
+BIN=obj/bench
+TMP=$(mktemp -d)
+PIDS=""
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# station <port> <http port> [options...]
+station() {
+	./sdrrc -p "$1" -H "$2" "${@:3}" >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	for i in $(seq 50); do
+		(exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "station on port $1 did not come up" >&2
+	return 1
+}
+
+# proc_usage <pid>: CPU time in clock ticks and voluntary context switches, the
+# wakeups, of every thread of a process
+proc_usage() {
+	awk '{ print $14 + $15 }' /proc/"$1"/task/*/stat |
+		awk '{ t += $1 } END { printf "%d ", t }'
+	awk '/^voluntary_ctxt_switches/ { n += $2 } END { print n }' \
+		/proc/"$1"/task/*/status
+}
+
+# idle <pid> <build>: what a station with nothing to do costs over $SECS
+idle() {
+	local t0 w0 t1 w1
+
+	sleep 1
+	read -r t0 w0 < <(proc_usage "$1")
+	sleep "$SECS"
+	read -r t1 w1 < <(proc_usage "$1")
+	awk -v b="$2" -v s="$SECS" -v t=$((t1 - t0)) -v w=$((w1 - w0)) \
+		-v hz="$(getconf CLK_TCK)" 'BEGIN {
+		printf "{\"bench\":\"idle\",\"build\":\"%s\",\"seconds\":%d," \
+			"\"cpu_ms\":%.1f,\"cpu_pct\":%.3f,\"wakeups_per_s\":%.1f}\n",
+			b, s, t * 1000 / hz, t * 100 / (hz * s), w / s
+	}'
+}
+
+if [ ! -x sdrrc ] || [ ! -x $BIN/bench_load ] || [ ! -x $BIN/bench_micro ] ||
+   [ ! -x $BIN/bench_reload ] || [ ! -x $BIN/bench_scan ] ||
+   [ ! -x $BIN/bench_squelch ] || [ ! -x $BIN/bench_record ] ||
+   [ ! -x $BIN/bench_resample ] || [ ! -x $BIN/bench_state ] ||
+   [ ! -x $BIN/bench_log ] || [ ! -x $BIN/bench_trace ] ||
+   [ ! -x $BIN/bench_apply ] || [ ! -x $BIN/bench_hop ] ||
+   [ ! -x $BIN/bench_retune ]; then
+	echo "build first: make && make bench" >&2
+	exit 1
+fi
+ulimit -n 65536 2>/dev/null || ulimit -n "$(ulimit -Hn)"
+
+# Hot paths in isolation
+$BIN/bench_micro
+
+# Spectrum sweep, over the capture when there is one
+$BIN/bench_scan ${IQ:+-i "$IQ"} ${IQ_RATE:+-r $IQ_RATE}
+
+# Squelch on a mostly idle capture, the synthesized one by default
+$BIN/bench_squelch ${IDLE_IQ:+-i "$IDLE_IQ"} ${IDLE_IQ_RATE:+-r $IDLE_IQ_RATE}
+
+# Resampling to the other output rates, with its accuracy checks
+$BIN/bench_resample
+
+# Station state read and written from many threads at once
+$BIN/bench_state
+
+# Log calls, old fprintf against queued for the writer thread
+$BIN/bench_log
+
+# Tracing spans, off and on, and dumps taken while they are recorded
+$BIN/bench_trace
+
+# Recording many streams at once, into the temporary directory
+$BIN/bench_record -d "$TMP" -t "$SECS"
+
+# Control plane: one station, idle first, then several client shapes
+station $BASE $((BASE + 1)) || exit 1
+idle "${PIDS##* }" current
+if [ -n "$BASELINE" ]; then
+	"$BASELINE" -p $((BASE + 1003)) >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	idle $! baseline
+fi
+$BIN/bench_load -p $BASE -d "$SECS"
+$BIN/bench_load -p $BASE -d "$SECS" -c 16 -P 32 -m status:8,setfreq:1,setmod:1
+$BIN/bench_load -p $BASE -d "$SECS" -c 16 -P 32 -m status:8,setfreq:1,setmod:1 -b
+$BIN/bench_load -p $BASE -d "$SECS" -c 100 -i 1000
+
+# Audio fan-out, only with a real encoder and a capture to play
+if [ -n "$IQ" ] && command -v ffmpeg >/dev/null; then
+	station $((BASE + 2)) $((BASE + 3)) -i "$IQ" ${IQ_RATE:+-r $IQ_RATE} || exit 1
+	exec 3<>"/dev/tcp/127.0.0.1/$((BASE + 2))"
+	echo start >&3
+	sleep 2
+	$BIN/bench_load -H $((BASE + 3)) -l "$LISTENERS" -d "$SECS" -s "${PIDS##* }"
+	exec 3>&-
+else
+	echo '{"bench":"listeners","skipped":"needs ffmpeg and IQ"}'
+fi
+
+# Child processes: reload latency, with no descriptor or zombie left behind
+if command -v ffmpeg >/dev/null && { [ -n "$IQ" ] || command -v rtl_fm >/dev/null; }; then
+	station $((BASE + 4)) $((BASE + 5)) ${IQ:+-i "$IQ"} ${IQ_RATE:+-r $IQ_RATE} ||
+		exit 1
+	$BIN/bench_reload -s "${PIDS##* }" -p $((BASE + 4)) -n "$RELOADS"
+
+	# New frequency and modulation: setmod, setfreq, reload against apply
+	station $((BASE + 6)) $((BASE + 7)) -M ${IQ:+-i "$IQ"} ${IQ_RATE:+-r $IQ_RATE} ||
+		exit 1
+	$BIN/bench_apply -p $((BASE + 6)) -H $((BASE + 7)) -n 1000
+else
+	echo '{"bench":"reload","skipped":"needs ffmpeg and rtl_fm or IQ"}'
+	echo '{"bench":"apply","skipped":"needs ffmpeg and rtl_fm or IQ"}'
+fi
+
+# Frequency hopping: client-timed setfreq against the station's scan list.
+# Short dwell times need the in-process demodulator, and a recorded IQ file
+# cannot be retuned, so the benchmark serves rtl_tcp to the station itself.
+if command -v ffmpeg >/dev/null; then
+	station $((BASE + 8)) $((BASE + 9)) -M \
+		-i rtltcp:127.0.0.1:$((BASE + 1004)) -r 1032000 || exit 1
+	$BIN/bench_hop -p $((BASE + 8)) -H $((BASE + 9)) -P $((BASE + 1004)) \
+		-d "$SECS"
+else
+	echo '{"bench":"hop","skipped":"needs ffmpeg"}'
+fi
+
+# Retune to audio, with the benchmark itself serving rtl_tcp to the station
+if command -v ffmpeg >/dev/null; then
+	station $((BASE + 1001)) $((BASE + 1002)) \
+		-i rtltcp:127.0.0.1:$((BASE + 1000)) -r 1032000 || exit 1
+	$BIN/bench_retune -p $((BASE + 1001)) -H $((BASE + 1002)) -P $((BASE + 1000))
+else
+	echo '{"bench":"retune","skipped":"needs ffmpeg"}'
+fi
+
+# Manager mode: pipelined commands to many stations at once
+for k in $(seq "$STATIONS"); do
+	port=$((BASE + 10 + 2 * k))
+	station $port $((port + 1)) || exit 1
+	echo "s$k=127.0.0.1:$port" >> "$TMP/stations"
+done
+for k in $(seq 1000); do
+	echo "* status"
+done > "$TMP/commands"
+
+./sdrrc -m -q -f "$TMP/stations" < "$TMP/commands" 2>&1 |
+	sed 's/\x1b\[[0-9;]*m//g' |
+	awk -v n="$STATIONS" '
+		/commands to/ { sent = $2; replies = $7; failed = $9 }
+		/commands\/s/ { rate = $2; p50 = $6; p99 = $9; max = $12 }
+		END {
+			printf "{\"bench\":\"manager\",\"stations\":%d,\"commands\":%d," \
+				"\"replies\":%d,\"failed\":%d,\"cmd_per_s\":%d," \
+				"\"rtt_ms\":{\"p50\":%s,\"p99\":%s,\"max\":%s}}\n",
+				n, sent, replies, failed, rate, p50, p99, max
+		}'
@@ -0,0 +1,285 @@
+/*
+ * channelizer.c: Several stations out of one wideband capture.
+ *
+ * The capture goes once through a polyphase filterbank: for every output
+ * the prototype filter is folded into CHZ_BINS branches and a single FFT
+ * gives all bins at once. Each channel then only has to fine tune inside its
+ * bin and run the usual demodulator at a much lower rate, which is what lets
+ * the work spread over several cores.
+ */
+
+#include "common.h"
+#include "channelizer.h"
+#include "squelch.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* DC estimate smoothing between blocks, as in the single channel frontend */
+#define CHZ_DC_ALPHA    0.05f
+
+/* Prototype cutoff relative to the bin spacing */
+#define CHZ_CUTOFF      0.85f
+
+int chz_init(struct channelizer *chz, uint32_t in_rate)
+{
+	unsigned k;
+	float cutoff, sum = 0.0f;
+
+	memset(chz, 0, sizeof *chz);
+
+	if (in_rate < CHZ_BINS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	chz->nbins = CHZ_BINS;
+	chz->decim = CHZ_BINS / 2;
+	chz->in_rate = in_rate;
+	chz->spacing = in_rate / chz->nbins;
+	chz->out_rate = in_rate / chz->decim;
+	chz->ntaps = chz->nbins * CHZ_TAPS_PER_BIN;
+	chz->stride = DSP_BLOCK / chz->decim + 1;
+
+	if (fft_plan_init(&chz->fft, chz->nbins) < 0)
+		return -1;
+
+	chz->taps = malloc(chz->ntaps * sizeof *chz->taps);
+	chz->buf_i = calloc(chz->ntaps - 1 + DSP_BLOCK, sizeof *chz->buf_i);
+	chz->buf_q = calloc(chz->ntaps - 1 + DSP_BLOCK, sizeof *chz->buf_q);
+	chz->u_re = malloc(chz->nbins * sizeof *chz->u_re);
+	chz->u_im = malloc(chz->nbins * sizeof *chz->u_im);
+	chz->out_i = malloc(chz->nbins * chz->stride * sizeof *chz->out_i);
+	chz->out_q = malloc(chz->nbins * chz->stride * sizeof *chz->out_q);
+	if (!chz->taps || !chz->buf_i || !chz->buf_q || !chz->u_re ||
+	    !chz->u_im || !chz->out_i || !chz->out_q) {
+		chz_free(chz);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Windowed sinc, flat over a bin and well down at the output Nyquist */
+	cutoff = CHZ_CUTOFF / chz->nbins;
+	for (k = 0; k < chz->ntaps; k++) {
+		float m = (float)k - (chz->ntaps - 1) / 2.0f;
+		float sinc = (m == 0.0f) ? 2.0f * cutoff :
+			sinf(2.0f * (float)M_PI * cutoff * m) / ((float)M_PI * m);
+		float win = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * k / (chz->ntaps - 1));
+
+		chz->taps[k] = sinc * win;
+		sum += chz->taps[k];
+	}
+	for (k = 0; k < chz->ntaps; k++)
+		chz->taps[k] /= sum;
+
+	return 0;
+}
+
+void chz_free(struct channelizer *chz)
+{
+	if (!chz)
+		return;
+
+	fft_plan_free(&chz->fft);
+	free(chz->taps);
+	free(chz->buf_i);
+	free(chz->buf_q);
+	free(chz->u_re);
+	free(chz->u_im);
+	free(chz->out_i);
+	free(chz->out_q);
+	chz->taps = chz->buf_i = chz->buf_q = NULL;
+	chz->u_re = chz->u_im = chz->out_i = chz->out_q = NULL;
+}
+
+/*
+ * Split 'n' (at most DSP_BLOCK) u8 IQ samples into bins. The outputs stay
+ * in the channelizer until the next call.
+ */
+void chz_process(struct channelizer *chz, const uint8_t *iq, size_t n)
+{
+	unsigned hist = chz->ntaps - 1;
+	unsigned mask = chz->nbins - 1;
+	unsigned m, l, b, idx;
+	float sum_i, sum_q, sign;
+	size_t pos;
+
+	dsp_k.u8_to_f32(iq, chz->buf_i + hist, chz->buf_q + hist, n,
+		chz->dc_i, chz->dc_q, &sum_i, &sum_q);
+
+	if (n > 0) {
+		chz->dc_i += CHZ_DC_ALPHA * (sum_i / n - chz->dc_i);
+		chz->dc_q += CHZ_DC_ALPHA * (sum_q / n - chz->dc_q);
+	}
+
+	chz->nout = 0;
+	for (pos = chz->phase; pos < n; pos += chz->decim) {
+		/* Newest sample of this output */
+		const float *x_i = chz->buf_i + hist + pos;
+		const float *x_q = chz->buf_q + hist + pos;
+
+		/* Fold the filter into one branch per bin */
+		for (m = 0; m < chz->nbins; m++) {
+			float ai = 0.0f, aq = 0.0f;
+
+			for (l = m; l < chz->ntaps; l += chz->nbins) {
+				ai += chz->taps[l] * x_i[-(long)l];
+				aq += chz->taps[l] * x_q[-(long)l];
+			}
+			chz->u_re[m] = ai;
+			chz->u_im[m] = aq;
+		}
+
+		fft_forward(&chz->fft, chz->u_re, chz->u_im);
+
+		/*
+		 * Bin 'b' is the FFT output at -b. Decimating by half the number
+		 * of bins leaves odd bins rotated by pi on every other output.
+		 */
+		for (b = 0; b < chz->nbins; b++) {
+			idx = (chz->nbins - b) & mask;
+			sign = (chz->count & b & 1) ? -1.0f : 1.0f;
+			chz->out_i[b * chz->stride + chz->nout] = sign * chz->u_re[idx];
+			chz->out_q[b * chz->stride + chz->nout] = sign * chz->u_im[idx];
+		}
+
+		chz->count++;
+		chz->nout++;
+	}
+	chz->phase = pos - n;
+
+	memmove(chz->buf_i, chz->buf_i + n, hist * sizeof *chz->buf_i);
+	memmove(chz->buf_q, chz->buf_q + n, hist * sizeof *chz->buf_q);
+}
+
+/* Whether 'freq' can be picked out of a capture centered at 'center' */
+bool chz_in_band(uint32_t in_rate, uint32_t center, uint32_t freq)
+{
+	int64_t offset = (int64_t)freq - center;
+	int64_t spacing = in_rate / CHZ_BINS;
+
+	/* The outermost bin straddles the capture edges, it is not used */
+	return llabs(offset) < (CHZ_BINS / 2 - 1) * spacing + spacing / 2;
+}
+
+/*
+ * Channels
+ */
+int chz_channel_init(struct chz_channel *ch, const struct channelizer *chz,
+	unsigned id, uint32_t freq, uint8_t modulation, struct pcm_ring *out)
+{
+	memset(ch, 0, sizeof *ch);
+	ch->id = id;
+	ch->freq = freq;
+	ch->modulation = modulation;
+	ch->out = out;
+	atomic_init(&ch->dead, false);
+
+	if (dsp_frontend_init(&ch->fe, chz->out_rate, DSP_DEMOD_RATE) < 0)
+		return -1;
+	if (dsp_demod_init(&ch->dm, modulation, ch->fe.out_rate, DSP_OUT_RATE) < 0)
+		goto _err_demod;
+
+	ch->mix_i = malloc(chz->stride * sizeof *ch->mix_i);
+	ch->mix_q = malloc(chz->stride * sizeof *ch->mix_q);
+	ch->bb_i = malloc(DSP_BLOCK * sizeof *ch->bb_i);
+	ch->bb_q = malloc(DSP_BLOCK * sizeof *ch->bb_q);
+	ch->pcm_f = malloc(DSP_BLOCK * sizeof *ch->pcm_f);
+	ch->pcm = malloc(DSP_BLOCK * sizeof *ch->pcm);
+	if (!ch->mix_i || !ch->mix_q || !ch->bb_i || !ch->bb_q ||
+	    !ch->pcm_f || !ch->pcm) {
+		chz_channel_free(ch);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+
+_err_demod:
+	dsp_frontend_free(&ch->fe);
+	return -1;
+}
+
+void chz_channel_free(struct chz_channel *ch)
+{
+	if (!ch)
+		return;
+
+	dsp_frontend_free(&ch->fe);
+	dsp_demod_free(&ch->dm);
+	free(ch->mix_i);
+	free(ch->mix_q);
+	free(ch->bb_i);
+	free(ch->bb_q);
+	free(ch->pcm_f);
+	free(ch->pcm);
+	ch->mix_i = ch->mix_q = ch->bb_i = ch->bb_q = ch->pcm_f = NULL;
+	ch->pcm = NULL;
+}
+
+/* Pick the nearest bin for a tuner at 'center' and the shift within it */
+void chz_channel_tune(struct chz_channel *ch, const struct channelizer *chz,
+	uint32_t center)
+{
+	int64_t offset = (int64_t)ch->freq - center;
+	long bin;
+	double w;
+
+	ch->in_band = chz_in_band(chz->in_rate, center, ch->freq);
+	if (!ch->in_band)
+		return;
+
+	bin = lround((double)offset / chz->spacing);
+	ch->bin = (unsigned long)bin & (chz->nbins - 1);
+
+	w = -2.0 * M_PI * (offset - (double)bin * chz->spacing) / chz->out_rate;
+	ch->step_re = cos(w);
+	ch->step_im = sin(w);
+	ch->nco_re = 1.0f;
+	ch->nco_im = 0.0f;
+}
+
+/*
+ * Demodulate the channel out of the last block. Channels out of the band
+ * keep producing silence, so their encoder is never starved, unless the
+ * squelch closes on it. Returns the number of PCM samples written into
+ * 'ch->pcm'.
+ */
+size_t chz_channel_process(struct chz_channel *ch, const struct channelizer *chz)
+{
+	const float *in_i = chz->out_i + ch->bin * chz->stride;
+	const float *in_q = chz->out_q + ch->bin * chz->stride;
+	float nr = ch->nco_re, ni = ch->nco_im, t, mag;
+	size_t k, nbb, nout;
+
+	if (!ch->in_band) {
+		memset(ch->mix_i, 0, chz->nout * sizeof *ch->mix_i);
+		memset(ch->mix_q, 0, chz->nout * sizeof *ch->mix_q);
+	} else {
+		for (k = 0; k < chz->nout; k++) {
+			ch->mix_i[k] = in_i[k] * nr - in_q[k] * ni;
+			ch->mix_q[k] = in_i[k] * ni + in_q[k] * nr;
+
+			t = nr * ch->step_re - ni * ch->step_im;
+			ni = nr * ch->step_im + ni * ch->step_re;
+			nr = t;
+		}
+
+		/* Keep the oscillator on the unit circle */
+		mag = 1.0f / sqrtf(nr * nr + ni * ni);
+		ch->nco_re = nr * mag;
+		ch->nco_im = ni * mag;
+	}
+
+	nbb = dsp_frontend_process_f32(&ch->fe, ch->mix_i, ch->mix_q, chz->nout,
+		ch->bb_i, ch->bb_q);
+	if (ch->sq && !squelch_feed_iq(ch->sq, ch->bb_i, ch->bb_q, nbb,
+			ch->fe.out_rate))
+		return 0;
+	nout = dsp_demod_process(&ch->dm, ch->bb_i, ch->bb_q, nbb, ch->pcm_f);
+	dsp_k.f32_to_s16(ch->pcm_f, ch->pcm, nout, DSP_PCM_SCALE);
+
+	return nout;
+}
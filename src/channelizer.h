@@ -0,0 +1,88 @@
+#ifndef __CHANNELIZER_H__
+#define __CHANNELIZER_H__
+
+#include "dsp.h"
+#include "fft.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct pcm_ring;
+struct squelch;
+
+/* Filterbank size (power of two) and prototype filter length per bin */
+#define CHZ_BINS            8
+#define CHZ_TAPS_PER_BIN    24
+
+/*
+ * Polyphase FFT analysis filterbank. The capture is split into CHZ_BINS
+ * evenly spaced bins, each one decimated by half the number of bins, so
+ * neighbouring bins overlap and any frequency falls well inside one of them.
+ */
+struct channelizer {
+	unsigned  nbins;
+	unsigned  decim;
+	uint32_t  in_rate;
+	uint32_t  spacing;      /* Distance between bin centers, in Hz */
+	uint32_t  out_rate;     /* Rate of every bin output */
+
+	float    *taps;         /* Prototype low pass */
+	unsigned  ntaps;
+	float    *buf_i;        /* History (ntaps - 1) followed by the block */
+	float    *buf_q;
+	unsigned  phase;
+	uint64_t  count;        /* Outputs so far, for the phase correction */
+	float     dc_i;
+	float     dc_q;
+
+	struct fft_plan fft;
+	float    *u_re;
+	float    *u_im;
+
+	/* Output of the last block, bin 'b' starts at b * stride */
+	float    *out_i;
+	float    *out_q;
+	size_t    stride;
+	size_t    nout;
+};
+
+/* One station picked out of the filterbank and demodulated */
+struct chz_channel {
+	unsigned id;
+	uint32_t freq;
+	uint8_t  modulation;
+	struct pcm_ring *out;   /* s16le PCM at DSP_OUT_RATE */
+	struct squelch *sq;     /* Gates the demodulator, optional */
+	atomic_bool dead;       /* Removed, released at the next block */
+
+	bool     in_band;
+	unsigned bin;
+	float    nco_re;        /* Fine tuning inside the bin */
+	float    nco_im;
+	float    step_re;
+	float    step_im;
+
+	struct dsp_frontend fe;
+	struct dsp_demod    dm;
+	float   *mix_i;
+	float   *mix_q;
+	float   *bb_i;
+	float   *bb_q;
+	float   *pcm_f;
+	int16_t *pcm;
+};
+
+int chz_init(struct channelizer *chz, uint32_t in_rate);
+void chz_free(struct channelizer *chz);
+void chz_process(struct channelizer *chz, const uint8_t *iq, size_t n);
+bool chz_in_band(uint32_t in_rate, uint32_t center, uint32_t freq);
+
+int chz_channel_init(struct chz_channel *ch, const struct channelizer *chz,
+	unsigned id, uint32_t freq, uint8_t modulation, struct pcm_ring *out);
+void chz_channel_free(struct chz_channel *ch);
+void chz_channel_tune(struct chz_channel *ch, const struct channelizer *chz,
+	uint32_t center);
+size_t chz_channel_process(struct chz_channel *ch, const struct channelizer *chz);
+
+#endif /* __CHANNELIZER_H__ */
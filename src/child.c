@@ -0,0 +1,326 @@
+/*
+ * child.c: Spawn and supervise helper processes (rtl_fm, ffmpeg).
+ *
+ * Children are started with posix_spawn(), which does not copy the station
+ * address space the way fork() does. Every child is watched through a pidfd
+ * in the event loop and reaped as soon as it exits, so no zombie is left
+ * behind however often the pipeline is reloaded.
+ */
+
+#include "common.h"
+#include "child.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open  434
+#endif
+
+extern char **environ;
+
+/* Every child not reaped yet, killed ones included */
+static TAILQ_HEAD(, child) children = TAILQ_HEAD_INITIALIZER(children);
+static unsigned nchildren;
+
+static void child_release(struct child *c)
+{
+	ev_del(c->loop, &c->h);
+	close(c->h.fd);
+	TAILQ_REMOVE(&children, c, entries);
+	nchildren--;
+	free(c);
+}
+
+static void child_pidfd_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct child *c = h->context;
+	int status;
+
+	if (waitpid(c->pid, &status, WNOHANG) <= 0)
+		return;
+
+	if (c->on_exit)
+		c->on_exit(c, status, c->context);
+	child_release(c);
+}
+
+/*
+ * Run argv[0], looked up in PATH, with 'in_fd' and 'out_fd' as its stdin and
+ * stdout (/dev/null when negative) and stderr thrown away. The signal mask
+ * is set to 'sigmask' and SIGPIPE back to its default action.
+ */
+struct child *child_spawn(struct ev_loop *loop, char *const argv[],
+	int in_fd, int out_fd, const sigset_t *sigmask)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t def;
+	struct child *c;
+	uint64_t t0;
+	int err;
+
+	t0 = trace_begin();
+	c = calloc(1, sizeof *c);
+	if (!c) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	if (in_fd >= 0)
+		posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+	else
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+			O_RDONLY, 0);
+	if (out_fd >= 0)
+		posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+	else
+		posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+			O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+		O_WRONLY, 0);
+
+	sigemptyset(&def);
+	sigaddset(&def, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+		POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setsigdefault(&attr, &def);
+	if (sigmask)
+		posix_spawnattr_setsigmask(&attr, sigmask);
+
+	err = posix_spawnp(&c->pid, argv[0], &fa, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err) {
+		print_error("cannot run %s: %s\n", argv[0], strerror(err));
+		free(c);
+		errno = err;
+		return NULL;
+	}
+
+	c->h.fd = syscall(SYS_pidfd_open, c->pid, 0);
+	c->h.func = &child_pidfd_cb;
+	c->h.context = c;
+	c->loop = loop;
+	if (c->h.fd < 0 || ev_add(loop, &c->h, EPOLLIN) < 0) {
+		err = errno;
+		print_error("cannot watch %s (pidfd needs Linux 5.3)\n", argv[0]);
+		kill(c->pid, SIGKILL);
+		waitpid(c->pid, NULL, 0);
+		if (c->h.fd >= 0)
+			close(c->h.fd);
+		free(c);
+		errno = err;
+		return NULL;
+	}
+
+	TAILQ_INSERT_TAIL(&children, c, entries);
+	nchildren++;
+	metrics_add(METRIC_SPAWNS, 1);
+	trace_end("spawn", "child", t0, c->pid);
+	return c;
+}
+
+/* Kill a child and forget about it, it is reaped once it is gone */
+void child_kill(struct child *c)
+{
+	if (!c)
+		return;
+
+	c->on_exit = NULL;
+	kill(c->pid, SIGKILL);
+}
+
+/* Kill every child left and wait for all of them, on the way out */
+void child_reap_all(void)
+{
+	struct child *c;
+
+	while ((c = TAILQ_FIRST(&children))) {
+		kill(c->pid, SIGKILL);
+		while (waitpid(c->pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		child_release(c);
+	}
+}
+
+/* Children alive or waiting to be reaped */
+unsigned child_count(void)
+{
+	return nchildren;
+}
+
+/*
+ * Supervision
+ */
+
+static void child_sup_arm(struct child_sup *sup, unsigned ms)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec  = ms / 1000,
+			.tv_nsec = (ms % 1000) * 1000000L,
+		},
+	};
+
+	timerfd_settime(sup->timer_h.fd, 0, &its, NULL);
+}
+
+/* Schedule the next spawn, later with every crash in a row */
+static unsigned child_sup_backoff(struct child_sup *sup)
+{
+	unsigned ms;
+
+	ms = CHILD_BACKOFF_MIN_MS << (sup->crashes < 6 ? sup->crashes : 6);
+	if (ms > CHILD_BACKOFF_MAX_MS)
+		ms = CHILD_BACKOFF_MAX_MS;
+	sup->crashes++;
+
+	child_sup_arm(sup, ms);
+	return ms;
+}
+
+static void child_sup_exit(struct child *c, int status, void *context)
+{
+	struct child_sup *sup = context;
+	unsigned ms;
+
+	sup->child = NULL;
+	if (!sup->active)
+		return;
+
+	if (metrics_now_ns() - sup->started_ns >= CHILD_STABLE_NS)
+		sup->crashes = 0;
+	ms = child_sup_backoff(sup);
+	metrics_add(METRIC_CRASHES, 1);
+
+	if (WIFSIGNALED(status))
+		print_warn("%s was killed by signal %d, restarting in %u ms\n",
+			sup->name, WTERMSIG(status), ms);
+	else
+		print_warn("%s has exited with status %d, restarting in %u ms\n",
+			sup->name, WEXITSTATUS(status), ms);
+}
+
+static int child_sup_spawn(struct child_sup *sup)
+{
+	struct child *c = sup->spawn(sup);
+
+	if (!c)
+		return -1;
+
+	c->on_exit = &child_sup_exit;
+	c->context = sup;
+	sup->child = c;
+	sup->started_ns = metrics_now_ns();
+	return 0;
+}
+
+static void child_sup_timer_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct child_sup *sup = h->context;
+	uint64_t expirations;
+
+	if (read(h->fd, &expirations, sizeof expirations) < 0)
+		return;
+	if (!sup->active || sup->child)
+		return;
+
+	if (child_sup_spawn(sup) < 0)
+		print_warn("cannot start %s, retrying in %u ms\n", sup->name,
+			child_sup_backoff(sup));
+}
+
+int child_sup_init(struct child_sup *sup, struct ev_loop *loop,
+	const char *name, child_spawn_t spawn, void *context)
+{
+	sup->name = name;
+	sup->loop = loop;
+	sup->child = NULL;
+	sup->spawn = spawn;
+	sup->context = context;
+	sup->crashes = 0;
+	sup->active = false;
+
+	sup->timer_h.func = &child_sup_timer_cb;
+	sup->timer_h.context = sup;
+	sup->timer_h.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (sup->timer_h.fd < 0)
+		return -1;
+
+	if (ev_add(loop, &sup->timer_h, EPOLLIN) < 0) {
+		close(sup->timer_h.fd);
+		sup->timer_h.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Spawn the child and keep it running until child_sup_stop() */
+int child_sup_start(struct child_sup *sup)
+{
+	if (sup->active)
+		return 0;
+
+	sup->crashes = 0;
+	if (child_sup_spawn(sup) < 0)
+		return -1;
+
+	sup->active = true;
+	return 0;
+}
+
+/*
+ * Replace a running child right away, to pick up new arguments. When the
+ * new one cannot be spawned, the usual backoff keeps trying.
+ */
+int child_sup_restart(struct child_sup *sup)
+{
+	if (!sup->active)
+		return child_sup_start(sup);
+
+	child_kill(sup->child);
+	sup->child = NULL;
+	child_sup_arm(sup, 0);
+
+	if (child_sup_spawn(sup) < 0) {
+		print_warn("cannot restart %s, retrying in %u ms\n", sup->name,
+			child_sup_backoff(sup));
+		return -1;
+	}
+
+	return 0;
+}
+
+void child_sup_stop(struct child_sup *sup)
+{
+	sup->active = false;
+	child_sup_arm(sup, 0);
+	child_kill(sup->child);
+	sup->child = NULL;
+}
+
+void child_sup_close(struct child_sup *sup)
+{
+	if (sup->timer_h.fd < 0)
+		return;
+
+	child_sup_stop(sup);
+	ev_del(sup->loop, &sup->timer_h);
+	close(sup->timer_h.fd);
+	sup->timer_h.fd = -1;
+}
@@ -0,0 +1,71 @@
+#ifndef __CHILD_H__
+#define __CHILD_H__
+
+#include "event_loop.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+/* Restart delays of a supervised child that keeps dying */
+#define CHILD_BACKOFF_MIN_MS    100
+#define CHILD_BACKOFF_MAX_MS    5000
+
+/* A child that ran this long is no longer crashing in a loop */
+#define CHILD_STABLE_NS         (10 * UINT64_C(1000000000))
+
+struct child;
+struct child_sup;
+
+/* Called once the process is gone and reaped, 'status' as from waitpid() */
+typedef void (*child_exit_t)(struct child *c, int status, void *context);
+
+/*
+ * A process started by child_spawn(). Its pidfd is watched by the event
+ * loop, so the process is reaped as soon as it exits. The structure is
+ * released right after the exit callback.
+ */
+struct child {
+	struct ev_handler h;        /* pidfd */
+	struct ev_loop   *loop;
+	pid_t             pid;
+	child_exit_t      on_exit;  /* NULL once the owner has let it go */
+	void             *context;
+	TAILQ_ENTRY(child) entries;
+};
+
+/* Spawns the process of a supervisor, NULL on failure */
+typedef struct child *(*child_spawn_t)(struct child_sup *sup);
+
+/*
+ * Keeps one child running: when it dies on its own, a new one is spawned
+ * after a delay that doubles on every crash in a row.
+ */
+struct child_sup {
+	const char       *name;
+	struct ev_loop   *loop;
+	struct ev_handler timer_h;
+	struct child     *child;
+	child_spawn_t     spawn;
+	void             *context;
+	unsigned          crashes;      /* In a row, reset by a stable run */
+	uint64_t          started_ns;
+	bool              active;
+};
+
+struct child *child_spawn(struct ev_loop *loop, char *const argv[],
+	int in_fd, int out_fd, const sigset_t *sigmask);
+void child_kill(struct child *c);
+void child_reap_all(void);
+unsigned child_count(void);
+
+int child_sup_init(struct child_sup *sup, struct ev_loop *loop,
+	const char *name, child_spawn_t spawn, void *context);
+int child_sup_start(struct child_sup *sup);
+int child_sup_restart(struct child_sup *sup);
+void child_sup_stop(struct child_sup *sup);
+void child_sup_close(struct child_sup *sup);
+
+#endif /* __CHILD_H__ */
@@ -1,9 +1,12 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include "log.h"
+
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -27,6 +30,10 @@
 #define MOD_LSB     0x05
 #define MOD_UNKNOWN 0xFF
 
+/* Tuning range, in Hz */
+#define FREQ_MIN    40000
+#define FREQ_MAX    120000000
+
 struct sdr_settings {
 	uint8_t modulation;
 	uint32_t frequency;
@@ -42,19 +49,39 @@ struct sdr_settings {
 #define M_STATION       0x00
 #define M_MANAGER       0x01
 
+struct demod_engine;
+struct state_pub;
+
 struct app_config {
-	uint8_t  status;
 	uint8_t  op_mode;
 
 	char    *host;
 	uint16_t port;
+	uint16_t http_port;     /* Audio streaming server */
 
 	int      pfd[2];
-	int      manager_sock;
-	pid_t    ffmpeg_pid;
-	pid_t    rtlsdr_pid;
-	bool     child_running;
-	struct   sdr_settings *sdr;
+	int      event_fd;
+	sigset_t orig_sigmask;
+	struct   state_pub *state;  /* Settings and status, see state.h */
+
+	char    *iq_source;     /* In-process demodulation when set */
+	uint32_t iq_rate;
+	struct   demod_engine *demod;
+
+	char   **stations;      /* Manager targets, [name=]host:port[@group...] */
+	unsigned nstations;
+	char    *stations_file;
+	bool     quiet;         /* Manager only prints the summary */
+	bool     metrics;       /* Serve /metrics next to the streams */
+
+	unsigned pcm_buffer_ms; /* Audio held for each encoder */
+	uint8_t  pcm_policy;    /* PCM_DROP_*, when an encoder falls behind */
+	float    squelch_db;    /* Open threshold in dBFS, NaN when off */
+	char    *record_dir;    /* Where the recording command writes */
+	unsigned timeshift_mb;  /* Replay memory for all the streams */
+	uint32_t *rates;        /* Extra rates of the main stream */
+	unsigned nrates;
+	char    *hop_list;      /* Scan list to rotate through from startup */
 };
 
 /* Convert modulation code into string */
@@ -148,20 +175,13 @@ static void strtrim(char *str)
 #define COLOR_BOLDGRAY  "\x1B[1;30m"
 #define COLOR_BOLDWHITE "\x1B[1;37m"
 
-/* ENABLE_DEBUG should be set on compile time */
-#define debug_alert(fmt, ...) \
-	do { if (ENABLE_DEBUG) fprintf(stderr, COLOR_RED fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define debug_warn(fmt, ...) \
-	do { if (ENABLE_DEBUG) fprintf(stderr, COLOR_YELLOW fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define debug_success(fmt, ...) \
-	do { if (ENABLE_DEBUG) fprintf(stderr, COLOR_GREEN fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define debug_info(fmt, ...) \
-	do { if (ENABLE_DEBUG) fprintf(stderr, COLOR_BOLDWHITE fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define print_error(fmt, ...) \
-	do { fprintf(stderr, COLOR_RED "ERROR: " fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define print_warn(fmt, ...) \
-	do { fprintf(stderr, COLOR_YELLOW "WARN: " fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
-#define print_info(fmt, ...) \
-	do { fprintf(stdout, COLOR_OFF "INFO: " fmt COLOR_OFF, ##__VA_ARGS__); } while (0)
+/* Through log.c, queued for its writer thread once log_start() is called */
+#define debug_alert(fmt, ...)   log_print(LOG_S_ALERT, fmt, ##__VA_ARGS__)
+#define debug_warn(fmt, ...)    log_print(LOG_S_DWARN, fmt, ##__VA_ARGS__)
+#define debug_success(fmt, ...) log_print(LOG_S_SUCCESS, fmt, ##__VA_ARGS__)
+#define debug_info(fmt, ...)    log_print(LOG_S_DINFO, fmt, ##__VA_ARGS__)
+#define print_error(fmt, ...)   log_print(LOG_S_ERROR, fmt, ##__VA_ARGS__)
+#define print_warn(fmt, ...)    log_print(LOG_S_WARN, fmt, ##__VA_ARGS__)
+#define print_info(fmt, ...)    log_print(LOG_S_INFO, fmt, ##__VA_ARGS__)
 
 #endif /* __COMMON_H__ */
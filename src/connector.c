@@ -0,0 +1,330 @@
+/*
+ * connector.c: Non-blocking connections over IPv4 and IPv6 (happy eyeballs).
+ *
+ * Names are resolved off the loop, then the addresses of both families are
+ * tried alternately, each one getting a short head start over the next.
+ * Nothing here ever blocks, so connecting to hundreds of hosts takes about
+ * as long as the slowest of them.
+ */
+
+#include "common.h"
+#include "connector.h"
+#include "event_loop.h"
+#include "resolver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+static uint64_t conn_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/* Wake up for the closest deadline or head start over, if any */
+static void conn_arm(struct connector *c)
+{
+	struct itimerspec its;
+	struct conn_req *req;
+	uint64_t when = UINT64_MAX;
+
+	TAILQ_FOREACH(req, &c->active, entries) {
+		if (req->deadline_ms < when)
+			when = req->deadline_ms;
+		if (req->nrunning > 0 && req->next < req->addrs.naddrs &&
+		    req->next_ms < when)
+			when = req->next_ms;
+	}
+
+	memset(&its, 0, sizeof its);
+	if (when != UINT64_MAX) {
+		/* Zero would disarm it, and that time is long gone anyway */
+		if (when == 0)
+			when = 1;
+		its.it_value.tv_sec = when / 1000;
+		its.it_value.tv_nsec = (when % 1000) * 1000000;
+	}
+	timerfd_settime(c->timer_h.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void conn_close_attempt(struct conn_req *req, struct conn_attempt *att)
+{
+	ev_del(req->c->loop, &att->h);
+	close(att->h.fd);
+	att->h.fd = -1;
+	req->nrunning--;
+}
+
+/* Tidy up, then hand the socket or the reason over; 'req' may be reused */
+static void conn_finish(struct conn_req *req, int fd, const char *err)
+{
+	struct connector *c = req->c;
+	unsigned k;
+
+	for (k = 0; k < RES_MAX_ADDRS; k++)
+		if (req->att[k].h.fd >= 0)
+			conn_close_attempt(req, &req->att[k]);
+	if (req->resolving)
+		resolver_cancel(&c->res, req);
+
+	TAILQ_REMOVE(&c->active, req, entries);
+	req->active = false;
+	req->resolving = false;
+
+	req->cb(req->context, fd, err);
+}
+
+static void conn_attempt_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events);
+
+/*
+ * Start on the next address. One that fails right away is no reason to
+ * wait, the one after it is tried at once.
+ */
+static void conn_next(struct conn_req *req)
+{
+	struct conn_attempt *att;
+	struct sockaddr *sa;
+	unsigned k;
+	int fd;
+
+	while (req->next < req->addrs.naddrs) {
+		k = req->next++;
+		sa = (struct sockaddr *)&req->addrs.addr[k];
+
+		fd = socket(sa->sa_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			req->err = errno;
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		if (connect(fd, sa, req->addrs.len[k]) < 0 && errno != EINPROGRESS) {
+			req->err = errno;
+			close(fd);
+			continue;
+		}
+
+		att = &req->att[k];
+		att->h.fd = fd;
+		att->h.func = &conn_attempt_cb;
+		att->h.context = att;
+		att->req = req;
+		if (ev_add(req->c->loop, &att->h, EPOLLOUT) < 0) {
+			req->err = errno;
+			close(fd);
+			att->h.fd = -1;
+			continue;
+		}
+
+		req->nrunning++;
+		req->next_ms = conn_now_ms() + CONN_ATTEMPT_DELAY_MS;
+		return;
+	}
+
+	if (req->nrunning == 0)
+		conn_finish(req, -1, strerror(req->err ? req->err : ECONNREFUSED));
+}
+
+static void conn_attempt_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct conn_attempt *att = h->context;
+	struct conn_req *req = att->req;
+	struct connector *c = req->c;
+	socklen_t len = sizeof(int);
+	int err, fd;
+
+	/* Closed earlier in the same batch, when another attempt won */
+	if (!req->active || h->fd < 0)
+		return;
+
+	if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err == 0) {
+		fd = h->fd;
+		ev_del(loop, h);
+		h->fd = -1;
+		req->nrunning--;
+		conn_finish(req, fd, NULL);
+	} else {
+		req->err = err;
+		conn_close_attempt(req, att);
+		conn_next(req);
+	}
+
+	conn_arm(c);
+}
+
+static void conn_resolved(void *context, int err, const struct res_addrs *addrs)
+{
+	struct conn_req *req = context;
+	struct sockaddr_in6 *sin6;
+	struct sockaddr_in *sin;
+	unsigned k, first = 0, other = 0, n = 0;
+	int family;
+
+	req->resolving = false;
+	if (err) {
+		conn_finish(req, -1, gai_strerror(err));
+		return;
+	}
+
+	/*
+	 * Alternate between the families, starting with the one the system
+	 * prefers, so a broken one costs a single head start at most.
+	 */
+	family = addrs->addr[0].ss_family;
+	while (n < addrs->naddrs) {
+		while (first < addrs->naddrs && addrs->addr[first].ss_family != family)
+			first++;
+		if (first < addrs->naddrs) {
+			req->addrs.addr[n] = addrs->addr[first];
+			req->addrs.len[n++] = addrs->len[first++];
+		}
+		while (other < addrs->naddrs && addrs->addr[other].ss_family == family)
+			other++;
+		if (other < addrs->naddrs) {
+			req->addrs.addr[n] = addrs->addr[other];
+			req->addrs.len[n++] = addrs->len[other++];
+		}
+	}
+	req->addrs.naddrs = n;
+
+	for (k = 0; k < n; k++) {
+		if (req->addrs.addr[k].ss_family == AF_INET6) {
+			sin6 = (struct sockaddr_in6 *)&req->addrs.addr[k];
+			sin6->sin6_port = htons(req->port);
+		} else {
+			sin = (struct sockaddr_in *)&req->addrs.addr[k];
+			sin->sin_port = htons(req->port);
+		}
+	}
+
+	req->next = 0;
+	conn_next(req);
+}
+
+static void conn_timer_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct connector *c = h->context;
+	struct conn_req *req;
+	uint64_t expirations, now = conn_now_ms();
+
+	if (read(h->fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+		return;
+
+	/* Finishing changes the list, start over after each one */
+_again:
+	TAILQ_FOREACH(req, &c->active, entries) {
+		if (now >= req->deadline_ms) {
+			conn_finish(req, -1, strerror(ETIMEDOUT));
+			goto _again;
+		}
+		if (req->nrunning > 0 && req->next < req->addrs.naddrs &&
+		    now >= req->next_ms) {
+			conn_next(req);
+			if (!req->active)
+				goto _again;
+		}
+	}
+
+	conn_arm(c);
+}
+
+int connector_init(struct connector *c, struct ev_loop *loop)
+{
+	memset(c, 0, sizeof *c);
+	c->loop = loop;
+	TAILQ_INIT(&c->active);
+
+	c->timer_h.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	c->timer_h.func = &conn_timer_cb;
+	c->timer_h.context = c;
+	if (c->timer_h.fd < 0)
+		return -1;
+
+	if (ev_add(loop, &c->timer_h, EPOLLIN) < 0 ||
+	    resolver_init(&c->res, loop) < 0) {
+		ev_del(loop, &c->timer_h);
+		close(c->timer_h.fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void connector_close(struct connector *c)
+{
+	struct conn_req *req;
+
+	while ((req = TAILQ_FIRST(&c->active)))
+		connector_cancel(req);
+
+	ev_del(c->loop, &c->timer_h);
+	close(c->timer_h.fd);
+	resolver_close(&c->res);
+}
+
+/*
+ * Connect to 'host' and call 'cb' with the outcome, at most
+ * CONN_TIMEOUT_MS later. With a literal address that cannot be reached at
+ * all, that may be before this returns.
+ */
+int connector_start(struct connector *c, struct conn_req *req,
+	const char *host, uint16_t port, conn_cb_t cb, void *context)
+{
+	unsigned k;
+
+	memset(req, 0, sizeof *req);
+	req->c = c;
+	req->port = port;
+	req->cb = cb;
+	req->context = context;
+	for (k = 0; k < RES_MAX_ADDRS; k++)
+		req->att[k].h.fd = -1;
+	req->deadline_ms = conn_now_ms() + CONN_TIMEOUT_MS;
+	req->active = true;
+	req->resolving = true;
+	TAILQ_INSERT_TAIL(&c->active, req, entries);
+
+	if (resolver_lookup(&c->res, host, &conn_resolved, req) < 0) {
+		TAILQ_REMOVE(&c->active, req, entries);
+		req->active = false;
+		return -1;
+	}
+
+	conn_arm(c);
+	return 0;
+}
+
+/* Give up on a connection, its callback is not called */
+void connector_cancel(struct conn_req *req)
+{
+	struct connector *c = req->c;
+	unsigned k;
+
+	if (!req->active)
+		return;
+
+	for (k = 0; k < RES_MAX_ADDRS; k++)
+		if (req->att[k].h.fd >= 0)
+			conn_close_attempt(req, &req->att[k]);
+	if (req->resolving)
+		resolver_cancel(&c->res, req);
+
+	TAILQ_REMOVE(&c->active, req, entries);
+	req->active = false;
+	conn_arm(c);
+}
@@ -0,0 +1,67 @@
+#ifndef __CONNECTOR_H__
+#define __CONNECTOR_H__
+
+#include "common.h"
+#include "event_loop.h"
+#include "resolver.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* Head start of each address over the next one, as in RFC 8305 */
+#define CONN_ATTEMPT_DELAY_MS   250
+#define CONN_TIMEOUT_MS         5000
+
+struct conn_req;
+
+/* 'fd' is the connected socket, still non-blocking, or -1 and the reason */
+typedef void (*conn_cb_t)(void *context, int fd, const char *err);
+
+/* Connection attempt to one address */
+struct conn_attempt {
+	struct ev_handler   h;
+	struct conn_req    *req;
+};
+
+/*
+ * Connection to one host, in the memory of whoever asked for it. Every
+ * address is tried in turn, the next one starting as soon as the previous
+ * one fails or has had CONN_ATTEMPT_DELAY_MS to succeed, without giving up
+ * on it: the first handshake to complete wins.
+ */
+struct conn_req {
+	struct connector   *c;
+	uint16_t            port;
+	conn_cb_t           cb;
+	void               *context;
+
+	struct res_addrs    addrs;      /* Families interleaved */
+	unsigned            next;
+	struct conn_attempt att[RES_MAX_ADDRS];
+	unsigned            nrunning;
+	uint64_t            next_ms;    /* When to start the next address */
+	uint64_t            deadline_ms;
+	int                 err;        /* Of the last attempt that failed */
+	bool                resolving;
+	bool                active;
+	TAILQ_ENTRY(conn_req) entries;
+};
+
+TAILQ_HEAD(conn_req_list, conn_req);
+
+/* Resolver, plus one timer for the attempts of every connection */
+struct connector {
+	struct ev_loop       *loop;
+	struct resolver       res;
+	struct ev_handler     timer_h;
+	struct conn_req_list  active;
+};
+
+int connector_init(struct connector *c, struct ev_loop *loop);
+void connector_close(struct connector *c);
+int connector_start(struct connector *c, struct conn_req *req,
+	const char *host, uint16_t port, conn_cb_t cb, void *context);
+void connector_cancel(struct conn_req *req);
+
+#endif /* __CONNECTOR_H__ */
@@ -0,0 +1,454 @@
+/*
+ * demod.c: In-process demodulation engine.
+ *
+ * One thread reads the capture and demodulates the main frequency. When
+ * extra channels are added, the same blocks also go through the channelizer
+ * and the channels are shared out to a pool of workers, one per core.
+ */
+
+#include "common.h"
+#include "demod.h"
+#include "metrics.h"
+#include "pcm_ring.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void channel_release(struct chz_channel *ch)
+{
+	pcm_ring_free(ch->out);
+	chz_channel_free(ch);
+	free(ch);
+}
+
+/*
+ * Pick up the channels added and removed since the last block, and follow
+ * the tuner. Returns the number of live channels.
+ */
+static unsigned demod_sync_channels(struct demod_engine *eng)
+{
+	uint32_t center = atomic_load(&eng->center);
+	unsigned k, j;
+
+	pthread_mutex_lock(&eng->chan_lock);
+
+	for (k = 0, j = 0; k < eng->nchans; k++) {
+		if (atomic_load(&eng->chans[k]->dead))
+			channel_release(eng->chans[k]);
+		else
+			eng->chans[j++] = eng->chans[k];
+	}
+	eng->nchans = j;
+
+	for (k = 0; k < eng->npending; k++) {
+		chz_channel_tune(eng->pending[k], &eng->chz, center);
+		eng->chans[eng->nchans++] = eng->pending[k];
+	}
+	eng->npending = 0;
+
+	pthread_mutex_unlock(&eng->chan_lock);
+
+	if (center != eng->chz_center) {
+		for (k = 0; k < eng->nchans; k++)
+			chz_channel_tune(eng->chans[k], &eng->chz, center);
+		eng->chz_center = center;
+	}
+
+	return eng->nchans;
+}
+
+/* Take channels of the current block until none is left */
+static void demod_work(struct demod_engine *eng)
+{
+	struct chz_channel *ch;
+	unsigned k;
+	size_t nout;
+
+	while ((k = atomic_fetch_add(&eng->work_next, 1)) < eng->nchans) {
+		ch = eng->chans[k];
+		nout = chz_channel_process(ch, &eng->chz);
+		if (nout > 0 && ch->out)
+			pcm_ring_push(ch->out, ch->pcm, nout * sizeof *ch->pcm);
+	}
+}
+
+static void *demod_worker(void *arg)
+{
+	struct demod_engine *eng = arg;
+	unsigned gen = 0;
+
+	pthread_mutex_lock(&eng->work_lock);
+	for (;;) {
+		while (!eng->work_quit && eng->work_gen == gen)
+			pthread_cond_wait(&eng->work_cond, &eng->work_lock);
+		if (eng->work_quit)
+			break;
+		gen = eng->work_gen;
+		pthread_mutex_unlock(&eng->work_lock);
+
+		demod_work(eng);
+
+		pthread_mutex_lock(&eng->work_lock);
+		if (--eng->work_active == 0)
+			pthread_cond_signal(&eng->done_cond);
+	}
+	pthread_mutex_unlock(&eng->work_lock);
+
+	return NULL;
+}
+
+/* Demodulate every channel of the block, with the help of the workers */
+static void demod_run_channels(struct demod_engine *eng)
+{
+	atomic_store(&eng->work_next, 0);
+
+	if (eng->nchans < 2 || eng->nworkers == 0) {
+		demod_work(eng);
+		return;
+	}
+
+	pthread_mutex_lock(&eng->work_lock);
+	eng->work_active = eng->nworkers;
+	eng->work_gen++;
+	pthread_cond_broadcast(&eng->work_cond);
+	pthread_mutex_unlock(&eng->work_lock);
+
+	demod_work(eng);
+
+	pthread_mutex_lock(&eng->work_lock);
+	while (eng->work_active > 0)
+		pthread_cond_wait(&eng->done_cond, &eng->work_lock);
+	pthread_mutex_unlock(&eng->work_lock);
+}
+
+static void demod_workers_start(struct demod_engine *eng, unsigned want)
+{
+	if (want > DEMOD_MAX_WORKERS)
+		want = DEMOD_MAX_WORKERS;
+
+	for (eng->nworkers = 0; eng->nworkers < want; eng->nworkers++) {
+		if (pthread_create(&eng->workers[eng->nworkers], NULL,
+				&demod_worker, eng) != 0) {
+			print_warn("cannot start more than %u channel workers\n",
+				eng->nworkers);
+			break;
+		}
+	}
+}
+
+static void demod_workers_stop(struct demod_engine *eng)
+{
+	unsigned k;
+
+	pthread_mutex_lock(&eng->work_lock);
+	eng->work_quit = true;
+	pthread_cond_broadcast(&eng->work_cond);
+	pthread_mutex_unlock(&eng->work_lock);
+
+	for (k = 0; k < eng->nworkers; k++)
+		pthread_join(eng->workers[k], NULL);
+	eng->nworkers = 0;
+}
+
+/*
+ * Demodulate 'n' samples of 'iq': the main frequency into 'pcm', which is
+ * left for the caller to push, and every channel into its own output.
+ * Returns the number of samples in 'pcm'.
+ */
+size_t demod_process(struct demod_engine *eng, const uint8_t *iq, size_t n)
+{
+	size_t nout;
+
+	nout = dsp_chain_process(&eng->chain, iq, n, eng->pcm);
+
+	if (demod_sync_channels(eng) > 0) {
+		chz_process(&eng->chz, iq, n);
+		demod_run_channels(eng);
+	}
+
+	return nout;
+}
+
+static void *demod_thread(void *arg)
+{
+	struct demod_engine *eng = arg;
+	size_t pending = 0;     /* Odd byte left over from the last read */
+	size_t n, nout;
+	ssize_t nbr;
+	unsigned mod;
+	uint64_t t0;
+
+	trace_thread_name("demod");
+	while (!atomic_load_explicit(&eng->stop, memory_order_relaxed)) {
+		mod = atomic_load_explicit(&eng->want_mod, memory_order_relaxed);
+		if (mod != eng->chain.dm.modulation)
+			dsp_demod_set_modulation(&eng->chain.dm, mod);
+
+		nbr = iq_source_read(&eng->src, eng->iq + pending,
+			2 * DSP_BLOCK - pending);
+		if (nbr <= 0) {
+			if (!atomic_load(&eng->stop))
+				print_error("IQ source %s has stopped\n", eng->src.spec);
+			break;
+		}
+		metrics_add(METRIC_IQ_BYTES, nbr);
+
+		t0 = trace_begin();
+		n = (pending + nbr) / 2;
+		nout = demod_process(eng, eng->iq, n);
+
+		pending = (pending + nbr) & 1;
+		if (pending)
+			eng->iq[0] = eng->iq[2 * n];
+
+		if (nout > 0)
+			pcm_ring_push(eng->out, eng->pcm, nout * sizeof *eng->pcm);
+		trace_end("demod block", "demod", t0, nout);
+	}
+
+	return NULL;
+}
+
+/*
+ * Everything of an engine but the source and its thread, with 'nworkers'
+ * workers for the channels. demod_start() builds on it, benchmarks drive it
+ * block by block through demod_process().
+ */
+struct demod_engine *demod_create(uint32_t rate,
+	const struct sdr_settings *sdr, struct pcm_ring *out, unsigned nworkers)
+{
+	struct demod_engine *eng;
+
+	if (!sdr) {
+		errno = EFAULT;
+		return NULL;
+	}
+
+	eng = calloc(1, sizeof *eng);
+	if (!eng)
+		return NULL;
+
+	if (rate == 0)
+		rate = dsp_capture_rate(DSP_DEMOD_RATE);
+
+	atomic_init(&eng->stop, false);
+	atomic_init(&eng->want_mod, sdr->modulation);
+	atomic_init(&eng->center, sdr->frequency);
+	atomic_init(&eng->work_next, 0);
+	eng->rate = rate;
+	eng->tuned_freq = sdr->frequency;
+	eng->chz_center = sdr->frequency;
+	eng->out = out;
+	pthread_mutex_init(&eng->chan_lock, NULL);
+	pthread_mutex_init(&eng->work_lock, NULL);
+	pthread_cond_init(&eng->work_cond, NULL);
+	pthread_cond_init(&eng->done_cond, NULL);
+
+	eng->iq = malloc(2 * DSP_BLOCK);
+	eng->pcm = malloc(DSP_BLOCK * sizeof *eng->pcm);
+	if (!eng->iq || !eng->pcm)
+		goto _err_alloc;
+
+	if (dsp_chain_init(&eng->chain, sdr->modulation, rate, DSP_OUT_RATE) < 0)
+		goto _err_alloc;
+	eng->chain.sq = out ? &out->squelch : NULL;
+
+	if (chz_init(&eng->chz, rate) < 0)
+		goto _err_chz;
+
+	demod_workers_start(eng, nworkers);
+	return eng;
+
+_err_chz:
+	dsp_chain_free(&eng->chain);
+_err_alloc:
+	free(eng->iq);
+	free(eng->pcm);
+	pthread_mutex_destroy(&eng->chan_lock);
+	pthread_mutex_destroy(&eng->work_lock);
+	pthread_cond_destroy(&eng->work_cond);
+	pthread_cond_destroy(&eng->done_cond);
+	free(eng);
+	return NULL;
+}
+
+/* Undo demod_create(), the channels go too but not the main output */
+void demod_destroy(struct demod_engine *eng)
+{
+	unsigned k;
+
+	if (!eng)
+		return;
+
+	demod_workers_stop(eng);
+
+	for (k = 0; k < eng->nchans; k++)
+		channel_release(eng->chans[k]);
+	for (k = 0; k < eng->npending; k++)
+		channel_release(eng->pending[k]);
+
+	chz_free(&eng->chz);
+	dsp_chain_free(&eng->chain);
+	pthread_mutex_destroy(&eng->chan_lock);
+	pthread_mutex_destroy(&eng->work_lock);
+	pthread_cond_destroy(&eng->work_cond);
+	pthread_cond_destroy(&eng->done_cond);
+	free(eng->iq);
+	free(eng->pcm);
+	free(eng);
+}
+
+struct demod_engine *demod_start(const char *spec, uint32_t rate,
+	const struct sdr_settings *sdr, struct pcm_ring *out)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct demod_engine *eng;
+
+	if (!spec || !sdr) {
+		errno = EFAULT;
+		return NULL;
+	}
+
+	/* One worker per core besides the thread */
+	eng = demod_create(rate, sdr, out, (ncpu > 1) ? ncpu - 1 : 0);
+	if (!eng)
+		return NULL;
+
+	if (iq_source_open(&eng->src, spec, eng->rate, sdr->frequency) < 0)
+		goto _err_source;
+
+	if (pthread_create(&eng->tid, NULL, &demod_thread, eng) != 0) {
+		print_error("cannot start the demodulator thread\n");
+		goto _err_thread;
+	}
+
+	print_info("Demodulating %s at %u S/s (%s kernels, %u workers)\n",
+		spec, eng->rate, dsp_k.name, eng->nworkers);
+	return eng;
+
+_err_thread:
+	iq_source_close(&eng->src);
+_err_source:
+	demod_destroy(eng);
+	return NULL;
+}
+
+void demod_stop(struct demod_engine *eng)
+{
+	struct pcm_ring *out;
+
+	if (!eng)
+		return;
+
+	atomic_store(&eng->stop, true);
+	iq_source_interrupt(&eng->src);
+	pthread_join(eng->tid, NULL);
+	iq_source_close(&eng->src);
+
+	out = eng->out;
+	demod_destroy(eng);
+	pcm_ring_free(out);
+}
+
+/*
+ * Apply new settings to a running engine. The modulation switches at the
+ * next block boundary, the frequency goes to the tuner right away through
+ * its control channel. Returns -1 with ENOTSUP when the frequency cannot be
+ * changed in flight (recorded IQ files).
+ */
+int demod_retune(struct demod_engine *eng, const struct sdr_settings *sdr)
+{
+	if (!eng || !sdr) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	atomic_store(&eng->want_mod, sdr->modulation);
+
+	if (sdr->frequency == eng->tuned_freq)
+		return 0;
+	if (iq_source_tune(&eng->src, sdr->frequency) < 0)
+		return -1;
+
+	eng->tuned_freq = sdr->frequency;
+	atomic_store(&eng->center, sdr->frequency);
+	return 0;
+}
+
+/*
+ * Demodulate 'freq' out of the capture into 'out', which is owned by the
+ * engine from now on, unless this fails. The channel starts with the next
+ * block.
+ */
+int demod_add_channel(struct demod_engine *eng, unsigned id, uint32_t freq,
+	uint8_t modulation, struct pcm_ring *out)
+{
+	struct chz_channel *ch;
+
+	if (!eng) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	ch = malloc(sizeof *ch);
+	if (!ch) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (chz_channel_init(ch, &eng->chz, id, freq, modulation, out) < 0) {
+		free(ch);
+		return -1;
+	}
+	ch->sq = out ? &out->squelch : NULL;
+
+	pthread_mutex_lock(&eng->chan_lock);
+	if (eng->nchans + eng->npending == DEMOD_MAX_CHANNELS) {
+		pthread_mutex_unlock(&eng->chan_lock);
+		chz_channel_free(ch);
+		free(ch);
+		errno = ENOSPC;
+		return -1;
+	}
+	eng->pending[eng->npending++] = ch;
+	pthread_mutex_unlock(&eng->chan_lock);
+
+	return 0;
+}
+
+/* Remove a channel, its output is closed by the engine */
+int demod_del_channel(struct demod_engine *eng, unsigned id)
+{
+	unsigned k;
+
+	if (!eng) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	pthread_mutex_lock(&eng->chan_lock);
+
+	for (k = 0; k < eng->npending; k++) {
+		if (eng->pending[k]->id == id) {
+			channel_release(eng->pending[k]);
+			eng->pending[k] = eng->pending[--eng->npending];
+			pthread_mutex_unlock(&eng->chan_lock);
+			return 0;
+		}
+	}
+
+	for (k = 0; k < eng->nchans; k++) {
+		if (eng->chans[k]->id == id && !atomic_load(&eng->chans[k]->dead)) {
+			atomic_store(&eng->chans[k]->dead, true);
+			pthread_mutex_unlock(&eng->chan_lock);
+			return 0;
+		}
+	}
+
+	pthread_mutex_unlock(&eng->chan_lock);
+	errno = ENOENT;
+	return -1;
+}
@@ -0,0 +1,70 @@
+#ifndef __DEMOD_H__
+#define __DEMOD_H__
+
+#include "common.h"
+#include "channelizer.h"
+#include "dsp.h"
+#include "iq_source.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEMOD_MAX_CHANNELS  16
+#define DEMOD_MAX_WORKERS   16
+
+/*
+ * In-process replacement for rtl_fm: a thread reading IQ from a source,
+ * running it through the DSP chain and pushing s16le PCM into 'out'. The
+ * engine owns the rings of its outputs and frees them when stopped.
+ */
+struct demod_engine {
+	pthread_t        tid;
+	atomic_bool      stop;
+	atomic_uint      want_mod;      /* Applied by the thread between blocks */
+	uint32_t         rate;          /* Capture rate */
+	uint32_t         tuned_freq;    /* Last frequency sent to the tuner */
+	struct pcm_ring *out;
+	struct iq_source src;
+	struct dsp_chain chain;
+	uint8_t         *iq;
+	int16_t         *pcm;
+
+	/*
+	 * Extra channels carved out of the capture. The thread owns 'chans',
+	 * the station hands new channels over through 'pending'.
+	 */
+	struct channelizer  chz;
+	atomic_uint         center;     /* Tuner frequency channels refer to */
+	uint32_t            chz_center;
+	pthread_mutex_t     chan_lock;
+	struct chz_channel *chans[DEMOD_MAX_CHANNELS];
+	unsigned            nchans;
+	struct chz_channel *pending[DEMOD_MAX_CHANNELS];
+	unsigned            npending;
+
+	/* Workers sharing the channels of every block with the thread */
+	pthread_t           workers[DEMOD_MAX_WORKERS];
+	unsigned            nworkers;
+	pthread_mutex_t     work_lock;
+	pthread_cond_t      work_cond;
+	pthread_cond_t      done_cond;
+	unsigned            work_gen;
+	unsigned            work_active;
+	atomic_uint         work_next;
+	bool                work_quit;
+};
+
+struct demod_engine *demod_start(const char *spec, uint32_t rate,
+	const struct sdr_settings *sdr, struct pcm_ring *out);
+void demod_stop(struct demod_engine *eng);
+struct demod_engine *demod_create(uint32_t rate,
+	const struct sdr_settings *sdr, struct pcm_ring *out, unsigned nworkers);
+void demod_destroy(struct demod_engine *eng);
+size_t demod_process(struct demod_engine *eng, const uint8_t *iq, size_t n);
+int demod_retune(struct demod_engine *eng, const struct sdr_settings *sdr);
+
+int demod_add_channel(struct demod_engine *eng, unsigned id, uint32_t freq,
+	uint8_t modulation, struct pcm_ring *out);
+int demod_del_channel(struct demod_engine *eng, unsigned id);
+
+#endif /* __DEMOD_H__ */
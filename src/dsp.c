@@ -0,0 +1,951 @@
+/*
+ * dsp.c: In-process demodulation chain.
+ *
+ * u8 IQ from the tuner is centered, freed from its DC offset and brought
+ * down to the demod rate with a decimating FIR. The complex baseband is then
+ * demodulated (polar discriminator for FM), de-emphasized and decimated to
+ * the audio output rate as signed 16 bits PCM, the same format rtl_fm used
+ * to write into the pipe. SSB is decimated first and demodulated by the
+ * phasing method, where the Hilbert transformer can stay short.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "squelch.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSP_X86 1
+#endif
+
+/* Polynomial atan approximation, good to about 0.005 rad */
+#define ATAN_C1     0.7853981634f   /* pi / 4 */
+#define ATAN_C2     0.2730f
+#define INV_PI      0.3183098862f
+
+/* DC estimate smoothing between blocks */
+#define DC_ALPHA    0.05f
+
+/*
+ * Scalar kernels, also the reference for the vector ones
+ */
+static void u8_to_f32_c(const uint8_t *iq, float *out_i, float *out_q,
+	size_t n, float dc_i, float dc_q, float *sum_i, float *sum_q)
+{
+	float si = 0.0f, sq = 0.0f;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		float fi = ((float)iq[2 * k] - 127.5f) * (1.0f / 128.0f);
+		float fq = ((float)iq[2 * k + 1] - 127.5f) * (1.0f / 128.0f);
+
+		si += fi;
+		sq += fq;
+		out_i[k] = fi - dc_i;
+		out_q[k] = fq - dc_q;
+	}
+
+	*sum_i = si;
+	*sum_q = sq;
+}
+
+static void fir2_c(const float *taps, const float *x_i, const float *x_q,
+	size_t ntaps, float *y_i, float *y_q)
+{
+	float ai = 0.0f, aq = 0.0f;
+	size_t k;
+
+	for (k = 0; k < ntaps; k++) {
+		ai += taps[k] * x_i[k];
+		aq += taps[k] * x_q[k];
+	}
+
+	*y_i = ai;
+	*y_q = aq;
+}
+
+static float dot_c(const float *taps, const float *x, size_t ntaps)
+{
+	float acc = 0.0f;
+	size_t k;
+
+	for (k = 0; k < ntaps; k++)
+		acc += taps[k] * x[k];
+
+	return acc;
+}
+
+static inline float fast_atan2(float y, float x)
+{
+	float ax = fabsf(x), ay = fabsf(y);
+	float mx = (ax > ay) ? ax : ay;
+	float mn = (ax > ay) ? ay : ax;
+	float a, r;
+
+	if (mx == 0.0f)
+		return 0.0f;
+
+	a = mn / mx;
+	r = a * (ATAN_C1 + ATAN_C2 * (1.0f - a));
+	if (ay > ax)
+		r = (float)M_PI_2 - r;
+	if (x < 0.0f)
+		r = (float)M_PI - r;
+
+	return (y < 0.0f) ? -r : r;
+}
+
+static void fm_disc_c(const float *in_i, const float *in_q, size_t n,
+	float *prev_i, float *prev_q, float *out)
+{
+	float pi = *prev_i, pq = *prev_q;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		float re = in_i[k] * pi + in_q[k] * pq;
+		float im = in_q[k] * pi - in_i[k] * pq;
+
+		out[k] = fast_atan2(im, re) * INV_PI;
+		pi = in_i[k];
+		pq = in_q[k];
+	}
+
+	*prev_i = pi;
+	*prev_q = pq;
+}
+
+static void f32_to_s16_c(const float *in, int16_t *out, size_t n, float gain)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		float v = in[k] * gain;
+
+		if (v > 32767.0f)
+			v = 32767.0f;
+		else if (v < -32768.0f)
+			v = -32768.0f;
+		out[k] = (int16_t)lrintf(v);
+	}
+}
+
+static void power_acc_c(const float *re, const float *im, float *acc, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		acc[k] += re[k] * re[k] + im[k] * im[k];
+}
+
+static float power_sum_c(const float *re, const float *im, size_t n)
+{
+	float sum = 0.0f;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		sum += re[k] * re[k] + im[k] * im[k];
+
+	return sum;
+}
+
+static uint64_t energy_s16_c(const int16_t *x, size_t n)
+{
+	uint64_t sum = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		sum += (uint32_t)((int32_t)x[k] * x[k]);
+
+	return sum;
+}
+
+#ifdef DSP_X86
+/*
+ * SSE2 kernels, always available on x86_64
+ */
+static void u8_to_f32_sse2(const uint8_t *iq, float *out_i, float *out_q,
+	size_t n, float dc_i, float dc_q, float *sum_i, float *sum_q)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo16 = _mm_set1_epi32(0xffff);
+	const __m128 bias = _mm_set1_ps(127.5f);
+	const __m128 scale = _mm_set1_ps(1.0f / 128.0f);
+	const __m128 vdc_i = _mm_set1_ps(dc_i), vdc_q = _mm_set1_ps(dc_q);
+	__m128 si = _mm_setzero_ps(), sq = _mm_setzero_ps();
+	float tmp[4], ti, tq;
+	size_t k;
+
+	/* 8 complex samples per iteration */
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m128i raw = _mm_loadu_si128((const __m128i *)(iq + 2 * k));
+		__m128i half[2] = {_mm_unpacklo_epi8(raw, zero),
+		                   _mm_unpackhi_epi8(raw, zero)};
+		int h;
+
+		for (h = 0; h < 2; h++) {
+			__m128 fi = _mm_cvtepi32_ps(_mm_and_si128(half[h], lo16));
+			__m128 fq = _mm_cvtepi32_ps(_mm_srli_epi32(half[h], 16));
+
+			fi = _mm_mul_ps(_mm_sub_ps(fi, bias), scale);
+			fq = _mm_mul_ps(_mm_sub_ps(fq, bias), scale);
+			si = _mm_add_ps(si, fi);
+			sq = _mm_add_ps(sq, fq);
+			_mm_storeu_ps(out_i + k + 4 * h, _mm_sub_ps(fi, vdc_i));
+			_mm_storeu_ps(out_q + k + 4 * h, _mm_sub_ps(fq, vdc_q));
+		}
+	}
+
+	u8_to_f32_c(iq + 2 * k, out_i + k, out_q + k, n - k, dc_i, dc_q, &ti, &tq);
+
+	_mm_storeu_ps(tmp, si);
+	*sum_i = tmp[0] + tmp[1] + tmp[2] + tmp[3] + ti;
+	_mm_storeu_ps(tmp, sq);
+	*sum_q = tmp[0] + tmp[1] + tmp[2] + tmp[3] + tq;
+}
+
+static void fir2_sse2(const float *taps, const float *x_i, const float *x_q,
+	size_t ntaps, float *y_i, float *y_q)
+{
+	__m128 ai = _mm_setzero_ps(), aq = _mm_setzero_ps();
+	float tmp[4], ri, rq;
+	size_t k;
+
+	for (k = 0; k + 4 <= ntaps; k += 4) {
+		__m128 t = _mm_loadu_ps(taps + k);
+		ai = _mm_add_ps(ai, _mm_mul_ps(t, _mm_loadu_ps(x_i + k)));
+		aq = _mm_add_ps(aq, _mm_mul_ps(t, _mm_loadu_ps(x_q + k)));
+	}
+
+	fir2_c(taps + k, x_i + k, x_q + k, ntaps - k, &ri, &rq);
+
+	_mm_storeu_ps(tmp, ai);
+	*y_i = tmp[0] + tmp[1] + tmp[2] + tmp[3] + ri;
+	_mm_storeu_ps(tmp, aq);
+	*y_q = tmp[0] + tmp[1] + tmp[2] + tmp[3] + rq;
+}
+
+static float dot_sse2(const float *taps, const float *x, size_t ntaps)
+{
+	__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+	float tmp[4];
+	size_t k;
+
+	/* Two accumulators hide the latency of the additions */
+	for (k = 0; k + 8 <= ntaps; k += 8) {
+		a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(taps + k),
+			_mm_loadu_ps(x + k)));
+		a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(taps + k + 4),
+			_mm_loadu_ps(x + k + 4)));
+	}
+
+	_mm_storeu_ps(tmp, _mm_add_ps(a0, a1));
+	return tmp[0] + tmp[1] + tmp[2] + tmp[3] +
+		dot_c(taps + k, x + k, ntaps - k);
+}
+
+static inline __m128 atan2_sse2(__m128 y, __m128 x)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 tiny = _mm_set1_ps(1e-30f);
+	__m128 ax = _mm_andnot_ps(sign, x), ay = _mm_andnot_ps(sign, y);
+	__m128 mx = _mm_max_ps(ax, ay), mn = _mm_min_ps(ax, ay);
+	__m128 a = _mm_div_ps(mn, _mm_add_ps(mx, tiny));
+	__m128 r, m;
+
+	r = _mm_mul_ps(a, _mm_add_ps(_mm_set1_ps(ATAN_C1),
+		_mm_mul_ps(_mm_set1_ps(ATAN_C2), _mm_sub_ps(one, a))));
+
+	m = _mm_cmpgt_ps(ay, ax);
+	r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps((float)M_PI_2), r)),
+		_mm_andnot_ps(m, r));
+	m = _mm_cmplt_ps(x, _mm_setzero_ps());
+	r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps((float)M_PI), r)),
+		_mm_andnot_ps(m, r));
+
+	return _mm_xor_ps(r, _mm_and_ps(sign, y));
+}
+
+static void fm_disc_sse2(const float *in_i, const float *in_q, size_t n,
+	float *prev_i, float *prev_q, float *out)
+{
+	const __m128 inv_pi = _mm_set1_ps(INV_PI);
+	size_t k;
+
+	if (n == 0)
+		return;
+
+	/* The first sample pairs with the previous block */
+	fm_disc_c(in_i, in_q, 1, prev_i, prev_q, out);
+
+	for (k = 1; k + 4 <= n; k += 4) {
+		__m128 i = _mm_loadu_ps(in_i + k), q = _mm_loadu_ps(in_q + k);
+		__m128 pi = _mm_loadu_ps(in_i + k - 1);
+		__m128 pq = _mm_loadu_ps(in_q + k - 1);
+		__m128 re = _mm_add_ps(_mm_mul_ps(i, pi), _mm_mul_ps(q, pq));
+		__m128 im = _mm_sub_ps(_mm_mul_ps(q, pi), _mm_mul_ps(i, pq));
+
+		_mm_storeu_ps(out + k, _mm_mul_ps(atan2_sse2(im, re), inv_pi));
+	}
+
+	*prev_i = in_i[k - 1];
+	*prev_q = in_q[k - 1];
+	fm_disc_c(in_i + k, in_q + k, n - k, prev_i, prev_q, out + k);
+}
+
+static void f32_to_s16_sse2(const float *in, int16_t *out, size_t n, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t k;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + k), g));
+		__m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + k + 4), g));
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packs_epi32(a, b));
+	}
+
+	f32_to_s16_c(in + k, out + k, n - k, gain);
+}
+
+static void power_acc_sse2(const float *re, const float *im, float *acc,
+	size_t n)
+{
+	size_t k;
+
+	for (k = 0; k + 4 <= n; k += 4) {
+		__m128 r = _mm_loadu_ps(re + k), i = _mm_loadu_ps(im + k);
+		__m128 p = _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i));
+		_mm_storeu_ps(acc + k, _mm_add_ps(_mm_loadu_ps(acc + k), p));
+	}
+
+	power_acc_c(re + k, im + k, acc + k, n - k);
+}
+
+static float power_sum_sse2(const float *re, const float *im, size_t n)
+{
+	__m128 acc = _mm_setzero_ps();
+	float lane[4];
+	size_t k;
+
+	for (k = 0; k + 4 <= n; k += 4) {
+		__m128 r = _mm_loadu_ps(re + k), i = _mm_loadu_ps(im + k);
+		acc = _mm_add_ps(acc, _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i)));
+	}
+
+	_mm_storeu_ps(lane, acc);
+	return lane[0] + lane[1] + lane[2] + lane[3] +
+		power_sum_c(re + k, im + k, n - k);
+}
+
+/* Pairs of squares fit in 32 bits unsigned, they are summed on 64 */
+static uint64_t energy_s16_sse2(const int16_t *x, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	uint64_t lane[2];
+	size_t k;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(x + k));
+		__m128i p = _mm_madd_epi16(v, v);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, zero));
+	}
+
+	_mm_storeu_si128((__m128i *)lane, acc);
+	return lane[0] + lane[1] + energy_s16_c(x + k, n - k);
+}
+
+/*
+ * AVX2 kernels, selected at runtime
+ */
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static void u8_to_f32_avx2(const uint8_t *iq, float *out_i, float *out_q,
+	size_t n, float dc_i, float dc_q, float *sum_i, float *sum_q)
+{
+	const __m256i lo16 = _mm256_set1_epi32(0xffff);
+	const __m256 bias = _mm256_set1_ps(127.5f);
+	const __m256 scale = _mm256_set1_ps(1.0f / 128.0f);
+	const __m256 vdc_i = _mm256_set1_ps(dc_i), vdc_q = _mm256_set1_ps(dc_q);
+	__m256 si = _mm256_setzero_ps(), sq = _mm256_setzero_ps();
+	float tmp[8], ti, tq;
+	size_t k;
+	int j;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m128i raw = _mm_loadu_si128((const __m128i *)(iq + 2 * k));
+		__m256i w = _mm256_cvtepu8_epi16(raw);
+		__m256 fi = _mm256_cvtepi32_ps(_mm256_and_si256(w, lo16));
+		__m256 fq = _mm256_cvtepi32_ps(_mm256_srli_epi32(w, 16));
+
+		fi = _mm256_mul_ps(_mm256_sub_ps(fi, bias), scale);
+		fq = _mm256_mul_ps(_mm256_sub_ps(fq, bias), scale);
+		si = _mm256_add_ps(si, fi);
+		sq = _mm256_add_ps(sq, fq);
+		_mm256_storeu_ps(out_i + k, _mm256_sub_ps(fi, vdc_i));
+		_mm256_storeu_ps(out_q + k, _mm256_sub_ps(fq, vdc_q));
+	}
+
+	u8_to_f32_c(iq + 2 * k, out_i + k, out_q + k, n - k, dc_i, dc_q, &ti, &tq);
+
+	_mm256_storeu_ps(tmp, si);
+	for (j = 0; j < 8; j++)
+		ti += tmp[j];
+	_mm256_storeu_ps(tmp, sq);
+	for (j = 0; j < 8; j++)
+		tq += tmp[j];
+
+	*sum_i = ti;
+	*sum_q = tq;
+}
+
+AVX2 static void fir2_avx2(const float *taps, const float *x_i,
+	const float *x_q, size_t ntaps, float *y_i, float *y_q)
+{
+	__m256 ai = _mm256_setzero_ps(), aq = _mm256_setzero_ps();
+	float tmp[8], ri, rq;
+	size_t k;
+	int j;
+
+	for (k = 0; k + 8 <= ntaps; k += 8) {
+		__m256 t = _mm256_loadu_ps(taps + k);
+		ai = _mm256_fmadd_ps(t, _mm256_loadu_ps(x_i + k), ai);
+		aq = _mm256_fmadd_ps(t, _mm256_loadu_ps(x_q + k), aq);
+	}
+
+	fir2_c(taps + k, x_i + k, x_q + k, ntaps - k, &ri, &rq);
+
+	_mm256_storeu_ps(tmp, ai);
+	for (j = 0; j < 8; j++)
+		ri += tmp[j];
+	_mm256_storeu_ps(tmp, aq);
+	for (j = 0; j < 8; j++)
+		rq += tmp[j];
+
+	*y_i = ri;
+	*y_q = rq;
+}
+
+AVX2 static float dot_avx2(const float *taps, const float *x, size_t ntaps)
+{
+	__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+	float tmp[8], r;
+	size_t k;
+	int j;
+
+	for (k = 0; k + 16 <= ntaps; k += 16) {
+		a0 = _mm256_fmadd_ps(_mm256_loadu_ps(taps + k),
+			_mm256_loadu_ps(x + k), a0);
+		a1 = _mm256_fmadd_ps(_mm256_loadu_ps(taps + k + 8),
+			_mm256_loadu_ps(x + k + 8), a1);
+	}
+
+	r = dot_c(taps + k, x + k, ntaps - k);
+	_mm256_storeu_ps(tmp, _mm256_add_ps(a0, a1));
+	for (j = 0; j < 8; j++)
+		r += tmp[j];
+
+	return r;
+}
+
+AVX2 static inline __m256 atan2_avx2(__m256 y, __m256 x)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 tiny = _mm256_set1_ps(1e-30f);
+	__m256 ax = _mm256_andnot_ps(sign, x), ay = _mm256_andnot_ps(sign, y);
+	__m256 mx = _mm256_max_ps(ax, ay), mn = _mm256_min_ps(ax, ay);
+	__m256 a = _mm256_div_ps(mn, _mm256_add_ps(mx, tiny));
+	__m256 r;
+
+	r = _mm256_mul_ps(a, _mm256_fmadd_ps(_mm256_set1_ps(ATAN_C2),
+		_mm256_sub_ps(one, a), _mm256_set1_ps(ATAN_C1)));
+
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps((float)M_PI_2), r),
+		_mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps((float)M_PI), r), x);
+
+	return _mm256_xor_ps(r, _mm256_and_ps(sign, y));
+}
+
+AVX2 static void fm_disc_avx2(const float *in_i, const float *in_q, size_t n,
+	float *prev_i, float *prev_q, float *out)
+{
+	const __m256 inv_pi = _mm256_set1_ps(INV_PI);
+	size_t k;
+
+	if (n == 0)
+		return;
+
+	fm_disc_c(in_i, in_q, 1, prev_i, prev_q, out);
+
+	for (k = 1; k + 8 <= n; k += 8) {
+		__m256 i = _mm256_loadu_ps(in_i + k), q = _mm256_loadu_ps(in_q + k);
+		__m256 pi = _mm256_loadu_ps(in_i + k - 1);
+		__m256 pq = _mm256_loadu_ps(in_q + k - 1);
+		__m256 re = _mm256_fmadd_ps(i, pi, _mm256_mul_ps(q, pq));
+		__m256 im = _mm256_fmsub_ps(q, pi, _mm256_mul_ps(i, pq));
+
+		_mm256_storeu_ps(out + k, _mm256_mul_ps(atan2_avx2(im, re), inv_pi));
+	}
+
+	*prev_i = in_i[k - 1];
+	*prev_q = in_q[k - 1];
+	fm_disc_c(in_i + k, in_q + k, n - k, prev_i, prev_q, out + k);
+}
+
+AVX2 static void f32_to_s16_avx2(const float *in, int16_t *out, size_t n,
+	float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t k;
+
+	for (k = 0; k + 16 <= n; k += 16) {
+		__m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + k), g));
+		__m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + k + 8), g));
+		/* packs works per 128 bits lane, restore the order afterwards */
+		__m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(out + k), p);
+	}
+
+	f32_to_s16_c(in + k, out + k, n - k, gain);
+}
+
+AVX2 static void power_acc_avx2(const float *re, const float *im, float *acc,
+	size_t n)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m256 r = _mm256_loadu_ps(re + k), i = _mm256_loadu_ps(im + k);
+		__m256 p = _mm256_fmadd_ps(i, i, _mm256_mul_ps(r, r));
+		_mm256_storeu_ps(acc + k, _mm256_add_ps(_mm256_loadu_ps(acc + k), p));
+	}
+
+	power_acc_c(re + k, im + k, acc + k, n - k);
+}
+
+AVX2 static float power_sum_avx2(const float *re, const float *im, size_t n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	float lane[8];
+	size_t k;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m256 r = _mm256_loadu_ps(re + k), i = _mm256_loadu_ps(im + k);
+		acc = _mm256_fmadd_ps(r, r, _mm256_fmadd_ps(i, i, acc));
+	}
+
+	_mm256_storeu_ps(lane, acc);
+	return lane[0] + lane[1] + lane[2] + lane[3] + lane[4] + lane[5] +
+		lane[6] + lane[7] + power_sum_c(re + k, im + k, n - k);
+}
+
+AVX2 static uint64_t energy_s16_avx2(const int16_t *x, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lane[4];
+	size_t k;
+
+	for (k = 0; k + 16 <= n; k += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(x + k));
+		__m256i p = _mm256_madd_epi16(v, v);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(p, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(p, zero));
+	}
+
+	_mm256_storeu_si256((__m256i *)lane, acc);
+	return lane[0] + lane[1] + lane[2] + lane[3] +
+		energy_s16_c(x + k, n - k);
+}
+#endif /* DSP_X86 */
+
+struct dsp_kernels dsp_k = {
+	"scalar", &u8_to_f32_c, &fir2_c, &dot_c, &fm_disc_c, &f32_to_s16_c,
+	&power_acc_c, &power_sum_c, &energy_s16_c
+};
+
+void dsp_kernels_init(void)
+{
+#ifdef DSP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		dsp_k = (struct dsp_kernels) {"avx2", &u8_to_f32_avx2, &fir2_avx2,
+			&dot_avx2, &fm_disc_avx2, &f32_to_s16_avx2, &power_acc_avx2,
+			&power_sum_avx2, &energy_s16_avx2};
+	} else {
+		dsp_k = (struct dsp_kernels) {"sse2", &u8_to_f32_sse2, &fir2_sse2,
+			&dot_sse2, &fm_disc_sse2, &f32_to_s16_sse2, &power_acc_sse2,
+			&power_sum_sse2, &energy_s16_sse2};
+	}
+#endif
+}
+
+uint32_t dsp_capture_rate(uint32_t demod_rate)
+{
+	/* Same rule rtl_fm uses to pick its capture rate */
+	return demod_rate * (1000000 / demod_rate + 1);
+}
+
+/*
+ * Frontend
+ */
+int dsp_frontend_init(struct dsp_frontend *fe, uint32_t in_rate,
+	uint32_t out_rate)
+{
+	unsigned k;
+	float cutoff, sum = 0.0f;
+
+	if (!fe || in_rate == 0 || out_rate == 0 || out_rate > in_rate) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fe->decim = (in_rate + out_rate / 2) / out_rate;
+	fe->in_rate = in_rate;
+	fe->out_rate = in_rate / fe->decim;
+	fe->phase = 0;
+	fe->dc_i = fe->dc_q = 0.0f;
+
+	/* Windowed sinc low pass, a few lobes per decimation step */
+	fe->ntaps = 8 * fe->decim + 1;
+	fe->taps = malloc(fe->ntaps * sizeof *fe->taps);
+	fe->buf_i = calloc(fe->ntaps - 1 + DSP_BLOCK, sizeof *fe->buf_i);
+	fe->buf_q = calloc(fe->ntaps - 1 + DSP_BLOCK, sizeof *fe->buf_q);
+	if (!fe->taps || !fe->buf_i || !fe->buf_q) {
+		dsp_frontend_free(fe);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	cutoff = 0.45f / fe->decim;
+	for (k = 0; k < fe->ntaps; k++) {
+		float m = (float)k - (fe->ntaps - 1) / 2.0f;
+		float sinc = (m == 0.0f) ? 2.0f * cutoff :
+			sinf(2.0f * (float)M_PI * cutoff * m) / ((float)M_PI * m);
+		float win = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * k / (fe->ntaps - 1));
+
+		fe->taps[k] = sinc * win;
+		sum += fe->taps[k];
+	}
+	for (k = 0; k < fe->ntaps; k++)
+		fe->taps[k] /= sum;
+
+	return 0;
+}
+
+void dsp_frontend_free(struct dsp_frontend *fe)
+{
+	if (!fe)
+		return;
+
+	free(fe->taps);
+	free(fe->buf_i);
+	free(fe->buf_q);
+	fe->taps = fe->buf_i = fe->buf_q = NULL;
+}
+
+/* Filter the 'n' new samples sitting after the history and decimate them */
+static size_t frontend_decimate(struct dsp_frontend *fe, size_t n,
+	float *out_i, float *out_q)
+{
+	unsigned hist = fe->ntaps - 1;
+	size_t pos, nout = 0;
+
+	for (pos = fe->phase; pos < n; pos += fe->decim, nout++)
+		dsp_k.fir2(fe->taps, fe->buf_i + pos, fe->buf_q + pos, fe->ntaps,
+			&out_i[nout], &out_q[nout]);
+	fe->phase = pos - n;
+
+	/* Keep the tail as history for the next block */
+	memmove(fe->buf_i, fe->buf_i + n, hist * sizeof *fe->buf_i);
+	memmove(fe->buf_q, fe->buf_q + n, hist * sizeof *fe->buf_q);
+
+	return nout;
+}
+
+/*
+ * Take 'n' (at most DSP_BLOCK) complex u8 samples and write the decimated
+ * baseband into 'out_i'/'out_q'. Returns the number of output samples.
+ */
+size_t dsp_frontend_process(struct dsp_frontend *fe, const uint8_t *iq,
+	size_t n, float *out_i, float *out_q)
+{
+	unsigned hist = fe->ntaps - 1;
+	float sum_i, sum_q;
+
+	dsp_k.u8_to_f32(iq, fe->buf_i + hist, fe->buf_q + hist, n,
+		fe->dc_i, fe->dc_q, &sum_i, &sum_q);
+
+	/* Track the DC offset of the tuner from block to block */
+	if (n > 0) {
+		fe->dc_i += DC_ALPHA * (sum_i / n - fe->dc_i);
+		fe->dc_q += DC_ALPHA * (sum_q / n - fe->dc_q);
+	}
+
+	return frontend_decimate(fe, n, out_i, out_q);
+}
+
+/* Same as dsp_frontend_process(), for baseband already in floats */
+size_t dsp_frontend_process_f32(struct dsp_frontend *fe, const float *in_i,
+	const float *in_q, size_t n, float *out_i, float *out_q)
+{
+	unsigned hist = fe->ntaps - 1;
+
+	memcpy(fe->buf_i + hist, in_i, n * sizeof *in_i);
+	memcpy(fe->buf_q + hist, in_q, n * sizeof *in_q);
+
+	return frontend_decimate(fe, n, out_i, out_q);
+}
+
+/*
+ * Demodulator
+ */
+void dsp_demod_set_modulation(struct dsp_demod *dm, uint8_t modulation)
+{
+	dm->modulation = modulation;
+	dm->deemph_alpha = 0.0f;
+	dm->deemph_y = 0.0f;
+	dm->dc = 0.0f;
+	dm->acc_q = 0.0f;
+	if (dm->ssb_i) {
+		memset(dm->ssb_i, 0, (DSP_SSB_TAPS - 1) * sizeof *dm->ssb_i);
+		memset(dm->ssb_q, 0, (DSP_SSB_TAPS - 1) * sizeof *dm->ssb_q);
+	}
+
+	switch (modulation) {
+	case MOD_WBFM:
+		dm->gain = dm->in_rate / (2.0f * DSP_WBFM_DEV);
+		dm->deemph_alpha = 1.0f - expf(-1.0f / (dm->in_rate * DSP_WBFM_TAU));
+		break;
+	case MOD_FM:
+		dm->gain = dm->in_rate / (2.0f * DSP_FM_DEV);
+		break;
+	default:
+		dm->gain = 1.0f;
+		break;
+	}
+}
+
+/*
+ * Windowed ideal Hilbert transformer, 2 / (pi m) on odd taps. Stored in
+ * reverse for a plain dot, which only flips its sign.
+ */
+static void ssb_design(float *taps)
+{
+	int mid = (DSP_SSB_TAPS - 1) / 2, k, m;
+
+	for (k = 0; k < DSP_SSB_TAPS; k++) {
+		float win = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * k /
+			(DSP_SSB_TAPS - 1));
+
+		m = k - mid;
+		taps[k] = (m & 1) ? -2.0f / ((float)M_PI * m) * win : 0.0f;
+	}
+}
+
+int dsp_demod_init(struct dsp_demod *dm, uint8_t modulation, uint32_t in_rate,
+	uint32_t out_rate)
+{
+	if (!dm || in_rate == 0 || out_rate == 0 || out_rate > in_rate) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dm->in_rate = in_rate;
+	dm->out_rate = out_rate;
+	dm->prev_i = dm->prev_q = 0.0f;
+	dm->frac = 0;
+	dm->acc = 0.0f;
+	dm->acc_n = 0;
+
+	dm->audio = malloc(DSP_BLOCK * sizeof *dm->audio);
+	dm->ssb_taps = malloc(DSP_SSB_TAPS * sizeof *dm->ssb_taps);
+	dm->ssb_i = calloc(DSP_SSB_TAPS - 1 + DSP_BLOCK, sizeof *dm->ssb_i);
+	dm->ssb_q = calloc(DSP_SSB_TAPS - 1 + DSP_BLOCK, sizeof *dm->ssb_q);
+	if (!dm->audio || !dm->ssb_taps || !dm->ssb_i || !dm->ssb_q) {
+		dsp_demod_free(dm);
+		errno = ENOMEM;
+		return -1;
+	}
+	ssb_design(dm->ssb_taps);
+
+	dsp_demod_set_modulation(dm, modulation);
+	return 0;
+}
+
+void dsp_demod_free(struct dsp_demod *dm)
+{
+	if (!dm)
+		return;
+
+	free(dm->audio);
+	free(dm->ssb_taps);
+	free(dm->ssb_i);
+	free(dm->ssb_q);
+	dm->audio = dm->ssb_taps = dm->ssb_i = dm->ssb_q = NULL;
+}
+
+/*
+ * Phasing SSB demodulator. Both components are brought down to the output
+ * rate with the same integrate-and-dump as the other modes, then the audio
+ * is I, delayed to line up, minus (USB) or plus (LSB) the Hilbert transform
+ * of Q; the other sideband cancels out.
+ */
+static size_t demod_ssb(struct dsp_demod *dm, const float *in_i,
+	const float *in_q, size_t n, float *out)
+{
+	const unsigned hist = DSP_SSB_TAPS - 1, mid = hist / 2;
+	float sign = (dm->modulation == MOD_USB) ? -0.5f : 0.5f;
+	float *bi = dm->ssb_i, *bq = dm->ssb_q;
+	size_t k, m = 0;
+
+	for (k = 0; k < n; k++) {
+		dm->acc += in_i[k];
+		dm->acc_q += in_q[k];
+		dm->acc_n++;
+		dm->frac += dm->out_rate;
+		if (dm->frac >= dm->in_rate) {
+			dm->frac -= dm->in_rate;
+			bi[hist + m] = dm->acc / dm->acc_n;
+			bq[hist + m] = dm->acc_q / dm->acc_n;
+			m++;
+			dm->acc = dm->acc_q = 0.0f;
+			dm->acc_n = 0;
+		}
+	}
+
+	for (k = 0; k < m; k++)
+		out[k] = 0.5f * bi[k + mid] +
+			sign * dsp_k.dot(dm->ssb_taps, bq + k, DSP_SSB_TAPS);
+
+	memmove(bi, bi + m, hist * sizeof *bi);
+	memmove(bq, bq + m, hist * sizeof *bq);
+	return m;
+}
+
+/*
+ * Demodulate 'n' (at most DSP_BLOCK) baseband samples into 'out', as floats
+ * in [-1, 1] at the output rate. Returns the number of audio samples.
+ */
+size_t dsp_demod_process(struct dsp_demod *dm, const float *in_i,
+	const float *in_q, size_t n, float *out)
+{
+	float *a = dm->audio;
+	size_t k, nout = 0;
+
+	switch (dm->modulation) {
+	case MOD_FM:
+	case MOD_WBFM:
+		dsp_k.fm_disc(in_i, in_q, n, &dm->prev_i, &dm->prev_q, a);
+		break;
+	case MOD_AM:
+		for (k = 0; k < n; k++) {
+			float mag = sqrtf(in_i[k] * in_i[k] + in_q[k] * in_q[k]);
+			dm->dc += 0.001f * (mag - dm->dc);
+			a[k] = mag - dm->dc;
+		}
+		break;
+	case MOD_USB:
+	case MOD_LSB:
+		return demod_ssb(dm, in_i, in_q, n, out);
+	default:
+		/* Raw: the in-phase component only, output is mono */
+		memcpy(a, in_i, n * sizeof *a);
+		break;
+	}
+
+	/* De-emphasis and fractional integrate-and-dump down to out_rate */
+	for (k = 0; k < n; k++) {
+		float v = a[k] * dm->gain;
+
+		if (dm->deemph_alpha > 0.0f) {
+			dm->deemph_y += dm->deemph_alpha * (v - dm->deemph_y);
+			v = dm->deemph_y;
+		}
+
+		dm->acc += v;
+		dm->acc_n++;
+		dm->frac += dm->out_rate;
+		if (dm->frac >= dm->in_rate) {
+			dm->frac -= dm->in_rate;
+			out[nout++] = dm->acc / dm->acc_n;
+			dm->acc = 0.0f;
+			dm->acc_n = 0;
+		}
+	}
+
+	return nout;
+}
+
+/*
+ * Full chain
+ */
+int dsp_chain_init(struct dsp_chain *ch, uint8_t modulation, uint32_t in_rate,
+	uint32_t out_rate)
+{
+	memset(ch, 0, sizeof *ch);
+
+	if (dsp_frontend_init(&ch->fe, in_rate, DSP_DEMOD_RATE) < 0)
+		return -1;
+	if (dsp_demod_init(&ch->dm, modulation, ch->fe.out_rate, out_rate) < 0)
+		goto _err_demod;
+
+	ch->bb_i = malloc(DSP_BLOCK * sizeof *ch->bb_i);
+	ch->bb_q = malloc(DSP_BLOCK * sizeof *ch->bb_q);
+	ch->pcm_f = malloc(DSP_BLOCK * sizeof *ch->pcm_f);
+	if (!ch->bb_i || !ch->bb_q || !ch->pcm_f)
+		goto _err_alloc;
+
+	return 0;
+
+_err_alloc:
+	free(ch->bb_i);
+	free(ch->bb_q);
+	free(ch->pcm_f);
+	dsp_demod_free(&ch->dm);
+_err_demod:
+	dsp_frontend_free(&ch->fe);
+	errno = ENOMEM;
+	return -1;
+}
+
+void dsp_chain_free(struct dsp_chain *ch)
+{
+	if (!ch)
+		return;
+
+	dsp_frontend_free(&ch->fe);
+	dsp_demod_free(&ch->dm);
+	free(ch->bb_i);
+	free(ch->bb_q);
+	free(ch->pcm_f);
+	ch->bb_i = ch->bb_q = ch->pcm_f = NULL;
+}
+
+/*
+ * Run 'n' (at most DSP_BLOCK) u8 IQ samples through the whole chain. The
+ * 'pcm' buffer must hold DSP_BLOCK samples. Returns the number of samples,
+ * none while the squelch is closed.
+ */
+size_t dsp_chain_process(struct dsp_chain *ch, const uint8_t *iq, size_t n,
+	int16_t *pcm)
+{
+	size_t nbb, nout;
+
+	nbb = dsp_frontend_process(&ch->fe, iq, n, ch->bb_i, ch->bb_q);
+	if (ch->sq && !squelch_feed_iq(ch->sq, ch->bb_i, ch->bb_q, nbb,
+			ch->fe.out_rate))
+		return 0;
+	nout = dsp_demod_process(&ch->dm, ch->bb_i, ch->bb_q, nbb, ch->pcm_f);
+	dsp_k.f32_to_s16(ch->pcm_f, pcm, nout, DSP_PCM_SCALE);
+
+	return nout;
+}
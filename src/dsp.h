@@ -0,0 +1,134 @@
+#ifndef __DSP_H__
+#define __DSP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest number of complex samples processed at once */
+#define DSP_BLOCK       16384
+
+/* Default rates, matching what rtl_fm was launched with */
+#define DSP_DEMOD_RATE  172000
+#define DSP_OUT_RATE    22050
+
+/* FM deviation used to normalize the discriminator output */
+#define DSP_FM_DEV      5000.0f
+#define DSP_WBFM_DEV    75000.0f
+#define DSP_WBFM_TAU    75e-6f
+
+/* Nominal deviation maps to half scale, leaving headroom for overshoot */
+#define DSP_PCM_SCALE   16384.0f
+
+/* Hilbert transformer of the SSB phasing demodulator, at the output rate */
+#define DSP_SSB_TAPS    127
+
+/*
+ * Hot loops, one implementation per instruction set. The best one for the
+ * running CPU is picked by dsp_kernels_init().
+ */
+struct dsp_kernels {
+	const char *name;
+	/* Deinterleave u8 IQ, center it and remove 'dc'. Returns raw sums */
+	void  (*u8_to_f32)(const uint8_t *iq, float *out_i, float *out_q,
+		size_t n, float dc_i, float dc_q, float *sum_i, float *sum_q);
+	/* Two dot products sharing the same taps */
+	void  (*fir2)(const float *taps, const float *x_i, const float *x_q,
+		size_t ntaps, float *y_i, float *y_q);
+	/* One dot product, for real signals */
+	float (*dot)(const float *taps, const float *x, size_t ntaps);
+	/* Polar discriminator: arg(x[n] * conj(x[n-1])) / pi */
+	void  (*fm_disc)(const float *in_i, const float *in_q, size_t n,
+		float *prev_i, float *prev_q, float *out);
+	/* Scale and convert to signed 16 bits with saturation */
+	void  (*f32_to_s16)(const float *in, int16_t *out, size_t n, float gain);
+	/* Add the power of complex samples (re^2 + im^2) into 'acc' */
+	void  (*power_acc)(const float *re, const float *im, float *acc,
+		size_t n);
+	/* Total power of complex samples */
+	float (*power_sum)(const float *re, const float *im, size_t n);
+	/* Sum of the squares of s16 samples */
+	uint64_t (*energy_s16)(const int16_t *x, size_t n);
+};
+
+extern struct dsp_kernels dsp_k;
+
+void dsp_kernels_init(void);
+
+/* IQ at the capture rate down to complex baseband at the demod rate */
+struct dsp_frontend {
+	uint32_t in_rate;
+	uint32_t out_rate;
+	unsigned decim;
+	unsigned phase;     /* Offset of the next output into the block */
+
+	float   *taps;
+	unsigned ntaps;
+	float   *buf_i;     /* History (ntaps - 1) followed by the block */
+	float   *buf_q;
+
+	float    dc_i;
+	float    dc_q;
+};
+
+/* Complex baseband down to mono audio at the output rate */
+struct dsp_demod {
+	uint8_t  modulation;
+	uint32_t in_rate;
+	uint32_t out_rate;
+	float    gain;
+
+	float    prev_i;    /* Last sample of the previous block */
+	float    prev_q;
+	float    dc;        /* DC blocker for AM */
+
+	float    deemph_alpha;
+	float    deemph_y;
+
+	uint64_t frac;      /* Fractional decimator state */
+	float    acc;
+	float    acc_q;     /* SSB decimates both components */
+	unsigned acc_n;
+
+	float   *audio;     /* Scratch, one float per input sample */
+	float   *ssb_taps;
+	float   *ssb_i;     /* History (DSP_SSB_TAPS - 1) followed by the block */
+	float   *ssb_q;
+};
+
+struct squelch;
+
+/* Full single channel chain: frontend + demodulator */
+struct dsp_chain {
+	struct dsp_frontend fe;
+	struct dsp_demod    dm;
+	struct squelch     *sq;     /* Gates the demodulator, optional */
+	float              *bb_i;
+	float              *bb_q;
+	float              *pcm_f;
+};
+
+int dsp_frontend_init(struct dsp_frontend *fe, uint32_t in_rate,
+	uint32_t out_rate);
+void dsp_frontend_free(struct dsp_frontend *fe);
+size_t dsp_frontend_process(struct dsp_frontend *fe, const uint8_t *iq,
+	size_t n, float *out_i, float *out_q);
+size_t dsp_frontend_process_f32(struct dsp_frontend *fe, const float *in_i,
+	const float *in_q, size_t n, float *out_i, float *out_q);
+
+int dsp_demod_init(struct dsp_demod *dm, uint8_t modulation, uint32_t in_rate,
+	uint32_t out_rate);
+void dsp_demod_free(struct dsp_demod *dm);
+void dsp_demod_set_modulation(struct dsp_demod *dm, uint8_t modulation);
+size_t dsp_demod_process(struct dsp_demod *dm, const float *in_i,
+	const float *in_q, size_t n, float *out);
+
+int dsp_chain_init(struct dsp_chain *ch, uint8_t modulation, uint32_t in_rate,
+	uint32_t out_rate);
+void dsp_chain_free(struct dsp_chain *ch);
+size_t dsp_chain_process(struct dsp_chain *ch, const uint8_t *iq, size_t n,
+	int16_t *pcm);
+
+/* Capture rate actually used for a given demod rate */
+uint32_t dsp_capture_rate(uint32_t demod_rate);
+
+#endif /* __DSP_H__ */
@@ -0,0 +1,290 @@
+/*
+ * event_loop.c: Minimal epoll based reactor.
+ *
+ * The loop sleeps in epoll_wait() without any timeout, so an idle station
+ * does not wake up at all. Anything that needs attention (sockets, signals,
+ * state changes) must be reachable through a file descriptor, or be a timer
+ * of the loop: while one is pending, epoll_wait() returns when it is due.
+ */
+
+#include "common.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+int ev_loop_init(struct ev_loop *loop)
+{
+	if (!loop) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		print_error("cannot create epoll instance\n");
+		return -1;
+	}
+	loop->running = false;
+	memset(&loop->stats, 0, sizeof loop->stats);
+	memset(&loop->wheel, 0, sizeof loop->wheel);
+	loop->wheel.base_ns = metrics_now_ns();
+	loop->batch_done = NULL;
+	loop->batch_context = NULL;
+
+	return 0;
+}
+
+void ev_loop_close(struct ev_loop *loop)
+{
+	if (!loop || loop->epfd < 0)
+		return;
+
+	close(loop->epfd);
+	loop->epfd = -1;
+}
+
+int ev_add(struct ev_loop *loop, struct ev_handler *h, uint32_t events)
+{
+	struct epoll_event ev = {.events = events, .data.ptr = h};
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, h->fd, &ev);
+}
+
+int ev_mod(struct ev_loop *loop, struct ev_handler *h, uint32_t events)
+{
+	struct epoll_event ev = {.events = events, .data.ptr = h};
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, h->fd, &ev);
+}
+
+int ev_del(struct ev_loop *loop, struct ev_handler *h)
+{
+	return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+}
+
+#define EV_WHEEL_MASK   (EV_WHEEL_SLOTS - 1)
+#define EV_LEVEL_SHIFT(level)   (EV_WHEEL_BITS * (level))
+
+static uint64_t ev_tick_now(struct ev_loop *loop)
+{
+	return (metrics_now_ns() - loop->wheel.base_ns) / 1000000;
+}
+
+/* Slot for 't', by how far ahead of the wheel it is due */
+static void ev_wheel_insert(struct ev_wheel *w, struct ev_timer *t)
+{
+	uint64_t delta;
+	unsigned level;
+
+	if (t->expires < w->tick)
+		t->expires = w->tick;
+	delta = t->expires - w->tick;
+	for (level = 0; level < EV_WHEEL_LEVELS - 1; level++)
+		if (delta >> EV_LEVEL_SHIFT(level + 1) == 0)
+			break;
+
+	LIST_INSERT_HEAD(&w->slot[level][(t->expires >> EV_LEVEL_SHIFT(level)) &
+		EV_WHEEL_MASK], t, entries);
+}
+
+/* Take every timer out of a slot, in O(1) */
+static void ev_wheel_take(struct ev_timer_list *slot, struct ev_timer_list *out)
+{
+	out->lh_first = slot->lh_first;
+	if (out->lh_first)
+		out->lh_first->entries.le_prev = &out->lh_first;
+	LIST_INIT(slot);
+}
+
+/*
+ * Arm 't' to fire 'msecs' from now, or re-arm it if it was pending. It never
+ * fires early, and at most a tick late on top of what the loop was busy with.
+ */
+void ev_timer_add(struct ev_loop *loop, struct ev_timer *t, uint64_t msecs)
+{
+	struct ev_wheel *w = &loop->wheel;
+	uint64_t now, tick;
+
+	ev_timer_del(loop, t);
+
+	/* Nothing ran the wheel while it was empty */
+	now = metrics_now_ns() - w->base_ns;
+	tick = now / 1000000;
+	if (w->pending == 0 && tick > w->tick)
+		w->tick = tick;
+
+	if (msecs > EV_TIMER_MAX_MS)
+		msecs = EV_TIMER_MAX_MS;
+	t->expires = (now + msecs * 1000000 + 999999) / 1000000;
+
+	/* The wheel can be a tick ahead of the clock, once it has run */
+	if (t->expires < w->tick)
+		t->expires = w->tick;
+	if (t->expires - w->tick > EV_TIMER_MAX_MS)
+		t->expires = w->tick + EV_TIMER_MAX_MS;
+
+	t->pending = true;
+	w->pending++;
+	ev_wheel_insert(w, t);
+}
+
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *t)
+{
+	if (!t->pending)
+		return;
+
+	LIST_REMOVE(t, entries);
+	t->pending = false;
+	loop->wheel.pending--;
+}
+
+/*
+ * Earliest tick a timer is due at. The first non-empty slot of every level,
+ * from where the wheel is, holds the earliest timers of that level; the
+ * current slot of a level above 0 comes first only until its span starts,
+ * since it is cascaded then and refilled with timers a whole turn away.
+ */
+static uint64_t ev_wheel_next(struct ev_wheel *w)
+{
+	uint64_t best = UINT64_MAX;
+	struct ev_timer_list *slot;
+	struct ev_timer *t;
+	unsigned level, cur, k, first;
+
+	for (level = 0; level < EV_WHEEL_LEVELS; level++) {
+		cur = (w->tick >> EV_LEVEL_SHIFT(level)) & EV_WHEEL_MASK;
+		first = (level == 0 ||
+			(w->tick & ((UINT64_C(1) << EV_LEVEL_SHIFT(level)) - 1)) == 0) ?
+			0 : 1;
+		for (k = first; k < first + EV_WHEEL_SLOTS; k++) {
+			slot = &w->slot[level][(cur + k) & EV_WHEEL_MASK];
+			if (LIST_EMPTY(slot))
+				continue;
+			LIST_FOREACH(t, slot, entries)
+				if (t->expires < best)
+					best = t->expires;
+			break;
+		}
+	}
+
+	return best;
+}
+
+/* Milliseconds epoll_wait() may sleep before the next timer is due */
+static int ev_timer_timeout(struct ev_loop *loop)
+{
+	uint64_t due, now;
+
+	if (loop->wheel.pending == 0)
+		return -1;
+
+	due = ev_wheel_next(&loop->wheel) * 1000000;
+	now = metrics_now_ns() - loop->wheel.base_ns;
+	if (due <= now)
+		return 0;
+
+	due = (due - now + 999999) / 1000000;
+	return (due > INT_MAX) ? INT_MAX : (int)due;
+}
+
+/*
+ * Run the wheel up to now, tick by tick. Whenever a level wraps around, the
+ * next slot of the level above is cascaded: its timers are put back where
+ * they belong from this tick on, which is a level lower at least.
+ */
+static void ev_timers_run(struct ev_loop *loop)
+{
+	struct ev_wheel *w = &loop->wheel;
+	struct ev_timer_list due;
+	struct ev_timer *t;
+	uint64_t now = ev_tick_now(loop);
+	unsigned level, idx;
+
+	while (w->pending > 0 && w->tick <= now) {
+		for (level = 1; level < EV_WHEEL_LEVELS; level++) {
+			if (w->tick & ((UINT64_C(1) << EV_LEVEL_SHIFT(level)) - 1))
+				break;
+			idx = (w->tick >> EV_LEVEL_SHIFT(level)) & EV_WHEEL_MASK;
+			ev_wheel_take(&w->slot[level][idx], &due);
+			while ((t = LIST_FIRST(&due))) {
+				LIST_REMOVE(t, entries);
+				ev_wheel_insert(w, t);
+			}
+		}
+
+		ev_wheel_take(&w->slot[0][w->tick & EV_WHEEL_MASK], &due);
+		w->tick++;
+
+		/* Callbacks may add and cancel timers, these included */
+		while ((t = LIST_FIRST(&due))) {
+			LIST_REMOVE(t, entries);
+			t->pending = false;
+			w->pending--;
+			loop->stats.timers++;
+			t->func(loop, t);
+		}
+	}
+
+	if (w->pending == 0 && w->tick <= now)
+		w->tick = now + 1;
+}
+
+/* Dispatch events until ev_stop() is called from one of the callbacks */
+int ev_run(struct ev_loop *loop)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	uint64_t t0, t1, t2, ts;
+	int i, n, timeout;
+
+	loop->running = true;
+	t0 = metrics_now_ns();
+	while (loop->running) {
+		timeout = ev_timer_timeout(loop);
+		n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			print_error("epoll_wait() has failed\n");
+			return -1;
+		}
+		t1 = metrics_now_ns();
+
+		for (i = 0; i < n; i++) {
+			struct ev_handler *h = events[i].data.ptr;
+			int fd = h->fd;
+
+			/* The handler may be gone by the time it returns */
+			ts = trace_begin();
+			h->func(loop, h, events[i].events);
+			trace_end("handler", "loop", ts, fd);
+		}
+		ev_timers_run(loop);
+		t2 = metrics_now_ns();
+
+		if (loop->batch_done)
+			loop->batch_done(loop, loop->batch_context);
+		if (trace_on())
+			trace_record("batch done", "loop", t2, metrics_now_ns(), n);
+
+		/* Only the loop thread writes these */
+		loop->stats.wait_ns += t1 - t0;
+		loop->stats.dispatch_ns += t2 - t1;
+		t0 = metrics_now_ns();
+		loop->stats.batch_ns += t0 - t2;
+		loop->stats.wakeups++;
+		loop->stats.events += n;
+	}
+
+	return 0;
+}
+
+void ev_stop(struct ev_loop *loop)
+{
+	loop->running = false;
+}
@@ -0,0 +1,103 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+#include <sys/queue.h>
+
+#define EV_MAX_EVENTS   64
+
+/* Timer wheel: 1 ms ticks, 64 slots per level, about 4.6 hours in all */
+#define EV_WHEEL_BITS   6
+#define EV_WHEEL_SLOTS  (1 << EV_WHEEL_BITS)
+#define EV_WHEEL_LEVELS 4
+#define EV_TIMER_MAX_MS ((UINT64_C(1) << (EV_WHEEL_BITS * EV_WHEEL_LEVELS)) - 1)
+
+struct ev_loop;
+struct ev_handler;
+struct ev_timer;
+
+/* Called from ev_run() with the epoll events that fired on 'h->fd' */
+typedef void (*ev_callback_t)(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events);
+
+/* Called from ev_run() once the timer is due, it is no longer pending then */
+typedef void (*ev_timer_cb_t)(struct ev_loop *loop, struct ev_timer *t);
+
+/*
+ * Every file descriptor owned by the loop is described by an ev_handler,
+ * usually embedded into a bigger structure. The handler must stay alive
+ * while it is registered.
+ */
+struct ev_handler {
+	int fd;
+	ev_callback_t func;
+	void *context;
+};
+
+/*
+ * One-shot timer run by the loop itself, with no file descriptor behind it.
+ * Like a handler, it is usually embedded into a bigger structure and must
+ * stay alive while it is pending.
+ */
+struct ev_timer {
+	ev_timer_cb_t func;
+	void *context;
+	uint64_t expires;       /* Tick it is due at */
+	bool pending;
+	LIST_ENTRY(ev_timer) entries;
+};
+
+LIST_HEAD(ev_timer_list, ev_timer);
+
+/*
+ * Hierarchical timer wheel. Level 0 holds the timers due within the next
+ * EV_WHEEL_SLOTS ticks, one slot per tick; every level above holds
+ * EV_WHEEL_SLOTS times longer spans per slot, and its timers are moved
+ * down a level whenever the one below wraps around. Adding or cancelling
+ * a timer takes constant time, however many are pending.
+ */
+struct ev_wheel {
+	uint64_t base_ns;       /* Time of tick 0 */
+	uint64_t tick;          /* Next tick to run */
+	unsigned pending;
+	struct ev_timer_list slot[EV_WHEEL_LEVELS][EV_WHEEL_SLOTS];
+};
+
+/* Where the loop spends its time, in nanoseconds */
+struct ev_stats {
+	uint64_t wait_ns;       /* Sleeping in epoll_wait() */
+	uint64_t dispatch_ns;   /* Running handlers and timers */
+	uint64_t batch_ns;      /* Running batch_done */
+	uint64_t wakeups;
+	uint64_t events;
+	uint64_t timers;        /* Timers that fired */
+};
+
+struct ev_loop {
+	int  epfd;
+	bool running;
+	struct ev_stats stats;
+	struct ev_wheel wheel;
+
+	/* Optional, runs after every batch of events has been dispatched */
+	void (*batch_done)(struct ev_loop *loop, void *context);
+	void *batch_context;
+};
+
+int ev_loop_init(struct ev_loop *loop);
+void ev_loop_close(struct ev_loop *loop);
+
+int ev_add(struct ev_loop *loop, struct ev_handler *h, uint32_t events);
+int ev_mod(struct ev_loop *loop, struct ev_handler *h, uint32_t events);
+int ev_del(struct ev_loop *loop, struct ev_handler *h);
+
+void ev_timer_add(struct ev_loop *loop, struct ev_timer *t, uint64_t msecs);
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *t);
+
+int ev_run(struct ev_loop *loop);
+void ev_stop(struct ev_loop *loop);
+
+#endif /* __EVENT_LOOP_H__ */
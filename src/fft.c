@@ -0,0 +1,93 @@
+/*
+ * fft.c: Small radix-2 FFT for the channelizer.
+ */
+
+#include "fft.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+int fft_plan_init(struct fft_plan *plan, unsigned n)
+{
+	unsigned k, b, r;
+
+	if (!plan || n < 2 || (n & (n - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	plan->n = n;
+	for (plan->log2n = 0; (1u << plan->log2n) < n; plan->log2n++)
+		;
+
+	plan->tw_re = malloc(n / 2 * sizeof *plan->tw_re);
+	plan->tw_im = malloc(n / 2 * sizeof *plan->tw_im);
+	plan->rev = malloc(n * sizeof *plan->rev);
+	if (!plan->tw_re || !plan->tw_im || !plan->rev) {
+		fft_plan_free(plan);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (k = 0; k < n / 2; k++) {
+		double a = -2.0 * M_PI * k / n;
+		plan->tw_re[k] = cos(a);
+		plan->tw_im[k] = sin(a);
+	}
+
+	for (k = 0; k < n; k++) {
+		for (b = 0, r = 0; b < plan->log2n; b++)
+			r |= ((k >> b) & 1) << (plan->log2n - 1 - b);
+		plan->rev[k] = r;
+	}
+
+	return 0;
+}
+
+void fft_plan_free(struct fft_plan *plan)
+{
+	if (!plan)
+		return;
+
+	free(plan->tw_re);
+	free(plan->tw_im);
+	free(plan->rev);
+	plan->tw_re = plan->tw_im = NULL;
+	plan->rev = NULL;
+}
+
+void fft_forward(const struct fft_plan *plan, float *re, float *im)
+{
+	unsigned n = plan->n;
+	unsigned k, j, len, half, step;
+	float t;
+
+	for (k = 0; k < n; k++) {
+		j = plan->rev[k];
+		if (j > k) {
+			t = re[k]; re[k] = re[j]; re[j] = t;
+			t = im[k]; im[k] = im[j]; im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= n; len <<= 1) {
+		half = len >> 1;
+		step = n / len;
+		for (k = 0; k < n; k += len) {
+			for (j = 0; j < half; j++) {
+				float wr = plan->tw_re[j * step];
+				float wi = plan->tw_im[j * step];
+				float *ar = re + k + j, *ai = im + k + j;
+				float *br = ar + half, *bi = ai + half;
+				float xr = *br * wr - *bi * wi;
+				float xi = *br * wi + *bi * wr;
+
+				*br = *ar - xr;
+				*bi = *ai - xi;
+				*ar += xr;
+				*ai += xi;
+			}
+		}
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef __FFT_H__
+#define __FFT_H__
+
+#include <stddef.h>
+
+/*
+ * In-place radix-2 complex FFT on split real/imaginary arrays. Twiddles and
+ * the bit reversal permutation are computed once per size.
+ */
+struct fft_plan {
+	unsigned  n;
+	unsigned  log2n;
+	float    *tw_re;    /* exp(-2 pi i k / n), k < n / 2 */
+	float    *tw_im;
+	unsigned *rev;
+};
+
+int fft_plan_init(struct fft_plan *plan, unsigned n);
+void fft_plan_free(struct fft_plan *plan);
+
+void fft_forward(const struct fft_plan *plan, float *re, float *im);
+
+#endif /* __FFT_H__ */
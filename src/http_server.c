@@ -0,0 +1,361 @@
+/*
+ * http_server.c: Minimal HTTP/1.1 server living in the station event loop.
+ *
+ * Only GET is supported. Each request is routed by path to a handler, which
+ * either answers right away (http_conn_respond) or keeps the connection open
+ * to stream audio through it.
+ */
+
+#include "common.h"
+#include "http_server.h"
+#include "net_utils.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static const char *status_text(int status)
+{
+	switch (status) {
+	case 200:
+		return "OK";
+	case 400:
+		return "Bad Request";
+	case 404:
+		return "Not Found";
+	case 405:
+		return "Method Not Allowed";
+	case 503:
+		return "Service Unavailable";
+	}
+	return "Error";
+}
+
+int http_conn_wait_writable(struct http_conn *conn, bool on)
+{
+	if (conn->blocked == on)
+		return 0;
+
+	conn->blocked = on;
+	return ev_mod(conn->srv->loop, &conn->h,
+		EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0));
+}
+
+/* Stop serving a connection, it is released by http_server_reap() */
+void http_conn_close(struct http_conn *conn)
+{
+	struct http_server *srv = conn->srv;
+
+	if (conn->closing)
+		return;
+
+	conn->closing = true;
+	ev_del(srv->loop, &conn->h);
+	close(conn->h.fd);
+
+	if (conn->stream) {
+		TAILQ_REMOVE(&conn->stream->listeners, conn, entries);
+		conn->stream->nlisteners--;
+	} else {
+		TAILQ_REMOVE(&srv->pending, conn, entries);
+	}
+
+	TAILQ_INSERT_TAIL(&srv->closed, conn, entries);
+	srv->nconns--;
+}
+
+/* Replace the bytes to send before anything else, a copy is made */
+int http_conn_set_prefix(struct http_conn *conn, const char *data, size_t len)
+{
+	char *prefix = malloc(len);
+
+	if (!prefix) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(prefix, data, len);
+	free(conn->prefix);
+	conn->prefix = prefix;
+	conn->prefix_len = len;
+	conn->prefix_sent = 0;
+
+	return 0;
+}
+
+/* Send the pending prefix of a one-shot response, then hang up */
+static void http_conn_flush_response(struct http_conn *conn)
+{
+	ssize_t nbw;
+
+	while (conn->prefix_sent < conn->prefix_len) {
+		nbw = send(conn->h.fd, conn->prefix + conn->prefix_sent,
+			conn->prefix_len - conn->prefix_sent,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (nbw < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				http_conn_wait_writable(conn, true);
+			else
+				http_conn_close(conn);
+			return;
+		}
+		conn->prefix_sent += nbw;
+	}
+
+	http_conn_close(conn);
+}
+
+int http_conn_respond(struct http_conn *conn, int status,
+	const char *content_type, const char *body, size_t len)
+{
+	char hdr[256];
+	char *buf;
+	int n;
+
+	n = snprintf(hdr, sizeof hdr,
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, status_text(status), content_type, len);
+
+	buf = malloc(n + len);
+	if (!buf) {
+		http_conn_close(conn);
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(buf, hdr, n);
+	if (len > 0)
+		memcpy(buf + n, body, len);
+
+	free(conn->prefix);
+	conn->prefix = buf;
+	conn->prefix_len = n + len;
+	conn->prefix_sent = 0;
+	conn->state = HTTP_S_RESPONSE;
+
+	http_conn_flush_response(conn);
+	return 0;
+}
+
+/* Parse the request line and hand the connection to its route */
+static void http_dispatch(struct http_conn *conn)
+{
+	struct http_server *srv = conn->srv;
+	char *method, *path, *saveptr;
+	unsigned k;
+
+	method = strtok_r(conn->req, " ", &saveptr);
+	path = strtok_r(NULL, " \r\n", &saveptr);
+	if (!method || !path) {
+		http_conn_respond(conn, 400, "text/plain", "Bad request\n", 12);
+		return;
+	}
+
+	conn->query = strchr(path, '?');
+	if (conn->query)
+		*conn->query++ = '\0';
+
+	if (strcmp(method, "GET") != 0) {
+		http_conn_respond(conn, 405, "text/plain", "Method not allowed\n", 19);
+		return;
+	}
+
+	for (k = 0; k < srv->nroutes; k++) {
+		if (strcmp(srv->routes[k].path, path) == 0) {
+			srv->routes[k].func(conn, srv->routes[k].context);
+			return;
+		}
+	}
+
+	http_conn_respond(conn, 404, "text/plain", "Not found\n", 10);
+}
+
+static void http_read_request(struct http_conn *conn)
+{
+	ssize_t nbr;
+
+	nbr = recv(conn->h.fd, conn->req + conn->req_len,
+		HTTP_REQ_BUFSZ - 1 - conn->req_len, MSG_DONTWAIT);
+	if (nbr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (nbr <= 0) {
+		http_conn_close(conn);
+		return;
+	}
+
+	conn->req_len += nbr;
+	conn->req[conn->req_len] = '\0';
+
+	if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n")) {
+		http_dispatch(conn);
+		return;
+	}
+
+	if (conn->req_len == HTTP_REQ_BUFSZ - 1)
+		http_conn_respond(conn, 400, "text/plain", "Request too long\n", 17);
+}
+
+static void http_conn_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct http_conn *conn = h->context;
+	char discard[256];
+
+	if (conn->closing)
+		return;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		http_conn_close(conn);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		if (conn->state == HTTP_S_STREAMING) {
+			conn->blocked = false;
+			stream_flush(conn);
+		} else if (conn->state == HTTP_S_RESPONSE) {
+			http_conn_flush_response(conn);
+		}
+	}
+
+	if (conn->closing || !(events & (EPOLLIN | EPOLLRDHUP)))
+		return;
+
+	if (conn->state == HTTP_S_REQUEST) {
+		http_read_request(conn);
+		return;
+	}
+
+	/* Nothing is expected from listeners, just notice when they leave */
+	if (recv(conn->h.fd, discard, sizeof discard, MSG_DONTWAIT) == 0)
+		http_conn_close(conn);
+}
+
+static void http_accept_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct http_server *srv = h->context;
+	struct http_conn *conn;
+	int sock;
+
+	for (;;) {
+		sock = accept(h->fd, NULL, NULL);
+		if (sock < 0)
+			return;
+
+		if (srv->nconns >= HTTP_MAX_CLIENTS) {
+			close(sock);
+			continue;
+		}
+
+		conn = calloc(1, sizeof *conn);
+		if (!conn) {
+			close(sock);
+			continue;
+		}
+
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+		fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+		conn->h.fd = sock;
+		conn->h.func = &http_conn_cb;
+		conn->h.context = conn;
+		conn->srv = srv;
+		conn->state = HTTP_S_REQUEST;
+
+		if (ev_add(loop, &conn->h, EPOLLIN | EPOLLRDHUP) < 0) {
+			close(sock);
+			free(conn);
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&srv->pending, conn, entries);
+		srv->nconns++;
+	}
+}
+
+int http_server_init(struct http_server *srv, struct ev_loop *loop,
+	uint16_t port)
+{
+	memset(srv, 0, sizeof *srv);
+	srv->loop = loop;
+	TAILQ_INIT(&srv->pending);
+	TAILQ_INIT(&srv->closed);
+
+	srv->listen_h.fd = tcp_server_socket(port, LISTEN_BACKLOG);
+	srv->listen_h.func = &http_accept_cb;
+	srv->listen_h.context = srv;
+	if (srv->listen_h.fd < 0)
+		return -1;
+
+	fcntl(srv->listen_h.fd, F_SETFL, fcntl(srv->listen_h.fd, F_GETFL) | O_NONBLOCK);
+	fcntl(srv->listen_h.fd, F_SETFD, FD_CLOEXEC);
+
+	if (ev_add(loop, &srv->listen_h, EPOLLIN) < 0) {
+		close(srv->listen_h.fd);
+		srv->listen_h.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void http_server_close(struct http_server *srv)
+{
+	struct http_conn *conn;
+
+	if (!srv || !srv->loop)
+		return;
+
+	while ((conn = TAILQ_FIRST(&srv->pending)))
+		http_conn_close(conn);
+	http_server_reap(srv);
+
+	if (srv->listen_h.fd >= 0) {
+		ev_del(srv->loop, &srv->listen_h);
+		close(srv->listen_h.fd);
+		srv->listen_h.fd = -1;
+	}
+}
+
+/* Free connections closed since the last call, once no event refers to them */
+void http_server_reap(struct http_server *srv)
+{
+	struct http_conn *conn;
+
+	while ((conn = TAILQ_FIRST(&srv->closed))) {
+		TAILQ_REMOVE(&srv->closed, conn, entries);
+		free(conn->prefix);
+		free(conn);
+	}
+}
+
+int http_server_route(struct http_server *srv, const char *path,
+	http_handler_t func, void *context)
+{
+	if (srv->nroutes == HTTP_MAX_ROUTES) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	srv->routes[srv->nroutes++] = (struct http_route) {path, func, context};
+	return 0;
+}
+
+void http_server_unroute(struct http_server *srv, const char *path)
+{
+	unsigned k;
+
+	for (k = 0; k < srv->nroutes; k++) {
+		if (strcmp(srv->routes[k].path, path) == 0) {
+			srv->routes[k] = srv->routes[--srv->nroutes];
+			return;
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef __HTTP_SERVER_H__
+#define __HTTP_SERVER_H__
+
+#include "event_loop.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define HTTP_REQ_BUFSZ      1024
+#define HTTP_MAX_CLIENTS    16384
+
+struct http_server;
+struct stream;
+
+/* Connection states */
+#define HTTP_S_REQUEST      0x00    /* Waiting for the request headers */
+#define HTTP_S_RESPONSE     0x01    /* Sending a one-shot response */
+#define HTTP_S_STREAMING    0x02    /* Attached to a stream as a listener */
+
+struct http_conn {
+	struct ev_handler   h;
+	struct http_server *srv;
+	uint8_t             state;
+	bool                closing;
+	bool                blocked;    /* Waiting for EPOLLOUT */
+
+	char                req[HTTP_REQ_BUFSZ];
+	size_t              req_len;
+	char               *query;      /* After '?' in the path, for the handler */
+
+	/* Bytes sent before any stream data: response headers and such */
+	char               *prefix;
+	size_t              prefix_len;
+	size_t              prefix_sent;
+
+	/* Listener state, offsets are absolute positions in the stream */
+	struct stream      *stream;
+	uint64_t            pos;
+	uint64_t            chunk_end;
+	char                chunk_hdr[16];
+	uint8_t             chunk_hdr_len;
+	uint8_t             chunk_hdr_sent;
+	uint8_t             chunk_trailer_sent;
+
+	TAILQ_ENTRY(http_conn) entries;     /* Server or stream list */
+};
+
+TAILQ_HEAD(http_conn_list, http_conn);
+
+/* Handler for a request path, must answer through http_conn_respond() */
+typedef void (*http_handler_t)(struct http_conn *conn, void *context);
+
+struct http_route {
+	const char    *path;
+	http_handler_t func;
+	void          *context;
+};
+
+#define HTTP_MAX_ROUTES     32
+
+struct http_server {
+	struct ev_handler     listen_h;
+	struct ev_loop       *loop;
+	struct http_route     routes[HTTP_MAX_ROUTES];
+	unsigned              nroutes;
+	struct http_conn_list pending;  /* Not attached to any stream */
+	struct http_conn_list closed;   /* Released by http_server_reap() */
+	unsigned              nconns;
+};
+
+int http_server_init(struct http_server *srv, struct ev_loop *loop,
+	uint16_t port);
+void http_server_close(struct http_server *srv);
+void http_server_reap(struct http_server *srv);
+
+int http_server_route(struct http_server *srv, const char *path,
+	http_handler_t func, void *context);
+void http_server_unroute(struct http_server *srv, const char *path);
+
+int http_conn_respond(struct http_conn *conn, int status,
+	const char *content_type, const char *body, size_t len);
+int http_conn_set_prefix(struct http_conn *conn, const char *data, size_t len);
+void http_conn_close(struct http_conn *conn);
+int http_conn_wait_writable(struct http_conn *conn, bool on);
+
+#endif /* __HTTP_SERVER_H__ */
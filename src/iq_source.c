@@ -0,0 +1,246 @@
+/*
+ * iq_source.c: u8 IQ sample sources for the in-process demodulator.
+ *
+ * Specs are either "file:<path>" for a recorded capture, or
+ * "rtltcp:<host>:<port>" for an rtl_tcp compatible server.
+ */
+
+#include "common.h"
+#include "iq_source.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+/* rtl_tcp greets its clients with "RTL0", tuner type and gain count */
+#define RTLTCP_HEADER_LEN   12
+
+/* A file reader this late gives up catching up and starts over */
+#define PACE_MAX_LAG_NS     (500 * UINT64_C(1000000))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Hold a file reader back to the sample rate. Nothing downstream blocks
+ * anymore, so a recorded capture would otherwise be read as fast as the
+ * disk allows.
+ */
+static void iq_source_pace(struct iq_source *src, size_t nbr)
+{
+	struct pollfd pfd = {.fd = src->wake_fd, .events = POLLIN};
+	uint64_t now = now_ns(), due;
+
+	if (src->pace_ns == 0) {
+		src->pace_ns = now;
+		src->pace_bytes = 0;
+	}
+
+	/* Whole seconds move into the origin, so the product cannot overflow */
+	src->pace_bytes += nbr;
+	while (src->pace_bytes >= 2 * (uint64_t)src->rate) {
+		src->pace_bytes -= 2 * (uint64_t)src->rate;
+		src->pace_ns += UINT64_C(1000000000);
+	}
+	due = src->pace_ns + src->pace_bytes * UINT64_C(500000000) / src->rate;
+	if (now > due + PACE_MAX_LAG_NS) {
+		src->pace_ns = now;
+		src->pace_bytes = 0;
+		return;
+	}
+	if (now >= due)
+		return;
+
+	/* Rounded up, the next block makes up for it */
+	poll(&pfd, 1, (due - now + 999999) / 1000000);
+}
+
+static int rtltcp_command(int fd, uint8_t cmd, uint32_t param)
+{
+	uint8_t msg[5] = {cmd, param >> 24, param >> 16, param >> 8, param};
+
+	if (send(fd, msg, sizeof msg, MSG_NOSIGNAL) != sizeof msg)
+		return -1;
+
+	return 0;
+}
+
+static int rtltcp_open(struct iq_source *src, const char *hostport,
+	uint32_t frequency)
+{
+	char buf[HOST_LEN], *host = buf, *colon, *end;
+	uint8_t header[RTLTCP_HEADER_LEN];
+	size_t got = 0;
+	long port;
+
+	snprintf(buf, sizeof buf, "%s", hostport);
+	colon = strrchr(buf, ':');
+	if (!colon) {
+		print_error("rtl_tcp source needs host:port\n");
+		return -1;
+	}
+	*colon = '\0';
+
+	/* "[::1]:1234" for an IPv6 address */
+	if (host[0] == '[' && colon[-1] == ']') {
+		colon[-1] = '\0';
+		host++;
+	}
+
+	errno = 0;
+	port = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || errno == ERANGE || port < 1 || port > 65535) {
+		print_error("Invalid rtl_tcp port.\n");
+		return -1;
+	}
+
+	src->fd = tcp_client_socket(host, port);
+	if (src->fd < 0) {
+		print_error("cannot connect to rtl_tcp at %s\n", hostport);
+		return -1;
+	}
+
+	while (got < sizeof header) {
+		ssize_t nbr = recv(src->fd, header + got, sizeof header - got, 0);
+		if (nbr <= 0)
+			goto _err;
+		got += nbr;
+	}
+	if (memcmp(header, "RTL0", 4) != 0) {
+		print_error("%s does not speak rtl_tcp\n", hostport);
+		goto _err;
+	}
+
+	if (rtltcp_command(src->fd, RTLTCP_SET_SAMPLE_RATE, src->rate) < 0 ||
+	    rtltcp_command(src->fd, RTLTCP_SET_GAIN_MODE, 0) < 0 ||
+	    rtltcp_command(src->fd, RTLTCP_SET_FREQ, frequency) < 0)
+		goto _err;
+
+	return 0;
+
+_err:
+	close(src->fd);
+	src->fd = -1;
+	return -1;
+}
+
+int iq_source_open(struct iq_source *src, const char *spec, uint32_t rate,
+	uint32_t frequency)
+{
+	if (!src || !spec) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	snprintf(src->spec, sizeof src->spec, "%s", spec);
+	src->rate = rate;
+	src->fd = -1;
+	src->pace_ns = 0;
+	src->pace_bytes = 0;
+	src->wake_fd = -1;
+	src->paced = false;
+
+	if (strncmp(spec, "file:", 5) == 0) {
+		src->type = IQ_SRC_FILE;
+		src->fd = open(spec + 5, O_RDONLY | O_CLOEXEC);
+		if (src->fd < 0) {
+			print_error("cannot open IQ file %s\n", spec + 5);
+			return -1;
+		}
+		src->paced = true;
+		src->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (src->wake_fd < 0) {
+			close(src->fd);
+			src->fd = -1;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp(spec, "rtltcp:", 7) == 0) {
+		src->type = IQ_SRC_RTLTCP;
+		return rtltcp_open(src, spec + 7, frequency);
+	}
+
+	print_error("Unknown IQ source: %s\n", spec);
+	errno = EINVAL;
+	return -1;
+}
+
+void iq_source_close(struct iq_source *src)
+{
+	if (!src || src->fd < 0)
+		return;
+
+	close(src->fd);
+	src->fd = -1;
+	if (src->wake_fd >= 0) {
+		close(src->wake_fd);
+		src->wake_fd = -1;
+	}
+}
+
+/* Wake up a reader blocked on the source, used when stopping */
+void iq_source_interrupt(struct iq_source *src)
+{
+	uint64_t one = 1;
+
+	if (!src || src->fd < 0)
+		return;
+
+	if (src->type == IQ_SRC_RTLTCP)
+		shutdown(src->fd, SHUT_RDWR);
+	else if (write(src->wake_fd, &one, sizeof one) < 0)
+		print_warn("cannot interrupt the IQ file reader\n");
+}
+
+/*
+ * Read up to 'n' bytes of IQ. Files are rewound, only empty ones hit EOF,
+ * and paced to the sample rate unless 'paced' was cleared.
+ */
+ssize_t iq_source_read(struct iq_source *src, uint8_t *buf, size_t n)
+{
+	bool rewound = false;
+	ssize_t nbr;
+
+	for (;;) {
+		nbr = read(src->fd, buf, n);
+		if (nbr < 0 && errno == EINTR)
+			continue;
+		if (nbr == 0 && src->type == IQ_SRC_FILE && !rewound) {
+			if (lseek(src->fd, 0, SEEK_SET) < 0)
+				return -1;
+			rewound = true;
+			continue;
+		}
+		if (nbr > 0 && src->paced && src->rate > 0)
+			iq_source_pace(src, nbr);
+		return nbr;
+	}
+}
+
+bool iq_source_tunable(const struct iq_source *src)
+{
+	return src && src->type == IQ_SRC_RTLTCP;
+}
+
+int iq_source_tune(struct iq_source *src, uint32_t frequency)
+{
+	if (!iq_source_tunable(src)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return rtltcp_command(src->fd, RTLTCP_SET_FREQ, frequency);
+}
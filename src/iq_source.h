@@ -0,0 +1,39 @@
+#ifndef __IQ_SOURCE_H__
+#define __IQ_SOURCE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Source types */
+#define IQ_SRC_FILE     0x00    /* Recorded u8 IQ, rewound on EOF */
+#define IQ_SRC_RTLTCP   0x01    /* rtl_tcp compatible server */
+
+/* rtl_tcp commands: 1 byte opcode followed by a big endian uint32 */
+#define RTLTCP_SET_FREQ         0x01
+#define RTLTCP_SET_SAMPLE_RATE  0x02
+#define RTLTCP_SET_GAIN_MODE    0x03
+
+struct iq_source {
+	uint8_t  type;
+	int      fd;
+	uint32_t rate;
+	char     spec[256];
+
+	/* Files are read at the sample rate, as a tuner would deliver them */
+	bool     paced;         /* Cleared by readers that want it all now */
+	uint64_t pace_ns;
+	uint64_t pace_bytes;
+	int      wake_fd;       /* Cuts the pacing wait short when stopping */
+};
+
+int iq_source_open(struct iq_source *src, const char *spec, uint32_t rate,
+	uint32_t frequency);
+void iq_source_close(struct iq_source *src);
+void iq_source_interrupt(struct iq_source *src);
+
+ssize_t iq_source_read(struct iq_source *src, uint8_t *buf, size_t n);
+int iq_source_tune(struct iq_source *src, uint32_t frequency);
+bool iq_source_tunable(const struct iq_source *src);
+
+#endif /* __IQ_SOURCE_H__ */
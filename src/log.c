@@ -0,0 +1,660 @@
+/*
+ * log.c: Messages of every thread, written out by a thread of its own.
+ *
+ * The thread that logs a message only queues, in a ring of its own, its
+ * monotonic time, the format and the arguments as they are: formatting,
+ * colors and the actual writes happen on the writer thread, which merges
+ * the rings back in time order. The format is kept by address, so it must
+ * outlive the message; the print_* macros only ever pass literals. Before
+ * log_start() and after log_stop(), and on threads beyond LOG_MAX_RINGS,
+ * messages are written out straight away instead. Queued messages read
+ * exactly as vfprintf() would have written them, up to LOG_MSG_MAX bytes.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "thread_slot.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+/* Queued message, its payload follows */
+struct log_rec {
+	uint64_t ns;
+	uint16_t len;       /* LOG_SKIP for the unused end of the ring */
+	uint8_t  style;
+	uint8_t  packed;    /* Format and arguments, else the text itself */
+	uint8_t  pad[4];
+};
+
+/* One conversion of a printf format */
+struct log_spec {
+	const char *start;  /* At the '%' */
+	size_t      len;
+	char        conv;
+	char        size;   /* 'H' for hh, 'q' for ll, else the modifier or 0 */
+	unsigned    nstar;  /* Width and precision taken from the arguments */
+};
+
+#define LOG_SKIP        0xffff
+#define LOG_ALIGN(n)    (((n) + 15) & ~(uint32_t)15)
+#define LOG_MASK        (LOG_RING_SIZE - 1)
+
+static const struct {
+	const char *color;
+	const char *prefix;
+	bool        err;        /* To stderr */
+} styles[LOG_S_COUNT] = {
+	[LOG_S_ERROR]   = {COLOR_RED,       "ERROR: ", true},
+	[LOG_S_WARN]    = {COLOR_YELLOW,    "WARN: ",  true},
+	[LOG_S_INFO]    = {COLOR_OFF,       "INFO: ",  false},
+	[LOG_S_ALERT]   = {COLOR_RED,       "",        true},
+	[LOG_S_DWARN]   = {COLOR_YELLOW,    "",        true},
+	[LOG_S_SUCCESS] = {COLOR_GREEN,     "",        true},
+	[LOG_S_DINFO]   = {COLOR_BOLDWHITE, "",        true},
+};
+
+static const char *level_names[] = {
+	[LOG_ERROR] = "error",
+	[LOG_WARN]  = "warn",
+	[LOG_INFO]  = "info",
+	[LOG_DEBUG] = "debug",
+};
+
+_Atomic int log_level = LOG_LEVEL_MAX;
+
+/* Whatever is left in a ring when its thread exits is still written out */
+static struct log_ring rings[LOG_MAX_RINGS];
+static struct thread_slots slots =
+	THREAD_SLOTS_INIT(rings, LOG_MAX_RINGS, in_use, NULL);
+static __thread struct log_ring *log_self;
+static __thread bool log_no_ring;
+
+static atomic_bool log_async;
+static atomic_bool log_timestamps;
+static atomic_bool writer_stop;
+static atomic_bool writer_asleep;       /* Until the next message */
+static pthread_t writer_tid;
+static int writer_efd = -1;
+static uint64_t drops_told;     /* Writer only */
+
+static uint64_t log_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Ring of the calling thread, NULL once they are all taken */
+static struct log_ring *log_ring_self(void)
+{
+	if (__builtin_expect(log_self != NULL, 1))
+		return log_self;
+	if (log_no_ring)
+		return NULL;
+
+	log_self = thread_slot_claim(&slots);
+	log_no_ring = !log_self;
+	return log_self;
+}
+
+static void log_prefix(FILE *fp, enum log_style style, uint64_t ns)
+{
+	if (atomic_load_explicit(&log_timestamps, memory_order_relaxed))
+		fprintf(fp, "[%6" PRIu64 ".%06" PRIu64 "] ", ns / 1000000000,
+			ns / 1000 % 1000000);
+	fputs(styles[style].color, fp);
+	fputs(styles[style].prefix, fp);
+}
+
+/*
+ * Find the next conversion from 'p' on, the text before it is literal.
+ * Returns NULL when there is none left. One that cannot be told apart
+ * comes with a 'conv' of zero.
+ */
+static const char *log_next_spec(const char *p, struct log_spec *sp)
+{
+	for (; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+
+		sp->start = p++;
+		sp->nstar = 0;
+		sp->size = 0;
+		while (*p && strchr("-+ #0'", *p))
+			p++;
+		if (*p == '*') {
+			sp->nstar++;
+			p++;
+		}
+		while (isdigit((unsigned char)*p))
+			p++;
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				sp->nstar++;
+				p++;
+			}
+			while (isdigit((unsigned char)*p))
+				p++;
+		}
+		if (*p && strchr("hlzjtL", *p)) {
+			sp->size = *p++;
+			if (sp->size == 'h' && *p == 'h') {
+				sp->size = 'H';
+				p++;
+			} else if (sp->size == 'l' && *p == 'l') {
+				sp->size = 'q';
+				p++;
+			}
+		}
+		/* No %n, nor anything glibc only */
+		if (!*p || !strchr("diouxXcsfFeEgGaAp", *p)) {
+			sp->conv = '\0';
+			return p;
+		}
+
+		sp->conv = *p++;
+		sp->len = p - sp->start;
+		return p;
+	}
+
+	return NULL;
+}
+
+/* Class of a conversion: signed, unsigned, floating, string or pointer */
+static char log_spec_class(const struct log_spec *sp)
+{
+	switch (sp->conv) {
+	case 'd': case 'i': case 'c':
+		return 'i';
+	case 'o': case 'u': case 'x': case 'X':
+		return 'u';
+	case 's':
+		return 's';
+	case 'p':
+		return 'p';
+	default:
+		return 'f';
+	}
+}
+
+/*
+ * Store the format address and the arguments 'ap' holds for it, in 8 byte
+ * slots; strings are copied. Returns the length, or -1 when it is not
+ * worth it and the message is better formatted right away.
+ */
+static int log_pack(char *out, size_t size, const char *fmt, va_list ap)
+{
+	struct log_spec sp;
+	const char *p = fmt, *str;
+	size_t pos = sizeof fmt, n;
+	unsigned k;
+	int64_t i;
+	uint64_t u;
+	double d;
+
+	memcpy(out, &fmt, sizeof fmt);
+	while ((p = log_next_spec(p, &sp))) {
+		if (!sp.conv || pos + 8 * (sp.nstar + 2) > size)
+			return -1;
+		for (k = 0; k < sp.nstar; k++) {
+			i = va_arg(ap, int);
+			memcpy(out + pos, &i, 8);
+			pos += 8;
+		}
+
+		switch (log_spec_class(&sp)) {
+		case 'i':
+			switch (sp.size) {
+			case 'l': i = va_arg(ap, long); break;
+			case 'q': i = va_arg(ap, long long); break;
+			case 'z': i = va_arg(ap, ssize_t); break;
+			case 'j': i = va_arg(ap, intmax_t); break;
+			case 't': i = va_arg(ap, ptrdiff_t); break;
+			default:  i = va_arg(ap, int); break;
+			}
+			memcpy(out + pos, &i, 8);
+			break;
+		case 'u':
+			switch (sp.size) {
+			case 'l': u = va_arg(ap, unsigned long); break;
+			case 'q': u = va_arg(ap, unsigned long long); break;
+			case 'z': u = va_arg(ap, size_t); break;
+			case 'j': u = va_arg(ap, uintmax_t); break;
+			case 't': u = va_arg(ap, ptrdiff_t); break;
+			default:  u = va_arg(ap, unsigned int); break;
+			}
+			memcpy(out + pos, &u, 8);
+			break;
+		case 'p':
+			u = (uintptr_t)va_arg(ap, void *);
+			memcpy(out + pos, &u, 8);
+			break;
+		case 'f':
+			if (sp.size == 'L')
+				return -1;
+			d = va_arg(ap, double);
+			memcpy(out + pos, &d, 8);
+			break;
+		case 's':
+			str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+			/* Whole, or the message is formatted right away */
+			n = strnlen(str, size - pos);
+			if (pos + 8 + n + 1 > size)
+				return -1;
+			u = n;
+			memcpy(out + pos, &u, 8);
+			memcpy(out + pos + 8, str, n);
+			out[pos + 8 + n] = '\0';
+			pos += (n + 8) & ~(size_t)7;
+			break;
+		}
+		pos += 8;
+	}
+
+	return pos;
+}
+
+/* The other way around, into 'out'. Returns the length of the text */
+static size_t log_unpack(char *out, size_t size, const char *in, size_t len)
+{
+	char spec[32];
+	const char *fmt, *p, *lit;
+	struct log_spec sp;
+	size_t pos = 8, o = 0, n;
+	int star[2] = {0, 0}, w;
+	unsigned k;
+	int64_t i;
+	uint64_t u;
+	double d;
+
+	memcpy(&fmt, in, sizeof fmt);
+
+	/* Literal text up to each conversion, then the conversion itself */
+#define LOG_PUT(...) \
+	do { \
+		if (sp.nstar == 0) \
+			w = snprintf(out + o, size - o, spec, __VA_ARGS__); \
+		else if (sp.nstar == 1) \
+			w = snprintf(out + o, size - o, spec, star[0], __VA_ARGS__); \
+		else \
+			w = snprintf(out + o, size - o, spec, star[0], star[1], \
+				__VA_ARGS__); \
+	} while (0)
+
+	for (p = lit = fmt; o + 1 < size; lit = p) {
+		p = log_next_spec(lit, &sp);
+		n = p ? (size_t)(sp.start - lit) : strlen(lit);
+
+		/* Literal, with its %% */
+		for (k = 0; k < n && o + 1 < size; k++) {
+			out[o++] = lit[k];
+			if (lit[k] == '%')
+				k++;
+		}
+		if (!p || o + 1 >= size || pos + 8 * (sp.nstar + 1) > len)
+			break;
+
+		for (k = 0; k < sp.nstar; k++) {
+			memcpy(&i, in + pos, 8);
+			star[k] = i;
+			pos += 8;
+		}
+		n = (sp.len < sizeof spec) ? sp.len : sizeof spec - 1;
+		memcpy(spec, sp.start, n);
+		spec[n] = '\0';
+
+		w = 0;
+		switch (log_spec_class(&sp)) {
+		case 'i':
+			memcpy(&i, in + pos, 8);
+			switch (sp.size) {
+			case 'l': LOG_PUT((long)i); break;
+			case 'q': LOG_PUT((long long)i); break;
+			case 'z': LOG_PUT((ssize_t)i); break;
+			case 'j': LOG_PUT((intmax_t)i); break;
+			case 't': LOG_PUT((ptrdiff_t)i); break;
+			default:  LOG_PUT((int)i); break;
+			}
+			break;
+		case 'u':
+			memcpy(&u, in + pos, 8);
+			switch (sp.size) {
+			case 'l': LOG_PUT((unsigned long)u); break;
+			case 'q': LOG_PUT((unsigned long long)u); break;
+			case 'z': LOG_PUT((size_t)u); break;
+			case 'j': LOG_PUT((uintmax_t)u); break;
+			case 't': LOG_PUT((ptrdiff_t)u); break;
+			default:  LOG_PUT((unsigned int)u); break;
+			}
+			break;
+		case 'p':
+			memcpy(&u, in + pos, 8);
+			LOG_PUT((void *)(uintptr_t)u);
+			break;
+		case 'f':
+			memcpy(&d, in + pos, 8);
+			LOG_PUT(d);
+			break;
+		case 's':
+			memcpy(&u, in + pos, 8);
+			LOG_PUT(in + pos + 8);
+			pos += (u + 8) & ~(uint64_t)7;
+			break;
+		}
+#undef LOG_PUT
+		pos += 8;
+		if (w > 0)
+			o += ((size_t)w < size - o) ? (size_t)w : size - o - 1;
+	}
+
+	return o;
+}
+
+static void log_push(struct log_ring *r, enum log_style style, uint64_t ns,
+	const char *payload, uint32_t len, bool packed)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t need = LOG_ALIGN(sizeof(struct log_rec) + len);
+	uint32_t off = head & LOG_MASK, skip = 0, next;
+	struct log_rec *rec;
+	uint64_t one = 1;
+
+	/* Records never wrap, the end of the ring is skipped instead */
+	if (LOG_RING_SIZE - off < need)
+		skip = LOG_RING_SIZE - off;
+
+	if (LOG_RING_SIZE - (head - r->tail_seen) < need + skip) {
+		r->tail_seen = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (LOG_RING_SIZE - (head - r->tail_seen) < need + skip) {
+			atomic_store_explicit(&r->dropped, atomic_load_explicit(
+				&r->dropped, memory_order_relaxed) + 1,
+				memory_order_relaxed);
+			return;
+		}
+	}
+
+	if (skip) {
+		rec = (struct log_rec *)(r->buf + off);
+		rec->len = LOG_SKIP;
+		off = 0;
+	}
+	rec = (struct log_rec *)(r->buf + off);
+	rec->ns = ns;
+	rec->len = len;
+	rec->style = style;
+	rec->packed = packed;
+	memcpy(rec + 1, payload, len);
+	next = head + skip + need;
+	atomic_store_explicit(&r->head, next, memory_order_release);
+
+	/*
+	 * A writer that found every ring empty waits for the first message
+	 * without a timer, so an idle process never wakes up. The fence pairs
+	 * with the one in log_writer(): either it sees this message, or this
+	 * sees it asleep. Past that, every half a ring, the writer should not
+	 * wait for its timer either.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if ((atomic_load_explicit(&writer_asleep, memory_order_relaxed) &&
+	     atomic_exchange(&writer_asleep, false)) ||
+	    ((head ^ next) & (LOG_RING_SIZE / 2)))
+		if (write(writer_efd, &one, sizeof one) < 0)
+			return;
+}
+
+void log_write(enum log_style style, const char *fmt, ...)
+{
+	char buf[LOG_MSG_MAX];
+	struct log_ring *r = NULL;
+	va_list ap, aq;
+	uint64_t ns;
+	FILE *fp;
+	int len;
+
+	if (atomic_load_explicit(&log_async, memory_order_acquire))
+		r = log_ring_self();
+
+	va_start(ap, fmt);
+	if (r) {
+		ns = log_now_ns();
+		va_copy(aq, ap);
+		len = log_pack(buf, sizeof buf, fmt, aq);
+		va_end(aq);
+		if (len >= 0) {
+			log_push(r, style, ns, buf, len, true);
+		} else {
+			len = vsnprintf(buf, sizeof buf, fmt, ap);
+			if (len >= (int)sizeof buf)
+				len = sizeof buf - 1;
+			if (len >= 0)
+				log_push(r, style, ns, buf, len, false);
+		}
+	} else {
+		fp = styles[style].err ? stderr : stdout;
+		ns = atomic_load_explicit(&log_timestamps, memory_order_relaxed) ?
+			log_now_ns() : 0;
+		flockfile(fp);
+		log_prefix(fp, style, ns);
+		vfprintf(fp, fmt, ap);
+		fputs(COLOR_OFF, fp);
+		funlockfile(fp);
+	}
+	va_end(ap);
+}
+
+/* Next message of a ring, past the skipped end if need be */
+static struct log_rec *log_peek(struct log_ring *r, uint32_t head,
+	uint32_t *tail)
+{
+	struct log_rec *rec;
+
+	while (*tail != head) {
+		rec = (struct log_rec *)(r->buf + (*tail & LOG_MASK));
+		if (rec->len != LOG_SKIP)
+			return rec;
+		*tail += LOG_RING_SIZE - (*tail & LOG_MASK);
+		atomic_store_explicit(&r->tail, *tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/* Write out everything queued so far, oldest first across the rings */
+static void log_drain(void)
+{
+	unsigned n = thread_slots_high(&slots), k, best;
+	uint32_t head[LOG_MAX_RINGS], tail[LOG_MAX_RINGS];
+	struct log_rec *rec, *first;
+	char line[LOG_MSG_MAX];
+	uint64_t drops = 0;
+	FILE *fp;
+
+	if (n > LOG_MAX_RINGS)
+		n = LOG_MAX_RINGS;
+	for (k = 0; k < n; k++) {
+		head[k] = atomic_load_explicit(&rings[k].head, memory_order_acquire);
+		tail[k] = atomic_load_explicit(&rings[k].tail, memory_order_relaxed);
+	}
+
+	for (;;) {
+		first = NULL;
+		best = 0;
+		for (k = 0; k < n; k++) {
+			rec = log_peek(&rings[k], head[k], &tail[k]);
+			if (rec && (!first || rec->ns < first->ns)) {
+				first = rec;
+				best = k;
+			}
+		}
+		if (!first)
+			break;
+
+		fp = styles[first->style].err ? stderr : stdout;
+		log_prefix(fp, first->style, first->ns);
+		if (first->packed)
+			fwrite(line, 1, log_unpack(line, sizeof line,
+				(const char *)(first + 1), first->len), fp);
+		else
+			fwrite(first + 1, 1, first->len, fp);
+		fputs(COLOR_OFF, fp);
+		tail[best] += LOG_ALIGN(sizeof *first + first->len);
+		atomic_store_explicit(&rings[best].tail, tail[best],
+			memory_order_release);
+	}
+
+	for (k = 0; k < n; k++)
+		drops += atomic_load_explicit(&rings[k].dropped, memory_order_relaxed);
+	if (drops > drops_told) {
+		fprintf(stderr, COLOR_YELLOW "WARN: %" PRIu64
+			" log messages dropped\n" COLOR_OFF, drops - drops_told);
+		drops_told = drops;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+/* Something queued and not written yet, on any ring */
+static bool log_pending(void)
+{
+	unsigned n = thread_slots_high(&slots), k;
+
+	if (n > LOG_MAX_RINGS)
+		n = LOG_MAX_RINGS;
+	for (k = 0; k < n; k++) {
+		if (atomic_load(&rings[k].head) != atomic_load(&rings[k].tail))
+			return true;
+	}
+
+	return false;
+}
+
+static void *log_writer(void *arg)
+{
+	struct pollfd pfd = {.fd = writer_efd, .events = POLLIN};
+	uint64_t count;
+	int timeout;
+
+	while (!atomic_load(&writer_stop)) {
+		/* Messages coming in are batched, nothing at all is waited for */
+		timeout = LOG_FLUSH_MS;
+		if (!log_pending()) {
+			atomic_store(&writer_asleep, true);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (log_pending())
+				atomic_store(&writer_asleep, false);
+			else
+				timeout = -1;
+		}
+
+		if (poll(&pfd, 1, timeout) > 0 &&
+		    read(writer_efd, &count, sizeof count) < 0 && errno != EAGAIN)
+			break;
+		atomic_store(&writer_asleep, false);
+		log_drain();
+	}
+
+	log_drain();
+	return NULL;
+}
+
+/* Hand the writes over to the writer thread */
+int log_start(void)
+{
+	if (atomic_load(&log_async))
+		return 0;
+
+	/* Kept open for good, a late wakeup must not hit a reused descriptor */
+	if (writer_efd < 0)
+		writer_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (writer_efd < 0)
+		return -1;
+
+	atomic_store(&writer_stop, false);
+	if (pthread_create(&writer_tid, NULL, &log_writer, NULL) != 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	atomic_store(&log_async, true);
+	return 0;
+}
+
+/* Write out what is queued and go back to writing on the calling thread */
+void log_stop(void)
+{
+	uint64_t one = 1;
+
+	if (!atomic_load(&log_async))
+		return;
+
+	atomic_store(&log_async, false);
+	atomic_store(&writer_stop, true);
+	if (write(writer_efd, &one, sizeof one) < 0)
+		print_warn("cannot wake the log writer up\n");
+	pthread_join(writer_tid, NULL);
+
+	/* Messages queued while the writer was on its way out */
+	log_drain();
+}
+
+void log_set_level(int level)
+{
+	atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+void log_set_timestamps(bool on)
+{
+	atomic_store_explicit(&log_timestamps, on, memory_order_relaxed);
+}
+
+/* Messages lost to full rings, since the start */
+uint64_t log_dropped(void)
+{
+	unsigned n = thread_slots_high(&slots), k;
+	uint64_t drops = 0;
+
+	if (n > LOG_MAX_RINGS)
+		n = LOG_MAX_RINGS;
+	for (k = 0; k < n; k++)
+		drops += atomic_load_explicit(&rings[k].dropped, memory_order_relaxed);
+
+	return drops;
+}
+
+int string_to_log_level(const char *str)
+{
+	int k;
+
+	for (k = LOG_ERROR; k <= LOG_DEBUG; k++)
+		if (strcmp(str, level_names[k]) == 0)
+			return k;
+
+	return -1;
+}
+
+const char *log_level_name(int level)
+{
+	if (level < LOG_ERROR || level > LOG_DEBUG)
+		return NULL;
+
+	return level_names[level];
+}
@@ -0,0 +1,81 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Levels, most severe first */
+#define LOG_ERROR       0
+#define LOG_WARN        1
+#define LOG_INFO        2
+#define LOG_DEBUG       3
+
+/* ENABLE_DEBUG should be set on compile time */
+#ifndef ENABLE_DEBUG
+#define ENABLE_DEBUG    0
+#endif
+
+/* Calls above this level are compiled out */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX   (ENABLE_DEBUG ? LOG_DEBUG : LOG_INFO)
+#endif
+
+/* How each message is shown, which also gives its level */
+enum log_style {
+	LOG_S_ERROR,
+	LOG_S_WARN,
+	LOG_S_INFO,
+	LOG_S_ALERT,            /* debug_alert() and friends, at LOG_DEBUG */
+	LOG_S_DWARN,
+	LOG_S_SUCCESS,
+	LOG_S_DINFO,
+	LOG_S_COUNT
+};
+
+#define LOG_RING_SIZE   (64 * 1024)     /* Per thread, a power of two */
+#define LOG_MAX_RINGS   64
+#define LOG_MSG_MAX     1024            /* Longer messages are cut */
+#define LOG_FLUSH_MS    10              /* Longest a message waits */
+
+/*
+ * Messages of one thread, on their way to the writer. Only the owner moves
+ * 'head' and only the writer moves 'tail', so neither ever waits for the
+ * other: a full ring drops the message and counts it instead. The owner
+ * goes by the last tail it saw until that one says the ring is full.
+ */
+struct log_ring {
+	_Atomic uint32_t head;
+	uint32_t         tail_seen;
+	_Atomic uint64_t dropped;
+	atomic_bool      in_use;
+	_Atomic uint32_t tail __attribute__((aligned(64)));
+	char             buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+extern _Atomic int log_level;
+
+void log_write(enum log_style style, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int log_start(void);
+void log_stop(void);
+void log_set_level(int level);
+void log_set_timestamps(bool on);
+uint64_t log_dropped(void);
+int string_to_log_level(const char *str);
+const char *log_level_name(int level);
+
+/* Level of a style */
+#define LOG_STYLE_LEVEL(s) \
+	((s) <= LOG_S_INFO ? (int)(s) : LOG_DEBUG)
+
+/* Checked at compile time first, then against the runtime level */
+#define log_print(style, fmt, ...) \
+	do { \
+		if (LOG_STYLE_LEVEL(style) <= LOG_LEVEL_MAX && \
+		    LOG_STYLE_LEVEL(style) <= atomic_load_explicit(&log_level, \
+				memory_order_relaxed)) \
+			log_write(style, fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,76 @@
+/*
+ * main.c: Entry point, station or manager as the command line says.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "log.h"
+#include "manager.h"
+#include "sdrrc.h"
+
+#include <signal.h>
+#include <stdlib.h>
+
+#include <sys/resource.h>
+
+/* Make room for as many managers as the hard limit allows */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= rl.rlim_max)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		print_warn("cannot raise the open files limit\n");
+}
+
+int main(int argc, char *const *argv)
+{
+	struct app_config *cfg;
+	sigset_t mask;
+
+	int retval;
+
+	if (!(cfg = cfg_alloc_init())) {
+		print_error("Cannot allocate memory\n");
+		exit(253);
+	}
+
+	/* Parse and pack arguments into a struct */
+	parse_args(argc, argv, cfg);
+
+	/* Signals are delivered through a signalfd owned by the event loop */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &cfg->orig_sigmask);
+
+	/* Broken pipes are reported through write() errors instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	dsp_kernels_init();
+
+	if (cfg->op_mode == M_STATION) {
+		print_info("Running in station mode, listening on port: tcp/%u\n",
+			cfg->port);
+
+		raise_fd_limit();
+		sta_set_status(cfg, S_LISTENING);
+
+		/*
+		 * The loop and the pumps only queue their messages. Managers keep
+		 * writing them out in line, in order with the replies they print.
+		 */
+		if (log_start() < 0)
+			print_warn("cannot start the log writer\n");
+		retval = sta_mode_loop(cfg);
+		log_stop();
+	} else {
+		retval = mgr_mode_loop(cfg);
+	}
+
+	cfg_free(cfg);
+	return retval;
+}
\ No newline at end of file
@@ -0,0 +1,743 @@
+/*
+ * manager.c: Drive many stations at once.
+ *
+ * Commands are read from stdin as "<target> <command>", the target being a
+ * station name, "@group" or "*" for every station. They are pipelined:
+ * queued and written as soon as possible, without waiting for the replies
+ * of earlier ones. A station answers every command with exactly one line
+ * and in order, so a reply always belongs to the oldest request pending on
+ * its connection. Lines starting with '!' are events, not replies. A replay
+ * reply is followed by the Ogg file it announces, saved next to us.
+ */
+
+#include "common.h"
+#include "connector.h"
+#include "event_loop.h"
+#include "manager.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+/* Input reads per wakeup, so a fast producer cannot starve the stations */
+#define MGR_INPUT_BURST     16
+
+static uint64_t mgr_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+/* Fill a station from "[name=]host:port[@group...]" */
+static int mgr_station_parse(struct mgr_station *st, const char *spec)
+{
+	char buf[HOST_LEN + (MGR_MAX_GROUPS + 1) * MGR_NAME_LEN];
+	char *host = buf, *name = NULL, *groups, *colon, *end, *next;
+	long port;
+
+	if (snprintf(buf, sizeof buf, "%s", spec) >= (int)sizeof buf)
+		goto _parse_error;
+
+	groups = strchr(buf, '@');
+	if (groups)
+		*groups++ = '\0';
+
+	if ((next = strchr(buf, '='))) {
+		*next = '\0';
+		name = buf;
+		host = next + 1;
+	}
+
+	colon = strrchr(host, ':');
+	if (!colon || colon == host)
+		goto _parse_error;
+	*colon = '\0';
+
+	/* IPv6 addresses are bracketed, "[::1]:port" */
+	if (host[0] == '[') {
+		if (colon[-1] != ']' || colon - host < 3)
+			goto _parse_error;
+		colon[-1] = '\0';
+		host++;
+	}
+
+	errno = 0;
+	port = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || errno == ERANGE || port < 1 || port > 65535)
+		goto _parse_error;
+
+	if (strlen(host) >= HOST_LEN)
+		goto _parse_error;
+	strcpy(st->host, host);
+	st->port = port;
+
+	if (name) {
+		if (*name == '\0' ||
+		    snprintf(st->name, MGR_NAME_LEN, "%s", name) >= MGR_NAME_LEN)
+			goto _parse_error;
+	} else if (snprintf(st->name, MGR_NAME_LEN, "%s:%ld", host, port) >=
+			MGR_NAME_LEN) {
+		goto _parse_error;
+	}
+
+	for (; groups; groups = next) {
+		next = strchr(groups, '@');
+		if (next)
+			*next++ = '\0';
+		if (*groups == '\0' || st->ngroups == MGR_MAX_GROUPS ||
+		    strlen(groups) >= MGR_NAME_LEN)
+			goto _parse_error;
+		strcpy(st->groups[st->ngroups++], groups);
+	}
+
+	return 0;
+
+_parse_error:
+	print_error("Invalid station: %s\n", spec);
+	errno = EINVAL;
+	return -1;
+}
+
+static int mgr_add_station(struct mgr_context *ctx, const char *spec)
+{
+	struct mgr_station *st;
+
+	if (ctx->nstations == MGR_MAX_STATIONS) {
+		print_error("Too many stations (%d at most)\n", MGR_MAX_STATIONS);
+		return -1;
+	}
+
+	st = &ctx->stations[ctx->nstations];
+	memset(st, 0, sizeof *st);
+	if (mgr_station_parse(st, spec) < 0)
+		return -1;
+
+	st->ctx = ctx;
+	st->h.fd = -1;
+	st->replay_fd = -1;
+	st->h.context = st;
+	line_buffer_init(&st->rx);
+	ctx->nstations++;
+
+	return 0;
+}
+
+/* One station per line, blank lines and '#' comments are skipped */
+static int mgr_load_stations(struct mgr_context *ctx, const char *path)
+{
+	char line[HOST_LEN + (MGR_MAX_GROUPS + 1) * MGR_NAME_LEN];
+	FILE *fp = fopen(path, "r");
+	int retval = 0;
+
+	if (!fp) {
+		print_error("cannot open %s\n", path);
+		return -1;
+	}
+
+	while (retval == 0 && fgets(line, sizeof line, fp)) {
+		strtrim(line);
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		retval = mgr_add_station(ctx, line);
+	}
+
+	fclose(fp);
+	return retval;
+}
+
+static bool mgr_station_match(const struct mgr_station *st, const char *target)
+{
+	unsigned k;
+
+	if (strcmp(target, "*") == 0)
+		return true;
+
+	if (target[0] != '@')
+		return strcmp(target, st->name) == 0;
+
+	for (k = 0; k < st->ngroups; k++)
+		if (strcmp(target + 1, st->groups[k]) == 0)
+			return true;
+
+	return false;
+}
+
+static void mgr_check_done(struct mgr_context *ctx)
+{
+	if (ctx->input_done && ctx->pending == 0)
+		ev_stop(&ctx->loop);
+}
+
+static void mgr_want_write(struct mgr_station *st, bool on)
+{
+	if (st->want_write == on)
+		return;
+
+	st->want_write = on;
+	ev_mod(&st->ctx->loop, &st->h, EPOLLIN | (on ? EPOLLOUT : 0));
+}
+
+/* Give up on a station, whatever is still pending on it is lost */
+static void mgr_station_down(struct mgr_station *st, const char *why)
+{
+	struct mgr_context *ctx = st->ctx;
+
+	if (st->down)
+		return;
+
+	print_warn("[%s] %s, %zu requests lost\n", st->name, why, st->req_count);
+
+	st->down = true;
+	st->connected = false;
+	connector_cancel(&st->conn);
+	if (st->h.fd >= 0) {
+		ev_del(&ctx->loop, &st->h);
+		close(st->h.fd);
+		st->h.fd = -1;
+	}
+
+	ctx->failed += st->req_count;
+	ctx->pending -= st->req_count;
+	st->req_count = 0;
+
+	/* A replay cut short is not worth keeping */
+	if (st->replay_left > 0) {
+		st->replay_left = 0;
+		ctx->failed++;
+		ctx->pending--;
+	}
+	if (st->replay_fd >= 0) {
+		close(st->replay_fd);
+		st->replay_fd = -1;
+	}
+	st->tx_head = st->tx_len = 0;
+
+	mgr_check_done(ctx);
+}
+
+static void mgr_flush(struct mgr_station *st)
+{
+	ssize_t nbw;
+
+	if (!st->connected)
+		return;
+
+	while (st->tx_head < st->tx_len) {
+		nbw = send(st->h.fd, st->tx + st->tx_head, st->tx_len - st->tx_head,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (nbw < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				mgr_want_write(st, true);
+				return;
+			}
+			mgr_station_down(st, strerror(errno));
+			return;
+		}
+		st->tx_head += nbw;
+	}
+
+	st->tx_head = st->tx_len = 0;
+	mgr_want_write(st, false);
+}
+
+/* Queue a command and its request, it goes out with the next flush */
+static int mgr_send(struct mgr_station *st, uint64_t seq, const char *cmd,
+	size_t len, uint64_t now)
+{
+	struct mgr_request *reqs;
+	size_t need, k;
+	char *tx;
+
+	/* Reclaim what was already sent before growing the buffer */
+	if (st->tx_head > 0 && st->tx_len + len + 1 > st->tx_cap) {
+		memmove(st->tx, st->tx + st->tx_head, st->tx_len - st->tx_head);
+		st->tx_len -= st->tx_head;
+		st->tx_head = 0;
+	}
+
+	need = st->tx_len + len + 1;
+	if (need > st->tx_cap) {
+		size_t cap = st->tx_cap ? st->tx_cap : LINE_BUFSZ;
+
+		while (cap < need)
+			cap *= 2;
+		if (!(tx = realloc(st->tx, cap)))
+			return -1;
+		st->tx = tx;
+		st->tx_cap = cap;
+	}
+
+	if (st->req_count == st->req_cap) {
+		size_t cap = st->req_cap ? 2 * st->req_cap : 64;
+
+		if (!(reqs = malloc(cap * sizeof *reqs)))
+			return -1;
+		for (k = 0; k < st->req_count; k++)
+			reqs[k] = st->reqs[(st->req_head + k) % st->req_cap];
+		free(st->reqs);
+		st->reqs = reqs;
+		st->req_cap = cap;
+		st->req_head = 0;
+	}
+
+	memcpy(st->tx + st->tx_len, cmd, len);
+	st->tx[st->tx_len + len] = '\n';
+	st->tx_len += len + 1;
+
+	st->reqs[(st->req_head + st->req_count) % st->req_cap] =
+		(struct mgr_request) {seq, now};
+	st->req_count++;
+
+	return 0;
+}
+
+static void mgr_record_rtt(struct mgr_context *ctx, uint64_t rtt)
+{
+	uint32_t *buf;
+
+	if (ctx->nrtt == ctx->rtt_cap) {
+		size_t cap = ctx->rtt_cap ? 2 * ctx->rtt_cap : 4096;
+
+		if (!(buf = realloc(ctx->rtt, cap * sizeof *buf)))
+			return;
+		ctx->rtt = buf;
+		ctx->rtt_cap = cap;
+	}
+
+	ctx->rtt[ctx->nrtt++] = (rtt > UINT32_MAX) ? UINT32_MAX : rtt;
+}
+
+/* Save the audio of a replay, the command stays pending until it is in */
+static void mgr_replay_open(struct mgr_station *st, uint64_t seq)
+{
+	char path[MGR_NAME_LEN + 32];
+	size_t k;
+
+	snprintf(path, sizeof path, "%s-%" PRIu64 ".ogg", st->name, seq);
+	for (k = 0; path[k]; k++)
+		if (path[k] == '/')
+			path[k] = '_';
+
+	st->replay_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (st->replay_fd < 0)
+		print_warn("[%s] cannot save the replay into %s\n", st->name, path);
+	else if (!st->ctx->cfg->quiet)
+		printf("[%s] #%" PRIu64 " saving into %s\n", st->name, seq, path);
+	st->ctx->pending++;
+}
+
+/* Raw bytes of a replay out of the receive buffer */
+static void mgr_replay_save(struct mgr_station *st)
+{
+	void *data;
+	size_t len;
+
+	len = line_buffer_take(&st->rx, &data, st->replay_left);
+	if (len == 0)
+		return;
+
+	if (st->replay_fd >= 0 && write(st->replay_fd, data, len) != (ssize_t)len) {
+		print_warn("[%s] cannot save the replay\n", st->name);
+		close(st->replay_fd);
+		st->replay_fd = -1;
+	}
+
+	st->replay_left -= len;
+	if (st->replay_left == 0) {
+		if (st->replay_fd >= 0)
+			close(st->replay_fd);
+		st->replay_fd = -1;
+		st->ctx->pending--;
+	}
+}
+
+static void mgr_reply(struct mgr_station *st, const char *line)
+{
+	struct mgr_context *ctx = st->ctx;
+	struct mgr_request *req;
+	uint64_t now;
+
+	if (line[0] == '!') {
+		if (!ctx->cfg->quiet)
+			printf("[%s] %s\n", st->name, line);
+		return;
+	}
+
+	if (st->req_count == 0) {
+		print_warn("[%s] unexpected reply: %s\n", st->name, line);
+		return;
+	}
+
+	req = &st->reqs[st->req_head];
+	st->req_head = (st->req_head + 1) % st->req_cap;
+	st->req_count--;
+
+	now = mgr_now_us();
+	mgr_record_rtt(ctx, now - req->sent_us);
+	ctx->last_us = now;
+	ctx->replies++;
+	ctx->pending--;
+
+	if (!ctx->cfg->quiet)
+		printf("[%s] #%" PRIu64 " %s (%.3f ms)\n", st->name, req->seq, line,
+			(now - req->sent_us) / 1000.0);
+
+	if (sscanf(line, "<Replay: %" SCNu64 " bytes", &st->replay_left) == 1 &&
+	    st->replay_left > 0)
+		mgr_replay_open(st, req->seq);
+}
+
+/* The connector is done with a station, commands queued meanwhile go out */
+static void mgr_connected(void *context, int fd, const char *err)
+{
+	struct mgr_station *st = context;
+
+	if (fd < 0) {
+		mgr_station_down(st, err);
+		return;
+	}
+
+	st->h.fd = fd;
+	if (ev_add(&st->ctx->loop, &st->h, EPOLLIN | EPOLLOUT) < 0) {
+		mgr_station_down(st, strerror(errno));
+		return;
+	}
+	st->connected = true;
+	st->want_write = true;
+	mgr_flush(st);
+}
+
+static void mgr_station_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct mgr_station *st = h->context;
+	ssize_t nbr, n;
+	char *line;
+
+	if (st->down)
+		return;
+
+	if (events & EPOLLOUT)
+		mgr_flush(st);
+
+	if (st->down || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return;
+
+	for (;;) {
+		nbr = line_buffer_fill(&st->rx, h->fd);
+		for (;;) {
+			if (st->replay_left > 0) {
+				mgr_replay_save(st);
+				if (st->replay_left > 0)
+					break;
+			}
+			n = line_buffer_next(&st->rx, &line);
+			if (n == LB_AGAIN)
+				break;
+			if (n >= 0)
+				mgr_reply(st, line);
+		}
+
+		if (nbr == 0) {
+			mgr_station_down(st, "connection closed");
+			return;
+		}
+		if (nbr < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				mgr_station_down(st, strerror(errno));
+			break;
+		}
+	}
+
+	mgr_check_done(st->ctx);
+}
+
+/* Split "<target> <command>" and queue the command on every match */
+static void mgr_exec_line(struct mgr_context *ctx, char *line)
+{
+	struct mgr_station *st;
+	char *target, *cmd;
+	unsigned k, matched = 0;
+	uint64_t now, seq;
+	size_t len;
+
+	target = line + strspn(line, " \t");
+	if (*target == '\0' || *target == '#')
+		return;
+
+	cmd = target + strcspn(target, " \t");
+	if (*cmd != '\0')
+		*cmd++ = '\0';
+	cmd += strspn(cmd, " \t");
+	len = strlen(cmd);
+	if (len == 0) {
+		print_error("Missing command for %s\n", target);
+		return;
+	}
+
+	now = mgr_now_us();
+	if (ctx->seq == 0)
+		ctx->start_us = now;
+	seq = ++ctx->seq;
+
+	for (k = 0; k < ctx->nstations; k++) {
+		st = &ctx->stations[k];
+		if (!mgr_station_match(st, target))
+			continue;
+		matched++;
+
+		if (st->down || mgr_send(st, seq, cmd, len, now) < 0) {
+			ctx->failed++;
+			if (!ctx->cfg->quiet)
+				printf("[%s] #%" PRIu64 " <Error: not sent>\n", st->name, seq);
+			continue;
+		}
+		ctx->sent++;
+		ctx->pending++;
+	}
+
+	if (matched == 0)
+		print_error("No station matches %s\n", target);
+}
+
+static void mgr_input_done(struct mgr_context *ctx)
+{
+	struct itimerspec its = {.it_value = {.tv_sec = MGR_DRAIN_TIMEOUT}};
+
+	if (ctx->input_done)
+		return;
+
+	ctx->input_done = true;
+	if (ctx->input_h.fd >= 0) {
+		ev_del(&ctx->loop, &ctx->input_h);
+		ctx->input_h.fd = -1;
+	}
+
+	/* Do not wait forever on stations that never answer */
+	timerfd_settime(ctx->timer_h.fd, 0, &its, NULL);
+	mgr_check_done(ctx);
+}
+
+static void mgr_read_input(struct mgr_context *ctx)
+{
+	ssize_t nbr, n;
+	char *line;
+	int k;
+
+	for (k = 0; k < MGR_INPUT_BURST; k++) {
+		nbr = line_buffer_fill(&ctx->input, STDIN_FILENO);
+		while ((n = line_buffer_next(&ctx->input, &line)) != LB_AGAIN) {
+			if (n >= 0)
+				mgr_exec_line(ctx, line);
+			else
+				print_warn("Input line too long, ignored\n");
+		}
+
+		if (nbr == 0) {
+			mgr_input_done(ctx);
+			return;
+		}
+		if (nbr < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				print_error("cannot read commands\n");
+				mgr_input_done(ctx);
+			}
+			return;
+		}
+	}
+}
+
+static void mgr_input_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	mgr_read_input(h->context);
+}
+
+static void mgr_timer_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct mgr_context *ctx = h->context;
+	uint64_t count;
+
+	if (read(h->fd, &count, sizeof count) < 0)
+		return;
+
+	print_warn("Giving up on %" PRIu64 " pending replies\n", ctx->pending);
+	ev_stop(loop);
+}
+
+static void mgr_signal_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct signalfd_siginfo si;
+
+	if (read(h->fd, &si, sizeof si) != sizeof si)
+		return;
+
+	printf("\n");
+	print_warn("Closing program...\n");
+	ev_stop(loop);
+}
+
+/* Everything queued during the batch goes out in as few writes as possible */
+static void mgr_batch_done(struct ev_loop *loop, void *context)
+{
+	struct mgr_context *ctx = context;
+	struct mgr_station *st;
+	unsigned k;
+
+	for (k = 0; k < ctx->nstations; k++) {
+		st = &ctx->stations[k];
+		if (st->connected && !st->want_write && st->tx_len > st->tx_head)
+			mgr_flush(st);
+	}
+
+	fflush(stdout);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void mgr_report(struct mgr_context *ctx)
+{
+	double elapsed, p50 = 0, p99 = 0, pmax = 0;
+
+	if (ctx->seq == 0)
+		return;
+
+	elapsed = ((ctx->last_us > ctx->start_us) ?
+		ctx->last_us - ctx->start_us : 0) / 1e6;
+
+	if (ctx->nrtt > 0) {
+		qsort(ctx->rtt, ctx->nrtt, sizeof *ctx->rtt, &cmp_u32);
+		p50 = ctx->rtt[ctx->nrtt / 2] / 1000.0;
+		p99 = ctx->rtt[(ctx->nrtt * 99) / 100] / 1000.0;
+		pmax = ctx->rtt[ctx->nrtt - 1] / 1000.0;
+	}
+
+	print_info("%" PRIu64 " commands to %u stations: %" PRIu64 " replies, %"
+		PRIu64 " failed, %" PRIu64 " pending\n", ctx->sent, ctx->nstations,
+		ctx->replies, ctx->failed, ctx->pending);
+	print_info("%.0f commands/s, rtt p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		(elapsed > 0) ? ctx->replies / elapsed : 0.0, p50, p99, pmax);
+}
+
+int mgr_mode_loop(struct app_config *cfg)
+{
+	struct mgr_context ctx = {
+		.cfg      = cfg,
+		.input_h  = {.fd = -1, .func = &mgr_input_cb,  .context = &ctx},
+		.signal_h = {.fd = -1, .func = &mgr_signal_cb, .context = &ctx},
+		.timer_h  = {.fd = -1, .func = &mgr_timer_cb,  .context = &ctx},
+	};
+	struct mgr_station *st;
+	char spec[HOST_LEN + 8];
+	int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+	int retval = -1;
+	sigset_t mask;
+	unsigned k;
+
+	ctx.stations = calloc(MGR_MAX_STATIONS, sizeof *ctx.stations);
+	if (!ctx.stations) {
+		print_error("Cannot allocate memory\n");
+		return -1;
+	}
+	line_buffer_init(&ctx.input);
+
+	/* Stations from --host/--port, --station and --stations-file */
+	if (cfg->host[0] != '\0') {
+		snprintf(spec, sizeof spec, "%s:%u", cfg->host, cfg->port);
+		if (mgr_add_station(&ctx, spec) < 0)
+			goto _free_stations;
+	}
+	for (k = 0; k < cfg->nstations; k++)
+		if (mgr_add_station(&ctx, cfg->stations[k]) < 0)
+			goto _free_stations;
+	if (cfg->stations_file && mgr_load_stations(&ctx, cfg->stations_file) < 0)
+		goto _free_stations;
+
+	if (ev_loop_init(&ctx.loop) < 0)
+		goto _free_stations;
+	if (connector_init(&ctx.conn, &ctx.loop) < 0) {
+		print_error("cannot start the resolver\n");
+		ev_loop_close(&ctx.loop);
+		goto _free_stations;
+	}
+	ctx.loop.batch_done = &mgr_batch_done;
+	ctx.loop.batch_context = &ctx;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	ctx.signal_h.fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	ctx.timer_h.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (ctx.signal_h.fd < 0 || ctx.timer_h.fd < 0 ||
+	    ev_add(&ctx.loop, &ctx.signal_h, EPOLLIN) < 0 ||
+	    ev_add(&ctx.loop, &ctx.timer_h, EPOLLIN) < 0) {
+		print_error("cannot register event handlers\n");
+		goto _close_fds;
+	}
+
+	/* Connect to every station at once, names are resolved in parallel */
+	for (k = 0; k < ctx.nstations; k++) {
+		st = &ctx.stations[k];
+		st->h.func = &mgr_station_cb;
+		if (connector_start(&ctx.conn, &st->conn, st->host, st->port,
+				&mgr_connected, st) < 0)
+			mgr_station_down(st, strerror(errno));
+	}
+
+	/*
+	 * Regular files cannot be watched by epoll: they are always readable,
+	 * so read them to the end right away.
+	 */
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK);
+	ctx.input_h.fd = STDIN_FILENO;
+	if (ev_add(&ctx.loop, &ctx.input_h, EPOLLIN) < 0) {
+		ctx.input_h.fd = -1;
+		while (!ctx.input_done)
+			mgr_read_input(&ctx);
+	}
+
+	if (ctx.loop.running || !ctx.input_done || ctx.pending > 0)
+		retval = ev_run(&ctx.loop);
+	else
+		retval = 0;
+
+	fflush(stdout);
+	mgr_report(&ctx);
+
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+	for (k = 0; k < ctx.nstations; k++) {
+		st = &ctx.stations[k];
+		if (st->h.fd >= 0)
+			close(st->h.fd);
+		free(st->tx);
+		free(st->reqs);
+	}
+
+_close_fds:
+	connector_close(&ctx.conn);
+	if (ctx.signal_h.fd >= 0)
+		close(ctx.signal_h.fd);
+	if (ctx.timer_h.fd >= 0)
+		close(ctx.timer_h.fd);
+	ev_loop_close(&ctx.loop);
+_free_stations:
+	free(ctx.rtt);
+	free(ctx.stations);
+	return retval;
+}
@@ -0,0 +1,89 @@
+#ifndef __MANAGER_H__
+#define __MANAGER_H__
+
+#include "common.h"
+#include "connector.h"
+#include "event_loop.h"
+#include "net_utils.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MGR_MAX_STATIONS    1024
+#define MGR_MAX_GROUPS      8
+#define MGR_NAME_LEN        32
+
+/* Seconds to wait for pending replies once the input is over */
+#define MGR_DRAIN_TIMEOUT   10
+
+struct mgr_context;
+
+/* A command sent and still waiting for its reply */
+struct mgr_request {
+	uint64_t seq;
+	uint64_t sent_us;
+};
+
+/* Connection to one station */
+struct mgr_station {
+	struct ev_handler   h;
+	struct mgr_context *ctx;
+	char                name[MGR_NAME_LEN];
+	char                host[HOST_LEN];
+	uint16_t            port;
+	char                groups[MGR_MAX_GROUPS][MGR_NAME_LEN];
+	unsigned            ngroups;
+
+	struct conn_req     conn;
+	bool                connected;
+	bool                down;
+	bool                want_write;  /* EPOLLOUT is armed */
+	struct line_buffer  rx;
+
+	/* Commands not written to the socket yet */
+	char               *tx;
+	size_t              tx_head;
+	size_t              tx_len;
+	size_t              tx_cap;
+
+	/* Replies come back in order, so requests are a FIFO (ring) */
+	struct mgr_request *reqs;
+	size_t              req_head;
+	size_t              req_count;
+	size_t              req_cap;
+
+	/* Audio of a replay reply still to come, saved into replay_fd */
+	uint64_t            replay_left;
+	int                 replay_fd;
+};
+
+struct mgr_context {
+	struct app_config  *cfg;
+	struct ev_loop      loop;
+	struct ev_handler   input_h;
+	struct ev_handler   signal_h;
+	struct ev_handler   timer_h;
+	struct line_buffer  input;
+	bool                input_done;
+	struct connector    conn;
+
+	struct mgr_station *stations;
+	unsigned            nstations;
+
+	uint64_t            seq;
+	uint64_t            sent;
+	uint64_t            replies;
+	uint64_t            failed;
+	uint64_t            pending;
+	uint64_t            start_us;
+	uint64_t            last_us;
+
+	/* Round trip times in microseconds, for the final report */
+	uint32_t           *rtt;
+	size_t              nrtt;
+	size_t              rtt_cap;
+};
+
+int mgr_mode_loop(struct app_config *cfg);
+
+#endif /* __MANAGER_H__ */
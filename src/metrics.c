@@ -0,0 +1,187 @@
+/*
+ * metrics.c: Per-thread counters and latency histograms.
+ */
+
+#include "metrics.h"
+#include "thread_slot.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+__thread struct metrics_shard *metrics_self;
+
+/* Exposition names of the counters, all of them monotonic */
+static const struct {
+	const char *name;
+	const char *help;
+	double      scale;
+} counter_info[METRIC_COUNT] = {
+	[METRIC_PCM_BYTES]    = {"sdrrc_pcm_bytes_total",
+		"PCM bytes written into the encoder pipes", 1},
+	[METRIC_PCM_STALLS]   = {"sdrrc_pcm_stalls_total",
+		"PCM writes held up by a full encoder pipe", 1},
+	[METRIC_PCM_STALL_NS] = {"sdrrc_pcm_stall_seconds_total",
+		"Time spent waiting on full encoder pipes", 1e-9},
+	[METRIC_IQ_BYTES]     = {"sdrrc_iq_bytes_total",
+		"Bytes read from the IQ source", 1},
+	[METRIC_ENC_BYTES]    = {"sdrrc_encoded_bytes_total",
+		"Encoded audio bytes read from the encoders", 1},
+	[METRIC_SPAWNS]       = {"sdrrc_child_spawns_total",
+		"Child processes started", 1},
+	[METRIC_RESTARTS]     = {"sdrrc_child_restarts_total",
+		"Children replaced on reload or retune", 1},
+	[METRIC_CRASHES]      = {"sdrrc_child_crashes_total",
+		"Supervised children that died on their own", 1},
+	[METRIC_ACCEPTED]     = {"sdrrc_connections_accepted_total",
+		"Manager connections accepted", 1},
+	[METRIC_REJECTED]     = {"sdrrc_connections_rejected_total",
+		"Manager connections refused over the limit", 1},
+	[METRIC_COMMANDS]     = {"sdrrc_commands_total",
+		"Commands executed, text and binary", 1},
+	[METRIC_REC_BYTES]    = {"sdrrc_record_bytes_total",
+		"Encoded audio written into recording segments", 1},
+	[METRIC_REC_DROPPED]  = {"sdrrc_record_dropped_bytes_total",
+		"Encoded audio lost because the disk fell behind", 1},
+	[METRIC_HOPS]         = {"sdrrc_hops_total",
+		"Scan list hops to the next entry", 1},
+	[METRIC_HOP_LATE_NS]  = {"sdrrc_hop_late_seconds_total",
+		"Time scan list hops fired after they were due", 1e-9},
+};
+
+static struct metrics_shard shards[METRICS_MAX_SHARDS] = {
+	[METRICS_MAX_SHARDS - 1] = {.shared = true},
+};
+
+/*
+ * All but the shared shard are handed out. Once a thread is given that one,
+ * every shard counts. When a thread exits its shard is given back, but the
+ * counts stay where they are: the next thread that picks the shard up
+ * carries on adding to them.
+ */
+static struct thread_slots slots =
+	THREAD_SLOTS_INIT(shards, METRICS_MAX_SHARDS - 1, in_use, NULL);
+
+/* Hand a free shard to the calling thread, once */
+struct metrics_shard *metrics_register(void)
+{
+	struct metrics_shard *s = thread_slot_claim(&slots);
+
+	if (s)
+		return s;
+
+	atomic_store(&slots.high, METRICS_MAX_SHARDS);
+	return &shards[METRICS_MAX_SHARDS - 1];
+}
+
+/* Sum of every shard. Counters may be a few events behind, never torn */
+void metrics_snapshot(struct metrics_snapshot *snap)
+{
+	unsigned n = thread_slots_high(&slots), k, h, b;
+
+	if (n > METRICS_MAX_SHARDS)
+		n = METRICS_MAX_SHARDS;
+
+	memset(snap, 0, sizeof *snap);
+	for (k = 0; k < n; k++) {
+		struct metrics_shard *s = &shards[k];
+
+		for (h = 0; h < METRIC_COUNT; h++)
+			snap->counter[h] += atomic_load_explicit(&s->counter[h],
+				memory_order_relaxed);
+
+		for (h = 0; h < METRICS_MAX_HISTS; h++) {
+			for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+				snap->hist[h][b] += atomic_load_explicit(&s->hist[h][b],
+					memory_order_relaxed);
+			snap->hist_sum_ns[h] += atomic_load_explicit(&s->hist_sum_ns[h],
+				memory_order_relaxed);
+		}
+	}
+}
+
+/* Upper bound of a bucket in microseconds, 0 for the +Inf one */
+uint64_t metrics_bucket_le_us(unsigned bucket)
+{
+	if (bucket >= METRICS_HIST_BUCKETS - 1)
+		return 0;
+
+	return UINT64_C(1) << (2 * bucket);
+}
+
+/* Upper bound of the bucket holding the 'q' quantile, -1 when empty */
+double metrics_quantile_us(const uint64_t *hist, double q)
+{
+	uint64_t total = 0, seen = 0, rank;
+	unsigned k;
+
+	for (k = 0; k < METRICS_HIST_BUCKETS; k++)
+		total += hist[k];
+	if (total == 0)
+		return -1.0;
+
+	rank = q * total;
+	for (k = 0; k < METRICS_HIST_BUCKETS - 1; k++) {
+		seen += hist[k];
+		if (seen > rank)
+			break;
+	}
+
+	return (k == METRICS_HIST_BUCKETS - 1) ? INFINITY :
+		(double)metrics_bucket_le_us(k);
+}
+
+uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Prometheus text format of a snapshot. Histogram 'k' is labelled with
+ * hist_names[k] and skipped when that name is NULL.
+ */
+void metrics_write_prometheus(FILE *fp, const struct metrics_snapshot *snap,
+	const char *const *hist_names, unsigned nhists)
+{
+	const char *h = "sdrrc_command_duration_seconds";
+	uint64_t count;
+	unsigned k, b;
+
+	for (k = 0; k < METRIC_COUNT; k++) {
+		fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n",
+			counter_info[k].name, counter_info[k].help, counter_info[k].name);
+		if (counter_info[k].scale == 1)
+			fprintf(fp, "%s %" PRIu64 "\n", counter_info[k].name,
+				snap->counter[k]);
+		else
+			fprintf(fp, "%s %.6f\n", counter_info[k].name,
+				snap->counter[k] * counter_info[k].scale);
+	}
+
+	fprintf(fp, "# HELP %s Time to execute a command\n"
+		"# TYPE %s histogram\n", h, h);
+	for (k = 0; k < nhists && k < METRICS_MAX_HISTS; k++) {
+		if (!hist_names[k])
+			continue;
+
+		count = 0;
+		for (b = 0; b < METRICS_HIST_BUCKETS; b++) {
+			count += snap->hist[k][b];
+			if (b < METRICS_HIST_BUCKETS - 1)
+				fprintf(fp, "%s_bucket{command=\"%s\",le=\"%.7g\"} %"
+					PRIu64 "\n", h, hist_names[k],
+					metrics_bucket_le_us(b) * 1e-6, count);
+			else
+				fprintf(fp, "%s_bucket{command=\"%s\",le=\"+Inf\"} %"
+					PRIu64 "\n", h, hist_names[k], count);
+		}
+		fprintf(fp, "%s_sum{command=\"%s\"} %.9f\n", h, hist_names[k],
+			snap->hist_sum_ns[k] * 1e-9);
+		fprintf(fp, "%s_count{command=\"%s\"} %" PRIu64 "\n", h,
+			hist_names[k], count);
+	}
+}
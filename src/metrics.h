@@ -0,0 +1,108 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_MAX_SHARDS      64
+#define METRICS_MAX_HISTS       32
+
+/* Latency buckets: 1 us and up by powers of 4 (about 1 s), then +Inf */
+#define METRICS_HIST_BUCKETS    12
+
+/* A PCM write that takes longer than this found the encoder pipe full */
+#define METRICS_STALL_NS        1000000
+
+enum metric_id {
+	METRIC_PCM_BYTES,       /* PCM written into the encoder pipes */
+	METRIC_PCM_STALLS,      /* Writes held up by a full encoder pipe */
+	METRIC_PCM_STALL_NS,    /* Time spent held up */
+	METRIC_IQ_BYTES,        /* Read from the IQ source */
+	METRIC_ENC_BYTES,       /* Encoded audio read back from ffmpeg */
+	METRIC_SPAWNS,          /* Child processes started */
+	METRIC_RESTARTS,        /* Children replaced on reload or retune */
+	METRIC_CRASHES,         /* Supervised children that died on their own */
+	METRIC_ACCEPTED,        /* Manager connections accepted */
+	METRIC_REJECTED,        /* Manager connections over the limit */
+	METRIC_COMMANDS,        /* Commands executed, both protocols */
+	METRIC_REC_BYTES,       /* Written into recording segments */
+	METRIC_REC_DROPPED,     /* Lost with every block still in flight */
+	METRIC_HOPS,            /* Scan list hops to the next entry */
+	METRIC_HOP_LATE_NS,     /* Time hops fired after they were due */
+	METRIC_COUNT
+};
+
+/*
+ * Every thread counts into a shard of its own. Only the owner writes, with
+ * relaxed loads and stores instead of locked read-modify-write, so the hot
+ * paths never bounce a cache line. Readers sum every shard. A shard is
+ * reused once its thread has exited; threads beyond METRICS_MAX_SHARDS at
+ * once share the last one, which then uses atomic adds.
+ */
+struct metrics_shard {
+	_Atomic uint64_t counter[METRIC_COUNT];
+	_Atomic uint64_t hist[METRICS_MAX_HISTS][METRICS_HIST_BUCKETS];
+	_Atomic uint64_t hist_sum_ns[METRICS_MAX_HISTS];
+	bool             shared;
+	atomic_bool      in_use;
+} __attribute__((aligned(64)));
+
+struct metrics_snapshot {
+	uint64_t counter[METRIC_COUNT];
+	uint64_t hist[METRICS_MAX_HISTS][METRICS_HIST_BUCKETS];
+	uint64_t hist_sum_ns[METRICS_MAX_HISTS];
+};
+
+extern __thread struct metrics_shard *metrics_self;
+
+struct metrics_shard *metrics_register(void);
+void metrics_snapshot(struct metrics_snapshot *snap);
+uint64_t metrics_bucket_le_us(unsigned bucket);
+double metrics_quantile_us(const uint64_t *hist, double q);
+uint64_t metrics_now_ns(void);
+void metrics_write_prometheus(FILE *fp, const struct metrics_snapshot *snap,
+	const char *const *hist_names, unsigned nhists);
+
+static inline struct metrics_shard *metrics_shard(void)
+{
+	if (__builtin_expect(!metrics_self, 0))
+		metrics_self = metrics_register();
+	return metrics_self;
+}
+
+static inline void metrics_bump(struct metrics_shard *s, _Atomic uint64_t *c,
+	uint64_t v)
+{
+	if (s->shared)
+		atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+	else
+		atomic_store_explicit(c, atomic_load_explicit(c,
+			memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline void metrics_add(enum metric_id id, uint64_t v)
+{
+	struct metrics_shard *s = metrics_shard();
+
+	metrics_bump(s, &s->counter[id], v);
+}
+
+/* Record a duration into histogram 'hist' */
+static inline void metrics_observe(unsigned hist, uint64_t ns)
+{
+	struct metrics_shard *s = metrics_shard();
+	uint64_t limit = 1000;
+	unsigned k = 0;
+
+	while (ns > limit && k < METRICS_HIST_BUCKETS - 1) {
+		limit *= 4;
+		k++;
+	}
+
+	metrics_bump(s, &s->hist[hist][k], 1);
+	metrics_bump(s, &s->hist_sum_ns[hist], ns);
+}
+
+#endif /* __METRICS_H__ */
@@ -16,10 +16,15 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <endian.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 int test_connection(int sockfd)
 {
 	ssize_t ret;
@@ -35,38 +40,72 @@ int test_connection(int sockfd)
 	return 0;
 }
 
-void *resolve_host(const char *hostname, struct sockaddr_in *addr)
+/* Stream socket addresses of 'hostname', see getaddrinfo(3) */
+static int tcp_lookup(const char *hostname, uint16_t port,
+	struct addrinfo **res)
 {
-	struct hostent *hp = gethostbyname(hostname);
+	struct addrinfo hints;
+	char service[8];
+	int err;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	snprintf(service, sizeof service, "%u", port);
 
-	if (hp == NULL) {
-		addr->sin_addr.s_addr = inet_addr(hostname);
-		hp = gethostbyaddr(&(addr->sin_addr.s_addr),
-			sizeof(addr->sin_addr.s_addr), AF_INET);
+	err = getaddrinfo(hostname, service, &hints, res);
+	if (err) {
+		print_error("Can't find host %s: %s\n", hostname,
+			gai_strerror(err));
+		return -1;
 	}
 
-	return hp;
+	return 0;
 }
 
+/*
+ * Listen on every address of both families when the host has IPv6, IPv4
+ * clients then show up as mapped addresses. On IPv4 only otherwise.
+ */
 int tcp_server_socket(uint16_t port, int backlog)
 {
-	int sock;
+	const int reuse = 1, v6only = 0;
+	struct sockaddr_in6 addr6;
 	struct sockaddr_in addr;
+	int sock;
+
+	sock = socket(AF_INET6, SOCK_STREAM, 0);
+	if (sock >= 0) {
+		memset(&addr6, 0, sizeof addr6);
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = htons(port);
+		addr6.sin6_addr = in6addr_any;
+
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof v6only);
+		if (bind(sock, (struct sockaddr *)&addr6, sizeof addr6) == 0) {
+			listen(sock, backlog);
+			return sock;
+		}
+		close(sock);
+	}
 
 	/* Create the socket. */
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 
 	/* Create the address of the server. */
+	memset(&addr, 0, sizeof addr);
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY); /* Use the wildcard address.*/
 
-	const int reuse = 1;
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
 
 	/* Bind the socket to the address. */
 	if (bind(sock, (struct sockaddr *)&addr, sizeof addr)) {
 		print_error("cannot bind the socket.\n");
+		close(sock);
 		return -1;
 	}
 
@@ -76,55 +115,88 @@ int tcp_server_socket(uint16_t port, int backlog)
 	return sock;
 }
 
+/*
+ * Connect to 'hostname' and return a blocking socket, trying each of its
+ * addresses for up to 5 seconds. Only for tools that have nothing better
+ * to do meanwhile, the event loop uses the connector instead.
+ */
 int tcp_client_socket(const char *hostname, uint16_t port)
 {
-	int sock, len, flags;
-	struct hostent *hp;
-	struct sockaddr_in addr;
-	struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
-	fd_set working_fds;
+	struct addrinfo *res, *ai;
+	struct pollfd pfd;
+	socklen_t so_len;
+	int sock, so_error;
 
-	/* Look up our host's network address.*/
-	if ((hp = resolve_host(hostname, &addr)) == NULL) {
-		print_error("Can't find host %s\n", hostname);
+	/* Look up our host's network addresses.*/
+	if (tcp_lookup(hostname, port, &res) < 0)
 		return -2;
-	}
-
-	/* Create a socket in the INET domain.*/
-	sock = socket(AF_INET, SOCK_STREAM, 0);
-
-	/* Set socket in non-blocking mode */
-	flags = fcntl(sock, F_GETFL, 0);
-	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
-	/* Create the address of the server. */
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	memcpy(&addr.sin_addr, hp->h_addr_list[0], hp->h_length);
-	len = sizeof(struct sockaddr_in);
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (sock < 0)
+			continue;
 
-	/* Connect to the server. */
-	connect(sock, (struct sockaddr *)&addr, len);
+		/* Set socket in non-blocking mode to bound the wait */
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
 
-	/* Wait for timeout */
-	FD_ZERO(&working_fds);
-	FD_SET(sock, &working_fds);
-	if (select(sock + 1, NULL, &working_fds, NULL, &timeout) == 1) {
-		int so_error;
-		socklen_t so_len = sizeof so_error;
+		so_error = 0;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			so_error = errno;
+			pfd.fd = sock;
+			pfd.events = POLLOUT;
+			if (so_error == EINPROGRESS && poll(&pfd, 1, 5000) == 1) {
+				so_len = sizeof so_error;
+				getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &so_len);
+			}
+		}
 
-		getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &so_len);
 		if (so_error == 0) {
-			flags = fcntl(sock, F_GETFL);
-			fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+			freeaddrinfo(res);
 			return sock;
 		}
+		close(sock);
 	}
 
-	/* Timed out */
+	/* Refused or timed out everywhere */
+	freeaddrinfo(res);
 	return -1;
 }
 
+/*
+ * Start connecting to 'hostname' without waiting for the handshake. The
+ * socket is returned non-blocking: it becomes writable once the connection
+ * is done, SO_ERROR then tells whether it succeeded. Only the first address
+ * is tried, and the lookup itself blocks: see the connector for better.
+ */
+int tcp_client_connect(const char *hostname, uint16_t port)
+{
+	struct addrinfo *res;
+	int sock;
+
+	if (tcp_lookup(hostname, port, &res) < 0)
+		return -2;
+
+	sock = socket(res->ai_family, SOCK_STREAM, 0);
+	if (sock < 0) {
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	if (connect(sock, res->ai_addr, res->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		freeaddrinfo(res);
+		close(sock);
+		return -1;
+	}
+
+	freeaddrinfo(res);
+	return sock;
+}
+
 /*
  * Read characters from 'fd' until a newline is encountered. If a newline
  * character is not encountered in the first (n - 1) bytes, then the excess
@@ -177,3 +249,148 @@ ssize_t read_line(int fd, void *buffer, size_t n)
 	*buf = '\0';
 	return totRead;
 }
+
+/* Return the offset of the first '\n' in 'buf', or 'n' when there is none */
+static size_t find_newline(const char *buf, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < n; i++)
+		if (buf[i] == '\n')
+			return i;
+
+	return n;
+}
+
+void line_buffer_init(struct line_buffer *lb)
+{
+	lb->head = 0;
+	lb->scan = 0;
+	lb->tail = 0;
+	lb->discard = false;
+}
+
+/*
+ * Perform a single read() from 'fd' into the free space of 'lb'. Returns the
+ * number of bytes read, 0 on EOF or -1 on error (errno is left untouched, so
+ * EAGAIN can be checked by the caller on non-blocking descriptors).
+ */
+ssize_t line_buffer_fill(struct line_buffer *lb, int fd)
+{
+	ssize_t nbr;
+
+	/* Reclaim the space taken by already consumed lines */
+	if (lb->head > 0) {
+		memmove(lb->data, lb->data + lb->head, lb->tail - lb->head);
+		lb->scan -= lb->head;
+		lb->tail -= lb->head;
+		lb->head = 0;
+	}
+
+	/* Full buffer without a newline: drop it and skip up to the next one */
+	if (lb->tail == LINE_BUFSZ) {
+		lb->scan = lb->tail = 0;
+		lb->discard = true;
+	}
+
+	do {
+		nbr = read(fd, lb->data + lb->tail, LINE_BUFSZ - lb->tail);
+	} while (nbr < 0 && errno == EINTR);
+
+	if (nbr > 0)
+		lb->tail += nbr;
+
+	return nbr;
+}
+
+/*
+ * Frame the next buffered line. On success '*line' points to a null
+ * terminated string inside the buffer, valid until the next call to
+ * line_buffer_fill(), and its length is returned (newline and carriage
+ * return excluded). Returns LB_AGAIN when more data is needed, and
+ * LB_TOOLONG once for every line that did not fit into the buffer.
+ */
+ssize_t line_buffer_next(struct line_buffer *lb, char **line)
+{
+	size_t off, len;
+	char *start;
+
+	off = lb->scan + find_newline(lb->data + lb->scan, lb->tail - lb->scan);
+	if (off == lb->tail) {
+		lb->scan = lb->tail;
+		return LB_AGAIN;
+	}
+
+	start = lb->data + lb->head;
+	len = off - lb->head;
+	lb->head = lb->scan = off + 1;
+
+	if (lb->discard) {
+		lb->discard = false;
+		return LB_TOOLONG;
+	}
+
+	if (len > 0 && start[len - 1] == '\r')
+		len--;
+	start[len] = '\0';
+
+	*line = start;
+	return len;
+}
+
+/*
+ * Hand out up to 'max' raw bytes, for a payload announced by the last line.
+ * '*data' is valid until the next call to line_buffer_fill().
+ */
+size_t line_buffer_take(struct line_buffer *lb, void **data, size_t max)
+{
+	size_t len = lb->tail - lb->head;
+
+	if (len > max)
+		len = max;
+
+	*data = lb->data + lb->head;
+	lb->head += len;
+	if (lb->scan < lb->head)
+		lb->scan = lb->head;
+
+	return len;
+}
+
+/*
+ * Frame the next length-prefixed message instead of a line: a little endian
+ * u32 with the payload size, then the payload. Same contract as
+ * line_buffer_next(), the payload is handed out in place. A frame that can
+ * never fit into the buffer is reported with LB_TOOLONG on every call, there
+ * is no way to find the next frame after it.
+ */
+ssize_t line_buffer_frame(struct line_buffer *lb, void **payload)
+{
+	uint32_t len;
+
+	if (lb->tail - lb->head < sizeof len)
+		return LB_AGAIN;
+
+	memcpy(&len, lb->data + lb->head, sizeof len);
+	len = le32toh(len);
+	if (len > LINE_BUFSZ - sizeof len)
+		return LB_TOOLONG;
+	if (lb->tail - lb->head - sizeof len < len)
+		return LB_AGAIN;
+
+	*payload = lb->data + lb->head + sizeof len;
+	lb->head += sizeof len + len;
+	lb->scan = lb->head;
+
+	return len;
+}
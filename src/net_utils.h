@@ -1,6 +1,7 @@
 #ifndef __NET_UTILS_H__
 #define __NET_UTILS_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <pthread.h>
@@ -9,8 +10,28 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 
-#define LISTEN_BACKLOG  16
-#define STATION_BUFSZ   192
+/* Managers connect all at once now, a SYN dropped waits a second to retry */
+#define LISTEN_BACKLOG  1024
+#define STATION_BUFSZ   512
+#define LINE_BUFSZ      4096
+
+/* Return values of line_buffer_next/frame() besides the length */
+#define LB_AGAIN        -1  /* No complete line buffered yet */
+#define LB_TOOLONG      -2  /* A line longer than LINE_BUFSZ was discarded */
+
+/*
+ * Per-connection receive buffer. Lines are framed in place: the newline is
+ * replaced by a null byte and a pointer into 'data' is handed out, so no
+ * copy is made. Consumed bytes are reclaimed by moving the pending partial
+ * line back to the start of the buffer right before the next read.
+ */
+struct line_buffer {
+	size_t head;        /* First byte not consumed yet */
+	size_t scan;        /* First byte not scanned for a newline yet */
+	size_t tail;        /* End of valid data */
+	bool   discard;     /* Skipping the rest of an overlong line */
+	char   data[LINE_BUFSZ];
+};
 
 #define max(x, y) ({ \
 	__typeof__(x) _x = (x); \
@@ -19,10 +40,16 @@
 })
 
 int test_connection(int sockfd);
-void *resolve_host(const char *hostname, struct sockaddr_in *addr);
 int tcp_server_socket(uint16_t port, int backlog);
 int tcp_client_socket(const char *hostname, uint16_t port);
+int tcp_client_connect(const char *hostname, uint16_t port);
 
 ssize_t read_line(int fd, void *buffer, size_t n);
 
+void line_buffer_init(struct line_buffer *lb);
+ssize_t line_buffer_fill(struct line_buffer *lb, int fd);
+ssize_t line_buffer_next(struct line_buffer *lb, char **line);
+ssize_t line_buffer_frame(struct line_buffer *lb, void **payload);
+size_t line_buffer_take(struct line_buffer *lb, void **data, size_t max);
+
 #endif /* __NET_UTILS_H__ */
@@ -0,0 +1,296 @@
+/*
+ * pcm_ring.c: Audio buffer between the demodulator and the encoder.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include "pcm_ring.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Blocking write into the encoder pipe, counting the time it waits */
+static int pcm_write_all(int fd, const uint8_t *p, size_t n)
+{
+	uint64_t t0 = metrics_now_ns(), dt;
+	ssize_t nbw;
+
+	while (n > 0) {
+		nbw = write(fd, p, n);
+		if (nbw < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		metrics_add(METRIC_PCM_BYTES, nbw);
+		p += nbw;
+		n -= nbw;
+	}
+
+	dt = metrics_now_ns() - t0;
+	if (dt > METRICS_STALL_NS) {
+		metrics_add(METRIC_PCM_STALLS, 1);
+		metrics_add(METRIC_PCM_STALL_NS, dt);
+	}
+
+	return 0;
+}
+
+/* Sleep until the ring has data, false when stopping */
+static bool pcm_ring_wait(struct pcm_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->waiting, true);
+	while (!atomic_load(&ring->stop) &&
+	       atomic_load(&ring->head) == atomic_load(&ring->tail))
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	atomic_store(&ring->waiting, false);
+	pthread_mutex_unlock(&ring->lock);
+
+	return !atomic_load(&ring->stop);
+}
+
+static void *pcm_ring_pump(void *arg)
+{
+	struct pcm_ring *ring = arg;
+	uint8_t chunk[PCM_RING_CHUNK];
+	uint64_t head, tail, t0;
+	size_t n, off, first;
+
+	trace_thread_name("pcm pump");
+	for (;;) {
+		tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (head == tail) {
+			if (!pcm_ring_wait(ring))
+				break;
+			continue;
+		}
+
+		n = (head - tail < sizeof chunk) ? head - tail : sizeof chunk;
+		off = tail & (ring->size - 1);
+		first = (n < ring->size - off) ? n : ring->size - off;
+		memcpy(chunk, ring->buf + off, first);
+		memcpy(chunk + first, ring->buf, n - first);
+
+		/* The producer dropped these bytes meanwhile, the copy may be torn */
+		if (!atomic_compare_exchange_strong(&ring->tail, &tail, tail + n))
+			continue;
+
+		/* Only happens once the station has closed the encoder pipe */
+		t0 = trace_begin();
+		if (pcm_write_all(ring->out_fd, chunk, n) < 0) {
+			atomic_store(&ring->failed, true);
+			break;
+		}
+		trace_end("pcm write", "pump", t0, n);
+	}
+
+	return NULL;
+}
+
+/* Ring holding 'msecs' of audio at 'rate', pumped into 'out_fd' */
+struct pcm_ring *pcm_ring_create(int out_fd, uint32_t rate, unsigned msecs,
+	uint8_t policy)
+{
+	struct pcm_ring *ring;
+	size_t want, size = PCM_RING_CHUNK;
+
+	want = (uint64_t)rate * sizeof(int16_t) * msecs / 1000;
+	while (size < want)
+		size <<= 1;
+
+	ring = calloc(1, sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	ring->buf = malloc(size);
+	if (!ring->buf) {
+		free(ring);
+		return NULL;
+	}
+	ring->size = size;
+	ring->rate = rate;
+	ring->policy = policy;
+	ring->out_fd = out_fd;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, false);
+	atomic_init(&ring->stop, false);
+	atomic_init(&ring->failed, false);
+	squelch_init(&ring->squelch, SQL_OFF, -1);
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	if (pthread_create(&ring->tid, NULL, &pcm_ring_pump, ring) != 0) {
+		pthread_mutex_destroy(&ring->lock);
+		pthread_cond_destroy(&ring->cond);
+		free(ring->buf);
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/*
+ * Stop the pump and close the encoder pipe. A pump blocked on a full pipe
+ * only returns once the encoder is gone, so kill it first.
+ */
+void pcm_ring_free(struct pcm_ring *ring)
+{
+	struct pcm_tap *tap;
+
+	if (!ring)
+		return;
+
+	while (ring->ntaps > 0) {
+		tap = &ring->taps[--ring->ntaps];
+		pcm_ring_free(tap->ring);
+		resampler_free(&tap->rs);
+		free(tap->pcm);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->stop, true);
+	pthread_cond_signal(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->tid, NULL);
+
+	close(ring->out_fd);
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+	free(ring->buf);
+	free(ring);
+}
+
+/*
+ * Feed 'out', and free it along with 'ring', with the audio of 'ring'
+ * resampled to the rate of 'out'.
+ */
+int pcm_ring_add_tap(struct pcm_ring *ring, struct pcm_ring *out)
+{
+	struct pcm_tap *tap;
+
+	if (ring->ntaps == PCM_MAX_TAPS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	tap = &ring->taps[ring->ntaps];
+	if (resampler_init(&tap->rs, ring->rate, out->rate) < 0)
+		return -1;
+	tap->pcm = malloc(resampler_max_out(&tap->rs, RS_BLOCK) * sizeof *tap->pcm);
+	if (!tap->pcm) {
+		resampler_free(&tap->rs);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tap->ring = out;
+	ring->ntaps++;
+	return 0;
+}
+
+static void pcm_ring_feed_taps(struct pcm_ring *ring, const int16_t *pcm,
+	size_t n)
+{
+	struct pcm_tap *tap;
+	size_t chunk, nout;
+	unsigned k;
+
+	for (; n > 0; pcm += chunk, n -= chunk) {
+		chunk = (n < RS_BLOCK) ? n : RS_BLOCK;
+		for (k = 0; k < ring->ntaps; k++) {
+			tap = &ring->taps[k];
+			nout = resampler_process(&tap->rs, pcm, chunk, tap->pcm);
+			pcm_ring_push(tap->ring, tap->pcm, nout * sizeof *tap->pcm);
+		}
+	}
+}
+
+/* Queue 'n' bytes of s16 PCM, never blocks. Only one thread may push */
+void pcm_ring_push(struct pcm_ring *ring, const void *data, size_t n)
+{
+	const uint8_t *p = data;
+	uint64_t head, tail, fill;
+	size_t room, lose, off, first;
+
+	n &= ~(size_t)1;
+	if (ring->ntaps > 0)
+		pcm_ring_feed_taps(ring, data, n / sizeof(int16_t));
+
+	/* Nobody is draining it anymore */
+	if (atomic_load_explicit(&ring->failed, memory_order_relaxed))
+		return;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	room = ring->size - (head - tail);
+
+	if (n > room) {
+		atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+		if (ring->policy == PCM_DROP_NEWEST) {
+			lose = n - room;
+			n = room;
+		} else {
+			/* Only the newest 'size' bytes can make it at all */
+			if (n > ring->size) {
+				lose = n - ring->size;
+				p += lose;
+				n = ring->size;
+				atomic_fetch_add_explicit(&ring->dropped, lose,
+					memory_order_relaxed);
+			}
+
+			/* Push the tail past the oldest audio, racing the pump */
+			do {
+				room = ring->size - (head - tail);
+				lose = (n > room) ? n - room : 0;
+			} while (lose > 0 && !atomic_compare_exchange_weak(&ring->tail,
+				&tail, tail + lose));
+		}
+		atomic_fetch_add_explicit(&ring->dropped, lose, memory_order_relaxed);
+	}
+
+	if (n == 0)
+		return;
+
+	off = head & (ring->size - 1);
+	first = (n < ring->size - off) ? n : ring->size - off;
+	memcpy(ring->buf + off, p, first);
+	memcpy(ring->buf, p + first, n - first);
+	atomic_store(&ring->head, head + n);
+
+	fill = head + n - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (fill > atomic_load_explicit(&ring->hwm, memory_order_relaxed))
+		atomic_store_explicit(&ring->hwm, fill, memory_order_relaxed);
+
+	/* Pairs with the 'waiting' store and 'head' check in pcm_ring_wait() */
+	if (atomic_load(&ring->waiting)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+/* Bytes queued right now */
+size_t pcm_ring_fill(struct pcm_ring *ring)
+{
+	return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+const char *pcm_policy_to_string(uint8_t policy)
+{
+	return (policy == PCM_DROP_NEWEST) ? "drop-newest" : "drop-oldest";
+}
+
+int string_to_pcm_policy(const char *str)
+{
+	if (strcmp(str, "oldest") == 0 || strcmp(str, "drop-oldest") == 0)
+		return PCM_DROP_OLDEST;
+	if (strcmp(str, "newest") == 0 || strcmp(str, "drop-newest") == 0)
+		return PCM_DROP_NEWEST;
+	return -1;
+}
@@ -0,0 +1,87 @@
+#ifndef __PCM_RING_H__
+#define __PCM_RING_H__
+
+#include "resample.h"
+#include "squelch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* What to throw away when the encoder falls behind and the ring is full */
+#define PCM_DROP_OLDEST     0x00    /* Keep the latest audio, default */
+#define PCM_DROP_NEWEST     0x01    /* Keep what is queued, lose the new */
+
+#define PCM_RING_MIN_MS     50
+#define PCM_RING_MAX_MS     60000
+#define PCM_RING_DEFAULT_MS 1000
+
+/* Bytes handed to the encoder per write() */
+#define PCM_RING_CHUNK      8192
+
+/* Rings fed with a resampled copy of the audio of another one */
+#define PCM_MAX_TAPS        4
+
+struct pcm_ring;
+
+struct pcm_tap {
+	struct resampler  rs;
+	struct pcm_ring  *ring;
+	int16_t          *pcm;          /* One resampled block */
+};
+
+/*
+ * Buffer between a PCM producer (the demodulator, or the station reading
+ * rtl_fm) and an encoder pipe. The producer never blocks: when the ring is
+ * full, audio is dropped according to 'policy' and the overrun is counted.
+ * A pump thread of the ring moves the data into 'out_fd' with blocking
+ * writes, so a slow encoder only delays the pump.
+ *
+ * Positions are absolute byte counts. 'head' only moves in the producer,
+ * 'tail' in the pump or, when dropping the oldest audio, in the producer.
+ * Both move by whole s16 samples.
+ *
+ * The producer also runs the squelch of the encoder, it starts out open.
+ * Audio it pushes goes to the taps as well, at their own rates, so one
+ * demodulator feeds encoders at several rates. The taps are owned by the
+ * ring and only added before the producer gets it.
+ */
+struct pcm_ring {
+	uint8_t         *buf;
+	size_t           size;          /* Power of two */
+	uint32_t         rate;
+	uint8_t          policy;
+	int              out_fd;
+	struct pcm_tap   taps[PCM_MAX_TAPS];
+	unsigned         ntaps;
+
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+
+	/* Readable from any thread */
+	_Atomic uint64_t hwm;           /* Highest fill level seen */
+	_Atomic uint64_t overruns;      /* Pushes that did not fit */
+	_Atomic uint64_t dropped;       /* Bytes lost to overruns */
+	atomic_bool      failed;        /* Encoder pipe is gone */
+	struct squelch   squelch;
+
+	pthread_t        tid;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	atomic_bool      waiting;       /* Pump asleep on an empty ring */
+	atomic_bool      stop;
+};
+
+struct pcm_ring *pcm_ring_create(int out_fd, uint32_t rate, unsigned msecs,
+	uint8_t policy);
+void pcm_ring_free(struct pcm_ring *ring);
+int pcm_ring_add_tap(struct pcm_ring *ring, struct pcm_ring *out);
+void pcm_ring_push(struct pcm_ring *ring, const void *data, size_t n);
+size_t pcm_ring_fill(struct pcm_ring *ring);
+
+const char *pcm_policy_to_string(uint8_t policy);
+int string_to_pcm_policy(const char *str);
+
+#endif /* __PCM_RING_H__ */
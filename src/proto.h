@@ -0,0 +1,110 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include "net_utils.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+
+/*
+ * Binary control protocol. A manager switches its connection over with the
+ * "binary" text command, every byte after the "<Protocol: binary>" reply is
+ * a frame:
+ *
+ *     u32 length | length bytes of fixed size records
+ *
+ * All integers are little endian. A request frame may batch any number of
+ * requests that fit; they are executed in order and answered in order, in
+ * one or more reply frames. Each request gets exactly one reply, except
+ * PROTO_OP_LISTCHAN which gets one per channel, all but the last flagged
+ * with PROTO_F_MORE.
+ */
+
+#define PROTO_FRAME_MAX     (LINE_BUFSZ - sizeof(uint32_t))
+#define PROTO_MAX_RECORDS   (PROTO_FRAME_MAX / sizeof(struct proto_request))
+
+/* Operations, same meaning and permissions as the text commands */
+#define PROTO_OP_STATUS     0x01
+#define PROTO_OP_START      0x02
+#define PROTO_OP_STOP       0x03
+#define PROTO_OP_RELOAD     0x04
+#define PROTO_OP_SETMOD     0x05    /* modulation */
+#define PROTO_OP_SETFREQ    0x06    /* freq */
+#define PROTO_OP_CONTROL    0x07
+#define PROTO_OP_ADDCHAN    0x08    /* freq, modulation */
+#define PROTO_OP_DELCHAN    0x09    /* chan */
+#define PROTO_OP_LISTCHAN   0x0A
+#define PROTO_OP_APPLY      0x0B    /* freq (0 keeps it), modulation (MOD_UNKNOWN) */
+#define PROTO_OP_COUNT      0x0C
+
+/* Reply status */
+#define PROTO_OK            0x00
+#define PROTO_E_INVAL       0x01    /* Bad argument */
+#define PROTO_E_RANGE       0x02    /* Frequency out of range or capture */
+#define PROTO_E_PERM        0x03    /* Read-only connection */
+#define PROTO_E_BUSY        0x04    /* Controlled by another manager */
+#define PROTO_E_STATE       0x05    /* Already running / not running */
+#define PROTO_E_NOENT       0x06    /* No such channel */
+#define PROTO_E_NOSPC       0x07    /* Too many channels */
+#define PROTO_E_NOTSUP      0x08    /* Unknown operation, or needs an IQ source */
+#define PROTO_E_IO          0x09    /* Pipeline could not be started */
+
+/* Reply flags */
+#define PROTO_F_RUNNING     0x01    /* Pipeline is running */
+#define PROTO_F_CONTROL     0x02    /* This connection controls the station */
+#define PROTO_F_MORE        0x04    /* More replies to the same request follow */
+
+struct proto_request {
+	uint32_t id;            /* Echoed back in the reply */
+	uint8_t  op;
+	uint8_t  modulation;    /* MOD_* */
+	uint16_t chan;
+	uint32_t freq;          /* Hz */
+	uint32_t reserved;
+};
+
+/* Settings of the station, or of 'chan' for the channel operations */
+struct proto_reply {
+	uint32_t id;
+	uint8_t  op;
+	uint8_t  status;
+	uint8_t  modulation;
+	uint8_t  flags;
+	uint32_t freq;
+	uint16_t chan;
+	uint16_t reserved;
+};
+
+_Static_assert(sizeof(struct proto_request) == 16, "request is 16 bytes");
+_Static_assert(sizeof(struct proto_reply) == 16, "reply is 16 bytes");
+
+/* The station reports failures through errno, this is their wire form */
+static inline uint8_t proto_status(int err)
+{
+	switch (err) {
+	case 0:
+		return PROTO_OK;
+	case EINVAL:
+		return PROTO_E_INVAL;
+	case ERANGE: /* Falls through */
+	case EDOM:
+		return PROTO_E_RANGE;
+	case EPERM:
+		return PROTO_E_PERM;
+	case EBUSY:
+		return PROTO_E_BUSY;
+	case EALREADY: /* Falls through */
+	case ESRCH:
+		return PROTO_E_STATE;
+	case ENOENT:
+		return PROTO_E_NOENT;
+	case ENOSPC:
+		return PROTO_E_NOSPC;
+	case ENOTSUP:
+		return PROTO_E_NOTSUP;
+	}
+	return PROTO_E_IO;
+}
+
+#endif /* __PROTO_H__ */
@@ -0,0 +1,738 @@
+/*
+ * recorder.c: Segmented recording of the encoded streams, with a time index.
+ *
+ * The station thread copies Ogg pages into large aligned blocks and queues
+ * the full ones; a writer thread puts them on disk. Segment files are
+ * preallocated to REC_SEGMENT_SIZE so a long recording does not fragment,
+ * and trimmed to their real length once complete.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include "recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * Bare io_uring, only the submission of writes is needed here. Every
+ * batch is waited for before the next one, so the rings never fill up.
+ */
+struct rec_uring {
+	int                  fd;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned             entries;
+
+	void                *sq_ptr;
+	void                *cq_ptr;
+	size_t               sq_len;
+	size_t               cq_len;
+	size_t               sqes_len;
+};
+
+static void rec_uring_free(struct rec_uring *u)
+{
+	if (!u)
+		return;
+
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+	free(u);
+}
+
+/* NULL when the kernel has no io_uring or does not let us use it */
+static struct rec_uring *rec_uring_init(unsigned entries)
+{
+#ifdef __NR_io_uring_setup
+	struct io_uring_params p;
+	struct rec_uring *u;
+	int fd;
+
+	memset(&p, 0, sizeof p);
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return NULL;
+
+	u = calloc(1, sizeof *u);
+	if (!u) {
+		close(fd);
+		return NULL;
+	}
+	u->fd = fd;
+	u->entries = p.sq_entries;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto _err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (u->cq_ptr == MAP_FAILED)
+		goto _err;
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto _err;
+
+	u->sq_tail = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ptr + p.cq_off.cqes);
+	return u;
+
+_err:
+	rec_uring_free(u);
+	return NULL;
+#else
+	return NULL;
+#endif
+}
+
+static int pwrite_all(int fd, const uint8_t *p, size_t n, uint64_t off)
+{
+	ssize_t nbw;
+
+	while (n > 0) {
+		nbw = pwrite(fd, p, n, off);
+		if (nbw < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += nbw;
+		n -= nbw;
+		off += nbw;
+	}
+
+	return 0;
+}
+
+static void rec_write_error(struct recorder *rec)
+{
+	print_error("cannot write the recording of %s: %s\n", rec->name,
+		strerror(errno));
+}
+
+/*
+ * Write 'n' blocks in one io_uring_enter(). Writes the kernel cut short
+ * are finished with pwrite(). Returns -1 if io_uring turned out unusable
+ * and nothing was written, 1 if it did not know the opcode.
+ */
+static int rec_uring_write(struct rec_writer *w, struct rec_buf **bufs,
+	unsigned n)
+{
+	struct rec_uring *u = w->uring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, ctail, idx, k, submitted = 0, done = 0;
+	struct rec_buf *b;
+	int ret, res, status = 0;
+
+	tail = *u->sq_tail;
+	for (k = 0; k < n; k++) {
+		b = bufs[k];
+		idx = tail & *u->sq_mask;
+		sqe = &u->sqes[idx];
+		memset(sqe, 0, sizeof *sqe);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = b->rec->fd;
+		sqe->addr = (uintptr_t)b->data;
+		sqe->len = b->len;
+		sqe->off = b->off;
+		sqe->user_data = k;
+		u->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (done < n) {
+		ret = syscall(__NR_io_uring_enter, u->fd, n - submitted, n - done,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (submitted == 0)
+				return -1;
+			print_error("io_uring has failed: %s\n", strerror(errno));
+			return 0;
+		}
+		submitted += ret;
+		atomic_fetch_add_explicit(&w->submits, 1, memory_order_relaxed);
+
+		head = *u->cq_head;
+		ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != ctail; head++, done++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			b = bufs[cqe->user_data];
+			res = cqe->res;
+			if (res == (int)b->len)
+				continue;
+
+			/* Kernels older than 5.6 know io_uring but not this opcode */
+			if (res == -EINVAL || res == -EOPNOTSUPP)
+				status = 1;
+			if (res < 0) {
+				errno = -res;
+				res = 0;
+			}
+			if (pwrite_all(b->rec->fd, b->data + res, b->len - res,
+					b->off + res) < 0)
+				rec_write_error(b->rec);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return status;
+}
+
+/* Put the queued blocks on disk, in one go when possible */
+static void rec_flush(struct rec_writer *w, struct rec_buf **bufs,
+	unsigned *n)
+{
+	uint64_t bytes = 0;
+	unsigned k;
+	int ret = -1;
+
+	if (*n == 0)
+		return;
+
+	if (w->uring)
+		ret = rec_uring_write(w, bufs, *n);
+	if (ret != 0 && w->uring) {
+		print_warn("io_uring is not usable, writing with pwrite()\n");
+		rec_uring_free(w->uring);
+		w->uring = NULL;
+	}
+	if (ret < 0) {
+		for (k = 0; k < *n; k++) {
+			if (pwrite_all(bufs[k]->rec->fd, bufs[k]->data, bufs[k]->len,
+					bufs[k]->off) < 0)
+				rec_write_error(bufs[k]->rec);
+		}
+		atomic_fetch_add_explicit(&w->submits, *n, memory_order_relaxed);
+	}
+
+	for (k = 0; k < *n; k++)
+		bytes += bufs[k]->len;
+	atomic_fetch_add_explicit(&w->bytes, bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&w->writes, *n, memory_order_relaxed);
+	metrics_add(METRIC_REC_BYTES, bytes);
+	*n = 0;
+}
+
+static void rec_segment_path(const struct recorder *rec, uint64_t seg_ms,
+	const char *ext, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s-%" PRIu64 ".%s", rec->dir, rec->name, seg_ms,
+		ext);
+}
+
+static void rec_open_segment(struct recorder *rec, uint64_t seg_ms)
+{
+	char path[512];
+	int err;
+
+	if (rec->fd >= 0)
+		close(rec->fd);
+
+	rec_segment_path(rec, seg_ms, "ogg", path, sizeof path);
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	rec->fd_ms = seg_ms;
+	if (rec->fd < 0) {
+		print_error("cannot create %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	/* Best effort, a full disk shows up in the writes anyway */
+	err = posix_fallocate(rec->fd, 0, REC_SEGMENT_SIZE);
+	if (err != 0)
+		print_warn("cannot preallocate %s: %s\n", path, strerror(err));
+}
+
+/* Index file: magic, start time, then the entries as they are in memory */
+static void rec_write_index(struct recorder *rec, const struct rec_buf *b)
+{
+	char path[512], magic[8] = REC_IDX_MAGIC;
+	uint64_t start = b->seg_ms;
+	int fd;
+
+	if (!b->idx)
+		return;
+
+	rec_segment_path(rec, b->seg_ms, "idx", path, sizeof path);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 ||
+	    pwrite_all(fd, (uint8_t *)magic, sizeof magic, 0) < 0 ||
+	    pwrite_all(fd, (uint8_t *)&start, sizeof start, sizeof magic) < 0 ||
+	    pwrite_all(fd, (uint8_t *)b->idx, b->nidx * sizeof *b->idx,
+			sizeof magic + sizeof start) < 0)
+		print_error("cannot write %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+static void rec_write_batch(struct rec_writer *w, struct rec_buf *list)
+{
+	struct rec_buf *pending[REC_QUEUE_DEPTH], *b;
+	struct recorder *rec;
+	unsigned n = 0;
+
+	for (b = list; b; b = b->next) {
+		rec = b->rec;
+		if (rec->fd < 0 || rec->fd_ms != b->seg_ms) {
+			rec_flush(w, pending, &n);
+			rec_open_segment(rec, b->seg_ms);
+		}
+
+		if (b->len > 0 && rec->fd >= 0) {
+			pending[n++] = b;
+			if (n == REC_QUEUE_DEPTH ||
+			    (w->uring && n == w->uring->entries))
+				rec_flush(w, pending, &n);
+		}
+
+		if (b->last) {
+			rec_flush(w, pending, &n);
+			if (rec->fd >= 0) {
+				if (ftruncate(rec->fd, b->off + b->len) < 0)
+					print_warn("cannot trim a segment of %s\n", rec->name);
+				close(rec->fd);
+				rec->fd = -1;
+			}
+			rec_write_index(rec, b);
+		}
+	}
+
+	rec_flush(w, pending, &n);
+}
+
+static void *rec_writer_thread(void *arg)
+{
+	struct rec_writer *w = arg;
+	struct rec_buf *list, *b, *next;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->head && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		list = w->head;
+		w->head = w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		if (!list)
+			break;
+
+		rec_write_batch(w, list);
+
+		/* The recorder may be freed as soon as its last block is back */
+		pthread_mutex_lock(&w->lock);
+		for (b = list; b; b = next) {
+			next = b->next;
+			free(b->idx);
+			b->idx = NULL;
+			b->next = b->rec->free;
+			b->rec->free = b;
+			b->rec->nfree++;
+		}
+		pthread_cond_broadcast(&w->done);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+int rec_writer_init(struct rec_writer *w)
+{
+	memset(w, 0, sizeof *w);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->uring = rec_uring_init(REC_QUEUE_DEPTH);
+
+	if (pthread_create(&w->tid, NULL, &rec_writer_thread, w) != 0) {
+		rec_uring_free(w->uring);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		pthread_cond_destroy(&w->done);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Every recorder must have been freed already */
+void rec_writer_close(struct rec_writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->tid, NULL);
+
+	rec_uring_free(w->uring);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	pthread_cond_destroy(&w->done);
+}
+
+const char *rec_writer_backend(const struct rec_writer *w)
+{
+	return w->uring ? "io_uring" : "pwrite";
+}
+
+/*
+ * A free block. Audio always leaves one of them for the end of the segment,
+ * the only one 'reserve' may take, so finishing a segment never has to wait
+ * for the disk.
+ */
+static struct rec_buf *rec_take(struct recorder *rec, bool reserve)
+{
+	struct rec_writer *w = rec->w;
+	struct rec_buf *b = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while (reserve && !rec->free)
+		pthread_cond_wait(&w->done, &w->lock);
+	if (rec->nfree > (reserve ? 0 : 1)) {
+		b = rec->free;
+		rec->free = b->next;
+		rec->nfree--;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (b) {
+		b->len = 0;
+		b->last = false;
+		b->next = NULL;
+	}
+	return b;
+}
+
+/* Whether 'n' bytes of audio fit in the blocks available right now */
+static bool rec_room(struct recorder *rec, size_t n)
+{
+	struct rec_writer *w = rec->w;
+	size_t room = rec->cur ? REC_BUF_SIZE - rec->cur->len : 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (rec->nfree > 1)
+		room += (rec->nfree - 1) * (size_t)REC_BUF_SIZE;
+	pthread_mutex_unlock(&w->lock);
+
+	return room >= n;
+}
+
+static void rec_submit(struct recorder *rec, struct rec_buf *b)
+{
+	struct rec_writer *w = rec->w;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = b;
+	else
+		w->head = b;
+	w->tail = b;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Copy into the current block, rec_room() said there is enough */
+static void rec_append(struct recorder *rec, const uint8_t *data, size_t n)
+{
+	struct rec_segment *seg = &rec->segs[rec->nsegs - 1];
+	size_t copy;
+
+	while (n > 0) {
+		if (!rec->cur) {
+			rec->cur = rec_take(rec, false);
+			if (!rec->cur)
+				return;
+			rec->cur->off = seg->len;
+			rec->cur->seg_ms = seg->start_ms;
+		}
+
+		copy = REC_BUF_SIZE - rec->cur->len;
+		if (copy > n)
+			copy = n;
+		memcpy(rec->cur->data + rec->cur->len, data, copy);
+		rec->cur->len += copy;
+		seg->len += copy;
+		rec->bytes += copy;
+		data += copy;
+		n -= copy;
+
+		if (rec->cur->len == REC_BUF_SIZE) {
+			rec_submit(rec, rec->cur);
+			rec->cur = NULL;
+		}
+	}
+}
+
+static int rec_start_segment(struct recorder *rec)
+{
+	struct rec_segment *segs, *seg;
+	uint64_t now = get_timestamp_ms();
+
+	segs = realloc(rec->segs, (rec->nsegs + 1) * sizeof *segs);
+	if (!segs)
+		return -1;
+	rec->segs = segs;
+
+	/* Two segments in the same millisecond would share a file name */
+	if (rec->nsegs > 0 && now <= segs[rec->nsegs - 1].start_ms)
+		now = segs[rec->nsegs - 1].start_ms + 1;
+
+	seg = &segs[rec->nsegs++];
+	memset(seg, 0, sizeof *seg);
+	seg->start_ms = now;
+	rec->seg_open = true;
+	return 0;
+}
+
+/* Queue the rest of the segment with a copy of its index */
+static void rec_finish_segment(struct recorder *rec)
+{
+	struct rec_segment *seg = &rec->segs[rec->nsegs - 1];
+	struct rec_buf *b = rec->cur;
+
+	if (!b) {
+		b = rec_take(rec, true);
+		b->off = seg->len;
+		b->seg_ms = seg->start_ms;
+	}
+	rec->cur = NULL;
+
+	b->last = true;
+	b->nidx = seg->nentries;
+	b->idx = malloc(seg->nentries * sizeof *seg->entries + 1);
+	if (b->idx)
+		memcpy(b->idx, seg->entries, seg->nentries * sizeof *seg->entries);
+
+	rec_submit(rec, b);
+	rec->seg_open = false;
+}
+
+static void rec_index_add(struct rec_segment *seg, uint64_t now)
+{
+	struct rec_entry *entries;
+	unsigned cap;
+
+	if (seg->nentries == seg->cap) {
+		cap = seg->cap ? 2 * seg->cap : 256;
+		entries = realloc(seg->entries, cap * sizeof *entries);
+		if (!entries)
+			return;
+		seg->entries = entries;
+		seg->cap = cap;
+	}
+
+	seg->entries[seg->nentries].dt_ms = now - seg->start_ms;
+	seg->entries[seg->nentries].offset = seg->len;
+	seg->nentries++;
+}
+
+struct recorder *recorder_create(struct rec_writer *w, const char *dir,
+	const char *name)
+{
+	struct recorder *rec;
+	unsigned k;
+
+	rec = calloc(1, sizeof *rec);
+	if (!rec)
+		return NULL;
+
+	rec->w = w;
+	rec->fd = -1;
+	snprintf(rec->dir, sizeof rec->dir, "%s", dir);
+	snprintf(rec->name, sizeof rec->name, "%s", name);
+
+	for (k = 0; k < REC_BUFS; k++) {
+		rec->bufs[k].rec = rec;
+		rec->bufs[k].data = aligned_alloc(REC_BUF_ALIGN, REC_BUF_SIZE);
+		if (!rec->bufs[k].data)
+			goto _err;
+		rec->bufs[k].next = rec->free;
+		rec->free = &rec->bufs[k];
+		rec->nfree++;
+	}
+
+	rec->active = true;
+	return rec;
+
+_err:
+	for (k = 0; k < REC_BUFS; k++)
+		free(rec->bufs[k].data);
+	free(rec);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Wait until everything queued so far is on disk */
+void recorder_sync(struct recorder *rec)
+{
+	struct rec_writer *w = rec->w;
+	unsigned held = rec->cur ? 1 : 0;
+
+	pthread_mutex_lock(&w->lock);
+	while (rec->nfree + held < REC_BUFS)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Stop if needed, then wait for the writer to be done with the recorder */
+void recorder_free(struct recorder *rec)
+{
+	unsigned k;
+
+	if (!rec)
+		return;
+
+	recorder_stop(rec);
+	recorder_sync(rec);
+
+	for (k = 0; k < REC_BUFS; k++)
+		free(rec->bufs[k].data);
+	for (k = 0; k < rec->nsegs; k++)
+		free(rec->segs[k].entries);
+	free(rec->segs);
+	free(rec);
+}
+
+/*
+ * Add an audio page, indexed at the current time. A segment starts with
+ * the codec headers 'hdr', and a page never straddles two of them. While
+ * the disk is behind whole pages are dropped, so the file stays playable.
+ */
+void recorder_page(struct recorder *rec, const uint8_t *hdr, size_t hdr_len,
+	const uint8_t *page, size_t len)
+{
+	if (!rec->active)
+		return;
+
+	if (rec->seg_open &&
+	    rec->segs[rec->nsegs - 1].len + len > REC_SEGMENT_SIZE)
+		rec_finish_segment(rec);
+
+	if (!rec_room(rec, len + (rec->seg_open ? 0 : hdr_len)) ||
+	    (!rec->seg_open && rec_start_segment(rec) < 0)) {
+		rec->dropped += len;
+		metrics_add(METRIC_REC_DROPPED, len);
+		return;
+	}
+
+	if (rec->segs[rec->nsegs - 1].len == 0)
+		rec_append(rec, hdr, hdr_len);
+
+	rec_index_add(&rec->segs[rec->nsegs - 1], get_timestamp_ms());
+	rec_append(rec, page, len);
+}
+
+/* Resume a stopped recording, into a new segment */
+void recorder_start(struct recorder *rec)
+{
+	rec->active = true;
+}
+
+/* The codec headers changed, pages from now on go into a new segment */
+void recorder_split(struct recorder *rec)
+{
+	if (rec->active && rec->seg_open)
+		rec_finish_segment(rec);
+}
+
+/* Write out what is left. The index stays around for recorder_seek() */
+void recorder_stop(struct recorder *rec)
+{
+	if (!rec->active)
+		return;
+
+	if (rec->seg_open)
+		rec_finish_segment(rec);
+	rec->active = false;
+}
+
+/*
+ * Segment file and offset of the page that was being recorded at 'ts_ms',
+ * found with two binary searches: segment, then page. Returns -1 with
+ * ERANGE when nothing was recorded at that time.
+ */
+int recorder_seek(const struct recorder *rec, uint64_t ts_ms, char *path,
+	size_t size, uint64_t *offset, uint64_t *page_ms)
+{
+	const struct rec_segment *seg, *last;
+	unsigned lo, hi, mid;
+	uint64_t dt;
+
+	if (rec->nsegs == 0 || ts_ms < rec->segs[0].start_ms) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	/* Last segment started at or before 'ts_ms' */
+	for (lo = 0, hi = rec->nsegs; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (rec->segs[mid].start_ms <= ts_ms)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	seg = &rec->segs[lo];
+
+	last = &rec->segs[rec->nsegs - 1];
+	if (seg->nentries == 0 || (!rec->active && seg == last &&
+	    ts_ms > last->start_ms + last->entries[last->nentries - 1].dt_ms)) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	/* Last page indexed at or before it, the first one otherwise */
+	dt = ts_ms - seg->start_ms;
+	for (lo = 0, hi = seg->nentries; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (seg->entries[mid].dt_ms <= dt)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	rec_segment_path(rec, seg->start_ms, "ogg", path, size);
+	*offset = seg->entries[lo].offset;
+	*page_ms = seg->start_ms + seg->entries[lo].dt_ms;
+	return 0;
+}
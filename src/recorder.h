@@ -0,0 +1,124 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Segments are preallocated this big, then trimmed to what they hold */
+#define REC_SEGMENT_SIZE    (64 << 20)
+
+/* Audio is written in blocks of this size, from a few per recorder */
+#define REC_BUF_SIZE        (256 << 10)
+#define REC_BUF_ALIGN       4096
+#define REC_BUFS            8
+
+/* Writes submitted to the kernel at once */
+#define REC_QUEUE_DEPTH     64
+
+#define REC_IDX_MAGIC       "SDRIDX1"
+
+struct recorder;
+
+/*
+ * Time index of a segment: one entry per Ogg page, in the order they were
+ * written. Times are relative to the start of the segment.
+ */
+struct rec_entry {
+	uint32_t dt_ms;
+	uint32_t offset;
+};
+
+/* Block of audio on its way to a segment file */
+struct rec_buf {
+	struct recorder  *rec;
+	uint8_t          *data;
+	size_t            len;
+	uint64_t          off;          /* Position in the segment */
+	uint64_t          seg_ms;       /* Start of the segment, names the file */
+	bool              last;         /* Segment is complete with it */
+	struct rec_entry *idx;          /* Its index then, a copy for the writer */
+	unsigned          nidx;
+	struct rec_buf   *next;
+};
+
+struct rec_segment {
+	uint64_t          start_ms;     /* get_timestamp_ms() of the first page */
+	uint64_t          len;
+	struct rec_entry *entries;
+	unsigned          nentries;
+	unsigned          cap;
+};
+
+struct rec_uring;
+
+/*
+ * One thread doing the disk writes of every recorder of the station, so
+ * the event loop never waits on the disk. Full blocks are queued to it and
+ * written in batches, through io_uring when the kernel allows it and with
+ * pwrite() otherwise.
+ */
+struct rec_writer {
+	pthread_t         tid;
+	pthread_mutex_t   lock;
+	pthread_cond_t    cond;         /* Work queued */
+	pthread_cond_t    done;         /* Blocks handed back */
+	struct rec_buf   *head;
+	struct rec_buf   *tail;
+	bool              stop;
+	struct rec_uring *uring;        /* NULL when falling back to pwrite() */
+
+	_Atomic uint64_t  bytes;
+	_Atomic uint64_t  writes;
+	_Atomic uint64_t  submits;      /* System calls issuing the writes */
+};
+
+/*
+ * Encoded stream of one mount point going into "<dir>/<name>-<ms>.ogg"
+ * segments, each one starting with the codec headers so it plays on its
+ * own, with a "<dir>/<name>-<ms>.idx" index written next to it when it is
+ * complete. Pages are only ever added from the station thread; the
+ * writer thread owns 'fd' and hands the blocks back through 'free'.
+ */
+struct recorder {
+	struct rec_writer  *w;
+	char                dir[256];
+	char                name[64];
+	bool                active;
+
+	struct rec_buf      bufs[REC_BUFS];
+	struct rec_buf     *free;       /* Under w->lock */
+	unsigned            nfree;
+	struct rec_buf     *cur;        /* Being filled */
+
+	/* Index of every segment so far, the last one is being written */
+	struct rec_segment *segs;
+	unsigned            nsegs;
+	bool                seg_open;
+
+	int                 fd;         /* Writer side */
+	uint64_t            fd_ms;
+
+	uint64_t            bytes;
+	uint64_t            dropped;    /* Pages lost while the disk was behind */
+};
+
+int rec_writer_init(struct rec_writer *w);
+void rec_writer_close(struct rec_writer *w);
+const char *rec_writer_backend(const struct rec_writer *w);
+
+struct recorder *recorder_create(struct rec_writer *w, const char *dir,
+	const char *name);
+void recorder_free(struct recorder *rec);
+void recorder_sync(struct recorder *rec);
+void recorder_page(struct recorder *rec, const uint8_t *hdr, size_t hdr_len,
+	const uint8_t *page, size_t len);
+void recorder_start(struct recorder *rec);
+void recorder_split(struct recorder *rec);
+void recorder_stop(struct recorder *rec);
+int recorder_seek(const struct recorder *rec, uint64_t ts_ms, char *path,
+	size_t size, uint64_t *offset, uint64_t *page_ms);
+
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,175 @@
+/*
+ * resample.c: Polyphase rational resampler.
+ *
+ * The prototype low pass is a Kaiser windowed sinc at the upsampled rate,
+ * spanning RS_ZEROS zero crossings on each side whatever the ratio, so the
+ * transition band is the same fraction of the output band for 8 kHz speech
+ * and for 48 kHz archives. The dot products go through dsp_k.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "resample.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Zero crossings of the sinc on each side */
+#define RS_ZEROS        24
+
+/* Cutoff, as a fraction of the lower Nyquist rate */
+#define RS_ROLLOFF      0.9
+
+/* Kaiser window shape, about 80 dB of stopband */
+#define RS_BETA         8.0
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Modified Bessel function of the first kind, order 0 */
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	unsigned k;
+
+	for (k = 1; k < 64 && term > sum * 1e-12; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+/* Prototype filter, dealt out to the phases in reverse for a plain dot */
+static void rs_design(struct resampler *rs)
+{
+	size_t len = (size_t)rs->up * rs->ntaps, j;
+	unsigned p, q, most = rs->up > rs->down ? rs->up : rs->down;
+	double fc = RS_ROLLOFF * 0.5 / most, mid = (len - 1) / 2.0;
+	double i0_beta = bessel_i0(RS_BETA), sum = 0.0;
+
+	for (j = 0; j < len; j++) {
+		double m = j - mid, r = m / (mid + 0.5);
+		double sinc = (m == 0.0) ? 2.0 * fc :
+			sin(2.0 * M_PI * fc * m) / (M_PI * m);
+		double win = bessel_i0(RS_BETA * sqrt(1.0 - r * r)) / i0_beta;
+
+		p = j % rs->up;
+		q = j / rs->up;
+		rs->bank[p * rs->ntaps + rs->ntaps - 1 - q] = sinc * win;
+		sum += sinc * win;
+	}
+
+	/* Every phase then has a gain of about one, as zero stuffing costs 'up' */
+	for (j = 0; j < len; j++)
+		rs->bank[j] *= rs->up / sum;
+}
+
+int resampler_init(struct resampler *rs, uint32_t in_rate, uint32_t out_rate)
+{
+	unsigned g, most;
+	double fc;
+
+	memset(rs, 0, sizeof *rs);
+	if (in_rate == 0 || out_rate == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	g = gcd(in_rate, out_rate);
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	if (rs->up > RS_MAX_PHASES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Enough taps for the zero crossings, padded for the vector kernels */
+	most = rs->up > rs->down ? rs->up : rs->down;
+	fc = RS_ROLLOFF * 0.5 / most;
+	rs->ntaps = ceil(RS_ZEROS / fc / rs->up);
+	rs->ntaps = (rs->ntaps + 15) & ~15u;
+
+	rs->bank = malloc((size_t)rs->up * rs->ntaps * sizeof *rs->bank);
+	rs->buf = malloc((rs->ntaps - 1 + RS_BLOCK) * sizeof *rs->buf);
+	rs->out = malloc(resampler_max_out(rs, RS_BLOCK) * sizeof *rs->out);
+	if (!rs->bank || !rs->buf || !rs->out) {
+		resampler_free(rs);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rs_design(rs);
+	resampler_reset(rs);
+	return 0;
+}
+
+void resampler_free(struct resampler *rs)
+{
+	free(rs->bank);
+	free(rs->buf);
+	free(rs->out);
+	rs->bank = rs->buf = rs->out = NULL;
+}
+
+/* Start over from silence, as for a new stream */
+void resampler_reset(struct resampler *rs)
+{
+	memset(rs->buf, 0, (rs->ntaps - 1) * sizeof *rs->buf);
+	rs->phase = 0;
+	rs->pos = rs->ntaps - 1;
+}
+
+/* Room needed in 'out' for 'n' input samples */
+size_t resampler_max_out(const struct resampler *rs, size_t n)
+{
+	return (n * rs->up + rs->down - 1) / rs->down + 1;
+}
+
+/*
+ * Resample 'n' samples into 'out', which has resampler_max_out() of room.
+ * Returns the number of output samples.
+ */
+size_t resampler_process(struct resampler *rs, const int16_t *in, size_t n,
+	int16_t *out)
+{
+	unsigned hist = rs->ntaps - 1;
+	size_t chunk, nout = 0, m, k;
+
+	while (n > 0) {
+		chunk = (n < RS_BLOCK) ? n : RS_BLOCK;
+		for (k = 0; k < chunk; k++)
+			rs->buf[hist + k] = in[k];
+
+		for (m = 0; rs->pos < hist + chunk; m++) {
+			rs->out[m] = dsp_k.dot(rs->bank + rs->phase * rs->ntaps,
+				rs->buf + rs->pos - hist, rs->ntaps);
+			rs->phase += rs->down;
+			rs->pos += rs->phase / rs->up;
+			rs->phase %= rs->up;
+		}
+		dsp_k.f32_to_s16(rs->out, out + nout, m, 1.0f);
+		nout += m;
+
+		/* Keep the tail as history for the next block */
+		memmove(rs->buf, rs->buf + chunk, hist * sizeof *rs->buf);
+		rs->pos -= chunk;
+		in += chunk;
+		n -= chunk;
+	}
+
+	return nout;
+}
@@ -0,0 +1,43 @@
+#ifndef __RESAMPLE_H__
+#define __RESAMPLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output rates an encoder may be given */
+#define RS_MIN_RATE     8000
+#define RS_MAX_RATE     192000
+
+/* Longest reduced ratio, 22050 to 48000 Hz is 320/147 */
+#define RS_MAX_PHASES   1024
+
+/* Input samples converted to floats at once */
+#define RS_BLOCK        4096
+
+/*
+ * Rational resampler for mono s16 PCM: up by 'up', low pass, down by
+ * 'down', with the filter split into 'up' phases so only the outputs are
+ * computed, each one a dot product of 'ntaps'. The low pass cuts below the
+ * lower of both Nyquist rates, so it does anti-imaging and anti-aliasing.
+ */
+struct resampler {
+	uint32_t in_rate;
+	uint32_t out_rate;
+	unsigned up;
+	unsigned down;
+	unsigned ntaps;     /* Per phase, a multiple of 16 */
+	float   *bank;      /* 'up' phases of 'ntaps' taps, time reversed */
+	float   *buf;       /* History (ntaps - 1) followed by the block */
+	float   *out;       /* Outputs of one block, before the conversion */
+	unsigned phase;     /* Of the next output */
+	size_t   pos;       /* Newest input it needs, as an index into 'buf' */
+};
+
+int resampler_init(struct resampler *rs, uint32_t in_rate, uint32_t out_rate);
+void resampler_free(struct resampler *rs);
+void resampler_reset(struct resampler *rs);
+size_t resampler_max_out(const struct resampler *rs, size_t n);
+size_t resampler_process(struct resampler *rs, const int16_t *in, size_t n,
+	int16_t *out);
+
+#endif /* __RESAMPLE_H__ */
@@ -0,0 +1,345 @@
+/*
+ * resolver.c: Asynchronous getaddrinfo() with a small TTL cache.
+ *
+ * getaddrinfo() blocks for as long as the DNS takes, so it never runs on
+ * the event loop: queries are queued to a few worker threads and their
+ * answers handed back through an eventfd, then cached for RES_TTL_MS.
+ */
+
+#include "common.h"
+#include "event_loop.h"
+#include "resolver.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static uint64_t res_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+static struct res_entry *res_slot(struct resolver *r, const char *host)
+{
+	uint32_t hash = 2166136261u;
+	const char *p;
+
+	for (p = host; *p; p++)
+		hash = (hash ^ (uint8_t)tolower(*p)) * 16777619u;
+
+	return &r->cache[hash & (RES_CACHE_SIZE - 1)];
+}
+
+/* Only stream sockets, and only families this host has an address for */
+static int res_getaddrinfo(const char *host, int flags, struct res_addrs *out)
+{
+	struct addrinfo hints, *res, *ai;
+	int err;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | flags;
+
+	err = getaddrinfo(host, NULL, &hints, &res);
+	if (err)
+		return err;
+
+	out->naddrs = 0;
+	for (ai = res; ai && out->naddrs < RES_MAX_ADDRS; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof out->addr[0])
+			continue;
+		memcpy(&out->addr[out->naddrs], ai->ai_addr, ai->ai_addrlen);
+		out->len[out->naddrs++] = ai->ai_addrlen;
+	}
+	freeaddrinfo(res);
+
+	return out->naddrs ? 0 : EAI_NONAME;
+}
+
+static void res_free_list(struct res_query_list *list)
+{
+	struct res_query *q;
+
+	while ((q = TAILQ_FIRST(list))) {
+		TAILQ_REMOVE(list, q, entries);
+		free(q);
+	}
+}
+
+/* Drop a reference to the pool, called with its lock held */
+static void res_pool_put(struct res_pool *pool)
+{
+	if (--pool->refs > 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	res_free_list(&pool->todo);
+	res_free_list(&pool->running);
+	res_free_list(&pool->done);
+	close(pool->efd);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool);
+}
+
+static void *res_thread(void *arg)
+{
+	struct res_pool *pool = arg;
+	struct res_query *q;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && TAILQ_EMPTY(&pool->todo))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop)
+			break;
+
+		q = TAILQ_FIRST(&pool->todo);
+		TAILQ_REMOVE(&pool->todo, q, entries);
+		TAILQ_INSERT_TAIL(&pool->running, q, entries);
+		pthread_mutex_unlock(&pool->lock);
+
+		q->err = res_getaddrinfo(q->host, 0, &q->addrs);
+
+		pthread_mutex_lock(&pool->lock);
+		TAILQ_REMOVE(&pool->running, q, entries);
+		TAILQ_INSERT_TAIL(&pool->done, q, entries);
+		if (write(pool->efd, &one, sizeof one) < 0)
+			print_warn("cannot notify a name resolution\n");
+	}
+	res_pool_put(pool);
+
+	return NULL;
+}
+
+/* Answers are cached before their callbacks run, which may look up again */
+static void res_done_cb(struct ev_loop *loop, struct ev_handler *h,
+	uint32_t events)
+{
+	struct resolver *r = h->context;
+	struct res_pool *pool = r->pool;
+	struct res_entry *e;
+	struct res_query *q, *w;
+	uint64_t cnt;
+
+	if (read(h->fd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+		return;
+
+	/* One at a time, a callback may cancel the ones after it */
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		q = TAILQ_FIRST(&pool->done);
+		if (q)
+			TAILQ_REMOVE(&pool->done, q, entries);
+		pthread_mutex_unlock(&pool->lock);
+		if (!q)
+			break;
+
+		if (q->err != EAI_AGAIN && q->err != EAI_SYSTEM &&
+		    q->err != EAI_MEMORY) {
+			e = res_slot(r, q->host);
+			snprintf(e->host, sizeof e->host, "%s", q->host);
+			e->expires_ms = res_now_ms() +
+				(q->err ? RES_NEG_TTL_MS : RES_TTL_MS);
+			e->err = q->err;
+			e->addrs = q->addrs;
+		}
+
+		if (!q->cancelled)
+			q->cb(q->context, q->err, &q->addrs);
+
+		/* Then every lookup of the same name made meanwhile */
+_again:
+		TAILQ_FOREACH(w, &r->waiting, entries) {
+			if (w->leader == q) {
+				TAILQ_REMOVE(&r->waiting, w, entries);
+				w->cb(w->context, q->err, &q->addrs);
+				free(w);
+				goto _again;
+			}
+		}
+		free(q);
+	}
+}
+
+int resolver_init(struct resolver *r, struct ev_loop *loop)
+{
+	struct res_pool *pool;
+	pthread_attr_t attr;
+	pthread_t tid;
+	unsigned k;
+
+	memset(r, 0, sizeof *r);
+	r->loop = loop;
+	TAILQ_INIT(&r->waiting);
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return -1;
+	TAILQ_INIT(&pool->todo);
+	TAILQ_INIT(&pool->running);
+	TAILQ_INIT(&pool->done);
+	pool->refs = 1;
+
+	pool->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (pool->efd < 0) {
+		free(pool);
+		return -1;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	r->pool = pool;
+
+	r->h.fd = pool->efd;
+	r->h.func = &res_done_cb;
+	r->h.context = r;
+	if (ev_add(loop, &r->h, EPOLLIN) < 0) {
+		pthread_mutex_lock(&pool->lock);
+		res_pool_put(pool);
+		return -1;
+	}
+
+	/* Never joined, see resolver_close(). Any thread at all will do. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&pool->lock);
+	for (k = 0; k < RES_THREADS; k++) {
+		if (pthread_create(&tid, &attr, &res_thread, pool) != 0)
+			break;
+		pool->refs++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_attr_destroy(&attr);
+
+	if (k == 0) {
+		resolver_close(r);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * No callback is called after this. The threads cannot be interrupted in
+ * getaddrinfo(), those still in there are left to finish on their own.
+ */
+void resolver_close(struct resolver *r)
+{
+	struct res_pool *pool = r->pool;
+
+	res_free_list(&r->waiting);
+	ev_del(r->loop, &r->h);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	res_pool_put(pool);
+	r->pool = NULL;
+}
+
+/* Lookup of 'host' already on its way, with the pool locked */
+static struct res_query *res_inflight(struct res_pool *pool, const char *host)
+{
+	struct res_query_list *lists[] = {&pool->todo, &pool->running, &pool->done};
+	struct res_query *q;
+	unsigned k;
+
+	for (k = 0; k < 3; k++)
+		TAILQ_FOREACH(q, lists[k], entries)
+			if (strcasecmp(q->host, host) == 0)
+				return q;
+
+	return NULL;
+}
+
+/*
+ * Resolve 'host' and call 'cb' with its addresses. The callback runs from
+ * here when the answer is known already, from the event loop otherwise.
+ */
+int resolver_lookup(struct resolver *r, const char *host, res_cb_t cb,
+	void *context)
+{
+	struct res_pool *pool = r->pool;
+	struct res_addrs addrs;
+	struct res_entry *e;
+	struct res_query *q;
+
+	if (strlen(host) >= HOST_LEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* Literal addresses need no DNS at all */
+	if (res_getaddrinfo(host, AI_NUMERICHOST, &addrs) == 0) {
+		cb(context, 0, &addrs);
+		return 0;
+	}
+
+	e = res_slot(r, host);
+	if (e->expires_ms > res_now_ms() && strcasecmp(e->host, host) == 0) {
+		r->hits++;
+		addrs = e->addrs;
+		cb(context, e->err, &addrs);
+		return 0;
+	}
+	r->misses++;
+
+	q = calloc(1, sizeof *q);
+	if (!q) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(q->host, sizeof q->host, "%s", host);
+	q->cb = cb;
+	q->context = context;
+
+	pthread_mutex_lock(&pool->lock);
+	q->leader = res_inflight(pool, host);
+	if (q->leader) {
+		TAILQ_INSERT_TAIL(&r->waiting, q, entries);
+	} else {
+		TAILQ_INSERT_TAIL(&pool->todo, q, entries);
+		pthread_cond_signal(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+ * Forget the callbacks of every pending lookup made for 'context'. Those
+ * queued still run, others may be waiting for them and the cache gains.
+ */
+void resolver_cancel(struct resolver *r, void *context)
+{
+	struct res_pool *pool = r->pool;
+	struct res_query_list *lists[] = {&pool->todo, &pool->running, &pool->done};
+	struct res_query *q, *next;
+	unsigned k;
+
+	for (q = TAILQ_FIRST(&r->waiting); q; q = next) {
+		next = TAILQ_NEXT(q, entries);
+		if (q->context == context) {
+			TAILQ_REMOVE(&r->waiting, q, entries);
+			free(q);
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (k = 0; k < 3; k++)
+		TAILQ_FOREACH(q, lists[k], entries)
+			if (q->context == context)
+				q->cancelled = true;
+	pthread_mutex_unlock(&pool->lock);
+}
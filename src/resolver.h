@@ -0,0 +1,91 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "common.h"
+#include "event_loop.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+/* getaddrinfo() tells no TTL, answers are kept this long */
+#define RES_TTL_MS          30000
+#define RES_NEG_TTL_MS      5000
+
+#define RES_CACHE_SIZE      256     /* Must be a power of two */
+#define RES_THREADS         8
+#define RES_MAX_ADDRS       8
+
+/* Addresses of a host, in the order getaddrinfo() prefers them */
+struct res_addrs {
+	unsigned                naddrs;
+	struct sockaddr_storage addr[RES_MAX_ADDRS];
+	socklen_t               len[RES_MAX_ADDRS];
+};
+
+/* 'err' is 0 or an EAI_* code, see gai_strerror() */
+typedef void (*res_cb_t)(void *context, int err, const struct res_addrs *addrs);
+
+struct res_query {
+	char                    host[HOST_LEN];
+	int                     err;
+	struct res_addrs        addrs;
+	res_cb_t                cb;
+	void                   *context;
+	bool                    cancelled;
+	struct res_query       *leader;     /* The lookup this one waits for */
+	TAILQ_ENTRY(res_query)  entries;
+};
+
+TAILQ_HEAD(res_query_list, res_query);
+
+struct res_entry {
+	char                    host[HOST_LEN];
+	uint64_t                expires_ms;
+	int                     err;
+	struct res_addrs        addrs;
+};
+
+/*
+ * What the worker threads share with the loop. It outlives the resolver
+ * when a lookup is still stuck in getaddrinfo() as that gets closed: the
+ * last one out frees it.
+ */
+struct res_pool {
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+	struct res_query_list   todo;
+	struct res_query_list   running;
+	struct res_query_list   done;
+	int                     efd;        /* Signalled once per answer */
+	unsigned                refs;
+	bool                    stop;
+};
+
+/*
+ * Name resolution off the event loop. Lookups run getaddrinfo() on a few
+ * threads of their own and are answered from the loop, through an eventfd.
+ * Numeric addresses and names still in the cache are answered right away,
+ * from within resolver_lookup(), and lookups of a name already on its way
+ * wait for that one.
+ */
+struct resolver {
+	struct ev_loop         *loop;
+	struct ev_handler       h;
+	struct res_pool        *pool;
+	struct res_query_list   waiting;    /* For a name already looked up */
+
+	struct res_entry        cache[RES_CACHE_SIZE];
+	uint64_t                hits;
+	uint64_t                misses;
+};
+
+int resolver_init(struct resolver *r, struct ev_loop *loop);
+void resolver_close(struct resolver *r);
+int resolver_lookup(struct resolver *r, const char *host, res_cb_t cb,
+	void *context);
+void resolver_cancel(struct resolver *r, void *context);
+
+#endif /* __RESOLVER_H__ */
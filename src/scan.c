@@ -0,0 +1,362 @@
+/*
+ * scan.c: Wideband power sweep and peak detection.
+ *
+ * The range is covered in hops as wide as most of the capture. Every hop
+ * is an averaged, windowed FFT power spectrum, folded into a grid of one
+ * point per step. Peaks are the local maxima of that grid standing out of
+ * its median, which is taken as the noise floor.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "fft.h"
+#include "iq_source.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+struct scan_state {
+	struct iq_source src;
+	struct fft_plan  plan;
+	uint32_t         rate;
+	float           *win;
+	float           *re;
+	float           *im;
+	float           *acc;
+	uint8_t         *iq;
+
+	uint32_t         start;
+	uint32_t         step;
+	unsigned         npoints;
+	float           *pw;            /* Linear power per point, < 0 if unseen */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int read_full(struct iq_source *src, uint8_t *buf, size_t n,
+	atomic_bool *cancel)
+{
+	ssize_t nbr;
+
+	while (n > 0) {
+		if (cancel && atomic_load(cancel)) {
+			errno = ECANCELED;
+			return -1;
+		}
+		nbr = iq_source_read(src, buf, n);
+		if (nbr <= 0) {
+			errno = EIO;
+			return -1;
+		}
+		buf += nbr;
+		n -= nbr;
+	}
+
+	return 0;
+}
+
+static int scan_discard(struct scan_state *st, size_t n, atomic_bool *cancel)
+{
+	const size_t max = 2 * SCAN_FFT_SIZE * SCAN_AVERAGES;
+	size_t len;
+
+	for (; n > 0; n -= len) {
+		len = (n < max) ? n : max;
+		if (read_full(&st->src, st->iq, len, cancel) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Averaged power spectrum of the capture, bin 0 at the tuner frequency */
+static int scan_spectrum(struct scan_state *st, atomic_bool *cancel)
+{
+	const unsigned n = SCAN_FFT_SIZE;
+	float si, sq, dc_i, dc_q;
+	unsigned f, k;
+
+	if (read_full(&st->src, st->iq, 2 * n * SCAN_AVERAGES, cancel) < 0)
+		return -1;
+
+	memset(st->acc, 0, n * sizeof *st->acc);
+	for (f = 0; f < SCAN_AVERAGES; f++) {
+		dsp_k.u8_to_f32(st->iq + 2 * n * f, st->re, st->im, n, 0.0f, 0.0f,
+			&si, &sq);
+		dc_i = si / n;
+		dc_q = sq / n;
+		for (k = 0; k < n; k++) {
+			st->re[k] = (st->re[k] - dc_i) * st->win[k];
+			st->im[k] = (st->im[k] - dc_q) * st->win[k];
+		}
+		fft_forward(&st->plan, st->re, st->im);
+		dsp_k.power_acc(st->re, st->im, st->acc, n);
+	}
+
+	/* What is left of the DC spike, replaced by its neighbours */
+	st->acc[0] = 0.5f * (st->acc[1] + st->acc[n - 1]);
+	return 0;
+}
+
+/* Fold the spectrum of a hop tuned to 'center' into the grid */
+static void scan_fold(struct scan_state *st, uint32_t center, uint32_t half)
+{
+	const int n = SCAN_FFT_SIZE;
+	double hz_per_bin = (double)st->rate / n;
+	int64_t lo = (int64_t)center - half, hi = (int64_t)center + half;
+	int64_t g0, g1, g, off;
+	int b, b0, b1;
+	float p;
+
+	if (hi < st->start)
+		return;
+
+	g0 = (lo <= st->start) ? 0 : (lo - st->start + st->step - 1) / st->step;
+	g1 = (hi - (int64_t)st->start) / st->step;
+	if (g1 >= st->npoints)
+		g1 = st->npoints - 1;
+
+	for (g = g0; g <= g1; g++) {
+		off = st->start + g * st->step - (int64_t)center;
+		b0 = lround((off - st->step / 2.0) / hz_per_bin);
+		b1 = lround((off + st->step / 2.0) / hz_per_bin);
+		if (b0 < -n / 2)
+			b0 = -n / 2;
+		if (b1 >= n / 2)
+			b1 = n / 2 - 1;
+
+		/* Largest bin under the point, the nearest one for fine steps */
+		for (p = 0.0f, b = b0; b <= b1 || b == b0; b++)
+			if (st->acc[(b + n) % n] > p)
+				p = st->acc[(b + n) % n];
+
+		p /= SCAN_AVERAGES;
+		if (p > st->pw[g])
+			st->pw[g] = p;
+	}
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	const float *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static int cmp_peak_snr(const void *a, const void *b)
+{
+	const struct scan_peak *x = a, *y = b;
+
+	return (x->snr_db < y->snr_db) - (x->snr_db > y->snr_db);
+}
+
+static int cmp_peak_freq(const void *a, const void *b)
+{
+	const struct scan_peak *x = a, *y = b;
+
+	return (x->freq > y->freq) - (x->freq < y->freq);
+}
+
+/*
+ * Noise floor and peaks of the grid. Peaks closer than two steps to a
+ * stronger one belong to the same signal and are dropped.
+ */
+static int scan_peaks(struct scan_state *st, struct scan_result *res)
+{
+	struct scan_peak *cand;
+	float *db, *sorted, left, right;
+	unsigned g, k, j, n = 0, ncand = 0;
+	uint32_t guard = 2 * st->step;
+
+	db = st->pw;
+	sorted = malloc(st->npoints * sizeof *sorted);
+	cand = malloc(st->npoints * sizeof *cand);
+	if (!sorted || !cand) {
+		free(sorted);
+		free(cand);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (g = 0; g < st->npoints; g++) {
+		if (st->pw[g] < 0.0f) {
+			db[g] = -INFINITY;
+			continue;
+		}
+		db[g] = 10.0f * log10f(st->pw[g] + 1e-20f);
+		sorted[n++] = db[g];
+	}
+	qsort(sorted, n, sizeof *sorted, &cmp_float);
+	res->floor_db = sorted[n / 2];
+
+	for (g = 0; g < st->npoints; g++) {
+		if (db[g] - res->floor_db < SCAN_THRESHOLD_DB)
+			continue;
+		left = (g > 0) ? db[g - 1] : -INFINITY;
+		right = (g + 1 < st->npoints) ? db[g + 1] : -INFINITY;
+		if (db[g] < left || db[g] <= right)
+			continue;
+
+		cand[ncand].freq = st->start + g * st->step;
+		cand[ncand].snr_db = db[g] - res->floor_db;
+		ncand++;
+	}
+
+	qsort(cand, ncand, sizeof *cand, &cmp_peak_snr);
+	res->npeaks = 0;
+	for (k = 0; k < ncand && res->npeaks < SCAN_MAX_PEAKS; k++) {
+		for (j = 0; j < res->npeaks; j++)
+			if (labs((long)cand[k].freq - (long)res->peaks[j].freq) <= guard)
+				break;
+		if (j == res->npeaks)
+			res->peaks[res->npeaks++] = cand[k];
+	}
+	qsort(res->peaks, res->npeaks, sizeof *res->peaks, &cmp_peak_freq);
+
+	free(sorted);
+	free(cand);
+	return 0;
+}
+
+static int scan_state_init(struct scan_state *st, uint32_t rate,
+	uint32_t start, uint32_t step, unsigned npoints)
+{
+	const unsigned n = SCAN_FFT_SIZE;
+	unsigned k;
+
+	memset(st, 0, sizeof *st);
+	st->rate = rate;
+	st->start = start;
+	st->step = step;
+	st->npoints = npoints;
+
+	if (fft_plan_init(&st->plan, n) < 0)
+		return -1;
+
+	st->win = malloc(n * sizeof *st->win);
+	st->re = malloc(n * sizeof *st->re);
+	st->im = malloc(n * sizeof *st->im);
+	st->acc = malloc(n * sizeof *st->acc);
+	st->iq = malloc(2 * n * SCAN_AVERAGES);
+	st->pw = malloc(npoints * sizeof *st->pw);
+	if (!st->win || !st->re || !st->im || !st->acc || !st->iq || !st->pw) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Hann window */
+	for (k = 0; k < n; k++)
+		st->win[k] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * k / n);
+	for (k = 0; k < npoints; k++)
+		st->pw[k] = -1.0f;
+
+	return 0;
+}
+
+static void scan_state_free(struct scan_state *st)
+{
+	fft_plan_free(&st->plan);
+	free(st->win);
+	free(st->re);
+	free(st->im);
+	free(st->acc);
+	free(st->iq);
+	free(st->pw);
+}
+
+/*
+ * Sweep 'start' to 'stop' with a point every 'step' Hz, reading from the IQ
+ * source 'spec' at 'rate'. Tunable sources hop across the range, anything
+ * else only covers the capture around 'center'. Blocking, 'cancel' is
+ * checked between reads. Returns -1 with errno set on failure: EDOM when
+ * no point of the range is covered.
+ */
+int scan_sweep(const char *spec, uint32_t rate, uint32_t center,
+	uint32_t start, uint32_t stop, uint32_t step, atomic_bool *cancel,
+	struct scan_result *res)
+{
+	struct scan_state st;
+	uint32_t usable, half, hop, lo = 0, hi = 0;
+	uint64_t t0 = now_ns();
+	unsigned g, npoints;
+	int retval = -1;
+
+	if (!spec || !res || rate == 0 || step == 0 || stop < start) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	npoints = (stop - start) / step + 1;
+	if (npoints > SCAN_MAX_POINTS) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	memset(res, 0, sizeof *res);
+	usable = (uint64_t)rate * SCAN_USABLE_NUM / SCAN_USABLE_DEN;
+	half = usable / 2;
+
+	if (scan_state_init(&st, rate, start, step, npoints) < 0)
+		goto _out;
+
+	if (iq_source_open(&st.src, spec, rate, center) < 0) {
+		errno = EIO;
+		goto _out;
+	}
+	/* A recording is read as fast as it comes */
+	st.src.paced = false;
+
+	if (!iq_source_tunable(&st.src)) {
+		if (scan_spectrum(&st, cancel) < 0)
+			goto _close;
+		scan_fold(&st, center, half);
+		res->hops = 1;
+	} else {
+		for (hop = start + half; hop - half <= stop; hop += usable) {
+			if (iq_source_tune(&st.src, hop) < 0) {
+				errno = EIO;
+				goto _close;
+			}
+			/* Samples still in flight were taken at the last frequency */
+			if (scan_discard(&st, 2 * (rate / SCAN_SETTLE_DIV), cancel) < 0 ||
+			    scan_spectrum(&st, cancel) < 0)
+				goto _close;
+			scan_fold(&st, hop, half);
+			res->hops++;
+		}
+	}
+
+	for (g = 0; g < npoints && st.pw[g] < 0.0f; g++)
+		;
+	if (g == npoints) {
+		errno = EDOM;
+		goto _close;
+	}
+	lo = start + g * step;
+	for (g = npoints; st.pw[g - 1] < 0.0f; g--)
+		;
+	hi = start + (g - 1) * step;
+
+	if (scan_peaks(&st, res) < 0)
+		goto _close;
+
+	res->lo = lo;
+	res->hi = hi;
+	res->npoints = npoints;
+	res->elapsed_ns = now_ns() - t0;
+	retval = 0;
+
+_close:
+	iq_source_close(&st.src);
+_out:
+	scan_state_free(&st);
+	return retval;
+}
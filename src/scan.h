@@ -0,0 +1,50 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Power spectrum of every hop: FFT size and frames averaged */
+#define SCAN_FFT_SIZE       1024
+#define SCAN_AVERAGES       32
+
+/* Share of the capture used per hop, the edges roll off in the tuner */
+#define SCAN_USABLE_NUM     3
+#define SCAN_USABLE_DEN     4
+
+/* Samples thrown away after retuning, about 25 ms worth */
+#define SCAN_SETTLE_DIV     40
+
+#define SCAN_MIN_STEP       100
+#define SCAN_MAX_POINTS     65536
+#define SCAN_MAX_PEAKS      16
+
+/* A peak stands this far above the median power of the sweep */
+#define SCAN_THRESHOLD_DB   10.0f
+
+struct scan_peak {
+	uint32_t freq;
+	float    snr_db;        /* Above the noise floor */
+};
+
+/*
+ * Outcome of a sweep. The range actually covered may be narrower than
+ * the one asked for when the source cannot be retuned (recorded files).
+ */
+struct scan_result {
+	uint32_t         lo;
+	uint32_t         hi;
+	unsigned         npoints;
+	unsigned         hops;
+	float            floor_db;
+	uint64_t         elapsed_ns;
+	struct scan_peak peaks[SCAN_MAX_PEAKS];     /* By frequency */
+	unsigned         npeaks;
+};
+
+int scan_sweep(const char *spec, uint32_t rate, uint32_t center,
+	uint32_t start, uint32_t stop, uint32_t step, atomic_bool *cancel,
+	struct scan_result *res);
+
+#endif /* __SCAN_H__ */
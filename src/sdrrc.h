@@ -0,0 +1,23 @@
+#ifndef __SDRRC_H__
+#define __SDRRC_H__
+
+#include "common.h"
+#include "station.h"
+
+/*
+ * Internals of sdrrc.c shared with main.c and the benchmarks: the program
+ * configuration and the dispatcher of station commands.
+ */
+struct mapping_table;
+
+struct app_config *cfg_alloc_init(void);
+void cfg_free(struct app_config *cfg);
+void parse_args(int argc, char *const *argv, struct app_config *cfg);
+
+struct mapping_table *cmd_lookup(const char *tok, size_t len);
+void sta_exec_line(struct sta_client *client, char *line, size_t len);
+
+void sta_set_status(struct app_config *cfg, uint8_t status);
+int sta_mode_loop(struct app_config *cfg);
+
+#endif /* __SDRRC_H__ */
@@ -0,0 +1,94 @@
+/*
+ * squelch.c: Power gate with hysteresis and hang time.
+ */
+
+#include "common.h"
+#include "dsp.h"
+#include "squelch.h"
+
+#include <unistd.h>
+
+void squelch_init(struct squelch *sq, float open_db, int event_fd)
+{
+	atomic_init(&sq->open_db, open_db);
+	atomic_init(&sq->level_db, -INFINITY);
+	atomic_init(&sq->open, true);
+	atomic_init(&sq->seq, 0);
+	atomic_init(&sq->closed_ns, 0);
+	sq->event_fd = event_fd;
+	sq->quiet_ns = 0;
+}
+
+/* New open threshold, taken into account with the next block */
+void squelch_set(struct squelch *sq, float open_db)
+{
+	atomic_store(&sq->open_db, open_db);
+}
+
+/*
+ * Open as soon as a block reaches the threshold. Close once blocks have
+ * stayed SQL_HYSTERESIS_DB below it for SQL_HANG_MS, so pauses in speech
+ * and fading do not chop the audio. Returns whether the block goes through.
+ */
+static bool squelch_update(struct squelch *sq, float level_db, size_t n,
+	uint32_t rate)
+{
+	float open_db = atomic_load_explicit(&sq->open_db, memory_order_relaxed);
+	bool open = atomic_load_explicit(&sq->open, memory_order_relaxed);
+	uint64_t block_ns = n * UINT64_C(1000000000) / rate, one = 1;
+	bool want;
+
+	atomic_store_explicit(&sq->level_db, level_db, memory_order_relaxed);
+
+	if (isnan(open_db) || level_db >= open_db) {
+		sq->quiet_ns = 0;
+		want = true;
+	} else if (!open) {
+		want = false;
+	} else if (level_db < open_db - SQL_HYSTERESIS_DB) {
+		sq->quiet_ns += block_ns;
+		want = sq->quiet_ns < SQL_HANG_MS * UINT64_C(1000000);
+	} else {
+		sq->quiet_ns = 0;
+		want = true;
+	}
+
+	if (!want)
+		atomic_fetch_add_explicit(&sq->closed_ns, block_ns,
+			memory_order_relaxed);
+
+	if (want != open) {
+		atomic_store(&sq->open, want);
+		atomic_fetch_add(&sq->seq, 1);
+		if (sq->event_fd >= 0 && write(sq->event_fd, &one, sizeof one) < 0)
+			print_warn("cannot notify a squelch change\n");
+	}
+
+	return want;
+}
+
+/* Complex baseband of the channel, full scale is 0 dBFS */
+bool squelch_feed_iq(struct squelch *sq, const float *in_i, const float *in_q,
+	size_t n, uint32_t rate)
+{
+	float ms;
+
+	if (n == 0 || rate == 0)
+		return atomic_load_explicit(&sq->open, memory_order_relaxed);
+
+	ms = dsp_k.power_sum(in_i, in_q, n) / n;
+	return squelch_update(sq, 10.0f * log10f(ms + 1e-20f), n, rate);
+}
+
+/* Demodulated audio, for producers without access to the IQ */
+bool squelch_feed_pcm(struct squelch *sq, const int16_t *pcm, size_t n,
+	uint32_t rate)
+{
+	double ms;
+
+	if (n == 0 || rate == 0)
+		return atomic_load_explicit(&sq->open, memory_order_relaxed);
+
+	ms = (double)dsp_k.energy_s16(pcm, n) / n / (32768.0 * 32768.0);
+	return squelch_update(sq, 10.0 * log10(ms + 1e-20), n, rate);
+}
@@ -0,0 +1,47 @@
+#ifndef __SQUELCH_H__
+#define __SQUELCH_H__
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Open threshold range in dBFS, and the one meaning "always open" */
+#define SQL_MIN_DB          -120.0f
+#define SQL_MAX_DB          0.0f
+#define SQL_OFF             NAN
+
+/* Closing takes this much less power, held for the hang time */
+#define SQL_HYSTERESIS_DB   6.0f
+#define SQL_HANG_MS         750
+
+/*
+ * Activity gate in front of an encoder. The producer measures the power of
+ * every block, IQ baseband of the channel or PCM when that is all there is,
+ * and only demodulates and pushes audio while the gate is open. A closed
+ * gate starves the encoder, so ffmpeg and the listeners fan-out go idle.
+ *
+ * Only the producer feeds it. Everything else may be read and the threshold
+ * changed from any thread; every change of state bumps 'seq' and wakes up
+ * 'event_fd', if set, so the station can tell its managers.
+ */
+struct squelch {
+	_Atomic float    open_db;       /* SQL_OFF to let everything through */
+	_Atomic float    level_db;      /* Power of the last block */
+	atomic_bool      open;
+	atomic_uint      seq;           /* Changes of state so far */
+	_Atomic uint64_t closed_ns;     /* Stream time held back */
+	int              event_fd;
+
+	uint64_t         quiet_ns;      /* Below the close threshold since */
+};
+
+void squelch_init(struct squelch *sq, float open_db, int event_fd);
+void squelch_set(struct squelch *sq, float open_db);
+bool squelch_feed_iq(struct squelch *sq, const float *in_i, const float *in_q,
+	size_t n, uint32_t rate);
+bool squelch_feed_pcm(struct squelch *sq, const int16_t *pcm, size_t n,
+	uint32_t rate);
+
+#endif /* __SQUELCH_H__ */
@@ -0,0 +1,98 @@
+/*
+ * state.c: Station state published through a sequence lock.
+ */
+
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Store 'st' into the published words, with the writer lock held */
+static void state_publish(struct state_pub *pub, const struct sta_state *st)
+{
+	uint64_t w[STATE_WORDS] = {0};
+	unsigned seq, k;
+
+	memcpy(w, st, sizeof *st);
+
+	seq = atomic_load_explicit(&pub->seq, memory_order_relaxed);
+	atomic_store_explicit(&pub->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (k = 0; k < STATE_WORDS; k++)
+		atomic_store_explicit(&pub->word[k], w[k], memory_order_relaxed);
+	atomic_store_explicit(&pub->seq, seq + 2, memory_order_release);
+
+	pub->cur = *st;
+}
+
+struct state_pub *state_create(const struct sta_state *initial)
+{
+	struct state_pub *pub = calloc(1, sizeof *pub);
+	struct sta_state st;
+
+	if (!pub)
+		return NULL;
+
+	/* Padding is copied around too, keep it zero */
+	memset(&st, 0, sizeof st);
+	st.sdr = initial->sdr;
+	st.status = initial->status;
+	st.running = initial->running;
+
+	pthread_mutex_init(&pub->write_lock, NULL);
+	state_publish(pub, &st);
+	return pub;
+}
+
+void state_free(struct state_pub *pub)
+{
+	if (!pub)
+		return;
+
+	pthread_mutex_destroy(&pub->write_lock);
+	free(pub);
+}
+
+/* Consistent copy of the latest value, from any thread */
+void state_read(struct state_pub *pub, struct sta_state *st)
+{
+	uint64_t w[STATE_WORDS];
+	unsigned s0, s1, k;
+
+	do {
+		s0 = atomic_load_explicit(&pub->seq, memory_order_acquire);
+		for (k = 0; k < STATE_WORDS; k++)
+			w[k] = atomic_load_explicit(&pub->word[k], memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		s1 = atomic_load_explicit(&pub->seq, memory_order_relaxed);
+	} while ((s0 & 1) || s0 != s1);
+
+	memcpy(st, w, sizeof *st);
+}
+
+/* Bumped by every commit, for readers that only care about changes */
+unsigned state_version(struct state_pub *pub)
+{
+	return atomic_load_explicit(&pub->seq, memory_order_acquire) / 2;
+}
+
+/*
+ * Start an update from the latest value. Other writers wait until the
+ * matching state_commit() or state_abort(); readers do not.
+ */
+void state_begin(struct state_pub *pub, struct sta_state *st)
+{
+	pthread_mutex_lock(&pub->write_lock);
+	*st = pub->cur;
+}
+
+void state_commit(struct state_pub *pub, const struct sta_state *st)
+{
+	state_publish(pub, st);
+	pthread_mutex_unlock(&pub->write_lock);
+}
+
+void state_abort(struct state_pub *pub)
+{
+	pthread_mutex_unlock(&pub->write_lock);
+}
@@ -0,0 +1,41 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Settings and status of the station, always read as a whole */
+struct sta_state {
+	struct sdr_settings sdr;
+	uint8_t             status;     /* S_* */
+	bool                running;    /* Demodulator or rtl_fm, and encoders */
+};
+
+#define STATE_WORDS ((sizeof(struct sta_state) + 7) / 8)
+
+/*
+ * Station state behind a sequence lock. Writers take turns on a mutex and
+ * publish a whole new value at once; readers copy it out without locking,
+ * starting over when a write went on meanwhile, so they never hold up a
+ * writer nor see half of an update. Every word is accessed atomically.
+ */
+struct state_pub {
+	_Atomic unsigned  seq;          /* Odd while a write is under way */
+	_Atomic uint64_t  word[STATE_WORDS];
+	pthread_mutex_t   write_lock;
+	struct sta_state  cur;          /* Writers' copy, under write_lock */
+};
+
+struct state_pub *state_create(const struct sta_state *initial);
+void state_free(struct state_pub *pub);
+void state_read(struct state_pub *pub, struct sta_state *st);
+unsigned state_version(struct state_pub *pub);
+void state_begin(struct state_pub *pub, struct sta_state *st);
+void state_commit(struct state_pub *pub, const struct sta_state *st);
+void state_abort(struct state_pub *pub);
+
+#endif /* __STATE_H__ */
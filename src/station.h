@@ -0,0 +1,170 @@
+#ifndef __STATION_H__
+#define __STATION_H__
+
+#include "child.h"
+#include "common.h"
+#include "event_loop.h"
+#include "http_server.h"
+#include "net_utils.h"
+#include "pcm_ring.h"
+#include "recorder.h"
+#include "scan.h"
+#include "stream.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+#define STA_MAX_CLIENTS 4096
+#define STA_MAX_CHANNELS 16
+
+/* Other rates of the main stream, one tap of its ring each */
+#define STA_MAX_OUTPUTS PCM_MAX_TAPS
+
+/* Scan list: entries, and how long each may be dwelt on */
+#define STA_MAX_HOPS    64
+#define STA_HOP_MIN_MS  10
+#define STA_HOP_MAX_MS  3600000
+#define STA_HOP_DEF_MS  1000
+
+/* Without an IQ source every hop restarts rtl_fm and the encoder */
+#define STA_HOP_EXT_MIN_MS  3000
+
+/* Upper bound of --timeshift, in MiB for the whole station */
+#define STA_TIMESHIFT_MAX_MB 16384
+
+/* Main stream, its other rates, every channel, /metrics and /trace.json */
+#define STA_MAX_ROUTES  (1 + STA_MAX_OUTPUTS + STA_MAX_CHANNELS + 2)
+_Static_assert(STA_MAX_ROUTES <= HTTP_MAX_ROUTES,
+	"the HTTP server has no room for every station route");
+
+struct sta_context;
+
+/* Per-connection state of a manager talking to the station */
+struct sta_client {
+	struct ev_handler   h;
+	struct sta_context *ctx;
+	struct app_config  *cfg;
+	bool                closing;
+	bool                binary;     /* Speaks proto.h frames */
+	bool                paused;     /* Waiting on a scan, input is held */
+	struct line_buffer  rx;
+
+	/* Ogg replay being sent instead of replies, input is held meanwhile */
+	struct stream      *replay;
+	uint64_t            replay_pos;
+	uint64_t            replay_end;
+	size_t              replay_hdr_left;
+	unsigned            replay_gen;
+	TAILQ_ENTRY(sta_client) entries;
+};
+
+TAILQ_HEAD(sta_client_list, sta_client);
+
+/* Output of an ffmpeg encoder and the stream it feeds */
+struct sta_encoder {
+	struct ev_handler   h;
+	struct stream       stream;
+	struct sta_context *ctx;
+	struct child_sup    sup;        /* Keeps ffmpeg running */
+	int                 pcm_fd;     /* Its stdin, kept across restarts */
+	struct pcm_ring    *ring;       /* Feeding pcm_fd, owned by its producer */
+	uint32_t            rate;       /* Of the PCM given to ffmpeg */
+	unsigned            sql_seq;    /* Last squelch change told to managers */
+	uint64_t            first_ns;   /* Start, until ffmpeg has output, traced */
+};
+
+/* Extra frequency demodulated out of the capture, served on /ch<id>.ogg */
+struct sta_channel {
+	unsigned           id;
+	uint32_t           freq;
+	uint8_t            modulation;
+	bool               running;
+	struct sta_encoder enc;
+	TAILQ_ENTRY(sta_channel) entries;   /* Once removed, until released */
+};
+
+TAILQ_HEAD(sta_channel_list, sta_channel);
+
+/*
+ * Sweep running in a thread of its own. The client that asked for it gets
+ * no other reply until this one, so its next commands wait meanwhile.
+ */
+struct sta_scan {
+	pthread_t           tid;
+	bool                busy;
+	atomic_bool         done;
+	atomic_bool         cancel;
+	struct sta_client  *client;     /* NULL once it has disconnected */
+	struct app_config  *cfg;
+	uint32_t            rate;
+	uint32_t            center;
+	uint32_t            start;
+	uint32_t            stop;
+	uint32_t            step;
+	int                 err;
+	struct scan_result  res;
+};
+
+/*
+ * Scan list the station hops through, driven by a timer of its loop. Hops
+ * follow a fixed schedule from the first one, so a late hop does not delay
+ * the next ones.
+ */
+struct sta_hop_entry {
+	struct sdr_settings sdr;
+	uint32_t            dwell_ms;
+	bool                stay;       /* Dwell again while the squelch is open */
+};
+
+struct sta_hop {
+	struct ev_timer      timer;
+	struct sta_hop_entry list[STA_MAX_HOPS];
+	unsigned             n;         /* 0 when not hopping */
+	unsigned             cur;
+	uint64_t             due_ns;    /* Of the pending hop */
+	uint64_t             late_max_ns;
+};
+
+/* Handlers and connections owned by the station event loop */
+struct sta_context {
+	struct app_config *cfg;
+	struct ev_loop     loop;
+	struct ev_handler  listen_h;
+	struct ev_handler  event_h;
+	struct ev_handler  signal_h;
+
+	/* Listeners get the encoded audio straight from the station */
+	struct http_server  http;
+	struct sta_encoder  enc;
+	struct sta_encoder  outputs[STA_MAX_OUTPUTS];   /* Served on /stream-<rate>.ogg */
+	unsigned            noutputs;
+	struct child_sup    rtl_sup;    /* rtl_fm, without an IQ source */
+	struct ev_handler   rtl_h;      /* Its PCM, pushed into enc.ring */
+	struct pcm_ring    *rtl_ring;
+	uint8_t             rtl_odd;    /* Half a sample left by the last read */
+	bool                rtl_has_odd;
+	struct sta_channel *channels[STA_MAX_CHANNELS];    /* Slot is id - 1 */
+	struct sta_channel_list closed_channels;    /* Released on the next wakeup */
+	struct sta_scan     scan;
+	struct sta_hop      hop;
+	struct rec_writer   rec_writer; /* Only with a recording directory */
+	bool                rec_ready;
+
+	/* Only one client at a time may change the station settings */
+	struct sta_client      *controller;
+	struct sta_client_list  clients;
+	struct sta_client_list  closed;     /* Released on the next wakeup */
+	unsigned int            nclients;
+
+	/* For the rates reported by the stats command */
+	uint64_t                start_ns;
+	uint64_t                stats_ns;
+	uint64_t                stats_pcm_bytes;
+};
+
+void sta_reply(struct sta_client *client, const char *fmt, ...);
+void sta_client_close(struct sta_client *client);
+void sta_wakeup(struct app_config *cfg);
+
+#endif /* __STATION_H__ */
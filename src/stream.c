@@ -0,0 +1,406 @@
+/*
+ * stream.c: Encoded audio fan-out to HTTP listeners.
+ *
+ * Listeners never get a private copy of the audio: each one keeps an offset
+ * into the shared ring and is served with writev() straight from it, framed
+ * as HTTP chunks. A listener falling more than a ring behind is dropped, so
+ * a slow client never holds back the others. The same ring, with the time
+ * marks of its pages, serves replays of the last seconds.
+ */
+
+#include "common.h"
+#include "http_server.h"
+#include "recorder.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define OGG_HDR_LEN     27
+#define OGG_FLAG_BOS    0x02
+
+static const char stream_headers[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: audio/ogg\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+int stream_init(struct stream *st, const char *mount, size_t size)
+{
+	if (!st || !mount || size == 0 || (size & (size - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(st, 0, sizeof *st);
+	snprintf(st->mount, sizeof st->mount, "%s", mount);
+	st->size = size;
+	TAILQ_INIT(&st->listeners);
+
+	st->nmarks = 1;
+	while (st->nmarks < size / STREAM_MARK_BYTES)
+		st->nmarks <<= 1;
+
+	st->ring = malloc(size);
+	st->page = malloc(OGG_MAX_PAGE);
+	st->marks = malloc(st->nmarks * sizeof *st->marks);
+	if (!st->ring || !st->page || !st->marks) {
+		stream_free(st);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+void stream_free(struct stream *st)
+{
+	struct http_conn *conn;
+
+	if (!st)
+		return;
+
+	while ((conn = TAILQ_FIRST(&st->listeners)))
+		http_conn_close(conn);
+
+	free(st->ring);
+	free(st->hdr);
+	free(st->page);
+	free(st->marks);
+	st->ring = st->hdr = st->page = NULL;
+	st->marks = NULL;
+}
+
+static void ring_append(struct stream *st, const uint8_t *data, size_t n)
+{
+	size_t off = st->head & (st->size - 1);
+	size_t first = (n < st->size - off) ? n : st->size - off;
+
+	memcpy(st->ring + off, data, first);
+	memcpy(st->ring, data + first, n - first);
+	st->head += n;
+}
+
+static void hdr_append(struct stream *st, const uint8_t *data, size_t n)
+{
+	uint8_t *hdr = realloc(st->hdr, st->hdr_len + n);
+
+	if (!hdr) {
+		print_error("Cannot allocate memory for stream headers\n");
+		return;
+	}
+
+	memcpy(hdr + st->hdr_len, data, n);
+	st->hdr = hdr;
+	st->hdr_len += n;
+}
+
+/* Marks only ever go forward, whatever happens to the wall clock */
+static uint64_t stream_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+static void process_page(struct stream *st, const uint8_t *p, size_t len)
+{
+	uint64_t granule = 0;
+	int k;
+
+	for (k = 7; k >= 0; k--)
+		granule = (granule << 8) | p[6 + k];
+
+	/* A new logical stream (encoder restart) brings new codec headers */
+	if (p[5] & OGG_FLAG_BOS) {
+		st->hdr_len = 0;
+		st->hdr_done = false;
+		st->hdr_gen++;
+		st->mark_tail = st->mark_head;
+		if (st->rec)
+			recorder_split(st->rec);
+	}
+
+	if (!st->hdr_done && granule == 0) {
+		hdr_append(st, p, len);
+		ring_append(st, p, len);
+		st->join_pos = st->head;
+		return;
+	}
+
+	st->hdr_done = true;
+	st->join_pos = st->head;
+	st->marks[st->mark_head & (st->nmarks - 1)] = (struct stream_mark) {
+		stream_now_ms(), st->head
+	};
+	st->mark_head++;
+	if (st->mark_head - st->mark_tail > st->nmarks)
+		st->mark_tail = st->mark_head - st->nmarks;
+	ring_append(st, p, len);
+	if (st->rec)
+		recorder_page(st->rec, st->hdr, st->hdr_len, p, len);
+}
+
+/* Reassemble Ogg pages out of 'data' and queue them for the listeners */
+static void parse_pages(struct stream *st, const uint8_t *data, size_t n)
+{
+	size_t copy, need, k;
+
+	while (n > 0) {
+		copy = (n < OGG_MAX_PAGE - st->page_len) ? n : OGG_MAX_PAGE - st->page_len;
+		memcpy(st->page + st->page_len, data, copy);
+		st->page_len += copy;
+		data += copy;
+		n -= copy;
+
+		for (;;) {
+			/* Resynchronize on the capture pattern */
+			if (st->page_len >= 4 && memcmp(st->page, "OggS", 4) != 0) {
+				for (k = 1; k + 4 <= st->page_len; k++)
+					if (memcmp(st->page + k, "OggS", 4) == 0)
+						break;
+				memmove(st->page, st->page + k, st->page_len - k);
+				st->page_len -= k;
+				continue;
+			}
+
+			if (st->page_len < OGG_HDR_LEN ||
+			    st->page_len < OGG_HDR_LEN + (size_t)st->page[26])
+				break;
+
+			need = OGG_HDR_LEN + st->page[26];
+			for (k = 0; k < st->page[26]; k++)
+				need += st->page[OGG_HDR_LEN + k];
+			if (st->page_len < need)
+				break;
+
+			process_page(st, st->page, need);
+			memmove(st->page, st->page + need, st->page_len - need);
+			st->page_len -= need;
+		}
+	}
+}
+
+/* Append encoder output and push it to every listener that can take it */
+void stream_feed(struct stream *st, const uint8_t *data, size_t n)
+{
+	struct http_conn *conn, *next;
+
+	parse_pages(st, data, n);
+
+	for (conn = TAILQ_FIRST(&st->listeners); conn; conn = next) {
+		next = TAILQ_NEXT(conn, entries);
+		if (!conn->blocked) {
+			stream_flush(conn);
+		} else if (st->head - conn->pos > st->size) {
+			print_warn("Dropping slow listener on %s\n", st->mount);
+			st->dropped++;
+			http_conn_close(conn);
+		}
+	}
+}
+
+/*
+ * Ring position of the first page of the last 'secs' seconds, and how many
+ * milliseconds ago it arrived. Pages about to be overwritten are left out, so whoever reads
+ * from there has some time to catch up. Without any, it is the live edge.
+ */
+uint64_t stream_rewind(const struct stream *st, unsigned secs,
+	uint64_t *age_ms)
+{
+	uint64_t now = stream_now_ms(), target, oldest, lo, hi, mid;
+	const struct stream_mark *m;
+
+	target = now > secs * UINT64_C(1000) ? now - secs * UINT64_C(1000) : 0;
+	oldest = st->head > st->size - st->size / 8 ?
+		st->head - (st->size - st->size / 8) : 0;
+
+	/* Marks go up in both time and position: first one past both limits */
+	for (lo = st->mark_tail, hi = st->mark_head; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		m = &st->marks[mid & (st->nmarks - 1)];
+		if (m->ms < target || m->pos < oldest)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == st->mark_head) {
+		*age_ms = 0;
+		return st->head;
+	}
+
+	m = &st->marks[lo & (st->nmarks - 1)];
+	*age_ms = now - m->ms;
+	return m->pos;
+}
+
+/* Seconds asked for with "?replay=<seconds>", 0 to start live */
+static unsigned replay_secs(const char *query)
+{
+	unsigned long secs;
+	const char *p;
+
+	for (p = query; p && *p; p += strcspn(p, "&"), p += (*p == '&')) {
+		if (strncmp(p, "replay=", 7) != 0)
+			continue;
+		secs = strtoul(p + 7, NULL, 10);
+		return secs < STREAM_REPLAY_MAX ? secs : STREAM_REPLAY_MAX;
+	}
+
+	return 0;
+}
+
+/*
+ * HTTP route handler: turn the connection into a listener, live or from
+ * "?replay=<seconds>" ago.
+ */
+void stream_http_cb(struct http_conn *conn, void *context)
+{
+	struct stream *st = context;
+	unsigned secs = replay_secs(conn->query);
+	uint64_t age_ms;
+	char size[16];
+	char *prefix;
+	size_t len;
+	int n;
+
+	if (!st->hdr_done) {
+		http_conn_respond(conn, 503, "text/plain", "Stream not ready\n", 17);
+		return;
+	}
+
+	/* Response headers followed by the codec headers, as the first chunk */
+	n = snprintf(size, sizeof size, "%zx\r\n", st->hdr_len);
+	len = sizeof stream_headers - 1 + n + st->hdr_len + 2;
+	prefix = malloc(len);
+	if (!prefix) {
+		http_conn_close(conn);
+		return;
+	}
+	memcpy(prefix, stream_headers, sizeof stream_headers - 1);
+	memcpy(prefix + sizeof stream_headers - 1, size, n);
+	memcpy(prefix + sizeof stream_headers - 1 + n, st->hdr, st->hdr_len);
+	memcpy(prefix + len - 2, "\r\n", 2);
+
+	free(conn->prefix);
+	conn->prefix = prefix;
+	conn->prefix_len = len;
+	conn->prefix_sent = 0;
+
+	conn->state = HTTP_S_STREAMING;
+	conn->stream = st;
+	conn->pos = conn->chunk_end = secs ? stream_rewind(st, secs, &age_ms) :
+		st->join_pos;
+	conn->chunk_hdr_len = 0;
+
+	TAILQ_REMOVE(&conn->srv->pending, conn, entries);
+	TAILQ_INSERT_TAIL(&st->listeners, conn, entries);
+	st->nlisteners++;
+
+	stream_flush(conn);
+}
+
+/*
+ * Send as much as possible to a listener: pending prefix first, then chunks
+ * taken straight from the ring.
+ */
+void stream_flush(struct http_conn *conn)
+{
+	struct stream *st = conn->stream;
+	struct iovec iov[4];
+	size_t off, len, first, n;
+	ssize_t nbw;
+	int cnt;
+
+	while (!conn->closing) {
+		if (conn->prefix_sent < conn->prefix_len) {
+			nbw = send(conn->h.fd, conn->prefix + conn->prefix_sent,
+				conn->prefix_len - conn->prefix_sent,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (nbw < 0)
+				goto _write_error;
+			conn->prefix_sent += nbw;
+			continue;
+		}
+
+		/* Start a new chunk with whatever the ring holds */
+		if (conn->chunk_hdr_len == 0) {
+			if (conn->pos == st->head) {
+				http_conn_wait_writable(conn, false);
+				return;
+			}
+
+			len = st->head - conn->pos;
+			if (len > STREAM_CHUNK_MAX)
+				len = STREAM_CHUNK_MAX;
+			conn->chunk_end = conn->pos + len;
+			conn->chunk_hdr_len = snprintf(conn->chunk_hdr,
+				sizeof conn->chunk_hdr, "%zx\r\n", len);
+			conn->chunk_hdr_sent = 0;
+			conn->chunk_trailer_sent = 0;
+		}
+
+		if (st->head - conn->pos > st->size) {
+			print_warn("Dropping slow listener on %s\n", st->mount);
+			st->dropped++;
+			http_conn_close(conn);
+			return;
+		}
+
+		cnt = 0;
+		if (conn->chunk_hdr_sent < conn->chunk_hdr_len) {
+			iov[cnt].iov_base = conn->chunk_hdr + conn->chunk_hdr_sent;
+			iov[cnt++].iov_len = conn->chunk_hdr_len - conn->chunk_hdr_sent;
+		}
+
+		len = conn->chunk_end - conn->pos;
+		off = conn->pos & (st->size - 1);
+		first = (len < st->size - off) ? len : st->size - off;
+		if (first > 0) {
+			iov[cnt].iov_base = st->ring + off;
+			iov[cnt++].iov_len = first;
+		}
+		if (len > first) {
+			iov[cnt].iov_base = st->ring;
+			iov[cnt++].iov_len = len - first;
+		}
+
+		iov[cnt].iov_base = (char *)"\r\n" + conn->chunk_trailer_sent;
+		iov[cnt++].iov_len = 2 - conn->chunk_trailer_sent;
+
+		nbw = writev(conn->h.fd, iov, cnt);
+		if (nbw < 0)
+			goto _write_error;
+
+		/* Account for what went out, header, data and trailer */
+		n = nbw;
+		len = conn->chunk_hdr_len - conn->chunk_hdr_sent;
+		len = (n < len) ? n : len;
+		conn->chunk_hdr_sent += len;
+		n -= len;
+
+		len = conn->chunk_end - conn->pos;
+		len = (n < len) ? n : len;
+		conn->pos += len;
+		n -= len;
+
+		conn->chunk_trailer_sent += n;
+		if (conn->chunk_trailer_sent == 2)
+			conn->chunk_hdr_len = 0;
+	}
+
+	return;
+
+_write_error:
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		http_conn_wait_writable(conn, true);
+	else
+		http_conn_close(conn);
+}
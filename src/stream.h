@@ -0,0 +1,75 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "http_server.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct recorder;
+
+#define STREAM_RING_SIZE    (1 << 20)   /* Must be a power of two */
+#define STREAM_CHUNK_MAX    (64 << 10)
+
+/* One time mark per this much ring, pages are seldom smaller */
+#define STREAM_MARK_BYTES   1024
+
+/* Longest replay asked for, the ring usually holds less */
+#define STREAM_REPLAY_MAX   3600
+
+/* Largest Ogg page: 27 bytes header, 255 lacing values of 255 bytes */
+#define OGG_MAX_PAGE        (27 + 255 + 255 * 255)
+
+/* Audio page that started at ring position 'pos' at monotonic time 'ms' */
+struct stream_mark {
+	uint64_t  ms;
+	uint64_t  pos;
+};
+
+/*
+ * Encoded audio shared by every listener of a mount point. The encoder
+ * output is split into Ogg pages: header pages are kept aside for late
+ * joiners, audio pages go into a ring all listeners read from directly.
+ *
+ * The ring doubles as a time-shift buffer: every audio page is marked with
+ * the time it arrived, so a listener can join some seconds in the past and
+ * still start on a page boundary. Ring and marks are allocated once.
+ */
+struct stream {
+	char      mount[64];
+
+	uint8_t  *ring;
+	size_t    size;
+	uint64_t  head;         /* Total bytes ever written into the ring */
+	uint64_t  join_pos;     /* Where new listeners start reading */
+
+	uint8_t  *hdr;          /* Codec header pages */
+	size_t    hdr_len;
+	bool      hdr_done;
+	unsigned  hdr_gen;      /* Bumped whenever they are replaced */
+
+	struct stream_mark *marks;  /* Ring of nmarks, a power of two */
+	size_t    nmarks;
+	uint64_t  mark_head;    /* Total marks ever added */
+	uint64_t  mark_tail;    /* First one still for the current headers */
+
+	uint8_t  *page;         /* Page being reassembled */
+	size_t    page_len;
+
+	struct http_conn_list listeners;
+	unsigned  nlisteners;
+	uint64_t  dropped;      /* Listeners dropped for being too slow */
+
+	struct recorder *rec;   /* Audio pages also go there, when recording */
+};
+
+int stream_init(struct stream *st, const char *mount, size_t size);
+void stream_free(struct stream *st);
+
+void stream_feed(struct stream *st, const uint8_t *data, size_t n);
+uint64_t stream_rewind(const struct stream *st, unsigned secs,
+	uint64_t *age_ms);
+void stream_http_cb(struct http_conn *conn, void *context);
+void stream_flush(struct http_conn *conn);
+
+#endif /* __STREAM_H__ */
@@ -0,0 +1,63 @@
+/*
+ * thread_slot.c: Slots of a fixed array handed out to threads.
+ */
+
+#include "thread_slot.h"
+
+#include <stdint.h>
+
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The thread's value is the flag itself, whatever the slot is */
+static void thread_slot_release(void *arg)
+{
+	atomic_bool *in_use = arg;
+
+	atomic_store_explicit(in_use, false, memory_order_release);
+}
+
+/*
+ * Hand the first free slot to the calling thread, to be given back when it
+ * exits. Returns NULL once they are all taken, or when 'setup' failed. The
+ * caller keeps the slot it got, this is only meant to run once per thread.
+ */
+void *thread_slot_claim(struct thread_slots *ts)
+{
+	atomic_bool *in_use;
+	unsigned k, n;
+	uint8_t *slot;
+	bool busy;
+
+	if (!atomic_load_explicit(&ts->key_ready, memory_order_acquire)) {
+		pthread_mutex_lock(&key_lock);
+		if (!atomic_load(&ts->key_ready) &&
+		    pthread_key_create(&ts->key, &thread_slot_release) == 0)
+			atomic_store_explicit(&ts->key_ready, true,
+				memory_order_release);
+		pthread_mutex_unlock(&key_lock);
+		if (!atomic_load(&ts->key_ready))
+			return NULL;
+	}
+
+	for (k = 0; k < ts->count; k++) {
+		slot = (uint8_t *)ts->base + k * ts->size;
+		in_use = (atomic_bool *)(slot + ts->in_use);
+		busy = false;
+		if (!atomic_compare_exchange_strong(in_use, &busy, true))
+			continue;
+
+		/* Set up before the slot is counted, so readers see it whole */
+		if (ts->setup && ts->setup(slot) < 0) {
+			atomic_store(in_use, false);
+			return NULL;
+		}
+
+		n = atomic_load(&ts->high);
+		while (n < k + 1 && !atomic_compare_exchange_weak(&ts->high, &n, k + 1))
+			;
+		pthread_setspecific(ts->key, in_use);
+		return slot;
+	}
+
+	return NULL;
+}
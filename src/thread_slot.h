@@ -0,0 +1,42 @@
+#ifndef __THREAD_SLOT_H__
+#define __THREAD_SLOT_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Fixed array of per-thread slots: metrics shards, log rings, trace rings.
+ * A thread claims the first free one by flipping its 'in_use' flag, and
+ * gives it back when it exits, its contents left for the next owner. Slots
+ * are never freed, so readers walk the first 'high' of them in place.
+ */
+struct thread_slots {
+	void            *base;
+	size_t           size;          /* Of one slot */
+	size_t           in_use;        /* Offset of its atomic_bool */
+	unsigned         count;
+	int            (*setup)(void *slot);    /* When claimed, may be NULL */
+	atomic_uint      high;          /* Highest slot handed out, plus one */
+	atomic_bool      key_ready;
+	pthread_key_t    key;
+};
+
+#define THREAD_SLOTS_INIT(array, n, member, fn) {                       \
+	.base = (array),                                                \
+	.size = sizeof *(array),                                        \
+	.in_use = offsetof(__typeof__(*(array)), member),               \
+	.count = (n),                                                   \
+	.setup = (fn),                                                  \
+}
+
+void *thread_slot_claim(struct thread_slots *ts);
+
+/* Slots ever handed out, the ones readers have to look at */
+static inline unsigned thread_slots_high(struct thread_slots *ts)
+{
+	return atomic_load(&ts->high);
+}
+
+#endif /* __THREAD_SLOT_H__ */
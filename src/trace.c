@@ -0,0 +1,219 @@
+/*
+ * trace.c: Nanosecond spans kept per thread, dumped as Chrome trace JSON.
+ *
+ * Every thread records into a ring of its own, so recording takes no lock
+ * and touches no shared cache line. The rings are a flight recorder: they
+ * always hold the latest TRACE_RING_SPANS spans of each thread, and a dump
+ * reads them in place while they keep being written. The output loads in
+ * chrome://tracing or https://ui.perfetto.dev.
+ */
+
+#include "common.h"
+#include "thread_slot.h"
+#include "trace.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+atomic_bool trace_enabled;
+
+static int trace_ring_setup(void *arg);
+
+/* The spans stay, the next thread to take a ring goes on from them */
+static struct trace_ring rings[TRACE_MAX_RINGS];
+static struct thread_slots slots =
+	THREAD_SLOTS_INIT(rings, TRACE_MAX_RINGS, in_use, &trace_ring_setup);
+static __thread struct trace_ring *trace_self;
+static __thread bool trace_no_ring;
+static __thread const char *trace_tname;
+
+/* Spans started before this are left out of dumps */
+static _Atomic uint64_t trace_floor_ns;
+
+/* What a dump copies out of a span */
+struct trace_event {
+	const char *name;
+	const char *cat;
+	uint64_t    start_ns;
+	uint64_t    dur_ns;
+	uint64_t    arg;
+	int         tid;
+};
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Published before the ring is counted, for trace_write_json() */
+static int trace_ring_setup(void *arg)
+{
+	struct trace_ring *r = arg;
+	struct trace_span *spans;
+
+	if (!r->spans) {
+		spans = calloc(TRACE_RING_SPANS, sizeof *spans);
+		if (!spans)
+			return -1;
+		r->spans = spans;
+	}
+	r->tid_self = syscall(SYS_gettid);
+	atomic_store(&r->tid, r->tid_self);
+	atomic_store(&r->tname, trace_tname);
+	return 0;
+}
+
+/* Ring of the calling thread, NULL once they are all taken */
+static struct trace_ring *trace_ring_self(void)
+{
+	if (__builtin_expect(trace_self != NULL, 1))
+		return trace_self;
+	if (trace_no_ring)
+		return NULL;
+
+	trace_self = thread_slot_claim(&slots);
+	trace_no_ring = !trace_self;
+	return trace_self;
+}
+
+/* Record a span that ran from 'start_ns' to 'end_ns' on this thread */
+void trace_record(const char *name, const char *cat, uint64_t start_ns,
+	uint64_t end_ns, uint64_t arg)
+{
+	struct trace_ring *r = trace_ring_self();
+	struct trace_span *s;
+	uint64_t head;
+	uint32_t seq;
+
+	if (!r)
+		return;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	s = &r->spans[head & (TRACE_RING_SPANS - 1)];
+
+	seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&s->tid, r->tid_self, memory_order_relaxed);
+	atomic_store_explicit(&s->name, name, memory_order_relaxed);
+	atomic_store_explicit(&s->cat, cat, memory_order_relaxed);
+	atomic_store_explicit(&s->start_ns, start_ns, memory_order_relaxed);
+	atomic_store_explicit(&s->dur_ns, end_ns - start_ns, memory_order_relaxed);
+	atomic_store_explicit(&s->arg, arg, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Shown for this thread in the dump, 'name' must outlive the thread. A ring
+ * is only taken by the first span, so threads that never record one leave
+ * every ring to the others.
+ */
+void trace_thread_name(const char *name)
+{
+	trace_tname = name;
+	if (trace_self)
+		atomic_store(&trace_self->tname, name);
+}
+
+void trace_set_enabled(bool on)
+{
+	atomic_store(&trace_enabled, on);
+}
+
+/* Rings belong to their threads, so clearing only moves the floor */
+void trace_clear(void)
+{
+	atomic_store(&trace_floor_ns, trace_now());
+}
+
+/* Spans recorded since startup, including overwritten ones */
+uint64_t trace_count(void)
+{
+	unsigned n = thread_slots_high(&slots), k;
+	uint64_t total = 0;
+
+	for (k = 0; k < n; k++)
+		total += atomic_load_explicit(&rings[k].head, memory_order_relaxed);
+
+	return total;
+}
+
+/* Consistent copy of a span, false when it is being written */
+static bool trace_copy(struct trace_span *s, struct trace_event *ev)
+{
+	uint32_t s0, s1;
+
+	s0 = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if (s0 & 1)
+		return false;
+	ev->name = atomic_load_explicit(&s->name, memory_order_relaxed);
+	ev->cat = atomic_load_explicit(&s->cat, memory_order_relaxed);
+	ev->start_ns = atomic_load_explicit(&s->start_ns, memory_order_relaxed);
+	ev->dur_ns = atomic_load_explicit(&s->dur_ns, memory_order_relaxed);
+	ev->arg = atomic_load_explicit(&s->arg, memory_order_relaxed);
+	ev->tid = atomic_load_explicit(&s->tid, memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	s1 = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+	return s0 == s1;
+}
+
+/*
+ * Every span still in the rings, as a Chrome trace "X" (complete) event
+ * with microsecond times, plus the name of each thread. Spans are written
+ * ring by ring; the viewers sort them on their own.
+ */
+int trace_write_json(FILE *fp)
+{
+	unsigned n = thread_slots_high(&slots), k;
+	uint64_t floor = atomic_load(&trace_floor_ns), head, i, first;
+	struct trace_ring *r;
+	struct trace_event ev;
+	const char *sep = "";
+	const char *tname;
+	int pid = getpid(), tid;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (k = 0; k < n; k++) {
+		r = &rings[k];
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (head == 0)
+			continue;
+
+		tid = atomic_load(&r->tid);
+		tname = atomic_load(&r->tname);
+		if (tname) {
+			fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				sep, pid, tid, tname);
+			sep = ",";
+		}
+
+		first = (head > TRACE_RING_SPANS) ? head - TRACE_RING_SPANS : 0;
+		for (i = first; i < head; i++) {
+			if (!trace_copy(&r->spans[i & (TRACE_RING_SPANS - 1)], &ev))
+				continue;
+			if (ev.start_ns < floor || !ev.name)
+				continue;
+
+			fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+				"\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%" PRIu64 "}}",
+				sep, ev.name, ev.cat ? ev.cat : "", ev.start_ns / 1000,
+				(unsigned)(ev.start_ns % 1000), ev.dur_ns / 1000,
+				(unsigned)(ev.dur_ns % 1000), pid, ev.tid, ev.arg);
+			sep = ",";
+		}
+	}
+	fprintf(fp, "\n]}\n");
+
+	return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,71 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAX_RINGS 64
+#define TRACE_RING_SPANS 4096           /* Per thread, a power of two */
+
+/*
+ * One finished span. Only the owner thread writes it, bumping 'seq' to odd
+ * before and back to even after, so a dump running at the same time can
+ * tell a span being overwritten and skip it instead of waiting.
+ */
+struct trace_span {
+	_Atomic uint32_t seq;
+	_Atomic int32_t  tid;           /* Rings outlive their threads */
+	_Atomic uint64_t arg;
+	_Atomic uint64_t start_ns;
+	_Atomic uint64_t dur_ns;
+	_Atomic(const char *) name;     /* String literals, never freed */
+	_Atomic(const char *) cat;
+};
+
+/*
+ * Spans of one thread, oldest overwritten first. The spans are allocated
+ * the first time a thread records one and stay with the ring, for the next
+ * thread, once it exits.
+ */
+struct trace_ring {
+	_Atomic uint64_t      head;     /* Spans ever recorded */
+	_Atomic int           tid;      /* Current owner */
+	int                   tid_self; /* The same, for the owner */
+	_Atomic(const char *) tname;
+	atomic_bool           in_use;
+	struct trace_span    *spans;
+} __attribute__((aligned(64)));
+
+extern atomic_bool trace_enabled;
+
+uint64_t trace_now(void);
+void trace_record(const char *name, const char *cat, uint64_t start_ns,
+	uint64_t end_ns, uint64_t arg);
+void trace_thread_name(const char *name);
+void trace_set_enabled(bool on);
+void trace_clear(void);
+uint64_t trace_count(void);
+int trace_write_json(FILE *fp);
+
+static inline bool trace_on(void)
+{
+	return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+/* Start of a span, zero while tracing is off */
+static inline uint64_t trace_begin(void)
+{
+	return trace_on() ? trace_now() : 0;
+}
+
+/* End of a span started by trace_begin(), dropped when it was off then */
+static inline void trace_end(const char *name, const char *cat,
+	uint64_t start_ns, uint64_t arg)
+{
+	if (start_ns && trace_on())
+		trace_record(name, cat, start_ns, trace_now(), arg);
+}
+
+#endif /* __TRACE_H__ */